@@ -0,0 +1,449 @@
+/**
+ * parser_bench.c - micro-benchmarks for the request parsers and the buffer primitives.
+ *
+ * Every case runs over a canned corpus: after a warm-up, the case is repeated for a
+ * fixed amount of time in several samples and the best and median cost per byte are
+ * reported (in ns, and in cycles where a cycle counter is available).
+ *
+ * Usage: parser_bench.elf [-t seconds] [-r samples] [-f text|csv] [filter]
+ *   -t seconds  time spent on each sample (default 0.2)
+ *   -r samples  samples per case (default 5)
+ *   -f format   text | csv (default text)
+ *   filter      only run cases whose name contains this string
+ *
+ * Numbers are only meaningful on an optimized build without sanitizers:
+ *   make clean && make bench EXTRA_CFLAGS="-O2 -fno-sanitize=address"
+ */
+#include "buffer.h"
+#include "buffer_chain.h"
+#include "parser.h"
+#include "parser_utils.h"
+#include "request.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CORPUS_SIZE      (256 * 1024)
+#define IO_BUFFER_SIZE   4096  // same as the server's BUFFER_SIZE
+#define WARMUP_NS        50000000ULL
+#define MAX_SAMPLES      32
+#define NS_PER_S         1000000000ULL
+
+struct corpus
+{
+	const char* name;
+	uint8_t* data;
+	size_t len;
+};
+
+struct bench_case
+{
+	const char* name;
+	/** the corpus the case runs over */
+	const struct corpus* corpus;
+	/** processes the whole corpus once; returns something derived from the work done */
+	size_t (*run)(const uint8_t* data, size_t len);
+};
+
+static volatile size_t sink;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_S + (uint64_t)ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_CYCLES 1
+static inline uint64_t
+cycles(void)
+{
+	return __builtin_ia32_rdtsc();
+}
+#else
+#define HAVE_CYCLES 0
+static inline uint64_t
+cycles(void)
+{
+	return 0;
+}
+#endif
+
+// CORPORA
+
+static struct corpus commands = { .name = "commands" };
+static struct corpus body_text = { .name = "body-text" };
+static struct corpus body_dots = { .name = "body-dots" };
+
+static void
+fill_repeating(struct corpus* c, const char* const* pieces, size_t npieces)
+{
+	c->data = malloc(CORPUS_SIZE);
+	if (c->data == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	size_t len = 0;
+	for (size_t i = 0;; i = (i + 1) % npieces) {
+		size_t n = strlen(pieces[i]);
+		if (len + n > CORPUS_SIZE) {
+			break;
+		}
+		memcpy(c->data + len, pieces[i], n);
+		len += n;
+	}
+	c->len = len;
+}
+
+static void
+init_corpora(void)
+{
+	// short commands, as a client sends them in a session
+	static const char* const cmds[] = {
+		"EHLO client.example.org\r\n",
+		"MAIL FROM:<alice@local>\r\n",
+		"RCPT TO:<bob@local>\r\n",
+		"RCPT TO:<carol.longer-name@local>\r\n",
+		"DATA\r\n",
+		"NOOP\r\n",
+		"RSET\r\n",
+		"QUIT\r\n",
+	};
+	fill_repeating(&commands, cmds, sizeof(cmds) / sizeof(*cmds));
+
+	// a large body: plain 76 character lines
+	static const char* const text[] = {
+		"Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod te\r\n",
+		"mpor incididunt ut labore et dolore magna aliqua. Ut enim ad minim veniam,\r\n",
+		"quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo co\r\n",
+	};
+	fill_repeating(&body_text, text, sizeof(text) / sizeof(*text));
+
+	// pathological dot-stuffing: every line starts with dots, some almost end the message
+	static const char* const dots[] = {
+		"..\r\n", ".a\r\n", "...\r\n", "..x.\r\n", "\r\n", ".\r\n..\r\n", "....\r\n",
+	};
+	fill_repeating(&body_dots, dots, sizeof(dots) / sizeof(*dots));
+}
+
+// CASES
+
+static struct request request;
+
+/** request_parser_feed over command lines, starting over after each one like the server does */
+static size_t
+run_request_feed(const uint8_t* data, size_t len)
+{
+	struct request_parser p = { .request = &request };
+	size_t done = 0;
+	request_parser_init(&p);
+	for (size_t i = 0; i < len; i++) {
+		enum request_state st = request_parser_feed(&p, data[i]);
+		if (request_is_done(st, NULL)) {
+			done++;
+			request_parser_init(&p);
+		}
+	}
+	return done;
+}
+
+/** request_consume over a buffer that is refilled from the corpus, as the reads would */
+static size_t
+run_request_consume(const uint8_t* data, size_t len)
+{
+	static uint8_t raw[IO_BUFFER_SIZE];
+	buffer b;
+	buffer_init(&b, sizeof(raw), raw);
+	struct request_parser p = { .request = &request };
+	request_parser_init(&p);
+
+	size_t done = 0, off = 0;
+	while (off < len || buffer_can_read(&b)) {
+		size_t space;
+		uint8_t* w = buffer_write_ptr(&b, &space);
+		size_t n = len - off < space ? len - off : space;
+		memcpy(w, data + off, n);
+		buffer_write_adv(&b, n);
+		off += n;
+
+		while (buffer_can_read(&b)) {
+			if (request_is_done(request_consume(&b, &p, NULL), NULL)) {
+				done++;
+				request_parser_init(&p);
+			}
+		}
+	}
+	return done;
+}
+
+/** request_consume_data over a body, in buffer sized reads */
+static size_t
+run_request_consume_data(const uint8_t* data, size_t len)
+{
+	static uint8_t raw[IO_BUFFER_SIZE];
+	buffer b;
+	buffer_init(&b, sizeof(raw), raw);
+	struct request_parser p = { .request = &request };
+	request_parser_data_init(&p);
+
+	size_t done = 0, off = 0;
+	while (off < len || buffer_can_read(&b)) {
+		size_t space;
+		uint8_t* w = buffer_write_ptr(&b, &space);
+		size_t n = len - off < space ? len - off : space;
+		memcpy(w, data + off, n);
+		buffer_write_adv(&b, n);
+		off += n;
+
+		while (buffer_can_read(&b)) {
+			enum request_state st = request_consume_data(&b, &p, NULL);
+			// the server writes out the chunk and goes on with the same parser state
+			done += p.i;
+			if (request_is_done(st, NULL)) {
+				st = request_body;
+			}
+			request_parser_data_init(&p);
+			p.state = st;
+		}
+	}
+	return done;
+}
+
+/** parser_feed with a strcmpi parser, reset at each line */
+static const struct parser_definition* ehlo_def;
+
+static size_t
+run_parser_feed(const uint8_t* data, size_t len)
+{
+	static struct parser* parser = NULL;
+	if (parser == NULL) {
+		parser = parser_init(parser_no_classes(), ehlo_def);
+	}
+	parser_reset(parser);
+	size_t matches = 0;
+	for (size_t i = 0; i < len; i++) {
+		const struct parser_event* e = parser_feed(parser, data[i]);
+		if (data[i] == '\n') {
+			matches += e->type == STRING_CMP_EQ;
+			parser_reset(parser);
+		}
+	}
+	return matches;
+}
+
+/** buffer_write + buffer_read, a byte at a time */
+static size_t
+run_buffer_bytes(const uint8_t* data, size_t len)
+{
+	static uint8_t raw[IO_BUFFER_SIZE];
+	buffer b;
+	buffer_init(&b, sizeof(raw), raw);
+	size_t acc = 0;
+	for (size_t i = 0; i < len; i++) {
+		buffer_write(&b, data[i]);
+		if (!buffer_can_write(&b)) {
+			while (buffer_can_read(&b)) {
+				acc += buffer_read(&b);
+			}
+		}
+	}
+	while (buffer_can_read(&b)) {
+		acc += buffer_read(&b);
+	}
+	return acc;
+}
+
+/** buffer_write_ptr/adv + buffer_read_ptr/adv in uneven chunks, compacting as the server does */
+static size_t
+run_buffer_chunks(const uint8_t* data, size_t len)
+{
+	static uint8_t raw[IO_BUFFER_SIZE];
+	static uint8_t out[IO_BUFFER_SIZE];
+	buffer b;
+	buffer_init(&b, sizeof(raw), raw);
+	size_t acc = 0, off = 0;
+	while (off < len) {
+		size_t space;
+		uint8_t* w = buffer_write_ptr(&b, &space);
+		size_t n = len - off < space ? len - off : space;
+		n = n > 1500 ? 1500 : n;  // about an MSS per read
+		memcpy(w, data + off, n);
+		buffer_write_adv(&b, n);
+		off += n;
+
+		size_t avail;
+		uint8_t* r = buffer_read_ptr(&b, &avail);
+		size_t m = avail > 1000 ? 1000 : avail;  // consumers rarely take all
+		memcpy(out, r, m);
+		buffer_read_adv(&b, m);
+		acc += out[0];
+		buffer_compact(&b);
+	}
+	return acc;
+}
+
+/** the same pattern as run_buffer_chunks over a buffer_chain: no compaction, segments recycled */
+static size_t
+run_buffer_chain_chunks(const uint8_t* data, size_t len)
+{
+	static uint8_t out[IO_BUFFER_SIZE];
+	buffer_chain c;
+	buffer_chain_init(&c, IO_BUFFER_SIZE);
+	size_t acc = 0, off = 0;
+	while (off < len) {
+		struct iovec iov[BUFFER_CHAIN_IOV_MAX];
+		size_t n = len - off > 1500 ? 1500 : len - off;
+		int cnt = buffer_chain_write_iov(&c, iov, BUFFER_CHAIN_IOV_MAX, n);
+		size_t w = 0;
+		for (int i = 0; i < cnt; i++) {
+			memcpy(iov[i].iov_base, data + off + w, iov[i].iov_len);
+			w += iov[i].iov_len;
+		}
+		buffer_chain_write_adv(&c, w);
+		off += w;
+
+		acc += buffer_chain_read(&c, out, 1000) > 0 ? out[0] : 0;
+	}
+	buffer_chain_reset(&c);
+	return acc;
+}
+
+static const struct bench_case cases[] = {
+	{ "request_parser_feed/commands", &commands, run_request_feed },
+	{ "request_consume/commands", &commands, run_request_consume },
+	{ "request_consume_data/body-text", &body_text, run_request_consume_data },
+	{ "request_consume_data/body-dots", &body_dots, run_request_consume_data },
+	{ "parser_feed/strcmpi-commands", &commands, run_parser_feed },
+	{ "buffer_bytes/body-text", &body_text, run_buffer_bytes },
+	{ "buffer_chunks/body-text", &body_text, run_buffer_chunks },
+	{ "buffer_chain_chunks/body-text", &body_text, run_buffer_chain_chunks },
+};
+
+// HARNESS
+
+struct sample
+{
+	double ns_per_byte;
+	double cycles_per_byte;
+};
+
+static int
+cmp_sample(const void* a, const void* b)
+{
+	double x = ((const struct sample*)a)->ns_per_byte, y = ((const struct sample*)b)->ns_per_byte;
+	return (x > y) - (x < y);
+}
+
+static void
+run_case(const struct bench_case* c, double sample_s, unsigned nsamples, bool csv)
+{
+	const uint8_t* data = c->corpus->data;
+	const size_t len = c->corpus->len;
+
+	// warm-up: caches, branch predictors and CPU frequency
+	uint64_t start = now_ns();
+	unsigned iterations = 0;
+	do {
+		sink += c->run(data, len);
+		iterations++;
+	} while (now_ns() - start < WARMUP_NS);
+	double ns_per_iter = (double)(now_ns() - start) / iterations;
+	unsigned per_sample = (unsigned)(sample_s * NS_PER_S / ns_per_iter);
+	per_sample = per_sample == 0 ? 1 : per_sample;
+
+	struct sample samples[MAX_SAMPLES];
+	for (unsigned s = 0; s < nsamples; s++) {
+		uint64_t t0 = now_ns(), c0 = cycles();
+		for (unsigned i = 0; i < per_sample; i++) {
+			sink += c->run(data, len);
+		}
+		uint64_t c1 = cycles(), t1 = now_ns();
+		double bytes = (double)len * per_sample;
+		samples[s].ns_per_byte = (t1 - t0) / bytes;
+		samples[s].cycles_per_byte = (c1 - c0) / bytes;
+	}
+	qsort(samples, nsamples, sizeof(*samples), cmp_sample);
+	const struct sample best = samples[0], median = samples[nsamples / 2];
+	const double mb_s = 1e3 / best.ns_per_byte;
+
+	if (csv) {
+		printf("%s,%s,%zu,%u,%.4f,%.4f,%.3f,%.3f,%.1f\n",
+		       c->name,
+		       c->corpus->name,
+		       len,
+		       per_sample * nsamples,
+		       best.ns_per_byte,
+		       median.ns_per_byte,
+		       HAVE_CYCLES ? best.cycles_per_byte : -1.0,
+		       HAVE_CYCLES ? median.cycles_per_byte : -1.0,
+		       mb_s);
+	} else if (HAVE_CYCLES) {
+		printf("%-34s %8.3f ns/B %8.3f (median) %8.2f cyc/B %9.1f MB/s\n",
+		       c->name,
+		       best.ns_per_byte,
+		       median.ns_per_byte,
+		       best.cycles_per_byte,
+		       mb_s);
+	} else {
+		printf("%-34s %8.3f ns/B %8.3f (median) %9.1f MB/s\n", c->name, best.ns_per_byte, median.ns_per_byte, mb_s);
+	}
+	fflush(stdout);
+}
+
+int
+main(int argc, char* argv[])
+{
+	double sample_s = 0.2;
+	unsigned nsamples = 5;
+	bool csv = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "t:r:f:")) != -1) {
+		switch (opt) {
+			case 't':
+				sample_s = atof(optarg);
+				break;
+			case 'r':
+				nsamples = (unsigned)atoi(optarg);
+				break;
+			case 'f':
+				csv = strcmp(optarg, "csv") == 0;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-t seconds] [-r samples] [-f text|csv] [filter]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (sample_s <= 0 || nsamples == 0 || nsamples > MAX_SAMPLES) {
+		fprintf(stderr, "%s: bad -t or -r (at most %d samples)\n", argv[0], MAX_SAMPLES);
+		return EXIT_FAILURE;
+	}
+	const char* filter = optind < argc ? argv[optind] : NULL;
+
+	init_corpora();
+	const struct parser_definition def = parser_utils_strcmpi("EHLO client.example.org\r");
+	ehlo_def = &def;
+
+	if (csv) {
+		printf("case,corpus,corpus_bytes,iterations,best_ns_per_byte,median_ns_per_byte,best_cycles_per_byte,"
+		       "median_cycles_per_byte,best_mb_s\n");
+	}
+	for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+		if (filter == NULL || strstr(cases[i].name, filter) != NULL) {
+			run_case(cases + i, sample_s, nsamples, csv);
+		}
+	}
+
+	parser_utils_strcmpi_destroy(&def);
+	free(commands.data);
+	free(body_text.data);
+	free(body_dots.data);
+	return EXIT_SUCCESS;
+}
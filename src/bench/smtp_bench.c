@@ -0,0 +1,948 @@
+/**
+ * smtp_bench.c - open-loop SMTP load generator.
+ *
+ * Messages arrive at a fixed average rate (Poisson or evenly spaced), independently of
+ * how fast the server answers, so a slow server shows up as queueing latency instead of
+ * a lower offered load (no coordinated omission). Each message is timed from its
+ * intended arrival until the server accepts it with a 250 after the end of DATA.
+ *
+ * Everything runs on a single thread with non-blocking sockets and poll(2).
+ *
+ * A refused connection (connect error or no 220 greeting) counts in conns_refused and
+ * holds back new connections with an exponential backoff. No new connections are opened
+ * after -d; messages still queued then, with no connection to take them, count as failed.
+ *
+ * Usage: smtp_bench.elf [options]
+ *   -H host        server address (default 127.0.0.1)
+ *   -p port        server port (default 2525)
+ *   -r rate        offered load in messages per second (default 100)
+ *   -d seconds     how long messages keep arriving (default 10)
+ *   -w seconds     warm-up: messages arriving earlier are not measured (default 0)
+ *   -a arrivals    poisson | uniform (default poisson)
+ *   -c conns       maximum concurrent connections (default 64)
+ *   -k messages    messages sent per connection before QUIT (default 1)
+ *   -s dist        message size in bytes (default fixed:1024)
+ *   -n dist        recipients per message (default fixed:1)
+ *   -u users       distinct recipient mailboxes, bench<i>@local (default 16)
+ *   -P             pipeline the envelope (MAIL, RCPTs and DATA in a single write)
+ *   -f format      text | csv | json (default text)
+ *   -S seed        random seed (default: time based)
+ *
+ * Distributions: fixed:N, uniform:MIN:MAX, exp:MEAN.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NS_PER_S        1000000000ULL
+#define NS_PER_MS       1000000.0
+#define MAX_RCPTS       100
+#define MAX_LINE        64
+#define IN_BUFFER_SIZE  4096
+#define DRAIN_TIMEOUT_S 30
+#define BODY_LINE_SIZE  78  // 76 characters + CRLF
+#define PENDING_SIZE    (1 << 20)
+// after a refused connection no new ones are opened for a while, doubling up to the max
+#define BACKOFF_MIN_NS (10 * 1000000ULL)
+#define BACKOFF_MAX_NS NS_PER_S
+
+typedef enum
+{
+	DIST_FIXED,
+	DIST_UNIFORM,
+	DIST_EXP,
+} dist_kind;
+
+struct dist
+{
+	dist_kind kind;
+	double a;
+	double b;
+	char spec[64];
+};
+
+typedef enum
+{
+	FORMAT_TEXT,
+	FORMAT_CSV,
+	FORMAT_JSON,
+} output_format;
+
+struct options
+{
+	const char* host;
+	const char* port;
+	double rate;
+	double duration;
+	double warmup;
+	bool poisson;
+	unsigned max_conns;
+	unsigned per_conn;
+	struct dist size;
+	struct dist rcpts;
+	unsigned users;
+	bool pipelining;
+	output_format format;
+	uint64_t seed;
+};
+
+struct message
+{
+	uint64_t intended;  // ns since the start of the run
+	size_t size;
+	unsigned rcpts;
+};
+
+typedef enum
+{
+	PHASE_FREE,
+	PHASE_CONNECTING,
+	PHASE_GREETING,
+	PHASE_EHLO,
+	PHASE_IDLE,
+	PHASE_ENVELOPE,
+	PHASE_BODY,
+	PHASE_QUIT,
+} conn_phase;
+
+struct conn
+{
+	int fd;
+	conn_phase phase;
+	unsigned messages_sent;
+
+	bool has_msg;
+	struct message msg;
+
+	// envelope commands: all of them are in `envelope', `line_end' marks where each one ends
+	char envelope[(MAX_RCPTS + 4) * MAX_LINE];
+	size_t line_end[MAX_RCPTS + 4];
+	unsigned lines;
+	unsigned lines_sent;
+	unsigned replies_pending;
+	bool failed;
+	bool trailer_queued;
+
+	// pending output
+	struct iovec iov[2];
+	int iovcnt;
+
+	char in[IN_BUFFER_SIZE];
+	size_t in_len;
+};
+
+struct stats
+{
+	uint64_t offered;
+	uint64_t completed;
+	uint64_t failed;
+	uint64_t dropped;
+	uint64_t conns_opened;
+	uint64_t conns_refused;
+	uint64_t bytes;
+	uint64_t* samples;  // latencies of measured messages, in ns
+	size_t nsamples;
+	size_t samples_cap;
+};
+
+static struct options opts;
+static struct stats stats;
+static struct conn* conns;
+static struct addrinfo* server_addr;
+static uint64_t start_ns;
+static uint64_t backoff_ns;    // 0 while the server accepts connections
+static uint64_t reconnect_at;  // ns since the start of the run
+static uint64_t rng_state;
+
+static char* body_pool;
+static size_t body_pool_size;
+static const char body_header[] = "Subject: bench\r\n\r\n";
+static const char body_trailer[] = "\r\n.\r\n";
+
+static struct message* pending;
+static size_t pending_head;
+static size_t pending_len;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_S + (uint64_t)ts.tv_nsec - start_ns;
+}
+
+/** xorshift64*, returns a double in (0, 1]. */
+static double
+rand_unit(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	uint64_t r = rng_state * 0x2545F4914F6CDD1DULL;
+	return ((r >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static double
+dist_sample(const struct dist* d)
+{
+	switch (d->kind) {
+		case DIST_UNIFORM:
+			return d->a + floor(rand_unit() * (d->b - d->a + 1));
+		case DIST_EXP:
+			return ceil(-log(rand_unit()) * d->a);
+		default:
+			return d->a;
+	}
+}
+
+static bool
+dist_parse(const char* spec, struct dist* d)
+{
+	snprintf(d->spec, sizeof(d->spec), "%s", spec);
+	if (sscanf(spec, "fixed:%lf", &d->a) == 1) {
+		d->kind = DIST_FIXED;
+	} else if (sscanf(spec, "uniform:%lf:%lf", &d->a, &d->b) == 2 && d->b >= d->a) {
+		d->kind = DIST_UNIFORM;
+	} else if (sscanf(spec, "exp:%lf", &d->a) == 1) {
+		d->kind = DIST_EXP;
+	} else {
+		return false;
+	}
+	return d->a >= 0;
+}
+
+static void
+usage(const char* prog)
+{
+	fprintf(stderr,
+	        "Usage: %s [-H host] [-p port] [-r rate] [-d seconds] [-w seconds] [-a poisson|uniform]\n"
+	        "       [-c conns] [-k messages] [-s dist] [-n dist] [-u users] [-P] [-f text|csv|json] [-S seed]\n"
+	        "Distributions: fixed:N, uniform:MIN:MAX, exp:MEAN\n",
+	        prog);
+	exit(EXIT_FAILURE);
+}
+
+static void
+parse_options(int argc, char* argv[])
+{
+	opts = (struct options){
+		.host = "127.0.0.1",
+		.port = "2525",
+		.rate = 100,
+		.duration = 10,
+		.warmup = 0,
+		.poisson = true,
+		.max_conns = 64,
+		.per_conn = 1,
+		.users = 16,
+		.format = FORMAT_TEXT,
+		.seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32),
+	};
+	dist_parse("fixed:1024", &opts.size);
+	dist_parse("fixed:1", &opts.rcpts);
+
+	int c;
+	while ((c = getopt(argc, argv, "H:p:r:d:w:a:c:k:s:n:u:Pf:S:")) != -1) {
+		switch (c) {
+			case 'H':
+				opts.host = optarg;
+				break;
+			case 'p':
+				opts.port = optarg;
+				break;
+			case 'r':
+				opts.rate = atof(optarg);
+				break;
+			case 'd':
+				opts.duration = atof(optarg);
+				break;
+			case 'w':
+				opts.warmup = atof(optarg);
+				break;
+			case 'a':
+				if (strcmp(optarg, "poisson") == 0)
+					opts.poisson = true;
+				else if (strcmp(optarg, "uniform") == 0)
+					opts.poisson = false;
+				else
+					usage(argv[0]);
+				break;
+			case 'c':
+				opts.max_conns = (unsigned)atoi(optarg);
+				break;
+			case 'k':
+				opts.per_conn = (unsigned)atoi(optarg);
+				break;
+			case 's':
+				if (!dist_parse(optarg, &opts.size))
+					usage(argv[0]);
+				break;
+			case 'n':
+				if (!dist_parse(optarg, &opts.rcpts))
+					usage(argv[0]);
+				break;
+			case 'u':
+				opts.users = (unsigned)atoi(optarg);
+				break;
+			case 'P':
+				opts.pipelining = true;
+				break;
+			case 'f':
+				if (strcmp(optarg, "text") == 0)
+					opts.format = FORMAT_TEXT;
+				else if (strcmp(optarg, "csv") == 0)
+					opts.format = FORMAT_CSV;
+				else if (strcmp(optarg, "json") == 0)
+					opts.format = FORMAT_JSON;
+				else
+					usage(argv[0]);
+				break;
+			case 'S':
+				opts.seed = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (opts.rate <= 0 || opts.duration <= 0 || opts.warmup < 0 || opts.warmup >= opts.duration ||
+	    opts.max_conns == 0 || opts.per_conn == 0 || opts.users == 0) {
+		usage(argv[0]);
+	}
+	rng_state = opts.seed == 0 ? 1 : opts.seed;
+}
+
+/** @brief Fills the body pool with 76 character lines, none starting with a dot. */
+static void
+init_body_pool(void)
+{
+	double max = opts.size.kind == DIST_UNIFORM ? opts.size.b : opts.size.a;
+	if (opts.size.kind == DIST_EXP) {
+		max = opts.size.a * 20;  // the tail beyond this is clamped
+	}
+	body_pool_size = (size_t)max + BODY_LINE_SIZE;
+	body_pool = malloc(body_pool_size);
+	if (body_pool == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < body_pool_size; i++) {
+		size_t col = i % BODY_LINE_SIZE;
+		body_pool[i] = col == BODY_LINE_SIZE - 2 ? '\r' : col == BODY_LINE_SIZE - 1 ? '\n' : 'a' + (i % 26);
+	}
+}
+
+static void
+record_latency(uint64_t ns)
+{
+	if (stats.nsamples == stats.samples_cap) {
+		stats.samples_cap = stats.samples_cap == 0 ? 4096 : stats.samples_cap * 2;
+		stats.samples = realloc(stats.samples, stats.samples_cap * sizeof(*stats.samples));
+		if (stats.samples == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	stats.samples[stats.nsamples++] = ns;
+}
+
+static bool
+measured(const struct message* m)
+{
+	return m->intended >= (uint64_t)(opts.warmup * NS_PER_S);
+}
+
+static void
+message_done(struct conn* c, bool ok)
+{
+	if (!c->has_msg) {
+		return;
+	}
+	c->has_msg = false;
+	if (!measured(&c->msg)) {
+		return;
+	}
+	if (ok) {
+		stats.completed++;
+		stats.bytes += c->msg.size;
+		record_latency(now_ns() - c->msg.intended);
+	} else {
+		stats.failed++;
+	}
+}
+
+static void
+conn_close(struct conn* c)
+{
+	message_done(c, false);
+	if (c->fd >= 0) {
+		close(c->fd);
+	}
+	c->fd = -1;
+	c->phase = PHASE_FREE;
+}
+
+/**
+ * @brief The server did not take the connection: back off before opening more, so a
+ * refusing server is not measured as a reconnect loop.
+ */
+static void
+conn_refused(struct conn* c)
+{
+	stats.conns_refused++;
+	backoff_ns = backoff_ns == 0 ? BACKOFF_MIN_NS : backoff_ns * 2 > BACKOFF_MAX_NS ? BACKOFF_MAX_NS : backoff_ns * 2;
+	reconnect_at = now_ns() + backoff_ns;
+	conn_close(c);
+}
+
+static void
+set_output(struct conn* c, const void* a, size_t alen, const void* b, size_t blen)
+{
+	c->iov[0] = (struct iovec){ .iov_base = (void*)a, .iov_len = alen };
+	c->iov[1] = (struct iovec){ .iov_base = (void*)b, .iov_len = blen };
+	c->iovcnt = blen > 0 ? 2 : 1;
+}
+
+static bool
+output_pending(const struct conn* c)
+{
+	return c->iovcnt > 0;
+}
+
+static void
+send_line(struct conn* c, const char* line)
+{
+	set_output(c, line, strlen(line), NULL, 0);
+}
+
+/** @brief Queues the next envelope command, or all of them when pipelining. */
+static void
+send_envelope(struct conn* c)
+{
+	const size_t from = c->lines_sent == 0 ? 0 : c->line_end[c->lines_sent - 1];
+	const unsigned upto = opts.pipelining ? c->lines : c->lines_sent + 1;
+	const size_t to = c->line_end[upto - 1];
+	c->replies_pending = upto - c->lines_sent;
+	c->lines_sent = upto;
+	set_output(c, c->envelope + from, to - from, NULL, 0);
+}
+
+static void
+start_message(struct conn* c, const struct message* m)
+{
+	c->msg = *m;
+	c->has_msg = true;
+	c->failed = false;
+	c->lines = 0;
+	c->lines_sent = 0;
+
+	size_t len = 0;
+	// After a message the server expects a new greeting: RSET brings it back to MAIL.
+	if (c->messages_sent > 0) {
+		len += snprintf(c->envelope + len, MAX_LINE, "RSET\r\n");
+		c->line_end[c->lines++] = len;
+	}
+	len += snprintf(c->envelope + len, MAX_LINE, "MAIL FROM:<bench@local>\r\n");
+	c->line_end[c->lines++] = len;
+	for (unsigned i = 0; i < m->rcpts; i++) {
+		unsigned user = (unsigned)(rand_unit() * opts.users) % opts.users;
+		len += snprintf(c->envelope + len, MAX_LINE, "RCPT TO:<bench%u@local>\r\n", user);
+		c->line_end[c->lines++] = len;
+	}
+	len += snprintf(c->envelope + len, MAX_LINE, "DATA\r\n");
+	c->line_end[c->lines++] = len;
+
+	c->messages_sent++;
+	c->phase = PHASE_ENVELOPE;
+	send_envelope(c);
+}
+
+static bool
+pending_pop(struct message* m)
+{
+	if (pending_len == 0) {
+		return false;
+	}
+	*m = pending[pending_head];
+	pending_head = (pending_head + 1) % PENDING_SIZE;
+	pending_len--;
+	return true;
+}
+
+/** @brief The connection is ready for a new message: take one, or say goodbye if it is used up. */
+static void
+conn_ready(struct conn* c)
+{
+	c->phase = PHASE_IDLE;
+	if (c->messages_sent >= opts.per_conn) {
+		c->phase = PHASE_QUIT;
+		send_line(c, "QUIT\r\n");
+		return;
+	}
+	struct message m;
+	if (pending_pop(&m)) {
+		start_message(c, &m);
+	}
+}
+
+static void
+conn_open(struct conn* c)
+{
+	c->fd = socket(server_addr->ai_family, SOCK_STREAM, 0);
+	if (c->fd < 0) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+	// commands are small writes waiting on a reply: don't let Nagle hold them back
+	int one = 1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	c->phase = PHASE_CONNECTING;
+	c->messages_sent = 0;
+	c->has_msg = false;
+	c->iovcnt = 0;
+	c->in_len = 0;
+	stats.conns_opened++;
+	if (connect(c->fd, server_addr->ai_addr, server_addr->ai_addrlen) != 0 && errno != EINPROGRESS) {
+		conn_refused(c);
+	}
+}
+
+/** @brief Handles one complete reply with status `code'. */
+static void
+on_reply(struct conn* c, int code)
+{
+	const bool positive = code >= 200 && code < 400;
+	switch (c->phase) {
+		case PHASE_GREETING:
+			if (code != 220) {
+				conn_refused(c);
+				return;
+			}
+			backoff_ns = 0;
+			c->phase = PHASE_EHLO;
+			send_line(c, "EHLO bench.local\r\n");
+			break;
+		case PHASE_EHLO:
+			if (!positive) {
+				conn_close(c);
+				return;
+			}
+			conn_ready(c);
+			break;
+		case PHASE_ENVELOPE:
+			c->failed |= !positive;
+			if (--c->replies_pending > 0) {
+				return;
+			}
+			if (c->lines_sent < c->lines) {
+				send_envelope(c);
+				return;
+			}
+			if (c->failed || code != 354) {
+				// the server may be waiting for the body or not: start over on a new connection
+				conn_close(c);
+				return;
+			}
+			c->phase = PHASE_BODY;
+			c->trailer_queued = false;
+			set_output(c, body_header, strlen(body_header), body_pool, c->msg.size);
+			break;
+		case PHASE_BODY:
+			message_done(c, code == 250);
+			conn_ready(c);
+			break;
+		case PHASE_QUIT:
+			conn_close(c);
+			break;
+		default:
+			break;
+	}
+}
+
+static void
+on_readable(struct conn* c)
+{
+	ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+	if (n <= 0) {
+		if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+			return;
+		}
+		conn_close(c);
+		return;
+	}
+	c->in_len += n;
+
+	// Replies end at a line whose fourth character is not '-'.
+	size_t start = 0;
+	char* nl;
+	while (c->phase != PHASE_FREE && (nl = memchr(c->in + start, '\n', c->in_len - start)) != NULL) {
+		const char* line = c->in + start;
+		const size_t len = nl - line;
+		start += len + 1;
+		if (len >= 4 && line[3] == '-') {
+			continue;
+		}
+		on_reply(c, len >= 3 ? atoi(line) : 0);
+	}
+	if (c->phase == PHASE_FREE) {
+		return;
+	}
+	memmove(c->in, c->in + start, c->in_len - start);
+	c->in_len -= start;
+	if (c->in_len == sizeof(c->in)) {
+		c->in_len = 0;  // a line longer than the buffer: drop it
+	}
+}
+
+static void
+on_writable(struct conn* c)
+{
+	if (c->phase == PHASE_CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err != 0) {
+			conn_refused(c);
+			return;
+		}
+		c->phase = PHASE_GREETING;
+		return;
+	}
+
+	ssize_t n = writev(c->fd, c->iov, c->iovcnt);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			conn_close(c);
+		}
+		return;
+	}
+	for (int i = 0; i < c->iovcnt; i++) {
+		size_t used = (size_t)n < c->iov[i].iov_len ? (size_t)n : c->iov[i].iov_len;
+		c->iov[i].iov_base = (char*)c->iov[i].iov_base + used;
+		c->iov[i].iov_len -= used;
+		n -= used;
+	}
+	while (c->iovcnt > 0 && c->iov[0].iov_len == 0) {
+		c->iov[0] = c->iov[1];
+		c->iovcnt--;
+	}
+	if (c->iovcnt == 0 && c->phase == PHASE_BODY && !c->trailer_queued) {
+		// header and body are out: finish with the end of data marker
+		c->trailer_queued = true;
+		set_output(c, body_trailer, strlen(body_trailer), NULL, 0);
+	}
+}
+
+static uint64_t
+interarrival_ns(void)
+{
+	double mean = NS_PER_S / opts.rate;
+	return (uint64_t)(opts.poisson ? -log(rand_unit()) * mean : mean);
+}
+
+static struct message
+new_message(uint64_t intended)
+{
+	struct message m = { .intended = intended };
+	double size = dist_sample(&opts.size);
+	m.size = size < 0 ? 0 : size > body_pool_size - BODY_LINE_SIZE ? body_pool_size - BODY_LINE_SIZE : (size_t)size;
+	double rcpts = dist_sample(&opts.rcpts);
+	m.rcpts = rcpts < 1 ? 1 : rcpts > MAX_RCPTS ? MAX_RCPTS : (unsigned)rcpts;
+	return m;
+}
+
+static void
+run(void)
+{
+	const uint64_t end = (uint64_t)(opts.duration * NS_PER_S);
+	const uint64_t drain_end = end + DRAIN_TIMEOUT_S * NS_PER_S;
+	uint64_t next_arrival = 0;
+	struct pollfd* pfds = calloc(opts.max_conns, sizeof(*pfds));
+	unsigned* pidx = calloc(opts.max_conns, sizeof(*pidx));
+	if (pfds == NULL || pidx == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (;;) {
+		uint64_t t = now_ns();
+		while (next_arrival <= t && next_arrival < end) {
+			struct message m = new_message(next_arrival);
+			if (measured(&m)) {
+				stats.offered++;
+			}
+			if (pending_len == PENDING_SIZE) {
+				stats.dropped += measured(&m);
+			} else {
+				pending[(pending_head + pending_len) % PENDING_SIZE] = m;
+				pending_len++;
+			}
+			next_arrival += interarrival_ns();
+		}
+
+		// hand queued messages to idle connections, opening new ones if allowed
+		unsigned busy = 0, connecting = 0;
+		for (unsigned i = 0; i < opts.max_conns; i++) {
+			struct conn* c = conns + i;
+			if (c->phase == PHASE_IDLE && pending_len > 0) {
+				conn_ready(c);
+			}
+			if (c->phase != PHASE_FREE && c->phase != PHASE_IDLE) {
+				busy++;
+			}
+			if (c->phase == PHASE_CONNECTING || c->phase == PHASE_GREETING || c->phase == PHASE_EHLO) {
+				connecting++;
+			}
+		}
+		// once -d is over, only connections already open finish what is queued
+		const bool may_open = t < end && t >= reconnect_at;
+		for (unsigned i = 0; may_open && i < opts.max_conns && pending_len > connecting; i++) {
+			if (conns[i].phase == PHASE_FREE) {
+				conn_open(conns + i);
+				connecting++;
+				busy++;
+			}
+		}
+
+		if (next_arrival >= end && busy == 0 && (pending_len == 0 || t >= end)) {
+			break;
+		}
+		if (t >= drain_end) {
+			break;
+		}
+
+		nfds_t nfds = 0;
+		for (unsigned i = 0; i < opts.max_conns; i++) {
+			struct conn* c = conns + i;
+			if (c->phase == PHASE_FREE) {
+				continue;
+			}
+			short events = POLLIN;
+			if (c->phase == PHASE_CONNECTING || output_pending(c)) {
+				events |= POLLOUT;
+			}
+			pfds[nfds] = (struct pollfd){ .fd = c->fd, .events = events };
+			pidx[nfds++] = i;
+		}
+
+		int timeout_ms = 100;
+		if (pending_len > connecting && t < reconnect_at) {
+			uint64_t wait = (reconnect_at - t) / 1000000;
+			timeout_ms = wait < (uint64_t)timeout_ms ? (int)wait : timeout_ms;
+		}
+		if (next_arrival < end) {
+			uint64_t wait = next_arrival > t ? (next_arrival - t) / 1000000 : 0;
+			timeout_ms = wait < (uint64_t)timeout_ms ? (int)wait : timeout_ms;
+		}
+		if (poll(pfds, nfds, timeout_ms) < 0 && errno != EINTR) {
+			perror("poll");
+			exit(EXIT_FAILURE);
+		}
+
+		for (nfds_t i = 0; i < nfds; i++) {
+			struct conn* c = conns + pidx[i];
+			if (pfds[i].revents & (POLLOUT | POLLERR | POLLHUP)) {
+				if (c->phase == PHASE_CONNECTING || output_pending(c)) {
+					on_writable(c);
+				}
+			}
+			if (c->phase != PHASE_FREE && c->phase != PHASE_CONNECTING && (pfds[i].revents & (POLLIN | POLLHUP))) {
+				on_readable(c);
+			}
+		}
+	}
+
+	// whatever is still in flight or queued after the drain timeout counts as failed
+	for (unsigned i = 0; i < opts.max_conns; i++) {
+		if (conns[i].phase != PHASE_FREE) {
+			conn_close(conns + i);
+		}
+	}
+	struct message m;
+	while (pending_pop(&m)) {
+		stats.failed += measured(&m);
+	}
+	free(pfds);
+	free(pidx);
+}
+
+static int
+cmp_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double
+percentile_ms(double p)
+{
+	if (stats.nsamples == 0) {
+		return 0;
+	}
+	size_t i = (size_t)ceil(p * stats.nsamples);
+	i = i == 0 ? 0 : i - 1;
+	return stats.samples[i] / NS_PER_MS;
+}
+
+static void
+report(void)
+{
+	qsort(stats.samples, stats.nsamples, sizeof(*stats.samples), cmp_u64);
+	double sum = 0;
+	for (size_t i = 0; i < stats.nsamples; i++) {
+		sum += stats.samples[i];
+	}
+	const double window = opts.duration - opts.warmup;
+	const double throughput = stats.completed / window;
+	const double mean = stats.nsamples == 0 ? 0 : sum / stats.nsamples / NS_PER_MS;
+	const double p50 = percentile_ms(0.50), p90 = percentile_ms(0.90), p99 = percentile_ms(0.99),
+	             p999 = percentile_ms(0.999), max = percentile_ms(1.0);
+	const double min = stats.nsamples == 0 ? 0 : stats.samples[0] / NS_PER_MS;
+
+	switch (opts.format) {
+		case FORMAT_CSV:
+			printf("rate,duration_s,warmup_s,arrivals,conns,per_conn,pipelining,size,rcpts,"
+			       "offered,completed,failed,dropped,conns_opened,conns_refused,throughput_msg_s,throughput_mb_s,"
+			       "min_ms,mean_ms,p50_ms,p90_ms,p99_ms,p999_ms,max_ms\n");
+			printf("%g,%g,%g,%s,%u,%u,%d,%s,%s,%llu,%llu,%llu,%llu,%llu,%llu,%.2f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%."
+			       "3f\n",
+			       opts.rate,
+			       opts.duration,
+			       opts.warmup,
+			       opts.poisson ? "poisson" : "uniform",
+			       opts.max_conns,
+			       opts.per_conn,
+			       opts.pipelining,
+			       opts.size.spec,
+			       opts.rcpts.spec,
+			       (unsigned long long)stats.offered,
+			       (unsigned long long)stats.completed,
+			       (unsigned long long)stats.failed,
+			       (unsigned long long)stats.dropped,
+			       (unsigned long long)stats.conns_opened,
+			       (unsigned long long)stats.conns_refused,
+			       throughput,
+			       stats.bytes / window / 1e6,
+			       min,
+			       mean,
+			       p50,
+			       p90,
+			       p99,
+			       p999,
+			       max);
+			break;
+		case FORMAT_JSON:
+			printf("{\"config\":{\"rate\":%g,\"duration_s\":%g,\"warmup_s\":%g,\"arrivals\":\"%s\",\"conns\":%u,"
+			       "\"per_conn\":%u,\"pipelining\":%s,\"size\":\"%s\",\"rcpts\":\"%s\"},",
+			       opts.rate,
+			       opts.duration,
+			       opts.warmup,
+			       opts.poisson ? "poisson" : "uniform",
+			       opts.max_conns,
+			       opts.per_conn,
+			       opts.pipelining ? "true" : "false",
+			       opts.size.spec,
+			       opts.rcpts.spec);
+			printf("\"messages\":{\"offered\":%llu,\"completed\":%llu,\"failed\":%llu,\"dropped\":%llu},"
+			       "\"connections\":{\"opened\":%llu,\"refused\":%llu},",
+			       (unsigned long long)stats.offered,
+			       (unsigned long long)stats.completed,
+			       (unsigned long long)stats.failed,
+			       (unsigned long long)stats.dropped,
+			       (unsigned long long)stats.conns_opened,
+			       (unsigned long long)stats.conns_refused);
+			printf("\"throughput\":{\"msg_s\":%.2f,\"mb_s\":%.3f},"
+			       "\"latency_ms\":{\"min\":%.3f,\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"p999\":%.3f,"
+			       "\"max\":%.3f}}\n",
+			       throughput,
+			       stats.bytes / window / 1e6,
+			       min,
+			       mean,
+			       p50,
+			       p90,
+			       p99,
+			       p999,
+			       max);
+			break;
+		default:
+			printf("offered %.0f msg/s for %gs (%gs warm-up), %s arrivals, %u conns, %u msg/conn, pipelining %s\n",
+			       opts.rate,
+			       opts.duration,
+			       opts.warmup,
+			       opts.poisson ? "poisson" : "uniform",
+			       opts.max_conns,
+			       opts.per_conn,
+			       opts.pipelining ? "on" : "off");
+			printf("size %s, recipients %s\n", opts.size.spec, opts.rcpts.spec);
+			printf("messages:    %llu offered, %llu completed, %llu failed, %llu dropped\n",
+			       (unsigned long long)stats.offered,
+			       (unsigned long long)stats.completed,
+			       (unsigned long long)stats.failed,
+			       (unsigned long long)stats.dropped);
+			printf("connections: %llu opened, %llu refused\n",
+			       (unsigned long long)stats.conns_opened,
+			       (unsigned long long)stats.conns_refused);
+			printf("throughput:  %.2f msg/s, %.3f MB/s\n", throughput, stats.bytes / window / 1e6);
+			printf("latency ms:  min %.3f  mean %.3f  p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+			       min,
+			       mean,
+			       p50,
+			       p90,
+			       p99,
+			       p999,
+			       max);
+			break;
+	}
+}
+
+int
+main(int argc, char* argv[])
+{
+	parse_options(argc, argv);
+
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	int err = getaddrinfo(opts.host, opts.port, &hints, &server_addr);
+	if (err != 0) {
+		fprintf(stderr, "%s: %s\n", opts.host, gai_strerror(err));
+		return EXIT_FAILURE;
+	}
+
+	init_body_pool();
+	conns = calloc(opts.max_conns, sizeof(*conns));
+	pending = malloc(PENDING_SIZE * sizeof(*pending));
+	if (conns == NULL || pending == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	for (unsigned i = 0; i < opts.max_conns; i++) {
+		conns[i].fd = -1;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	start_ns = (uint64_t)ts.tv_sec * NS_PER_S + (uint64_t)ts.tv_nsec;
+
+	run();
+	report();
+
+	freeaddrinfo(server_addr);
+	free(stats.samples);
+	free(pending);
+	free(conns);
+	free(body_pool);
+	return stats.failed == 0 && stats.dropped == 0 ? EXIT_SUCCESS : 2;
+}
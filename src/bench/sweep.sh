@@ -0,0 +1,20 @@
+#!/bin/sh
+# Runs smtp_bench.elf against an already running server at increasing offered rates
+# and prints one CSV row per rate, so runs before and after a change can be diffed.
+#
+# Usage: bench/sweep.sh "<rates>" [smtp_bench options...]
+#   e.g. bench/sweep.sh "100 200 400 800" -d 20 -w 5 -k 10 > before.csv
+
+rates=${1:-"100 200 400 800"}
+[ $# -gt 0 ] && shift
+
+bench=$(dirname "$0")/../smtp_bench.elf
+header=1
+for rate in $rates; do
+	if [ $header -eq 1 ]; then
+		"$bench" -f csv -r "$rate" "$@"
+		header=0
+	else
+		"$bench" -f csv -r "$rate" "$@" | tail -n +2
+	fi
+done
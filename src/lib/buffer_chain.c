@@ -0,0 +1,305 @@
+/**
+ * buffer_chain.c - buffer de segmentos encadenados (ver buffer_chain.h)
+ */
+#include "buffer_chain.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static struct buffer_segment* pool = NULL;
+static size_t pool_qty = 0;
+
+struct buffer_segment*
+buffer_segment_get(void)
+{
+	struct buffer_segment* s = pool;
+	if (s != NULL) {
+		pool = s->next;
+		pool_qty--;
+	} else {
+		s = malloc(sizeof(*s));
+		if (s == NULL) {
+			return NULL;
+		}
+	}
+	s->next = NULL;
+	s->read = 0;
+	s->write = 0;
+	return s;
+}
+
+void
+buffer_segment_put(struct buffer_segment* s)
+{
+	if (pool_qty >= BUFFER_CHAIN_POOL_MAX) {
+		free(s);
+		return;
+	}
+	s->next = pool;
+	pool = s;
+	pool_qty++;
+}
+
+size_t
+buffer_pool_free_qty(void)
+{
+	return pool_qty;
+}
+
+void
+buffer_pool_destroy(void)
+{
+	while (pool != NULL) {
+		struct buffer_segment* next = pool->next;
+		free(pool);
+		pool = next;
+	}
+	pool_qty = 0;
+}
+
+void
+buffer_chain_init(buffer_chain* c, size_t limit)
+{
+	memset(c, 0, sizeof(*c));
+	c->limit = limit;
+}
+
+void
+buffer_chain_reset(buffer_chain* c)
+{
+	struct buffer_segment* s = c->head;
+	while (s != NULL) {
+		struct buffer_segment* next = s->next;
+		buffer_segment_put(s);
+		s = next;
+	}
+	c->head = c->tail = c->cursor = NULL;
+	c->len = 0;
+}
+
+bool
+buffer_chain_can_read(const buffer_chain* c)
+{
+	return c->len > 0;
+}
+
+size_t
+buffer_chain_len(const buffer_chain* c)
+{
+	return c->len;
+}
+
+/** bytes que todavía se pueden encolar */
+static size_t
+room(const buffer_chain* c)
+{
+	if (c->limit == 0) {
+		return SIZE_MAX;
+	}
+	return c->len >= c->limit ? 0 : c->limit - c->len;
+}
+
+/** agrega un segmento vacío al final */
+static struct buffer_segment*
+append_segment(buffer_chain* c)
+{
+	struct buffer_segment* s = buffer_segment_get();
+	if (s == NULL) {
+		return NULL;
+	}
+	if (c->tail != NULL) {
+		c->tail->next = s;
+	} else {
+		c->head = s;
+	}
+	c->tail = s;
+	return s;
+}
+
+/** segmento donde sigue la escritura, agregando uno si hace falta */
+static struct buffer_segment*
+writable(buffer_chain* c)
+{
+	while (c->cursor != NULL && c->cursor->write == BUFFER_CHAIN_SEGMENT_SIZE) {
+		c->cursor = c->cursor->next;
+	}
+	if (c->cursor == NULL) {
+		c->cursor = append_segment(c);
+	}
+	return c->cursor;
+}
+
+size_t
+buffer_chain_write(buffer_chain* c, const void* data, size_t n)
+{
+	const uint8_t* src = data;
+	n = MIN(n, room(c));
+
+	size_t done = 0;
+	while (done < n) {
+		struct buffer_segment* s = writable(c);
+		if (s == NULL) {
+			break;
+		}
+		const size_t k = MIN((size_t)(BUFFER_CHAIN_SEGMENT_SIZE - s->write), n - done);
+		memcpy(s->data + s->write, src + done, k);
+		s->write += k;
+		done += k;
+	}
+	c->len += done;
+	return done;
+}
+
+void
+buffer_chain_read_adv(buffer_chain* c, size_t n)
+{
+	n = MIN(n, c->len);
+	c->len -= n;
+
+	while (n > 0) {
+		struct buffer_segment* s = c->head;
+		const size_t k = MIN((size_t)(s->write - s->read), n);
+		s->read += k;
+		n -= k;
+		if (s->read == s->write && s->write == BUFFER_CHAIN_SEGMENT_SIZE) {
+			// leído entero: vuelve al pool
+			c->head = s->next;
+			if (c->cursor == s) {
+				c->cursor = s->next;
+			}
+			if (c->tail == s) {
+				c->tail = NULL;
+			}
+			buffer_segment_put(s);
+		}
+	}
+
+	if (c->len == 0) {
+		// nada en vuelo: no retenemos memoria
+		buffer_chain_reset(c);
+	}
+}
+
+size_t
+buffer_chain_read(buffer_chain* c, void* dst, size_t n)
+{
+	uint8_t* out = dst;
+	size_t done = 0;
+	for (const struct buffer_segment* s = c->head; s != NULL && done < n; s = s->next) {
+		const size_t k = MIN((size_t)(s->write - s->read), n - done);
+		memcpy(out + done, s->data + s->read, k);
+		done += k;
+	}
+	buffer_chain_read_adv(c, done);
+	return done;
+}
+
+int
+buffer_chain_read_iov(const buffer_chain* c, struct iovec* iov, int iovcnt)
+{
+	int cnt = 0;
+	for (const struct buffer_segment* s = c->head; s != NULL && cnt < iovcnt; s = s->next) {
+		if (s->read == s->write) {
+			continue;
+		}
+		iov[cnt].iov_base = (void*)(s->data + s->read);
+		iov[cnt].iov_len = s->write - s->read;
+		cnt++;
+	}
+	return cnt;
+}
+
+int
+buffer_chain_write_iov(buffer_chain* c, struct iovec* iov, int iovcnt, size_t n)
+{
+	n = MIN(n, room(c));
+	if (n == 0 || iovcnt <= 0) {
+		return 0;
+	}
+
+	int cnt = 0;
+	struct buffer_segment* s = writable(c);
+	while (s != NULL) {
+		const size_t k = MIN((size_t)(BUFFER_CHAIN_SEGMENT_SIZE - s->write), n);
+		iov[cnt].iov_base = s->data + s->write;
+		iov[cnt].iov_len = k;
+		cnt++;
+		n -= k;
+		if (n == 0 || cnt == iovcnt) {
+			break;
+		}
+		s = s->next != NULL ? s->next : append_segment(c);
+	}
+	return cnt;
+}
+
+void
+buffer_chain_write_adv(buffer_chain* c, size_t n)
+{
+	while (n > 0) {
+		struct buffer_segment* s = writable(c);
+		if (s == NULL) {
+			break;
+		}
+		const size_t k = MIN((size_t)(BUFFER_CHAIN_SEGMENT_SIZE - s->write), n);
+		s->write += k;
+		c->len += k;
+		n -= k;
+	}
+	if (c->len == 0) {
+		// lo reservado y no usado vuelve al pool
+		buffer_chain_reset(c);
+	}
+}
+
+ssize_t
+buffer_chain_readv(buffer_chain* c, int fd, size_t n)
+{
+	struct iovec iov[BUFFER_CHAIN_IOV_MAX];
+	const int cnt = buffer_chain_write_iov(c, iov, BUFFER_CHAIN_IOV_MAX, n);
+	if (cnt == 0) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	const ssize_t r = readv(fd, iov, cnt);
+	buffer_chain_write_adv(c, r > 0 ? (size_t)r : 0);
+	return r;
+}
+
+ssize_t
+buffer_chain_writev(buffer_chain* c, int fd)
+{
+	struct iovec iov[BUFFER_CHAIN_IOV_MAX];
+	const int cnt = buffer_chain_read_iov(c, iov, BUFFER_CHAIN_IOV_MAX);
+	if (cnt == 0) {
+		return 0;
+	}
+	const ssize_t r = writev(fd, iov, cnt);
+	if (r > 0) {
+		buffer_chain_read_adv(c, r);
+	}
+	return r;
+}
+
+ssize_t
+buffer_chain_send(buffer_chain* c, int fd, int flags)
+{
+	struct iovec iov[BUFFER_CHAIN_IOV_MAX];
+	const int cnt = buffer_chain_read_iov(c, iov, BUFFER_CHAIN_IOV_MAX);
+	if (cnt == 0) {
+		return 0;
+	}
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = cnt,
+	};
+	const ssize_t r = sendmsg(fd, &msg, flags);
+	if (r > 0) {
+		buffer_chain_read_adv(c, r);
+	}
+	return r;
+}
@@ -0,0 +1,447 @@
+#include "compress.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HASH_LOG  12
+#define MIN_MATCH 4
+// el formato pide que los últimos 5 bytes sean literales y que el último
+// match empiece al menos 12 bytes antes del final del bloque
+#define LAST_LITERALS 5
+#define MF_LIMIT      12
+#define MAX_OFFSET    65535
+#define BLOCK_BOUND(n) ((n) + (n) / 255 + 16)
+#define UNCOMPRESSED_FLAG 0x80000000U
+
+// FLG: versión 01, bloques independientes, sin checksums ni tamaño de contenido
+#define FRAME_FLG 0x60
+// BD: bloques de hasta 64 KiB
+#define FRAME_BD 0x40
+
+struct compressor
+{
+	int fd;
+	uint64_t raw;
+	size_t in_len;
+	uint8_t in[COMPRESS_BLOCK_SIZE];
+	uint8_t out[4 + BLOCK_BOUND(COMPRESS_BLOCK_SIZE)];
+	uint32_t table[1 << HASH_LOG];
+};
+
+static uint32_t
+read32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static void
+write32le(uint8_t* p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t
+read32le(const uint8_t* p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int
+write_full(int fd, const uint8_t* buf, size_t len)
+{
+	while (len > 0) {
+		const ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/** @returns the bytes read, less than `len' only at end of file, or -1 on error. */
+static ssize_t
+read_full(int fd, uint8_t* buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		const ssize_t n = read(fd, buf + done, len - done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		done += n;
+	}
+	return done;
+}
+
+/** XXH32 with seed 0 for inputs shorter than 16 bytes, enough for the frame descriptor checksum. */
+static uint32_t
+xxh32_short(const uint8_t* p, size_t len)
+{
+	const uint32_t p1 = 2654435761U, p2 = 2246822519U, p3 = 3266489917U, p4 = 668265263U, p5 = 374761393U;
+	uint32_t h = p5 + (uint32_t)len;
+	size_t i = 0;
+	for (; i + 4 <= len; i += 4) {
+		h += read32le(p + i) * p3;
+		h = ((h << 17) | (h >> 15)) * p4;
+	}
+	for (; i < len; i++) {
+		h += p[i] * p5;
+		h = ((h << 11) | (h >> 21)) * p1;
+	}
+	h ^= h >> 15;
+	h *= p2;
+	h ^= h >> 13;
+	h *= p3;
+	h ^= h >> 16;
+	return h;
+}
+
+static uint8_t*
+put_length(uint8_t* op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+static uint8_t*
+put_sequence(uint8_t* op, const uint8_t* literals, size_t lit_len, size_t offset, size_t match_len)
+{
+	uint8_t* token = op++;
+	*token = (lit_len >= 15 ? 15 : lit_len) << 4;
+	if (lit_len >= 15) {
+		op = put_length(op, lit_len - 15);
+	}
+	memcpy(op, literals, lit_len);
+	op += lit_len;
+	if (match_len == 0) {
+		return op;
+	}
+	*op++ = offset;
+	*op++ = offset >> 8;
+	match_len -= MIN_MATCH;
+	*token |= match_len >= 15 ? 15 : match_len;
+	if (match_len >= 15) {
+		op = put_length(op, match_len - 15);
+	}
+	return op;
+}
+
+/** @returns the size of the compressed block written to `dst', at most BLOCK_BOUND(n). */
+static size_t
+compress_block(const uint8_t* src, size_t n, uint8_t* dst, uint32_t* table)
+{
+	uint8_t* op = dst;
+	size_t anchor = 0;
+	if (n > MF_LIMIT) {
+		memset(table, 0, sizeof(uint32_t) << HASH_LOG);
+		const size_t match_limit = n - LAST_LITERALS;
+		size_t ip = 1;
+		while (ip < n - MF_LIMIT) {
+			const uint32_t seq = read32(src + ip);
+			const uint32_t h = (seq * 2654435761U) >> (32 - HASH_LOG);
+			const size_t ref = table[h];
+			table[h] = ip;
+			if (ip - ref > MAX_OFFSET || read32(src + ref) != seq) {
+				// sin matches por un rato: avanzamos más rápido sobre lo incompresible
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+			size_t len = MIN_MATCH;
+			while (ip + len < match_limit && src[ref + len] == src[ip + len]) {
+				len++;
+			}
+			op = put_sequence(op, src + anchor, ip - anchor, ip - ref, len);
+			ip += len;
+			anchor = ip;
+		}
+	}
+	return put_sequence(op, src + anchor, n - anchor, 0, 0) - dst;
+}
+
+static int
+flush_block(compressor* c)
+{
+	if (c->in_len == 0) {
+		return 0;
+	}
+	size_t size = compress_block(c->in, c->in_len, c->out + 4, c->table);
+	uint32_t header = size;
+	if (size >= c->in_len) {
+		// no ganamos nada: va sin comprimir
+		memcpy(c->out + 4, c->in, c->in_len);
+		size = c->in_len;
+		header = size | UNCOMPRESSED_FLAG;
+	}
+	write32le(c->out, header);
+	c->in_len = 0;
+	return write_full(c->fd, c->out, 4 + size);
+}
+
+compressor*
+compressor_new(int fd)
+{
+	compressor* c = malloc(sizeof(*c));
+	if (c == NULL) {
+		return NULL;
+	}
+	c->fd = fd;
+	c->raw = 0;
+	c->in_len = 0;
+	uint8_t header[7];
+	write32le(header, COMPRESS_MAGIC);
+	header[4] = FRAME_FLG;
+	header[5] = FRAME_BD;
+	header[6] = (xxh32_short(header + 4, 2) >> 8) & 0xFF;
+	if (write_full(fd, header, sizeof(header)) != 0) {
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+ssize_t
+compressor_write(compressor* c, const void* buf, size_t len)
+{
+	const uint8_t* p = buf;
+	size_t left = len;
+	while (left > 0) {
+		size_t n = COMPRESS_BLOCK_SIZE - c->in_len;
+		if (n > left) {
+			n = left;
+		}
+		memcpy(c->in + c->in_len, p, n);
+		c->in_len += n;
+		p += n;
+		left -= n;
+		if (c->in_len == COMPRESS_BLOCK_SIZE && flush_block(c) != 0) {
+			return -1;
+		}
+	}
+	c->raw += len;
+	return len;
+}
+
+uint64_t
+compressor_raw_size(const compressor* c)
+{
+	return c->raw;
+}
+
+int
+compressor_finish(compressor* c)
+{
+	uint8_t end_mark[4] = { 0 };
+	const int ret = flush_block(c) == 0 && write_full(c->fd, end_mark, sizeof(end_mark)) == 0 ? 0 : -1;
+	free(c);
+	return ret;
+}
+
+void
+compressor_free(compressor* c)
+{
+	free(c);
+}
+
+bool
+compress_is_compressed(int fd)
+{
+	uint8_t magic[4];
+	return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && read32le(magic) == COMPRESS_MAGIC;
+}
+
+/** @returns the decompressed size, or -1 if the block is malformed or does not fit in `cap'. */
+static ssize_t
+decompress_block(const uint8_t* src, size_t n, uint8_t* dst, size_t cap)
+{
+	size_t ip = 0, op = 0;
+	while (ip < n) {
+		const uint8_t token = src[ip++];
+		size_t lit_len = token >> 4;
+		if (lit_len == 15) {
+			uint8_t b;
+			do {
+				if (ip >= n) {
+					return -1;
+				}
+				b = src[ip++];
+				lit_len += b;
+			} while (b == 255);
+		}
+		if (lit_len > n - ip || lit_len > cap - op) {
+			return -1;
+		}
+		memcpy(dst + op, src + ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+		if (ip == n) {
+			break;  // la última secuencia sólo tiene literales
+		}
+		if (n - ip < 2) {
+			return -1;
+		}
+		const size_t offset = src[ip] | (size_t)src[ip + 1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > op) {
+			return -1;
+		}
+		size_t match_len = token & 15;
+		if (match_len == 15) {
+			uint8_t b;
+			do {
+				if (ip >= n) {
+					return -1;
+				}
+				b = src[ip++];
+				match_len += b;
+			} while (b == 255);
+		}
+		match_len += MIN_MATCH;
+		if (match_len > cap - op) {
+			return -1;
+		}
+		// puede solaparse con lo que está copiando, así que va de a un byte
+		for (size_t i = 0; i < match_len; i++, op++) {
+			dst[op] = dst[op - offset];
+		}
+	}
+	return op;
+}
+
+/** @brief Reads and checks the frame descriptor. @returns the flags, or -1 if it is not a frame we can read. */
+static int
+read_frame_header(int in, size_t* max_block)
+{
+	uint8_t header[7];
+	if (read_full(in, header, sizeof(header)) != sizeof(header) || read32le(header) != COMPRESS_MAGIC) {
+		return -1;
+	}
+	const uint8_t flg = header[4], bd = header[5];
+	const bool independent = flg & 0x20, content_size = flg & 0x08, dict_id = flg & 0x01;
+	const unsigned block_id = (bd >> 4) & 7;
+	if ((flg >> 6) != 1 || !independent || dict_id || block_id < 4) {
+		return -1;
+	}
+	// el checksum del descriptor cubre FLG, BD y el tamaño de contenido si está
+	uint8_t descriptor[10] = { flg, bd };
+	size_t descriptor_len = 2;
+	uint8_t hc = header[6];
+	if (content_size) {
+		uint8_t rest[8];
+		if (read_full(in, rest, sizeof(rest)) != sizeof(rest)) {
+			return -1;
+		}
+		memcpy(descriptor + 2, &header[6], 1);
+		memcpy(descriptor + 3, rest, 7);
+		descriptor_len = 10;
+		hc = rest[7];
+	}
+	if (((xxh32_short(descriptor, descriptor_len) >> 8) & 0xFF) != hc) {
+		return -1;
+	}
+	*max_block = (size_t)1 << (8 + 2 * block_id);
+	return flg;
+}
+
+ssize_t
+compress_decompress(int in, int out)
+{
+	size_t max_block;
+	const int flg = read_frame_header(in, &max_block);
+	if (flg < 0) {
+		return -1;
+	}
+	const bool block_checksum = flg & 0x10, content_checksum = flg & 0x04;
+
+	uint8_t* src = malloc(max_block);
+	uint8_t* dst = malloc(max_block);
+	ssize_t total = 0;
+	while (src != NULL && dst != NULL) {
+		uint8_t size_bytes[4];
+		if (read_full(in, size_bytes, sizeof(size_bytes)) != sizeof(size_bytes)) {
+			total = -1;
+			break;
+		}
+		const uint32_t size = read32le(size_bytes) & ~UNCOMPRESSED_FLAG;
+		const bool raw = read32le(size_bytes) & UNCOMPRESSED_FLAG;
+		if (size == 0 && !raw) {
+			uint8_t checksum[4];
+			if (content_checksum && read_full(in, checksum, sizeof(checksum)) != sizeof(checksum)) {
+				total = -1;
+			}
+			break;
+		}
+		if (size > max_block || read_full(in, src, size) != (ssize_t)size) {
+			total = -1;
+			break;
+		}
+		uint8_t checksum[4];
+		if (block_checksum && read_full(in, checksum, sizeof(checksum)) != sizeof(checksum)) {
+			total = -1;
+			break;
+		}
+		const ssize_t n = raw ? (ssize_t)size : decompress_block(src, size, dst, max_block);
+		if (n < 0 || write_full(out, raw ? src : dst, n) != 0) {
+			total = -1;
+			break;
+		}
+		total += n;
+	}
+	if (src == NULL || dst == NULL) {
+		total = -1;
+	}
+	free(src);
+	free(dst);
+	return total;
+}
+
+ssize_t
+compress_read_head(int in, void* buf, size_t len)
+{
+	size_t max_block;
+	uint8_t size_bytes[4];
+	if (read_frame_header(in, &max_block) < 0 || read_full(in, size_bytes, sizeof(size_bytes)) != sizeof(size_bytes)) {
+		return -1;
+	}
+	const uint32_t size = read32le(size_bytes) & ~UNCOMPRESSED_FLAG;
+	const bool raw = read32le(size_bytes) & UNCOMPRESSED_FLAG;
+	if (size > max_block) {
+		return -1;
+	}
+	uint8_t* src = malloc(size > 0 ? size : 1);
+	uint8_t* dst = raw ? NULL : malloc(max_block);
+	ssize_t n = -1;
+	if (src != NULL && (raw || dst != NULL) && read_full(in, src, size) == (ssize_t)size) {
+		n = raw ? (ssize_t)size : decompress_block(src, size, dst, max_block);
+	}
+	if (n > (ssize_t)len) {
+		n = len;
+	}
+	if (n > 0) {
+		memcpy(buf, raw ? src : dst, n);
+	}
+	free(src);
+	free(dst);
+	return n;
+}
@@ -0,0 +1,299 @@
+#include "conn_table.h"
+
+#include "logger.h"
+
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+#define TABLE_MASK (CONN_TABLE_SIZE - 1)
+
+#if (CONN_TABLE_SIZE & (CONN_TABLE_SIZE - 1)) != 0
+#error "CONN_TABLE_SIZE must be a power of two"
+#endif
+
+typedef struct conn_key
+{
+	uint8_t family;
+	uint8_t addr[16];
+} conn_key;
+
+typedef struct conn_entry
+{
+	conn_key key;
+	bool used;
+	/** sessions currently open */
+	uint32_t active;
+	/** attempts in the current and previous rate windows */
+	uint32_t cur;
+	uint32_t prev;
+	time_t window_start;
+} conn_entry;
+
+static conn_entry* table = NULL;
+static unsigned used_count = 0;
+static uint64_t seed = 0;
+static struct conn_limits limits;
+static fd_selector selector = NULL;
+static struct wheel_timer sweep_timer;
+
+static void
+sweep_timer_handler(struct wheel_timer* t, void* data)
+{
+	(void)data;
+	conn_table_sweep(time(NULL));
+	selector_timer_schedule(selector, t, (uint64_t)limits.rate_window_s * 1000);
+}
+
+int
+conn_table_init(fd_selector selector_param, const struct conn_limits* limits_param)
+{
+	table = calloc(CONN_TABLE_SIZE, sizeof(*table));
+	if (table == NULL) {
+		log(LOG_ERROR, "Could not allocate memory for the connection table");
+		return -1;
+	}
+	used_count = 0;
+
+	if (limits_param != NULL) {
+		limits = *limits_param;
+	} else {
+		limits = (struct conn_limits){
+			.max_per_host = CONN_MAX_PER_HOST,
+			.max_rate = CONN_MAX_RATE,
+			.rate_window_s = CONN_RATE_WINDOW_S,
+			.v4_prefix = CONN_V4_PREFIX,
+			.v6_prefix = CONN_V6_PREFIX,
+		};
+	}
+	if (limits.rate_window_s == 0) {
+		limits.rate_window_s = CONN_RATE_WINDOW_S;
+	}
+
+	// A random per-process seed keeps remote hosts from choosing colliding
+	// prefixes. Without getrandom(2) the table still works, only predictably.
+	if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != (ssize_t)sizeof(seed)) {
+		log(LOG_WARNING, "Connection table: getrandom failed, using a predictable seed");
+		seed = 0xcbf29ce484222325ULL ^ ((uint64_t)time(NULL) << 16) ^ (uint64_t)getpid();
+	}
+
+	selector = selector_param;
+	if (selector != NULL) {
+		wheel_timer_init(&sweep_timer, sweep_timer_handler, NULL);
+		selector_timer_schedule(selector, &sweep_timer, (uint64_t)limits.rate_window_s * 1000);
+	}
+	return 0;
+}
+
+void
+conn_table_destroy(void)
+{
+	if (selector != NULL) {
+		selector_timer_cancel(selector, &sweep_timer);
+		selector = NULL;
+	}
+	free(table);
+	table = NULL;
+	used_count = 0;
+}
+
+static void
+mask_prefix(uint8_t* addr, size_t len, unsigned prefix)
+{
+	for (size_t i = 0; i < len; i++) {
+		if (prefix >= 8) {
+			prefix -= 8;
+		} else {
+			addr[i] &= (uint8_t)(0xFF << (8 - prefix));
+			prefix = 0;
+		}
+	}
+}
+
+/**
+ * @brief Builds the table key for `addr': the address family plus its prefix.
+ * IPv4-mapped IPv6 addresses are accounted as the IPv4 address they carry.
+ */
+static bool
+make_key(const struct sockaddr_storage* addr, conn_key* key)
+{
+	memset(key, 0, sizeof(*key));
+	if (addr->ss_family == AF_INET) {
+		const struct sockaddr_in* in = (const struct sockaddr_in*)addr;
+		key->family = AF_INET;
+		memcpy(key->addr, &in->sin_addr, 4);
+		mask_prefix(key->addr, 4, limits.v4_prefix);
+		return true;
+	}
+	if (addr->ss_family == AF_INET6) {
+		const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)addr;
+		if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+			key->family = AF_INET;
+			memcpy(key->addr, &in6->sin6_addr.s6_addr[12], 4);
+			mask_prefix(key->addr, 4, limits.v4_prefix);
+		} else {
+			key->family = AF_INET6;
+			memcpy(key->addr, &in6->sin6_addr, 16);
+			mask_prefix(key->addr, 16, limits.v6_prefix);
+		}
+		return true;
+	}
+	return false;
+}
+
+static unsigned
+hash_key(const conn_key* key)
+{
+	// FNV-1a
+	uint64_t h = seed;
+	const uint8_t* p = (const uint8_t*)key;
+	for (size_t i = 0; i < sizeof(*key); i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return (unsigned)(h ^ (h >> 32)) & TABLE_MASK;
+}
+
+/**
+ * @brief Finds the slot for `key'. If it is not present and `insert' is set, claims
+ * an empty slot for it. Returns NULL if absent (or the table is full).
+ */
+static conn_entry*
+lookup(const conn_key* key, bool insert)
+{
+	unsigned i = hash_key(key);
+	for (unsigned probes = 0; probes < CONN_TABLE_SIZE; probes++, i = (i + 1) & TABLE_MASK) {
+		conn_entry* e = table + i;
+		if (!e->used) {
+			if (!insert) {
+				return NULL;
+			}
+			memset(e, 0, sizeof(*e));
+			e->key = *key;
+			e->used = true;
+			used_count++;
+			return e;
+		}
+		if (memcmp(&e->key, key, sizeof(*key)) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/** @brief Removes slot `i' keeping every probe chain intact (backward shift deletion). */
+static void
+remove_at(unsigned i)
+{
+	unsigned j = i;
+	for (;;) {
+		j = (j + 1) & TABLE_MASK;
+		if (!table[j].used) {
+			break;
+		}
+		unsigned home = hash_key(&table[j].key);
+		// can table[j] be moved to i? only if its home is not in (i, j]
+		bool in_between = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+		if (!in_between) {
+			table[i] = table[j];
+			i = j;
+		}
+	}
+	table[i].used = false;
+	used_count--;
+}
+
+/** @brief Slides the rate window and returns the estimated attempts over the last window. */
+static uint32_t
+rate_estimate(conn_entry* e, time_t now)
+{
+	const time_t window = limits.rate_window_s;
+	time_t elapsed = now - e->window_start;
+	if (elapsed >= 2 * window || elapsed < 0) {
+		e->prev = 0;
+		e->cur = 0;
+		e->window_start = now;
+		elapsed = 0;
+	} else if (elapsed >= window) {
+		e->prev = e->cur;
+		e->cur = 0;
+		e->window_start += window;
+		elapsed -= window;
+	}
+	return (uint32_t)(e->prev * (window - elapsed) / window) + e->cur;
+}
+
+conn_verdict
+conn_table_acquire(const struct sockaddr_storage* addr, time_t now)
+{
+	conn_key key;
+	if (table == NULL || !make_key(addr, &key)) {
+		return CONN_ADMIT;
+	}
+
+	conn_entry* e = lookup(&key, true);
+	if (e == NULL) {
+		// Full: reclaim what we can, otherwise refuse so the table keeps its guarantees.
+		conn_table_sweep(now);
+		e = lookup(&key, true);
+		if (e == NULL) {
+			log(LOG_WARNING, "Connection table full, refusing connection");
+			return CONN_TOO_MANY;
+		}
+	}
+
+	uint32_t attempts = rate_estimate(e, now);
+	e->cur++;
+	if (attempts + 1 > limits.max_rate) {
+		return CONN_TOO_FAST;
+	}
+	if (e->active >= limits.max_per_host) {
+		return CONN_TOO_MANY;
+	}
+	e->active++;
+	return CONN_ADMIT;
+}
+
+void
+conn_table_release(const struct sockaddr_storage* addr)
+{
+	conn_key key;
+	if (table == NULL || !make_key(addr, &key)) {
+		return;
+	}
+	conn_entry* e = lookup(&key, false);
+	if (e != NULL && e->active > 0) {
+		e->active--;
+	}
+}
+
+void
+conn_table_sweep(time_t now)
+{
+	if (table == NULL) {
+		return;
+	}
+	unsigned i = 0;
+	while (i < CONN_TABLE_SIZE) {
+		conn_entry* e = table + i;
+		if (e->used && e->active == 0 && now - e->window_start >= 2 * (time_t)limits.rate_window_s) {
+			// remove_at may shift another entry into `i', so look at it again
+			remove_at(i);
+			continue;
+		}
+		i++;
+	}
+}
+
+unsigned
+conn_table_active(const struct sockaddr_storage* addr)
+{
+	conn_key key;
+	if (table == NULL || !make_key(addr, &key)) {
+		return 0;
+	}
+	conn_entry* e = lookup(&key, false);
+	return e == NULL ? 0 : e->active;
+}
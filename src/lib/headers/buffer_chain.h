@@ -0,0 +1,122 @@
+#ifndef BUFFER_CHAIN_H
+#define BUFFER_CHAIN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * buffer_chain.c - buffer de tamaño variable formado por segmentos fijos
+ *                  encadenados.
+ *
+ * A diferencia de `buffer', no hay un tope fijo ni hace falta compactar: se
+ * escribe al final del último segmento (pidiendo uno nuevo cuando se llena) y
+ * se lee desde el primero, que vuelve al pool apenas se termina de leer.
+ *
+ *   head                              tail
+ *    ↓                                 ↓
+ *  +--------+      +--------+      +--------+
+ *  |  R→### | ---> | ###### | ---> | ##W→   |
+ *  +--------+      +--------+      +--------+
+ *
+ * Los segmentos salen de un pool compartido, así que una conexión sólo ocupa
+ * memoria mientras tiene bytes en vuelo: cuando la cadena queda vacía todos
+ * sus segmentos se devuelven.
+ *
+ * Para I/O se exportan las regiones como iovec (readv/writev/sendmsg), de
+ * modo que una respuesta larga o una ráfaga del cliente se mueven en una
+ * sola llamada al sistema aunque ocupen varios segmentos.
+ *
+ * El pool no es thread-safe: se usa desde el hilo del selector.
+ */
+
+#ifndef BUFFER_CHAIN_SEGMENT_SIZE
+#define BUFFER_CHAIN_SEGMENT_SIZE 4096
+#endif
+// segmentos libres que el pool conserva para reusar; el resto se libera
+#ifndef BUFFER_CHAIN_POOL_MAX
+#define BUFFER_CHAIN_POOL_MAX 1024
+#endif
+// máximo de segmentos por llamada a readv/writev
+#define BUFFER_CHAIN_IOV_MAX 16
+
+struct buffer_segment
+{
+	struct buffer_segment* next;
+	/** offsets de lectura y escritura dentro de data. read <= write */
+	uint32_t read;
+	uint32_t write;
+	uint8_t data[BUFFER_CHAIN_SEGMENT_SIZE];
+};
+
+typedef struct buffer_chain
+{
+	struct buffer_segment* head;
+	struct buffer_segment* tail;
+	/** primer segmento con lugar para escribir, NULL si están todos llenos */
+	struct buffer_segment* cursor;
+	/** bytes para leer */
+	size_t len;
+	/** máximo de bytes encolados, 0 es sin límite */
+	size_t limit;
+} buffer_chain;
+
+/** toma un segmento vacío del pool (o del heap). NULL si no hay memoria */
+struct buffer_segment* buffer_segment_get(void);
+/** devuelve un segmento al pool */
+void buffer_segment_put(struct buffer_segment* s);
+/** cantidad de segmentos libres en el pool */
+size_t buffer_pool_free_qty(void);
+/** libera los segmentos libres del pool */
+void buffer_pool_destroy(void);
+
+/** inicializa una cadena vacía; no toma memoria hasta la primera escritura */
+void buffer_chain_init(buffer_chain* c, size_t limit);
+/** descarta el contenido y devuelve todos los segmentos al pool */
+void buffer_chain_reset(buffer_chain* c);
+
+/** retorna true si hay bytes para leer */
+bool buffer_chain_can_read(const buffer_chain* c);
+/** bytes para leer */
+size_t buffer_chain_len(const buffer_chain* c);
+
+/**
+ * copia hasta `n' bytes al final de la cadena.
+ * @return los bytes copiados; menos de `n' si se llegó al límite o no hay memoria
+ */
+size_t buffer_chain_write(buffer_chain* c, const void* data, size_t n);
+
+/**
+ * copia hasta `n' bytes del principio de la cadena y los consume.
+ * @return los bytes copiados
+ */
+size_t buffer_chain_read(buffer_chain* c, void* dst, size_t n);
+
+/** consume `n' bytes del principio de la cadena */
+void buffer_chain_read_adv(buffer_chain* c, size_t n);
+
+/**
+ * completa `iov' con las regiones para leer, en orden.
+ * @return la cantidad de entradas usadas (a lo sumo iovcnt)
+ */
+int buffer_chain_read_iov(const buffer_chain* c, struct iovec* iov, int iovcnt);
+
+/**
+ * reserva lugar para escribir hasta `n' bytes (tomando segmentos del pool) y
+ * completa `iov' con esas regiones. Se debe notificar lo escrito mediante
+ * `buffer_chain_write_adv'.
+ * @return la cantidad de entradas usadas (a lo sumo iovcnt)
+ */
+int buffer_chain_write_iov(buffer_chain* c, struct iovec* iov, int iovcnt, size_t n);
+void buffer_chain_write_adv(buffer_chain* c, size_t n);
+
+/** readv(2) de hasta `n' bytes al final de la cadena */
+ssize_t buffer_chain_readv(buffer_chain* c, int fd, size_t n);
+/** writev(2) desde el principio de la cadena; consume lo escrito */
+ssize_t buffer_chain_writev(buffer_chain* c, int fd);
+/** sendmsg(2) desde el principio de la cadena; consume lo enviado */
+ssize_t buffer_chain_send(buffer_chain* c, int fd, int flags);
+
+#endif
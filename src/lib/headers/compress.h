@@ -0,0 +1,60 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * compress.c - streaming LZ4 compression of stored messages.
+ *
+ * Files are written in the LZ4 frame format (independent 64 KiB blocks, no
+ * checksums), so `lz4 -d' can read them. The encoder is a plain greedy LZ4:
+ * one hash table lookup per position and no backward extension. It is
+ * cheap enough to run inline in the selector thread, and mail text usually
+ * shrinks by 3-5x.
+ *
+ * A compressor buffers one block; every full block is compressed and
+ * written to the file with blocking writes, which is what the temp files
+ * already get.
+ */
+
+#define COMPRESS_BLOCK_SIZE (64 * 1024)
+#define COMPRESS_MAGIC      0x184D2204U
+
+typedef struct compressor compressor;
+
+/** @brief Starts a frame on `fd'. @returns NULL if out of memory or the header could not be written. */
+compressor* compressor_new(int fd);
+
+/** @returns `len', or -1 if a block could not be written. */
+ssize_t compressor_write(compressor* c, const void* buf, size_t len);
+
+/** @brief Bytes given to compressor_write so far. */
+uint64_t compressor_raw_size(const compressor* c);
+
+/** @brief Writes the last block and the end mark, then frees `c'. @returns 0 on success, -1 on error. */
+int compressor_finish(compressor* c);
+
+/** @brief Frees `c' without finishing the frame, e.g. when the message is discarded. */
+void compressor_free(compressor* c);
+
+/** @brief true if the file at `fd' starts with an LZ4 frame. Does not move the offset. */
+bool compress_is_compressed(int fd);
+
+/**
+ * @brief Decompresses the LZ4 frame read from `in' into `out'.
+ * Frames with linked blocks (lz4 -BD) are not supported.
+ * @returns the number of bytes written, or -1 if the frame is invalid or an I/O error occurred.
+ */
+ssize_t compress_decompress(int in, int out);
+
+/**
+ * @brief Decompresses only the start of the LZ4 frame read from `in', up to `len' bytes
+ * of its first block, e.g. to look at the headers of a stored message.
+ * @returns the number of bytes copied to `buf', or -1 if the frame is invalid.
+ */
+ssize_t compress_read_head(int in, void* buf, size_t len);
+
+#endif
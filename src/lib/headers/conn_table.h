@@ -0,0 +1,85 @@
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+
+#include "selector.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+
+/**
+ * conn_table.c - per client prefix connection accounting and admission control.
+ *
+ * Clients are grouped by address prefix (a /32 for IPv4 and a /64 for IPv6 by
+ * default, since a single IPv6 host usually owns the whole /64). For every
+ * prefix we track how many sessions are currently open and how many connections
+ * it attempted recently (sliding window), so an abusive sender is refused right
+ * after accept(2), before any session state is allocated.
+ *
+ * Lookups are O(1) expected: open addressing with linear probing over a fixed
+ * power-of-two table. Entries with no open sessions are reclaimed by a periodic
+ * sweep driven by a selector timer.
+ */
+
+// Defaults, override at compile time if needed.
+#ifndef CONN_MAX_PER_HOST
+#define CONN_MAX_PER_HOST 20
+#endif
+#ifndef CONN_MAX_RATE
+#define CONN_MAX_RATE 60  // connection attempts per CONN_RATE_WINDOW_S
+#endif
+#ifndef CONN_RATE_WINDOW_S
+#define CONN_RATE_WINDOW_S 60
+#endif
+#ifndef CONN_TABLE_SIZE
+#define CONN_TABLE_SIZE 4096  // must be a power of two
+#endif
+#define CONN_V4_PREFIX 32
+#define CONN_V6_PREFIX 64
+
+typedef enum
+{
+	CONN_ADMIT = 0,
+	/** the prefix already has `max_per_host' open sessions */
+	CONN_TOO_MANY,
+	/** the prefix exceeded `max_rate' attempts in the current window */
+	CONN_TOO_FAST,
+} conn_verdict;
+
+struct conn_limits
+{
+	unsigned max_per_host;
+	unsigned max_rate;
+	unsigned rate_window_s;
+	uint8_t v4_prefix;
+	uint8_t v6_prefix;
+};
+
+/**
+ * @brief Initializes the connection table.
+ * @param selector Used to schedule the periodic sweep of idle entries. May be NULL,
+ * in which case conn_table_sweep must be called by the user.
+ * @param limits Limits to enforce, or NULL to use the compile time defaults.
+ * @returns 0 on success, -1 if memory could not be allocated.
+ */
+int conn_table_init(fd_selector selector, const struct conn_limits* limits);
+
+void conn_table_destroy(void);
+
+/**
+ * @brief Accounts a new connection attempt from `addr' and decides whether it may proceed.
+ * If the verdict is CONN_ADMIT, the caller must call conn_table_release once the session ends.
+ */
+conn_verdict conn_table_acquire(const struct sockaddr_storage* addr, time_t now);
+
+/** @brief Releases a session previously admitted by conn_table_acquire. */
+void conn_table_release(const struct sockaddr_storage* addr);
+
+/** @brief Drops entries without open sessions whose rate window already expired. */
+void conn_table_sweep(time_t now);
+
+/** @returns the amount of open sessions accounted for `addr''s prefix. */
+unsigned conn_table_active(const struct sockaddr_storage* addr);
+
+#endif
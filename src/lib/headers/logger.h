@@ -7,8 +7,7 @@
 // Define this to fully disable all loggin on compilation.
 // #define DISABLE_LOGGER
 
-#include "selector.h"
-
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
@@ -28,34 +27,110 @@ typedef enum
 #define MIN_LOG_LEVEL LOG_DEBUG
 #define MAX_LOG_LEVEL LOG_FATAL
 
+// Levels below this one are removed at compile time: the compiler sees a constant false
+// condition and drops the call entirely. Override with -DLOG_COMPILE_LEVEL=LOG_INFO.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL MIN_LOG_LEVEL
+#endif
+
 const char* logger_get_level_string(log_level_t level);
 
+/**
+ * Structured events. Besides text lines the logger can write a compact binary event log:
+ * fixed-size records that are cheap enough to emit for every state transition and
+ * delivery, meant to be analyzed offline (see tools/eventlog_decode.c).
+ */
+typedef enum
+{
+	LOG_EV_SESSION_OPEN = 1,  // fd, address family
+	LOG_EV_SESSION_REFUSED,   // fd, conn_verdict
+	LOG_EV_SESSION_CLOSE,     // fd, socket state
+	LOG_EV_SESSION_TIMEOUT,   // fd, socket state, smtp state
+	LOG_EV_SOCKET_STATE,      // from, to
+	LOG_EV_SMTP_STATE,        // from, to
+	LOG_EV_DELIVERED,         // recipient index, recipient count
+	LOG_EV_QUEUED,            // recipient count
+	LOG_EV_RELAYED,           // recipient index, recipient count, reply code
+	LOG_EV_MAX,
+} log_event_t;
+
+#define LOGGER_EVENT_FIELDS 4
+
+/** An event as stored on disk, in host byte order. */
+struct logger_event
+{
+	uint64_t timestamp_ns;  // CLOCK_REALTIME
+	uint32_t session;
+	uint16_t event;
+	uint16_t reserved;
+	uint32_t fields[LOGGER_EVENT_FIELDS];
+};
+
+#define LOGGER_EVENT_MAGIC   "SMTPEVLG"
+#define LOGGER_EVENT_VERSION 1
+#define LOGGER_EVENT_BOM     0x01020304u
+
+/** The header at the start of every event log file. */
+struct logger_event_header
+{
+	char magic[8];
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t byte_order_mark;  // LOGGER_EVENT_BOM, to detect files from hosts of other endianness
+};
+
+const char* logger_get_event_string(log_event_t event);
+
+/** @returns the name of the event's `i'th field, or NULL if the event does not use it. */
+const char* logger_get_event_field(log_event_t event, unsigned i);
+
 #ifdef DISABLE_LOGGER
-#define logger_init(selector, logFile, logStream)
+#define logger_init(logFile, logStream) 0
+#define logger_events_init(eventsFile)  0
 #define logger_finalize()
 #define logger_set_level(level)
 #define logger_is_enabled_for(level) 0
-#define logf(level, format, ...)
+#define logger_event(event, session, a, b, c)
+#define logf(level, ...)
 #define log(level, s)
 #else
 /**
  * @brief Initializes the logging system. Not calling this function will result is the
  * server running with logging disabled.
- * @param selector The selector to use. This is required as logging is typically buffered,
- * and to make writes non-blocking writing can only occur when the file descriptor is
- * available.
+ *
+ * Logging is asynchronous: logf only captures the format string pointer, the raw
+ * arguments and a timestamp into a lock-free ring buffer. A dedicated writer thread
+ * formats the records and writes them out, so the reactor thread never formats text
+ * nor blocks on disk or terminal writes. If the ring is full, records are dropped
+ * (and the amount dropped is reported) rather than stalling the caller. The writer
+ * sleeps on a condition variable while the ring is empty; the first record after that
+ * wakes it, which takes a mutex, so logf must not be called from signal handlers.
+ *
  * @param file A file where logs are saved. Set to NULL to disable saving logs to a file,
  * or set to an empty string "" to use a default file name appended by the current date.
  * @param log_stream A stream where logs are saved. Typically set to stdout to print logs
- * to the console. Set to NULL to disable. WARNING: Printing to this stream is done with
- * fprintf which may be blocking, halting the server. This stream is not closed by the
- * logging system.
+ * to the console. Set to NULL to disable. This stream is not closed by the logging system.
+ */
+int logger_init(const char* log_file, FILE* log_stream_param);
+
+/**
+ * @brief Enables the binary event log. Must be called after logger_init. Events go through
+ * the same ring and writer thread as text logs.
+ *
+ * @param events_file The file to append events to, or "" to use a default file name
+ * appended by the current date. NULL disables the event log.
+ */
+int logger_events_init(const char* events_file);
+
+/**
+ * @brief Records a structured event for `session'. The meaning of the fields depends on
+ * the event (see log_event_t). Does nothing if the event log is disabled.
  */
-int logger_init(fd_selector selector_param, const char* log_file, FILE* log_stream_param);
+void logger_event(log_event_t event, uint32_t session, uint32_t a, uint32_t b, uint32_t c);
 
 /**
- * @brief Closes the logging system, flushing any remaining logs, closing any opened
- * files and unregistering them from the selector.
+ * @brief Closes the logging system, flushing any remaining logs and closing any opened
+ * files. Joins the writer thread.
  */
 int logger_finalize();
 
@@ -63,35 +138,91 @@ void logger_set_level(log_level_t level);
 
 int logger_is_enabled_for(log_level_t level);
 
-void logger_pre_print();
-
-void logger_get_buf_start_and_max_length(char** bufstart_var, size_t* maxlen_var);
-
-int logger_post_print(int written, size_t maxlen);
-
-#define logf(level, format, ...)                                                                      \
-	if (logger_is_enabled_for(level)) {                                                               \
-		logger_pre_print();                                                                           \
-		time_t loginternal_time = time(NULL);                                                         \
-		struct tm loginternal_tm = *localtime(&loginternal_time);                                     \
-		size_t loginternal_maxlen;                                                                    \
-		char* loginternal_bufstart;                                                                   \
-		logger_get_buf_start_and_max_length(&loginternal_bufstart, &loginternal_maxlen);              \
-		int loginternal_written = snprintf(loginternal_bufstart,                                      \
-		                                   loginternal_maxlen,                                        \
-		                                   "%04d-%02d-%02dT%02d:%02d:%02d%s\t" format "\n",           \
-		                                   loginternal_tm.tm_year + 1900,                             \
-		                                   loginternal_tm.tm_mon + 1,                                 \
-		                                   loginternal_tm.tm_mday,                                    \
-		                                   loginternal_tm.tm_hour,                                    \
-		                                   loginternal_tm.tm_min,                                     \
-		                                   loginternal_tm.tm_sec,                                     \
-		                                   level == LOG_OUTPUT ? "" : logger_get_level_string(level), \
-		                                   ##__VA_ARGS__);                                            \
-		logger_post_print(loginternal_written, loginternal_maxlen);                                   \
-	}
+/** The type of a captured logf argument. */
+typedef enum
+{
+	LOGGER_ARG_INT,
+	LOGGER_ARG_UINT,
+	LOGGER_ARG_DOUBLE,
+	LOGGER_ARG_PTR,
+	LOGGER_ARG_STR,
+} logger_arg_type;
+
+/** A logf argument captured by value. Strings are copied by logger_submit. */
+struct logger_arg
+{
+	logger_arg_type type;
+	union
+	{
+		long long i;
+		unsigned long long u;
+		double d;
+		const void* p;
+	} v;
+};
+
+/** Maximum amount of arguments a single logf call may receive. */
+#define LOGGER_MAX_ARGS 8
+
+/**
+ * @brief Called by the logf macro. Enqueues a record with the given format (which must
+ * be a string literal) and arguments.
+ */
+void logger_submit(log_level_t level, const char* format, const struct logger_arg* args, unsigned nargs);
+
+// clang-format off
+static inline struct logger_arg logger_arg_int(long long x) { return (struct logger_arg){ .type = LOGGER_ARG_INT, .v.i = x }; }
+static inline struct logger_arg logger_arg_uint(unsigned long long x) { return (struct logger_arg){ .type = LOGGER_ARG_UINT, .v.u = x }; }
+static inline struct logger_arg logger_arg_double(double x) { return (struct logger_arg){ .type = LOGGER_ARG_DOUBLE, .v.d = x }; }
+static inline struct logger_arg logger_arg_ptr(const volatile void* x) { return (struct logger_arg){ .type = LOGGER_ARG_PTR, .v.p = (const void*)x }; }
+static inline struct logger_arg logger_arg_str(const char* x) { return (struct logger_arg){ .type = LOGGER_ARG_STR, .v.p = x }; }
+
+#define LOGGER_ARG(x) _Generic((x),                                                   \
+	char*: logger_arg_str, const char*: logger_arg_str,                               \
+	_Bool: logger_arg_int, char: logger_arg_int, signed char: logger_arg_int,         \
+	short: logger_arg_int, int: logger_arg_int, long: logger_arg_int,                 \
+	long long: logger_arg_int,                                                        \
+	unsigned char: logger_arg_uint, unsigned short: logger_arg_uint,                  \
+	unsigned int: logger_arg_uint, unsigned long: logger_arg_uint,                    \
+	unsigned long long: logger_arg_uint,                                              \
+	float: logger_arg_double, double: logger_arg_double,                              \
+	default: logger_arg_ptr)(x)
+
+#define LOGGER_FIRST(f, ...) f
+#define LOGGER_NARG(...)     LOGGER_NARG_(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0, _unused)
+#define LOGGER_NARG_(f, a1, a2, a3, a4, a5, a6, a7, a8, n, ...) n
+#define LOGGER_CAT(a, b)     LOGGER_CAT_(a, b)
+#define LOGGER_CAT_(a, b)    a##b
+
+#define LOGGER_ARGS_0(f)
+#define LOGGER_ARGS_1(f, a)      LOGGER_ARG(a)
+#define LOGGER_ARGS_2(f, a, ...) LOGGER_ARG(a), LOGGER_ARGS_1(f, __VA_ARGS__)
+#define LOGGER_ARGS_3(f, a, ...) LOGGER_ARG(a), LOGGER_ARGS_2(f, __VA_ARGS__)
+#define LOGGER_ARGS_4(f, a, ...) LOGGER_ARG(a), LOGGER_ARGS_3(f, __VA_ARGS__)
+#define LOGGER_ARGS_5(f, a, ...) LOGGER_ARG(a), LOGGER_ARGS_4(f, __VA_ARGS__)
+#define LOGGER_ARGS_6(f, a, ...) LOGGER_ARG(a), LOGGER_ARGS_5(f, __VA_ARGS__)
+#define LOGGER_ARGS_7(f, a, ...) LOGGER_ARG(a), LOGGER_ARGS_6(f, __VA_ARGS__)
+#define LOGGER_ARGS_8(f, a, ...) LOGGER_ARG(a), LOGGER_ARGS_7(f, __VA_ARGS__)
+// clang-format on
+
+/**
+ * logf(level, format, ...): the format must be a string literal, since only its pointer is
+ * stored and it is formatted later by the writer thread. Supports up to LOGGER_MAX_ARGS
+ * arguments.
+ */
+#define logf(level, ...)                                                                                   \
+	do {                                                                                                   \
+		if ((level) >= LOG_COMPILE_LEVEL && logger_is_enabled_for(level)) {                                \
+			const struct logger_arg loginternal_args[] = {                                                 \
+				{ 0 },                                                                                     \
+				LOGGER_CAT(LOGGER_ARGS_, LOGGER_NARG(__VA_ARGS__))(__VA_ARGS__)                            \
+			};                                                                                             \
+			logger_submit(                                                                                 \
+			    (level), "" LOGGER_FIRST(__VA_ARGS__, _unused), loginternal_args + 1, LOGGER_NARG(__VA_ARGS__)); \
+		}                                                                                                  \
+	} while (0)
 
 #define log(level, s) logf(level, "%s", s)
 
 #endif
-#endif
\ No newline at end of file
+#endif
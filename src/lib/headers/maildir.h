@@ -3,22 +3,113 @@
 
 #include "logger.h"
 #include <stdbool.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <string.h>
-#define MAIL_FILE_NAME_LENGTH 24
 #define MAIL_DIR_SIZE          7
 #define DOMAIN_NAME_SIZE       255
 #define LOCAL_USER_NAME_SIZE   64
 #define MAILBOX_INNER_DIR_SIZE 3  // tmp, new, cur
 #define MS_TEXT_SIZE           13
-#define MAIL_FILE_NAME_LENGTH  24
-#define RAND_STR_LENGTH        10
+// <sec>.M<usec>P<pid>Q<n>.<host>[,S=<size>], with the host cut to MAILDIR_HOST_SIZE
+#define MAIL_FILE_NAME_LENGTH  128
+#define MAILDIR_HOST_SIZE      48
+
+/*
+ * Sharded layout: the mailboxes listed in MAILDIR_SHARDS_FILE (one local part
+ * per line, `*' for every mailbox) get their messages under a hashed
+ * subdirectory, new/<hh>/<name> instead of new/<name>, so no single directory
+ * grows past a few thousand entries. The shard is the first
+ * MAILDIR_SHARD_DIGITS hex digits of a hash of the file name, which makes it
+ * computable from the name alone. Readers must go through
+ * maildir_message_path or maildir_foreach, which understand both layouts:
+ * messages delivered before a mailbox was sharded stay where they are.
+ */
+#define MAILDIR_SHARDS_FILE "./maildir_shards"
+#ifndef MAILDIR_SHARD_DIGITS
+#define MAILDIR_SHARD_DIGITS 2
+#endif
+#define MAILDIR_PATH_SIZE 256
+
+/*
+ * Delivered files, store links and the directories that hold them are
+ * fsynced before the delivery functions return 0, so the spool can drop its
+ * copy right after. Follows SPOOL_FSYNC unless set on its own.
+ */
+#ifndef MAILDIR_FSYNC
+#ifdef SPOOL_FSYNC
+#define MAILDIR_FSYNC SPOOL_FSYNC
+#else
+#define MAILDIR_FSYNC 1
+#endif
+#endif
+
+/**
+ * @brief Writes a new message file name in the standard maildir format,
+ * <sec>.M<usec>P<pid>Q<n>.<host>, where n counts the names this process has
+ * handed out. The pid and the counter make names unique on the host without
+ * any randomness, and the counter is atomic, so it is safe from any thread.
+ * @returns 0 on success, -1 if `size' is too small.
+ */
+int maildir_unique_name(char* out, size_t size);
+
+typedef void (*maildir_visit_fn)(const char* path, const char* name, void* arg);
+
+/*
+ * Compression: messages whose recipients are all listed in
+ * MAILDIR_COMPRESS_FILE (same format, `*' for every mailbox) are stored as
+ * LZ4 frames (see compress.h), and their file names get the maildir++
+ * ",S=<size>" suffix with the uncompressed size. Readers detect compressed
+ * files by their magic number, so both kinds can share a folder.
+ */
+#define MAILDIR_COMPRESS_FILE "./maildir_compress"
+
+/**
+ * @brief Loads the lists of sharded and compressed mailboxes.
+ * Without a file every mailbox keeps the flat, uncompressed layout.
+ * @returns 0 on success (including missing files), -1 on error.
+ */
+int maildir_init(const char* shards_file, const char* compress_file);
+
+void maildir_finalize(void);
+
+/** @brief true if new messages for `user' (a local part) go to hashed subdirectories. */
+bool maildir_is_sharded(const char* user);
+
+/** @brief true if messages for `user' (a local part) are stored compressed. */
+bool maildir_is_compressed(const char* user);
+
+/**
+ * @brief Finds message `name' in the new/ or cur/ folder of `user', in either layout.
+ * In cur/ the name may carry the ":2,<flags>" suffix.
+ * @returns 0 with the path copied to `out', or -1 if the message does not exist.
+ */
+int maildir_message_path(const char* user, const char* name, char* out, size_t size);
+
+/**
+ * @brief Calls `fn' for every message in `folder' ("new" or "cur") of `user',
+ * both at the top level and inside the shards.
+ * @returns the number of messages visited, or -1 if the folder cannot be read.
+ */
+long maildir_foreach(const char* user, const char* folder, maildir_visit_fn fn, void* arg);
 
 char * create_maildir(char * user);
 
-int create_temp_mail_file(char* email, char * copy_addr, char * copy_addr_path);
+/**
+ * @brief Creates the temp file for a mail in the maildir of email.
+ * @param size_hint Expected size in bytes (e.g. the SIZE declared in MAIL FROM), 0 if unknown.
+ * The file is preallocated with posix_fallocate to that size, so it is laid out contiguously;
+ * whoever writes it must truncate it to the bytes actually written (see maildir_trim_temp_file).
+ * @returns The file descriptor or -1 if an error occurred.
+ */
+int create_temp_mail_file(char* email, char * copy_addr, char * copy_addr_path, size_t size_hint);
+
+/**
+ * @brief Drops the preallocated space past the current offset of a temp file created with a size hint.
+ */
+void maildir_trim_temp_file(int fd);
 
 /**
  * @brief Gets the maildir path for a given email.
@@ -52,7 +143,58 @@ char* create_maildir(char* email);
  */
 int get_temp_file_fd(char * email, char * copy_addr);
 
-void copy_temp_to_new_single(char* email, char* temp_file_name, char * temp_file_full_path);
+/**
+ * @brief Copies the temp file at temp_file_full_path to the new/ folder of email's maildir, named temp_file_name.
+ * If the mailbox is sharded, the copy goes to the shard of temp_file_name, created on first use.
+ * Safe to call from several threads at once. On success the copy and its directory entry are on disk (see MAILDIR_FSYNC).
+ * @returns 0 on success, -1 if the maildir or the file could not be created, copied or synced.
+ */
+int copy_temp_to_new_single(const char* email, const char* temp_file_name, const char* temp_file_full_path);
+
+/*
+ * Content-addressed store: the spool hard links each message file into
+ * MAILDIR_STORE_DIR/<hh>/<key> once, and every recipient's new/ entry is
+ * another hard link to it. A message to N local recipients is written once
+ * instead of N times, and an identical file delivered again (same envelope
+ * and body) reuses the stored one. The key is a hash of the stored bytes
+ * computed while the message is received, plus its size. A hit is compared
+ * byte by byte before it is reused, so a hash collision only costs a copy.
+ * Stored messages that no maildir links to any more (link count 1) are
+ * removed by maildir_store_gc.
+ *
+ * Hard links need Maildir and Store on the same filesystem; otherwise
+ * delivery falls back to copying. Mail clients must not modify message
+ * files in place, which maildir already forbids.
+ */
+#define MAILDIR_STORE_DIR      "./Store"
+#define MAILDIR_STORE_KEY_SIZE 48
+#define MAILDIR_HASH_INIT      0xcbf29ce484222325ULL
+#ifndef MAILDIR_STORE_GC_MS
+#define MAILDIR_STORE_GC_MS 3600000
+#endif
+
+/** @brief Continues an FNV-1a hash over `len' bytes. Start with MAILDIR_HASH_INIT. */
+uint64_t maildir_hash(uint64_t h, const void* buf, size_t len);
+
+/** @brief Writes the store key (MAILDIR_STORE_KEY_SIZE bytes) of a message file. */
+void maildir_store_key(char* key, uint64_t hash, uint64_t size, bool compressed);
+
+/**
+ * @brief Makes sure the store holds the file at `data_path' under `key', and writes its path.
+ * Safe to call from several threads at once.
+ * @returns 0 on success, -1 if the message has to be delivered by copy.
+ */
+int maildir_store_add(const char* data_path, const char* key, char* store_path, size_t size);
+
+/**
+ * @brief Links the stored message at `store_path' into the new/ folder of email's maildir, named `name'.
+ * On success the link is on disk (see MAILDIR_FSYNC).
+ * @returns 0 on success, -1 if the message has to be delivered by copy.
+ */
+int maildir_link_to_new(const char* email, const char* name, const char* store_path);
+
+/** @brief Removes stored messages that are no longer linked from anywhere. @returns how many. */
+size_t maildir_store_gc(void);
 
 /**
  * @brief Copy the contents of the temporary file to each recipient's maildir. 
@@ -0,0 +1,115 @@
+#ifndef MAILINDEX_H
+#define MAILINDEX_H
+
+#include "maildir.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * mailindex.c - per-mailbox metadata index.
+ *
+ * Every maildir gets a MAILINDEX_FILE next to new/ and cur/, with one line per
+ * delivered message:
+ *
+ *     <received> <size> <subject hash> <sender> <file name>
+ *
+ * The received time is in seconds since the epoch, the size is the size of
+ * the file on disk, the subject hash is mailindex_subject_hash of the
+ * Subject header in hex, and the sender is the envelope sender, `-' if it
+ * was empty. Listing or searching a mailbox is a sequential read of this
+ * file instead of a readdir and a stat per message.
+ *
+ * The spool adds a line as it delivers each message, with a single write.
+ * Next to the index, MAILINDEX_STAMP_FILE keeps the modification time of
+ * new/, cur/ and each of their shards as of the last rebuild. A delivery
+ * updates the entry of the folder it wrote to. When any other folder has
+ * changed since, because a client moved, flagged or deleted a message, the
+ * index is stale: mailindex_check says so and a rebuild compacts it. A
+ * delivery the spool retries after a crash may still appear twice; use
+ * maildir_message_path to find the file.
+ *
+ * Rebuilding walks the whole maildir, so readers on the selector thread use
+ * mailindex_rebuild_async and list the mailbox when it is done. Each
+ * mailbox has its own lock: a rebuild only holds up deliveries to the
+ * mailbox it rebuilds.
+ */
+
+#define MAILINDEX_FILE       "mailindex"
+#define MAILINDEX_STAMP_FILE "mailindex.stamp"
+// what is read from each message to find its sender and subject
+#define MAILINDEX_HEAD_SIZE 8192
+#define MAILINDEX_FROM_SIZE (LOCAL_USER_NAME_SIZE + 1 + DOMAIN_NAME_SIZE)
+
+// threads that run mailindex_rebuild_async
+#ifndef MAILINDEX_WORKERS
+#define MAILINDEX_WORKERS 1
+#endif
+// mailboxes share this many locks, picked by a hash of the name
+#ifndef MAILINDEX_LOCKS
+#define MAILINDEX_LOCKS 64
+#endif
+
+typedef struct
+{
+	time_t received;
+	uint64_t size;
+	uint64_t subject_hash;
+	char from[MAILINDEX_FROM_SIZE + 1];
+	char name[MAIL_FILE_NAME_LENGTH + 1];
+} mailindex_entry;
+
+typedef void (*mailindex_visit_fn)(const mailindex_entry* entry, void* arg);
+/** @brief Called from a worker thread when a rebuild requested with mailindex_rebuild_async is done. */
+typedef void (*mailindex_notify_fn)(void* ctx, int fd);
+
+/**
+ * @brief Starts `workers' threads for mailindex_rebuild_async.
+ * @returns 0 on success, -1 if no thread could be started.
+ */
+int mailindex_init(unsigned workers);
+
+/**
+ * @brief Adds the message at `path', delivered as `name' to the maildir of `email', to its index.
+ * If the mailbox has no index yet nothing is written: mailindex_check reports it stale,
+ * and the rebuild that follows picks up the message.
+ * Safe to call from several threads at once.
+ * @returns 0 on success, -1 on error.
+ */
+int mailindex_append(const char* email, const char* name, const char* path);
+
+/**
+ * @brief Rewrites the index of `user' (a local part) from the messages in its new/ and cur/ folders.
+ * @returns the number of messages indexed, or -1 on error.
+ */
+long mailindex_rebuild(const char* user);
+
+/**
+ * @brief Tells whether the index of `user' matches its maildir.
+ * @returns 0 if it does, 1 if it is missing or stale, -1 if the mailbox does not exist.
+ */
+int mailindex_check(const char* user);
+
+/**
+ * @brief Rebuilds the index of `user' on a worker thread, if it is still stale by then,
+ * and calls `notify(ctx, fd)' when done, whether or not it succeeded.
+ * @returns 0 if the rebuild was queued, -1 if it was not and `notify' will not be called.
+ */
+int mailindex_rebuild_async(const char* user, mailindex_notify_fn notify, void* ctx, int fd);
+
+/**
+ * @brief Calls `fn' for every entry in the index of `user', in delivery order.
+ * It never rebuilds the index: a mailbox without one has no entries.
+ * @returns the number of entries, or -1 if the mailbox does not exist or cannot be read.
+ */
+long mailindex_foreach(const char* user, mailindex_visit_fn fn, void* arg);
+
+/** @brief Hash of a subject, ignoring case and surrounding blanks, as stored in the index. */
+uint64_t mailindex_subject_hash(const char* subject, size_t len);
+
+/** @brief Stops the worker threads. Queued rebuilds are dropped without calling their `notify'. */
+void mailindex_finalize(void);
+
+#endif
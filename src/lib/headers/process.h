@@ -13,6 +13,8 @@
 #define RCPT_VERB   "RCPT"
 #define QUIT_VERB   "QUIT"
 #define DATA_VERB   "DATA"
+#define BDAT_VERB   "BDAT"
+#define BDAT_LAST   "LAST"
 #define RSET_VERB   "RSET"
 #define NOOP_VERB   "NOOP"
 #define XAUTH_VERB  "XAUTH"
@@ -20,9 +22,13 @@
 #define XTRAN_VERB  "XTRAN"
 #define XGET_VERB   "XGET"
 #define XGET_ALL    "ALL"
+#define XLIST_VERB  "XLIST"
+#define XFIND_VERB  "XFIND"
 #define XQUIT_VERB  "XQUIT"
 #define FROM_PREFIX "FROM:"
 #define TO_PREFIX   "TO:"
+#define BODY_PARAM  "BODY="
+#define SIZE_PARAM  "SIZE="
 
 typedef smtp_state (*process_handler)(struct selector_key* key, char* msg);
 
@@ -33,6 +39,8 @@ smtp_state handle_from(struct selector_key* key, char* msg);
 smtp_state handle_to(struct selector_key* key, char* msg);
 smtp_state handle_body(struct selector_key* key, char* msg);
 smtp_state handle_data(struct selector_key* key, char* msg);
+smtp_state handle_bdat(struct selector_key* key, char* msg);
+smtp_state handle_chunk(struct selector_key* key, char* msg);
 bool handle_reset(struct selector_key* key, char* msg);
 bool handle_noop(struct selector_key* key, char* msg);
 bool handle_quit(struct selector_key* key, char* msg);
@@ -43,5 +51,6 @@ smtp_state handle_xtran(struct selector_key* key, char* msg);
 
 smtp_state handle_xfrom(struct selector_key* key, char* msg);
 smtp_state handle_xget(struct selector_key* key, char* msg);
+smtp_state handle_xlist(struct selector_key* key, char* msg);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,89 @@
+#ifndef QUOTA_H
+#define QUOTA_H
+
+#include "selector.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * quota.c - per-mailbox usage accounting and quota enforcement.
+ *
+ * Usage (bytes on disk and message count) is kept in memory, keyed by
+ * local part, and updated as the spool delivers each message, so checking
+ * a quota at RCPT time is a hash lookup instead of a directory walk.
+ *
+ * Limits come from QUOTA_FILE, one `<local part> <bytes>[K|M|G] [<messages>]'
+ * per line, with `*' as the default for everyone else. Without the file
+ * usage is still tracked but nothing is refused.
+ *
+ * The table is saved to QUOTA_USAGE_FILE every QUOTA_SAVE_MS and at exit,
+ * and loaded at startup so checks work from the first session. At startup
+ * it is also rebuilt from the maildirs by QUOTA_SCAN_THREADS threads in the
+ * background, which picks up messages removed or added by other programs.
+ * A delivery that lands while its mailbox is being walked may be counted
+ * twice until the next restart; it is never missed.
+ *
+ * During a zero-downtime restart the previous process keeps delivering and
+ * saves its own table when it exits. The new one is initialized `deferred':
+ * it checks and charges from the saved table, and only starts the rebuild
+ * and the saves with quota_start once the previous process is gone.
+ *
+ * Thread-safe: the spool workers charge deliveries while the selector
+ * thread checks recipients.
+ */
+
+#define QUOTA_FILE       "./quotas"
+#define QUOTA_USAGE_FILE "./quota.db"
+
+// Defaults, override at compile time if needed.
+#ifndef QUOTA_SAVE_MS
+#define QUOTA_SAVE_MS 60000
+#endif
+#ifndef QUOTA_SCAN_THREADS
+#define QUOTA_SCAN_THREADS 4
+#endif
+
+typedef enum
+{
+	QUOTA_OK,
+	/** the mailbox is full right now: 452 4.2.2, the sender may retry later */
+	QUOTA_FULL,
+	/** the message is larger than the whole quota: 552 5.2.2 */
+	QUOTA_TOO_BIG,
+} quota_result;
+
+/**
+ * @brief Loads the limits and the saved usage and, unless `deferred', calls quota_start.
+ * @param selector Used to save the usage periodically. May be NULL.
+ * @returns 0 on success (including missing files), -1 on error.
+ */
+int quota_init(fd_selector selector, const char* limits_path, const char* usage_path, bool deferred);
+
+/** @brief Starts rebuilding usage from the maildirs and saving it. Call once, from the selector thread. */
+void quota_start(void);
+
+/**
+ * @brief Whether a message of `size' bytes (0 if unknown) fits in the mailbox of `user'.
+ * Only the first `len' bytes of `user' are looked at, so an address can be passed with
+ * the length of its local part.
+ */
+quota_result quota_check(const char* user, size_t len, uint64_t size);
+
+/** @brief Counts a delivered message of `bytes' bytes for `user'. Does nothing before quota_init. */
+void quota_charge(const char* user, size_t len, uint64_t bytes);
+
+/** @returns 0 with the usage of `user', or -1 if nothing is known about it. */
+int quota_usage(const char* user, uint64_t* bytes, uint64_t* messages);
+
+/** @brief true once the startup rebuild has finished. */
+bool quota_rebuilt(void);
+
+/** @brief Writes the usage table to the usage file. @returns 0 on success, -1 on error. */
+int quota_save(void);
+
+/** @brief Stops the rebuild, saves the usage if quota_start was called and frees the table. */
+void quota_finalize(void);
+
+#endif
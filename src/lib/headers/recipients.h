@@ -0,0 +1,67 @@
+#ifndef RECIPIENTS_H
+#define RECIPIENTS_H
+
+#include "selector.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * recipients.c - directory of local mailboxes, checked at RCPT time.
+ *
+ * The directory is a text file with one local part per line (`#' starts a
+ * comment). A RCPT TO for a local part that is not listed is rejected before
+ * any DATA is transferred, so junk recipients never get a maildir created
+ * for them. Without the file every local part is accepted, as before.
+ *
+ * Lookups go through a Bloom filter first: most unknown recipients are
+ * rejected after hashing the name once and testing RECIPIENTS_BLOOM_K bits.
+ * The rest are confirmed against an open addressing hash set holding the
+ * exact names, so there are no false positives.
+ *
+ * The file is polled every RECIPIENTS_RELOAD_MS through a selector timer.
+ * When it changes the whole directory is rebuilt and swapped in; if the new
+ * file cannot be read the previous directory stays in use.
+ */
+
+#define RECIPIENTS_FILE "./recipients"
+
+// Defaults, override at compile time if needed.
+#ifndef RECIPIENTS_RELOAD_MS
+#define RECIPIENTS_RELOAD_MS 2000
+#endif
+// filter bits per name; with 10 bits and 7 probes about 1% of the misses get to the hash set
+#ifndef RECIPIENTS_BLOOM_BITS
+#define RECIPIENTS_BLOOM_BITS 10
+#endif
+#ifndef RECIPIENTS_BLOOM_K
+#define RECIPIENTS_BLOOM_K 7
+#endif
+
+/**
+ * @brief Loads the directory from `path' if it exists.
+ * @param selector Used to poll the file for changes. May be NULL, in which case
+ * recipients_reload must be called by the user.
+ * @returns 0 on success (including a missing file), -1 if the file exists but
+ * could not be loaded.
+ */
+int recipients_init(fd_selector selector, const char* path);
+
+/**
+ * @brief Rebuilds the directory if the file changed since it was loaded.
+ * @returns 1 if a new directory was swapped in, 0 if nothing changed, -1 on error.
+ */
+int recipients_reload(void);
+
+/**
+ * @brief true if `local_part' has a mailbox, or if there is no directory.
+ * `postmaster' is always accepted (RFC 5321 4.5.1).
+ */
+bool recipients_exists(const char* local_part, size_t len);
+
+/** @brief Names in the directory, 0 if there is none. */
+size_t recipients_count(void);
+
+void recipients_destroy(void);
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include "selector.h"
+#include "spool.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/**
+ * relay.c - entrega saliente por SMTP a dominios que no son LOCAL_DOMAIN.
+ *
+ * Las rutas son estáticas y se leen de un archivo con líneas
+ *
+ *   <dominio> <host> <puerto>
+ *
+ * donde el dominio `*' es la ruta por defecto y `#' empieza un comentario.
+ * Cada host se resuelve una única vez al arrancar. Sin rutas el servidor
+ * sigue rechazando a los destinatarios remotos como antes.
+ *
+ * Sólo los clientes de las redes de RELAY_CLIENTS_FILE, una
+ * `<dirección>[/<bits>]' por línea, pueden mandar a destinatarios remotos;
+ * los demás reciben un 550 5.7.1 aunque haya ruta, así que una ruta por
+ * defecto no abre el relay. Sin el archivo sólo se confía en 127.0.0.0/8 y ::1.
+ *
+ * Los destinatarios de un mensaje se agrupan por próximo salto: por cada
+ * grupo se escribe un sobre en RELAY_DIR (igual que el del spool: temporal,
+ * fsync y rename) junto a un hard link del mensaje, así que el mensaje
+ * sobrevive a una caída igual que una entrega local.
+ *
+ * Los fsync de los sobres nuevos los hace un hilo propio, de a tandas como
+ * el del spool (ver relay_submit); todo lo demás corre en el hilo del
+ * selector. Cada próximo salto tiene una única
+ * conexión persistente y no bloqueante que se reutiliza para todos sus
+ * mensajes; si el servidor anuncia PIPELINING se mandan MAIL, los RCPT y
+ * DATA en una sola escritura, y si anuncia CHUNKING los cuerpos binarios
+ * (BDAT) se reenvían con BDAT. La conexión se cierra tras RELAY_IDLE_MS sin
+ * mensajes.
+ *
+ * Cada destinatario se resuelve por separado: 2xx se entregó, 5xx se
+ * descarta (queda en el log) y 4xx se reintenta más tarde. Los reintentos,
+ * los timeouts y el cierre por inactividad son timers del selector; los
+ * errores de conexión aplazan a todo el salto con espera exponencial.
+ */
+
+#define RELAY_DIR         "./Relay"
+#define RELAY_ROUTES_FILE  "./relay_routes"
+#define RELAY_CLIENTS_FILE "./relay_clients"
+// <queue id>.<grupo>
+#define RELAY_ID_SIZE (SPOOL_ID_SIZE + 4)
+
+#ifndef RELAY_HELO_DOMAIN
+#define RELAY_HELO_DOMAIN "local"
+#endif
+// sin mensajes, la conexión a un salto se cierra (QUIT) tras este tiempo
+#ifndef RELAY_IDLE_MS
+#define RELAY_IDLE_MS 5000
+#endif
+// máximo de espera por una respuesta del servidor remoto
+#ifndef RELAY_TIMEOUT_MS
+#define RELAY_TIMEOUT_MS 60000
+#endif
+// primer reintento; se duplica hasta RELAY_RETRY_MAX_MS
+#ifndef RELAY_RETRY_MS
+#define RELAY_RETRY_MS 2000
+#endif
+#ifndef RELAY_RETRY_MAX_MS
+#define RELAY_RETRY_MAX_MS 600000
+#endif
+// pasados estos intentos el sobre se renombra a <id>.failed
+#ifndef RELAY_MAX_ATTEMPTS
+#define RELAY_MAX_ATTEMPTS 10
+#endif
+#ifndef RELAY_SCAN_INTERVAL_MS
+#define RELAY_SCAN_INTERVAL_MS 30000
+#endif
+
+/**
+ * Lee las rutas de `routes_file' y las redes de `clients_file', crea
+ * RELAY_DIR y carga los sobres que dejó un proceso anterior. Si el archivo
+ * de rutas no existe no hay rutas.
+ *
+ * @return 0, o -1 si algún archivo tiene errores o no se pudo crear el directorio.
+ */
+int relay_init(fd_selector s, const char* routes_file, const char* clients_file);
+
+/** true si hay una ruta para `domain' (o una ruta por defecto) */
+bool relay_has_route(const char* domain);
+
+/** true si `client' está en una de las redes que pueden usar el relay */
+bool relay_allowed(const struct sockaddr_storage* client);
+
+/**
+ * Encola el mensaje de `data_path' para los destinatarios `rcpt', que deben
+ * tener ruta. El archivo se enlaza, así que quien llama puede borrarlo
+ * después. Los fsync se hacen en el hilo que llama: desde el selector hay
+ * que usar `relay_submit'. Se llama desde el hilo del selector.
+ *
+ * @param id identificador del mensaje (ver `spool_new_id')
+ * @param stuffed el cuerpo está guardado como llegó por DATA, con los puntos
+ *                duplicados y sin el CRLF final; si no, es el de un BDAT
+ * @return 0, o -1 si no se pudo escribir algún sobre (no queda ninguno)
+ */
+int relay_enqueue(uint32_t session, const char* from, const char* const* rcpt, size_t rcpt_qty,
+                  const char* data_path, const char* id, bool stuffed);
+
+/** sobres enviados con relay_submit, hasta que se confirman */
+struct relay_commit;
+
+/**
+ * Como `relay_enqueue', pero sin esperar a que los sobres y el mensaje estén
+ * en disco: de eso se encarga el hilo de commits del relay, que al terminar
+ * llama a `notify(ctx, fd)' (ver spool_submit). Si SPOOL_FSYNC es 0 el
+ * commit ya vuelve terminado y no se avisa.
+ *
+ * Los mensajes recién entran en la cola cuando se suelta el commit ya
+ * terminado con `relay_commit_release'.
+ *
+ * @return el commit, o NULL si no se pudo escribir algún sobre (no queda ninguno)
+ */
+struct relay_commit* relay_submit(uint32_t session, const char* from, const char* const* rcpt, size_t rcpt_qty,
+                                  const char* data_path, const char* id, bool stuffed, spool_notify_fn notify,
+                                  void* ctx, int fd);
+
+/** en qué quedó un commit. Thread-safe */
+spool_commit_status relay_commit_status_of(struct relay_commit* commit);
+
+/**
+ * Suelta un commit desde el hilo del selector. Si terminó bien sus mensajes
+ * pasan a la cola; si todavía está pendiente nadie confirmó el mensaje, así
+ * que sus sobres se borran cuando termine. Tolera NULL.
+ */
+void relay_commit_release(struct relay_commit* commit);
+
+/** descarta los sobres de `id' que todavía no empezaron a enviarse */
+void relay_cancel(const char* id);
+
+/** mensajes en la cola de este proceso, incluidos los que se están enviando */
+size_t relay_pending(void);
+
+/**
+ * Cierra las conexiones y libera la cola. Lo pendiente sigue en disco para el
+ * próximo arranque. Se llama antes de destruir el selector.
+ */
+void relay_finalize(void);
+
+#endif
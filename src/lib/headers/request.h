@@ -12,6 +12,7 @@ enum request_state
 	request_cr,
 	request_data,
 	request_body,
+	request_chunk,
 	request_done,
 	request_error,
 
@@ -45,12 +46,30 @@ enum request_state request_parser_feed(struct request_parser* p, const uint8_t c
  * por cada elemento del buffer llama a `request_parser_feed' hasta que
  * el parseo se encuentra completo o se requieren mas bytes.
  *
+ * Si la línea entera ya está en el buffer se parsea de una sola pasada
+ * (memchr del CRLF) sin pasar por `request_parser_feed'; el resultado es el
+ * mismo.
+ *
  * @param errored parametro de salida. si es diferente de NULL se deja dicho
  *   si el parsing se debió a una condición de error
  */
 enum request_state request_consume(buffer* b, struct request_parser* p, bool* errored);
 
 
+/**
+ * camino rápido de los parsers de línea (comandos y admin): si la línea
+ * completa (hasta CRLF) ya está en el buffer la separa en verbo y argumento
+ * con memchr en lugar de pasar byte a byte por la máquina de estados.
+ *
+ * Sólo acepta líneas válidas que empiezan con el parser recién inicializado;
+ * cualquier otra cosa (línea partida entre lecturas, verbo o argumento
+ * demasiado largo, comando inválido) no consume nada y queda para la máquina
+ * de estados, que produce exactamente el mismo resultado.
+ *
+ * @param bare dice si `verb' (de `n' bytes) puede venir sin argumento
+ * @return true si consumió una línea; el parser queda en request_done
+ */
+bool request_consume_line(buffer* b, struct request_parser* p, bool (*bare)(const uint8_t* verb, size_t n));
 
 
 void request_parser_data_init(struct request_parser* p);
@@ -65,6 +84,15 @@ enum request_state request_parser_data_feed(struct request_parser* p, const uint
  */
 enum request_state request_consume_data(buffer* b, struct request_parser* p, bool* errored);
 
+/**
+ * prepara el parser para un bloque de BDAT de `n' bytes (RFC 3030). El bloque
+ * no se escanea ni se copia: quien lo consume escribe directo desde el buffer
+ * y avanza `i'.
+ */
+void request_parser_chunk_init(struct request_parser* p, unsigned int n);
+/** request_done cuando ya se consumieron los `n' bytes del bloque */
+enum request_state request_consume_chunk(buffer* b, struct request_parser* p, bool* errored);
+
 
 
 void request_parser_admin_init(struct request_parser* p);
@@ -1,7 +1,10 @@
 #ifndef SELECTOR_H_W50GNLODsARolpHbsDsrvYvMsbT
 #define SELECTOR_H_W50GNLODsARolpHbsDsrvYvMsbT
 
+#include "timer_wheel.h"
+
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -184,4 +187,16 @@ int selector_fd_set_nio(const int fd);
 /** notifica que un trabajo bloqueante terminó */
 selector_status selector_notify_block(fd_selector s, const int fd);
 
+/**
+ * arma (o rearma) el timer `t' para que venza dentro de `ms' milisegundos.
+ *
+ * El callback del timer se ejecuta en el hilo del selector, luego de
+ * despachar los eventos de entrada/salida de la iteración. El bloqueo de
+ * `selector_select' nunca supera al próximo vencimiento.
+ */
+selector_status selector_timer_schedule(fd_selector s, struct wheel_timer* t, const uint64_t ms);
+
+/** desarma un timer armado con `selector_timer_schedule'. Tolera timers no armados */
+selector_status selector_timer_cancel(fd_selector s, struct wheel_timer* t);
+
 #endif
@@ -1,11 +1,17 @@
 #ifndef SMTP_SERVER_H
 #define SMTP_SERVER_H
 #include "buffer.h"
+#include "buffer_chain.h"
+#include "compress.h"
 #include "maildir.h"
+#include "quota.h"
+#include "relay.h"
 #include "request.h"
 #include "selector.h"
+#include "spool.h"
 #include "states.h"
 #include "stm.h"
+#include "transform.h"
 
 #include <netdb.h>
 #include <stdbool.h>
@@ -26,6 +32,47 @@
 #define MAX_FILE_NAME        20
 #define LOCAL_DOMAIN         "local"
 
+// máximo de conexiones aceptadas por socket pasivo en cada iteración del selector
+#ifndef SMTP_ACCEPT_BUDGET
+#define SMTP_ACCEPT_BUDGET 64
+#endif
+// sin fds (EMFILE/ENFILE) o sin memoria para el socket, el socket pasivo deja de
+// mirarse este tiempo: sigue listo y si no el selector no haría otra cosa
+#ifndef SMTP_ACCEPT_BACKOFF_MS
+#define SMTP_ACCEPT_BACKOFF_MS 100
+#endif
+// backlog por defecto de los sockets pasivos (el kernel lo acota a somaxconn)
+#ifndef SMTP_DEFAULT_BACKLOG
+#define SMTP_DEFAULT_BACKLOG 1024
+#endif
+
+// máximo de bytes de respuesta encolados por sesión
+#ifndef SMTP_WRITE_LIMIT
+#define SMTP_WRITE_LIMIT (64 * 1024)
+#endif
+
+// tamaño máximo de un mensaje, anunciado con SIZE (RFC 1870)
+#ifndef SMTP_MAX_MESSAGE_SIZE
+#define SMTP_MAX_MESSAGE_SIZE 10240000
+#endif
+
+// timeouts por sesión en milisegundos (RFC 5321 4.5.3.2)
+#ifndef SMTP_GREETING_TIMEOUT_MS
+#define SMTP_GREETING_TIMEOUT_MS 300000  // esperando EHLO/HELO
+#endif
+#ifndef SMTP_COMMAND_TIMEOUT_MS
+#define SMTP_COMMAND_TIMEOUT_MS 300000  // esperando el próximo comando de una transacción
+#endif
+#ifndef SMTP_DATA_BLOCK_TIMEOUT_MS
+#define SMTP_DATA_BLOCK_TIMEOUT_MS 180000  // esperando el próximo bloque de DATA
+#endif
+#ifndef SMTP_IDLE_TIMEOUT_MS
+#define SMTP_IDLE_TIMEOUT_MS 300000  // sesión abierta sin transacción en curso
+#endif
+#ifndef SMTP_DRAIN_IDLE_TIMEOUT_MS
+#define SMTP_DRAIN_IDLE_TIMEOUT_MS 5000  // sin transacción en curso mientras se drena (ver smtp_drain)
+#endif
+
 typedef struct smtp_data
 {
 	struct state_machine stm;
@@ -35,14 +82,43 @@ typedef struct smtp_data
 	struct sockaddr_storage client_addr;
 
 	int fd;  // socket file descriptor
+	uint32_t id;  // identifica la sesión en el log de eventos
 
-	// buffers
-	struct buffer read_buffer;
-	struct buffer write_buffer;
+	fd_selector selector;
+	struct wheel_timer timeout;  // vence si el cliente no progresa
+
+	// sesiones vivas, para poder drenarlas
+	struct smtp_data* prev;
+	struct smtp_data* next;
 
-	int output_fd;  // file descriptor for the output file
+	// buffers
+	struct buffer read_buffer;  // sobre read_segment, que se pide al pool sólo mientras hay bytes sin consumir
+	struct buffer_segment* read_segment;
+	buffer_chain write_chain;  // respuestas; sólo ocupa segmentos mientras hay algo por enviar
+
+	int output_fd;  // file descriptor for the output file, -1 if none
+	compressor* compressor;  // no NULL si el mensaje se guarda comprimido
+	// hash y tamaño de lo escrito en el archivo, para el store (ver maildir.h)
+	bool content_hashed;
+	uint64_t content_hash;
+	uint64_t content_size;
 	char filename_fd[MAIL_FILE_NAME_LENGTH];
-	char temp_full_path[MAIL_DIR_SIZE + 1 + LOCAL_USER_NAME_SIZE + 1 + MAILBOX_INNER_DIR_SIZE + 1 + MAIL_FILE_NAME_LENGTH + 1];
+	char temp_full_path[MAILDIR_PATH_SIZE];
+	char queue_id[SPOOL_ID_SIZE];  // sobre del último mensaje aceptado, vacío si no se pudo encolar
+	quota_result quota_refused;  // por qué no se encoló, si fue por las cuotas
+	// plugin de transformación del mensaje en curso (ver transform.h)
+	const transform_plugin* plugin;
+	void* plugin_state;
+	bool plugin_failed;
+	// programa de transformación del mensaje en curso: el mensaje se encola cuando termina
+	pid_t transform_pid;  // 0 si no hay
+	int transform_pidfd;  // -1 si el kernel no da pidfds; sólo vale con transform_pid
+	bool body_failed;  // no se pudo preparar el archivo: el cuerpo se descarta con un 451
+	// sobre esperando su fsync en el spool: se contesta cuando avisa (ver spool_submit)
+	struct spool_commit* commit;
+	// sobres de los destinatarios remotos esperando su fsync; van antes que el del spool
+	struct relay_commit* relay_commit;
+	char store_key[MAILDIR_STORE_KEY_SIZE];
 
 	// parser
 	smtp_state state;
@@ -55,20 +131,25 @@ typedef struct smtp_data
 	uint8_t data[BODY_SIZE];
 
 	uint8_t user[LOCAL_USER_NAME_SIZE + 1 + DOMAIN_NAME_SIZE];  // for admin requests
+	// XLIST/XFIND con el índice desactualizado: se contesta cuando un hilo lo rehace
+	bool index_wait;
+	bool index_rebuilt;
 
 	char file_full_name[MAX_PATH];
 	char file_name[MAX_FILE_NAME];
 
 	bool is_body;
-
-	// raw buffer
-	uint8_t raw_buff_write[BUFFER_SIZE];
-	uint8_t raw_buff_read[BUFFER_SIZE];
+	bool binarymime;  // MAIL FROM con BODY=BINARYMIME: sólo se acepta BDAT
+	size_t declared_size;  // SIZE= de MAIL FROM, 0 si no lo mandó
+	uint64_t body_size;  // bytes recibidos del cuerpo en esta transacción, por DATA o sumando los BDAT
+	bool too_big;  // body_size pasó SMTP_MAX_MESSAGE_SIZE: el resto se descarta y se contesta 552
+	bool chunk_last;  // el BDAT en curso es el último (LAST)
 } smtp_data;
 
 struct status
 {
 	char* program;
+	bool plugin;  // la transformación es el plugin cargado y no `program'
 	bool transform;
 };
 
@@ -86,9 +167,23 @@ typedef enum
 } socket_state;
 
 void smtp_done(selector_key* key);
+/** cierra y borra el archivo temporal del mail en curso, si lo hay */
+void smtp_discard_body(struct selector_key* key);
 
 void smtp_passive_accept(selector_key* key);
-void init_status(char* program);
+/** `program' puede ser un plugin, y se cargan los de su directorio (ver transform.h). @returns -1 si no se pudo cargar */
+int init_status(char* program);
+
+/**
+ * deja de esperar a los clientes ociosos: las sesiones sin transacción en
+ * curso se cierran con un 421 tras SMTP_DRAIN_IDLE_TIMEOUT_MS, las demás
+ * terminan normalmente. Se usa cuando otro proceso tomó los sockets pasivos.
+ */
+void smtp_drain(fd_selector s);
+/** cantidad de sesiones abiertas */
+unsigned smtp_active_sessions(void);
 void set_status(bool value);
+/** transforma con el plugin `name', cargado al arrancar. @returns -1 si no hay uno con ese nombre */
+int set_plugin(const char* name);
 
 #endif
\ No newline at end of file
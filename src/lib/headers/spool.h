@@ -0,0 +1,142 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * spool.c - cola persistente entre la aceptación de un mensaje y su entrega a
+ *           los maildirs.
+ *
+ * Al terminar DATA/BDAT el mensaje ya está en un archivo temporal; la sesión
+ * sólo escribe un sobre (remitente, destinatarios y la ruta de ese archivo)
+ * en SPOOL_DIR y contesta 250. El sobre se escribe en un temporal y se
+ * renombra, así que o está completo o no está. Un grupo de hilos lo entrega
+ * después a cada destinatario, reintentando con espera exponencial los que
+ * fallan, y recién entonces borra el sobre y el archivo del mensaje: para
+ * ese momento cada entrega ya está en disco (ver MAILDIR_FSYNC).
+ *
+ * Lo que está en disco es la verdad: en memoria sólo se guarda qué sobres hay
+ * y cuándo reintentar cada uno. Al arrancar (y cada SPOOL_SCAN_INTERVAL_MS
+ * sin trabajo) se relee el directorio, así que los mensajes de un proceso
+ * anterior, por una caída o un upgrade, se terminan de entregar. Un sobre
+ * se bloquea (fcntl) mientras se entrega para que dos procesos no lo hagan a
+ * la vez.
+ *
+ * Entregar dos veces a un destinatario es inofensivo: el archivo en new/
+ * tiene el mismo nombre y contenido.
+ *
+ * Las sesiones no esperan el fsync en el hilo del selector: spool_submit
+ * escribe el sobre en un temporal y un hilo del spool sincroniza juntos
+ * todos los que se acumularon mientras hacía el anterior (group commit),
+ * con un solo fsync del directorio por tanda. Cuando la tanda está en disco
+ * avisa a cada sesión para que conteste.
+ *
+ * Si el mensaje trae una clave, se guarda una sola vez en el store de
+ * maildir.h y cada destinatario recibe un enlace duro. El store se limpia
+ * cada MAILDIR_STORE_GC_MS, en los escaneos sin trabajo.
+ */
+
+#define SPOOL_DIR     "./Spool"
+#define SPOOL_ID_SIZE 40
+
+#ifndef SPOOL_WORKERS
+#define SPOOL_WORKERS 2
+#endif
+// primer reintento; se duplica en cada intento fallido hasta SPOOL_RETRY_MAX_MS
+#ifndef SPOOL_RETRY_MS
+#define SPOOL_RETRY_MS 2000
+#endif
+#ifndef SPOOL_RETRY_MAX_MS
+#define SPOOL_RETRY_MAX_MS 600000
+#endif
+// pasados estos intentos el sobre se renombra a <id>.failed y no se reintenta
+#ifndef SPOOL_MAX_ATTEMPTS
+#define SPOOL_MAX_ATTEMPTS 10
+#endif
+#ifndef SPOOL_SCAN_INTERVAL_MS
+#define SPOOL_SCAN_INTERVAL_MS 30000
+#endif
+// fsync del mensaje y del sobre antes de confirmar; 0 cambia durabilidad por latencia
+#ifndef SPOOL_FSYNC
+#define SPOOL_FSYNC 1
+#endif
+
+/**
+ * Crea SPOOL_DIR si no existe, carga los sobres pendientes y arranca
+ * `workers' hilos de entrega.
+ *
+ * @return 0, o -1 si no se pudo crear el directorio o los hilos.
+ */
+int spool_init(unsigned workers);
+
+/**
+ * genera un identificador nuevo para un mensaje (SPOOL_ID_SIZE bytes), único
+ * entre procesos. Thread-safe.
+ */
+void spool_new_id(char* id);
+
+/**
+ * Encola con el identificador `id' un mensaje ya escrito en `data_path'.
+ * Desde ese momento el archivo es del spool, que lo borra cuando termina de
+ * entregarlo. `name' es el nombre con el que se entrega en new/ de cada
+ * destinatario, y `key' su clave en el store (ver maildir_store_key), o NULL
+ * para copiarlo a cada uno.
+ *
+ * Cuando retorna 0 el mensaje es durable (ver SPOOL_FSYNC) y se puede
+ * confirmar al cliente. Los fsync se hacen en el hilo que llama: desde el
+ * selector hay que usar `spool_submit'. Thread-safe.
+ *
+ * @param id generado con `spool_new_id'
+ * @return 0, o -1 si no se pudo escribir el sobre
+ */
+int spool_enqueue(uint32_t session, const char* from, const char* const* rcpt, size_t rcpt_qty, const char* name,
+                  const char* data_path, const char* key, const char* id);
+
+typedef enum
+{
+	SPOOL_COMMIT_PENDING,
+	SPOOL_COMMIT_DONE,
+	SPOOL_COMMIT_FAILED,
+} spool_commit_status;
+
+/** un sobre enviado con spool_submit, hasta que se confirma */
+struct spool_commit;
+
+/** avisa que un commit terminó. Se llama desde un hilo del spool */
+typedef void (*spool_notify_fn)(void* ctx, int fd);
+
+/**
+ * Como `spool_enqueue', pero sin esperar a que el sobre y el mensaje estén en
+ * disco: de eso se encarga un hilo del spool, que al terminar llama a
+ * `notify(ctx, fd)'. Si SPOOL_FSYNC es 0 el commit ya vuelve terminado y no
+ * se avisa.
+ *
+ * Desde que retorna el archivo es del spool, también si el commit falla: en
+ * ese caso lo borra.
+ *
+ * @return el commit, que hay que liberar con spool_commit_release, o NULL si
+ *         no se pudo escribir el sobre (el archivo sigue siendo de quien llama)
+ */
+struct spool_commit* spool_submit(uint32_t session, const char* from, const char* const* rcpt, size_t rcpt_qty,
+                                  const char* name, const char* data_path, const char* key, const char* id,
+                                  spool_notify_fn notify, void* ctx, int fd);
+
+/** en qué quedó un commit. Thread-safe */
+spool_commit_status spool_commit_status_of(struct spool_commit* commit);
+
+/** suelta un commit; si todavía está pendiente ya no se avisa. Tolera NULL */
+void spool_commit_release(struct spool_commit* commit);
+
+/** sobres en la cola de este proceso, incluidos los que se están entregando */
+size_t spool_pending(void);
+
+/**
+ * Detiene los hilos de entrega tras terminar lo que están entregando y los
+ * commits pendientes. Lo que
+ * queda pendiente sigue en disco para el próximo arranque.
+ */
+void spool_finalize(void);
+
+#endif
@@ -8,6 +8,8 @@ typedef enum
 	TO,
 	DATA,
 	BODY,
+	CHUNK,  // recibiendo el bloque de un BDAT (RFC 3030)
+	BDAT,   // esperando el próximo BDAT
 	DONE,
 	XAUTH,
 
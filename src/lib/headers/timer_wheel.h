@@ -0,0 +1,93 @@
+#ifndef TIMER_WHEEL_H_Qm3vJ8cN2xLwT5rAe7KdZs
+#define TIMER_WHEEL_H_Qm3vJ8cN2xLwT5rAe7KdZs
+
+#include <stdbool.h>
+#include <stdint.h>
+/**
+ * timer_wheel.c - rueda de timers jerárquica
+ *
+ * Permite armar, rearmar y cancelar timers en O(1) sin importar cuántos
+ * haya pendientes. El tiempo se discretiza en ticks de `tick_ms'
+ * milisegundos; cada nivel de la rueda tiene TIMER_WHEEL_SLOTS casilleros
+ * y cubre TIMER_WHEEL_SLOTS veces el rango del nivel anterior:
+ *
+ *   nivel 0: [now, now + 64) ticks             -> un casillero por tick
+ *   nivel 1: [now + 64, now + 64^2) ticks      -> un casillero cada 64 ticks
+ *   nivel 2: ...
+ *
+ * Cuando el nivel 0 da una vuelta completa, el casillero correspondiente
+ * del nivel 1 se "cascadea": sus timers se reubican en el nivel 0. Así
+ * nunca hace falta recorrer todos los timers para saber cuáles vencieron.
+ *
+ * Los timers son intrusivos: el usuario embebe un `struct wheel_timer' en
+ * su propia estructura, por lo que la rueda no aloca memoria por timer.
+ *
+ * El callback `on_expire' se llama con el timer ya desenganchado de la
+ * rueda, por lo que puede liberar la estructura que lo contiene o volver
+ * a armarlo.
+ */
+
+#define TIMER_WHEEL_BITS   6
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+struct wheel_timer;
+typedef void (*wheel_timer_callback)(struct wheel_timer* t, void* data);
+
+struct wheel_timer
+{
+	/** llamado cuando vence el timer */
+	wheel_timer_callback on_expire;
+	/** dato provisto por el usuario */
+	void* data;
+
+	// privados
+	uint64_t expires;  // en ticks
+	struct wheel_timer* next;
+	struct wheel_timer** pprev;  // NULL si no está armado
+	uint8_t level;
+	uint8_t slot;
+};
+
+typedef struct timer_wheel* timer_wheel;
+
+/** crea una rueda con la granularidad indicada. `now_ms' es el tiempo actual */
+timer_wheel timer_wheel_new(unsigned tick_ms, uint64_t now_ms);
+
+/** destruye la rueda. Los timers pendientes quedan desarmados sin llamarse */
+void timer_wheel_destroy(timer_wheel w);
+
+/** inicializa un timer desarmado */
+void wheel_timer_init(struct wheel_timer* t, wheel_timer_callback on_expire, void* data);
+
+/** true si el timer está armado */
+bool wheel_timer_pending(const struct wheel_timer* t);
+
+/**
+ * arma el timer para que venza `ms' milisegundos después de `now_ms'.
+ * Si ya estaba armado se rearma.
+ */
+void timer_wheel_schedule(timer_wheel w, struct wheel_timer* t, uint64_t now_ms, uint64_t ms);
+
+/** desarma el timer. Tolera timers no armados */
+void timer_wheel_cancel(timer_wheel w, struct wheel_timer* t);
+
+/**
+ * avanza la rueda hasta `now_ms', llamando a todos los timers vencidos.
+ * @return cantidad de timers que vencieron
+ */
+unsigned timer_wheel_advance(timer_wheel w, uint64_t now_ms);
+
+/**
+ * milisegundos hasta el próximo vencimiento (cota inferior: puede despertar
+ * antes de tiempo, nunca después), o -1 si no hay timers armados.
+ */
+int64_t timer_wheel_next_ms(timer_wheel w, uint64_t now_ms);
+
+/** cantidad de timers armados */
+unsigned timer_wheel_count(timer_wheel w);
+
+/** tiempo monotónico actual en milisegundos */
+uint64_t timer_wheel_now_ms(void);
+
+#endif
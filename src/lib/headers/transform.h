@@ -0,0 +1,85 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * transform.c - in-process transformation plugins.
+ *
+ * Besides an external program, the transformation can be a shared object
+ * loaded with dlopen: pass a path ending in TRANSFORM_PLUGIN_SUFFIX where
+ * the program would go. That file and every plugin in
+ * TRANSFORM_PLUGIN_DIR_ENV, when set, are loaded at startup, and XTRAN can
+ * only switch among them by name: nothing is loaded at runtime. The plugin
+ * exports a
+ * `transform_plugin' structure named TRANSFORM_PLUGIN_SYMBOL, and its
+ * callbacks run in the selector thread on the body bytes as they are
+ * received, so they must not block. Their output goes to the temp file
+ * through the same path as an untransformed body, so transformed messages
+ * can still be compressed and deduplicated.
+ *
+ * A plugin sees only the body: the envelope lines in front of it are
+ * written by the server. DATA bodies are dot-stuffed, BDAT bodies are not
+ * (see `stuffed' in init), and neither includes the final ".".
+ */
+
+#define TRANSFORM_PLUGIN_SYMBOL "smtpd_transform_plugin"
+#define TRANSFORM_PLUGIN_SUFFIX ".so"
+#define TRANSFORM_ABI_VERSION   1
+#define TRANSFORM_PLUGIN_DIR_ENV "SMTPD_PLUGIN_DIR"
+// plugins loaded at startup; all stay mapped because sessions may still use a replaced one
+#define TRANSFORM_MAX_PLUGINS 16
+
+/** @brief Writes transformed bytes to the message. @returns `len', or -1 on error. */
+typedef ssize_t (*transform_emit_fn)(void* sink, const void* buf, size_t len);
+
+typedef struct
+{
+	/** TRANSFORM_ABI_VERSION the plugin was built against */
+	unsigned abi_version;
+	const char* name;
+	/**
+	 * Called for every message before its body.
+	 * @returns the state passed to the other callbacks, or NULL to store the message untransformed.
+	 */
+	void* (*init)(const char* from, const char* const* rcpt, size_t rcpt_qty, bool stuffed);
+	/** Called with each piece of the body. @returns 0, or -1 to refuse the message (451). */
+	int (*chunk)(void* state, const void* buf, size_t len, transform_emit_fn emit, void* sink);
+	/**
+	 * Called once after the last chunk, also when the message is discarded, in which case
+	 * `emit' drops what it gets. Frees `state'. @returns 0, or -1 to refuse the message.
+	 */
+	int (*finish)(void* state, transform_emit_fn emit, void* sink);
+} transform_plugin;
+
+/** @brief true if `path' names a plugin rather than a program. */
+bool transform_is_plugin(const char* path);
+
+/**
+ * @brief Loads the plugin at `path'. Only call it at startup.
+ * @returns 0, or -1 if it cannot be loaded, was built for another ABI or its name is taken.
+ */
+int transform_load_file(const char* path);
+
+/**
+ * @brief Loads every plugin in `dir'. Ones that cannot be loaded or were built for
+ * another ABI are logged and skipped. Only call it at startup.
+ * @returns how many were loaded, or -1 if `dir' cannot be read.
+ */
+int transform_load_dir(const char* dir);
+
+/**
+ * @brief Makes the loaded plugin named `name' (the file name, with or without the
+ * suffix) the current one. @returns -1 if there is none, or `name' has a '/' or "..".
+ */
+int transform_select(const char* name);
+
+/** @brief The current plugin, or NULL if none was loaded. */
+const transform_plugin* transform_current(void);
+
+/** @brief Unloads every plugin. No session may be using one. */
+void transform_finalize(void);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/**
+ * upgrade.c - zero downtime restarts.
+ *
+ * The running server fork+execs a fresh copy of its binary and hands it the
+ * listening sockets over a unix socketpair (SCM_RIGHTS), so the kernel accept
+ * queues are never closed and no connection is refused. Once the new process
+ * is serving it acknowledges with a single byte; only then the old one stops
+ * accepting and drains its sessions, keeping the channel open until it
+ * exits. If the new process dies before the acknowledgement, the old one
+ * simply keeps serving.
+ *
+ * The channel is passed to the new process as an inherited descriptor whose
+ * number is stored in the UPGRADE_ENV environment variable.
+ */
+
+#define UPGRADE_ENV     "SMTPD_UPGRADE_FD"
+#define UPGRADE_MAX_FDS 8
+
+/**
+ * If this process was started by upgrade_start, receives the listening sockets
+ * into fds (at most n, in the order they were sent).
+ *
+ * @return the number of descriptors received, 0 if this is not an upgrade, or
+ *         -1 on error.
+ */
+int upgrade_inherit(int* fds, unsigned n);
+
+/**
+ * Tells the process we were started by that we are serving. No-op if this is
+ * not an upgrade. The channel stays open: see upgrade_previous.
+ */
+void upgrade_ready(void);
+
+/**
+ * After upgrade_ready, the channel to the process we were started by, which
+ * keeps its end open until it exits. Once it is readable (end of file) that
+ * process is gone and its files, such as the quota table, are ours.
+ *
+ * @return the descriptor, to be closed by the caller, or -1 if this is not an
+ *         upgrade.
+ */
+int upgrade_previous(void);
+
+/**
+ * Starts argv as a new process and sends it the n descriptors in fds.
+ *
+ * @return a non blocking descriptor that becomes readable when the new process
+ *         answers (see upgrade_finish), or -1 on error.
+ */
+int upgrade_start(char* const argv[], const int* fds, unsigned n);
+
+/**
+ * Reads the new process answer on the descriptor returned by upgrade_start.
+ * The descriptor is not closed.
+ *
+ * @return 1 if the new process is serving, 0 if it failed (it is reaped), or
+ *         -1 if there is nothing to read yet.
+ */
+int upgrade_finish(int channel);
+
+#endif
@@ -1,7 +1,11 @@
 #include "logger.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,19 +16,20 @@
 #define DEFAULT_LOG_FOLDER         "./log"
 #define DEFAULT_LOG_FILE           (DEFAULT_LOG_FOLDER "/%02d-%02d-%04d.log")
 #define DEFAULT_LOG_FILE_MAXSTRLEN 48
-
-/** The minimum allowed length for the log writing buffer. */
-#define LOG_MIN_BUFFER_SIZE 0x1000  // 4 KBs
-/** The maximum allowed length for the log writing buffer. */
-#define LOG_MAX_BUFFER_SIZE 0x400000  // 4 MBs
-/** The amount of bytes to expand the log buffer by when expanding. */
-#define LOG_BUFFER_SIZE_GRANULARITY 0x1000  // 4 KBs
-/** The maximum length a single print into the log buffer SHOULD require. */
-#define LOG_BUFFER_MAX_PRINT_LENGTH 0x200  // 512 bytes
-
-#define LOG_FILE_PERMISSION_BITS   (S_IRWXU | S_IRWXO | S_IRWXG)  
+#define DEFAULT_EVENTS_FILE        (DEFAULT_LOG_FOLDER "/%02d-%02d-%04d.events")
+
+/** The amount of records the ring can hold. Must be a power of two. */
+#define LOG_RING_SIZE 0x1000  // 4096 records
+/** Bytes reserved in each record for copies of string arguments. */
+#define LOG_RECORD_STR_SIZE 0x100  // 256 bytes
+/** The size of the writer thread's output buffer. */
+#define LOG_OUTPUT_BUFFER_SIZE 0x10000  // 64 KBs
+/** The maximum length a single formatted record may take. Longer records are truncated. */
+#define LOG_MAX_LINE_LENGTH 0x400  // 1 KB
+
+#define LOG_FILE_PERMISSION_BITS   (S_IRWXU | S_IRWXO | S_IRWXG)
 #define LOG_FOLDER_PERMISSION_BITS (S_IRWXU | S_IRWXO | S_IRWXG)
-#define LOG_FILE_OPEN_FLAGS        (O_WRONLY | O_APPEND | O_CREAT | O_NONBLOCK)
+#define LOG_FILE_OPEN_FLAGS        (O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC)
 
 const char*
 logger_get_level_string(log_level_t level)
@@ -47,121 +52,639 @@ logger_get_level_string(log_level_t level)
 	}
 }
 
+static const struct
+{
+	const char* name;
+	const char* fields[LOGGER_EVENT_FIELDS];
+} event_descriptors[LOG_EV_MAX] = {
+	[LOG_EV_SESSION_OPEN] = { "SESSION_OPEN", { "fd", "family" } },
+	[LOG_EV_SESSION_REFUSED] = { "SESSION_REFUSED", { "fd", "verdict" } },
+	[LOG_EV_SESSION_CLOSE] = { "SESSION_CLOSE", { "fd", "socket_state" } },
+	[LOG_EV_SESSION_TIMEOUT] = { "SESSION_TIMEOUT", { "fd", "socket_state", "smtp_state" } },
+	[LOG_EV_SOCKET_STATE] = { "SOCKET_STATE", { "from", "to" } },
+	[LOG_EV_SMTP_STATE] = { "SMTP_STATE", { "from", "to" } },
+	[LOG_EV_DELIVERED] = { "DELIVERED", { "rcpt", "rcpt_count" } },
+	[LOG_EV_QUEUED] = { "QUEUED", { "rcpt_count" } },
+	[LOG_EV_RELAYED] = { "RELAYED", { "rcpt", "rcpt_count", "code" } },
+};
+
+const char*
+logger_get_event_string(log_event_t event)
+{
+	if (event <= 0 || event >= LOG_EV_MAX || event_descriptors[event].name == NULL) {
+		return "UNKNOWN";
+	}
+	return event_descriptors[event].name;
+}
+
+const char*
+logger_get_event_field(log_event_t event, unsigned i)
+{
+	if (event <= 0 || event >= LOG_EV_MAX || i >= LOGGER_EVENT_FIELDS) {
+		return NULL;
+	}
+	return event_descriptors[event].fields[i];
+}
+
 #ifndef DISABLE_LOGGER
 
-/** The buffer where logs are buffered. */
-static char* buffer = NULL;
-static size_t buffer_start = 0, buffer_length = 0, buffer_capacity = 0;
+typedef enum
+{
+	RECORD_TEXT,
+	RECORD_EVENT,
+} record_kind;
+
+/** A log call, captured but not yet formatted. */
+struct log_record
+{
+	record_kind kind;
+	/** only for RECORD_EVENT records; its timestamp is filled in by the writer */
+	struct logger_event event;
+	log_level_t level;
+	struct timespec time;
+	const char* format;
+	unsigned nargs;
+	struct logger_arg args[LOGGER_MAX_ARGS];
+	/** offsets into `strs' of the copies of LOGGER_ARG_STR arguments */
+	uint16_t str_offset[LOGGER_MAX_ARGS];
+	char strs[LOG_RECORD_STR_SIZE];
+};
+
+/**
+ * A ring slot. `sequence' tells producers and the consumer who owns the slot: it equals
+ * the enqueue position when free, and position + 1 once the record is published.
+ * (Bounded MPMC queue by D. Vyukov, used here with a single consumer.)
+ */
+struct log_slot
+{
+	_Atomic size_t sequence;
+	struct log_record record;
+};
+
+static struct log_slot* ring = NULL;
+static _Atomic size_t enqueue_pos;
+static size_t dequeue_pos;  // only touched by the writer thread
+static atomic_ulong dropped;
+
+static pthread_t writer_thread;
+static atomic_bool running;
+/**
+ * The writer blocks on `wakeup' while the ring is empty. `writer_idle' says it may be
+ * waiting: producers only take the mutex to signal it when it is set, so a busy ring
+ * costs them nothing.
+ */
+static pthread_mutex_t wakeup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static atomic_bool writer_idle;
+static bool enabled = false;
 
 /** The file descriptor for writing logs to disk, or -1 if we're not doing that. */
 static int log_file_fd = -1;
-static fd_selector selector = NULL;
+/** The file descriptor for the binary event log, or -1 if it is disabled. */
+static int events_fd = -1;
 static log_level_t log_level = MIN_LOG_LEVEL;
 
 /** The stream for writing logs to, or NULL if we're not doing that. */
 static FILE* log_stream = NULL;
 
 /**
- * @brief Attempts to make at least len bytes available in the log buffer.
+ * @brief Claims the next ring slot, storing its position in `pos'. Never blocks: if the writer
+ * fell behind, returns NULL and the record is dropped.
  */
+static struct log_slot*
+claim_slot(size_t* pos_out)
+{
+	size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+	struct log_slot* slot;
+	for (;;) {
+		slot = ring + (pos & (LOG_RING_SIZE - 1));
+		size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+			        &enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+		}
+	}
+	*pos_out = pos;
+	return slot;
+}
+
+/** @brief Wakes the writer if it is waiting for records. */
+static void
+wake_writer(void)
+{
+	// Pairs with the fence in wait_for_records: either the writer sees our record, or we see it idle.
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&writer_idle, memory_order_relaxed) && atomic_exchange(&writer_idle, false)) {
+		pthread_mutex_lock(&wakeup_mutex);
+		pthread_cond_signal(&wakeup);
+		pthread_mutex_unlock(&wakeup_mutex);
+	}
+}
+
 static inline void
-make_buffer_space(size_t len)
-{
-	// Make enough space in the buffer for the string
-	if (buffer_length + buffer_start + len > buffer_capacity) {
-		// If the buffer can be compacted to fit this string, do so. Otherwise,
-		// we'll have to allocate more memory.
-		if (buffer_capacity <= len) {
-			memmove(buffer, buffer + buffer_start, buffer_length);
-			buffer_start = 0;
-		} else if (buffer_capacity < LOG_MAX_BUFFER_SIZE) {
-			size_t new_buffer_capacity = buffer_length + len;
-			new_buffer_capacity = (new_buffer_capacity + LOG_BUFFER_SIZE_GRANULARITY - 1) /
-			                      LOG_BUFFER_SIZE_GRANULARITY * LOG_BUFFER_SIZE_GRANULARITY;
-			if (new_buffer_capacity > LOG_MAX_BUFFER_SIZE)
-				new_buffer_capacity = LOG_MAX_BUFFER_SIZE;
-
-			// The buffer isn't large enough, let's try to expand it, or at
-			// least compact it to make as much space available as possible.
-			void* new_buffer = malloc(new_buffer_capacity);
-			if (new_buffer == NULL) {
-				memmove(buffer, buffer + buffer_start, buffer_length);
-				buffer_start = 0;
+publish_slot(struct log_slot* slot, size_t pos)
+{
+	atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+	wake_writer();
+}
+
+void
+logger_submit(log_level_t level, const char* format, const struct logger_arg* args, unsigned nargs)
+{
+	if (ring == NULL) {
+		return;
+	}
+	size_t pos;
+	struct log_slot* slot = claim_slot(&pos);
+	if (slot == NULL) {
+		return;
+	}
+
+	struct log_record* r = &slot->record;
+	r->kind = RECORD_TEXT;
+	r->level = level;
+	clock_gettime(CLOCK_REALTIME, &r->time);
+	r->format = format;
+	r->nargs = nargs > LOGGER_MAX_ARGS ? LOGGER_MAX_ARGS : nargs;
+
+	// Strings are the only arguments whose lifetime we can't rely on, so copy them.
+	size_t str_used = 0;
+	for (unsigned i = 0; i < r->nargs; i++) {
+		r->args[i] = args[i];
+		if (args[i].type == LOGGER_ARG_STR) {
+			const char* s = args[i].v.p == NULL ? "(null)" : args[i].v.p;
+			size_t room = LOG_RECORD_STR_SIZE - str_used;
+			size_t len = room == 0 ? 0 : strnlen(s, room - 1);
+			r->str_offset[i] = str_used;
+			if (room > 0) {
+				memcpy(r->strs + str_used, s, len);
+				r->strs[str_used + len] = '\0';
+				str_used += len + 1;
 			} else {
-				memcpy(new_buffer, buffer + buffer_start, buffer_length);
-				free(buffer);
-				buffer = new_buffer;
-				buffer_capacity = new_buffer_capacity;
-				buffer_start = 0;
+				r->str_offset[i] = LOG_RECORD_STR_SIZE - 1;
+			}
+		}
+	}
+	if (str_used == LOG_RECORD_STR_SIZE) {
+		r->strs[LOG_RECORD_STR_SIZE - 1] = '\0';
+	}
+
+	publish_slot(slot, pos);
+}
+
+void
+logger_event(log_event_t event, uint32_t session, uint32_t a, uint32_t b, uint32_t c)
+{
+	if (ring == NULL || events_fd < 0) {
+		return;
+	}
+	size_t pos;
+	struct log_slot* slot = claim_slot(&pos);
+	if (slot == NULL) {
+		return;
+	}
+
+	struct log_record* r = &slot->record;
+	r->kind = RECORD_EVENT;
+	clock_gettime(CLOCK_REALTIME, &r->time);
+	r->event = (struct logger_event){
+		.session = session,
+		.event = (uint16_t)event,
+		.fields = { a, b, c, 0 },
+	};
+
+	publish_slot(slot, pos);
+}
+
+typedef enum
+{
+	LEN_NONE,
+	LEN_HH,
+	LEN_H,
+	LEN_L,
+	LEN_LL,
+	LEN_Z,
+	LEN_J,
+	LEN_T,
+	LEN_BIG_L,
+} length_modifier;
+
+static unsigned long long
+raw_value(const struct logger_arg* a)
+{
+	switch (a->type) {
+		case LOGGER_ARG_INT:
+			return (unsigned long long)a->v.i;
+		case LOGGER_ARG_UINT:
+			return a->v.u;
+		case LOGGER_ARG_DOUBLE:
+			return (unsigned long long)(long long)a->v.d;
+		default:
+			return (unsigned long long)(uintptr_t)a->v.p;
+	}
+}
+
+/** Applies the conversions printf would have applied had it received the argument. */
+static long long
+signed_value(const struct logger_arg* a, length_modifier len)
+{
+	unsigned long long raw = raw_value(a);
+	switch (len) {
+		case LEN_HH:
+			return (signed char)raw;
+		case LEN_H:
+			return (short)raw;
+		case LEN_NONE:
+			return (int)raw;
+		case LEN_L:
+		case LEN_Z:
+		case LEN_T:
+			return (long)raw;
+		default:
+			return (long long)raw;
+	}
+}
+
+static unsigned long long
+unsigned_value(const struct logger_arg* a, length_modifier len)
+{
+	unsigned long long raw = raw_value(a);
+	switch (len) {
+		case LEN_HH:
+			return (unsigned char)raw;
+		case LEN_H:
+			return (unsigned short)raw;
+		case LEN_NONE:
+			return (unsigned int)raw;
+		case LEN_L:
+		case LEN_Z:
+		case LEN_T:
+			return (unsigned long)raw;
+		default:
+			return raw;
+	}
+}
+
+/**
+ * @brief Appends the width (or, with `precision', the precision) at `*f' to `spec', leaving
+ * room for the conversion. A `*' takes the next argument as an int, like printf: a negative
+ * width is the '-' flag, and a negative precision is as if none was given.
+ * @returns false if it does not fit or the argument is missing.
+ */
+static bool
+take_number(char* spec, size_t* spec_len, size_t cap, const char** f, const struct log_record* r, unsigned* argi,
+            bool precision)
+{
+	if (precision) {
+		if (**f != '.') {
+			return true;
+		}
+		(*f)++;
+	}
+	char num[24];
+	int len = 0;
+	if (**f == '*') {
+		(*f)++;
+		if (*argi >= r->nargs) {
+			return false;
+		}
+		const long long v = signed_value(r->args + (*argi)++, LEN_NONE);
+		if (precision && v < 0) {
+			return true;
+		}
+		len = snprintf(num, sizeof(num), "%lld", v);
+	} else {
+		while (isdigit((unsigned char)**f)) {
+			if (len < (int)sizeof(num) - 1) {
+				num[len++] = **f;
 			}
+			(*f)++;
 		}
 	}
+	const size_t need = (precision ? 1 : 0) + (size_t)len;
+	if (*spec_len + need + 4 > cap) {
+		return false;
+	}
+	if (precision) {
+		spec[(*spec_len)++] = '.';
+	}
+	memcpy(spec + *spec_len, num, len);
+	*spec_len += len;
+	return true;
 }
 
 /**
- * @brief Attempts to flush as much of the logging buffer into the logging file as it can.
- * This is performed with nonblocking writes. If any bytes are left for writing, we tell the
- * selector to notify us when writing is available and retry once that happens.
+ * @brief Renders a captured record's format and arguments into `out'. This is a small
+ * printf driver: every conversion is handed to snprintf on its own, with its length
+ * modifier rewritten to match the type we captured.
  */
-static inline void
-try_flush_buffer_to_file()
+static size_t
+format_args(char* out, size_t cap, const struct log_record* r)
 {
-	// Try to write everything we have in the buffer. This is nonblocking, so any
-	// (or all) remaining bytes will be saved in the buffer and retried later.
-	ssize_t written = write(log_file_fd, buffer + buffer_start, buffer_length);
-	if (written > 0) {
-		buffer_length -= written;
-		buffer_start = (buffer_length == 0 ? 0 : (buffer_start + written));
+	const char* f = r->format;
+	size_t n = 0;
+	unsigned argi = 0;
+
+	while (*f != '\0' && n + 1 < cap) {
+		if (*f != '%') {
+			out[n++] = *f++;
+			continue;
+		}
+		if (f[1] == '%') {
+			out[n++] = '%';
+			f += 2;
+			continue;
+		}
+
+		const char* start = f++;
+		// The conversion is rebuilt in `spec', with `*' widths and precisions replaced by their values.
+		char spec[32] = "%";
+		size_t spec_len = 1;
+		bool fits = true;
+		while (*f != '\0' && strchr("-+ #0", *f) != NULL) {
+			if (spec_len + 4 < sizeof(spec)) {
+				spec[spec_len++] = *f;
+			}
+			f++;
+		}
+		fits &= take_number(spec, &spec_len, sizeof(spec), &f, r, &argi, false);
+		fits &= take_number(spec, &spec_len, sizeof(spec), &f, r, &argi, true);
+		length_modifier len = LEN_NONE;
+		switch (*f) {
+			case 'h':
+				len = f[1] == 'h' ? LEN_HH : LEN_H;
+				f += f[1] == 'h' ? 2 : 1;
+				break;
+			case 'l':
+				len = f[1] == 'l' ? LEN_LL : LEN_L;
+				f += f[1] == 'l' ? 2 : 1;
+				break;
+			case 'z':
+				len = LEN_Z;
+				f++;
+				break;
+			case 'j':
+				len = LEN_J;
+				f++;
+				break;
+			case 't':
+				len = LEN_T;
+				f++;
+				break;
+			case 'L':
+				len = LEN_BIG_L;
+				f++;
+				break;
+			default:
+				break;
+		}
+		const char conv = *f;
+		if (conv == '\0') {
+			break;
+		}
+		f++;
+
+		if (!fits || argi >= r->nargs) {
+			// Unsupported or missing argument: print the conversion as is.
+			size_t verbatim = f - start;
+			if (verbatim > cap - 1 - n)
+				verbatim = cap - 1 - n;
+			memcpy(out + n, start, verbatim);
+			n += verbatim;
+			continue;
+		}
+
+		const struct logger_arg* a = r->args + argi;
+		const unsigned i = argi++;
+		int w;
+		switch (conv) {
+			case 'd':
+			case 'i':
+				strcpy(spec + spec_len, "lld");
+				w = snprintf(out + n, cap - n, spec, signed_value(a, len));
+				break;
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X':
+				spec[spec_len] = 'l';
+				spec[spec_len + 1] = 'l';
+				spec[spec_len + 2] = conv;
+				spec[spec_len + 3] = '\0';
+				w = snprintf(out + n, cap - n, spec, unsigned_value(a, len));
+				break;
+			case 'c':
+				strcpy(spec + spec_len, "c");
+				w = snprintf(out + n, cap - n, spec, (int)raw_value(a));
+				break;
+			case 'f':
+			case 'F':
+			case 'e':
+			case 'E':
+			case 'g':
+			case 'G':
+			case 'a':
+			case 'A':
+				spec[spec_len] = conv;
+				spec[spec_len + 1] = '\0';
+				w = snprintf(out + n,
+				             cap - n,
+				             spec,
+				             a->type == LOGGER_ARG_DOUBLE ? a->v.d : (double)(long long)raw_value(a));
+				break;
+			case 's':
+				strcpy(spec + spec_len, "s");
+				w = snprintf(out + n, cap - n, spec, a->type == LOGGER_ARG_STR ? r->strs + r->str_offset[i] : "(?)");
+				break;
+			case 'p':
+				strcpy(spec + spec_len, "p");
+				w = snprintf(out + n, cap - n, spec, (void*)(uintptr_t)raw_value(a));
+				break;
+			default:
+				w = 0;
+				break;
+		}
+		if (w > 0) {
+			n += (size_t)w < cap - n ? (size_t)w : cap - 1 - n;
+		}
 	}
+	out[n] = '\0';
+	return n;
+}
 
-	// If there are still remaining bytes to write, leave them in the buffer and retry
-	// once the selector says the fd can be written.
-	selector_set_interest(selector, log_file_fd, buffer_length > 0 ? OP_WRITE : OP_NOOP);
+static size_t
+format_record(char* out, size_t cap, const struct log_record* r)
+{
+	struct tm tm;
+	localtime_r(&r->time.tv_sec, &tm);
+	int n = snprintf(out,
+	                 cap,
+	                 "%04d-%02d-%02dT%02d:%02d:%02d%s\t",
+	                 tm.tm_year + 1900,
+	                 tm.tm_mon + 1,
+	                 tm.tm_mday,
+	                 tm.tm_hour,
+	                 tm.tm_min,
+	                 tm.tm_sec,
+	                 r->level == LOG_OUTPUT ? "" : logger_get_level_string(r->level));
+	if (n < 0 || (size_t)n >= cap - 1) {
+		return 0;
+	}
+	size_t len = n + format_args(out + n, cap - n - 1, r);
+	out[len++] = '\n';
+	return len;
 }
 
 static void
-fd_write_handler(selector_key* key)
+write_fully(int fd, const void* buf, size_t len)
 {
-	// TODO: TEMP FOR BUILD
-	key = key;
-	// END TEMP FOR BUILD
-	try_flush_buffer_to_file();
+	size_t off = 0;
+	while (off < len) {
+		ssize_t written = write(fd, (const char*)buf + off, len - off);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		off += written;
+	}
 }
 
 static void
-fd_close_handler(selector_key* key)
-{
-	// TODO: TEMP FOR BUILD
-	key = key;
-	// END TEMP FOR BUILD
-	// We will attempt to flush the remaining bytes to the log file and then close it.
-
-	if (buffer_length != 0) {
-		// Set the log file to blocking, then try to write the remaining bytes. If any of
-		// this fails, just ignore the failure.
-		int flags = fcntl(log_file_fd, F_GETFD, 0);
-		fcntl(log_file_fd, F_SETFL, flags & (~O_NONBLOCK));
-		ssize_t written = write(log_file_fd, buffer, buffer_length);
-		if (written > 0) {
-			buffer_length -= written;
-			buffer_start = (buffer_length == 0 ? 0 : (buffer_start + written));
+flush_output(const char* buf, size_t len)
+{
+	if (len == 0) {
+		return;
+	}
+	if (log_file_fd >= 0) {
+		write_fully(log_file_fd, buf, len);
+	}
+	if (log_stream != NULL) {
+		fwrite(buf, 1, len, log_stream);
+		fflush(log_stream);
+	}
+}
+
+/** Events waiting to be written, batched like text. */
+#define EVENTS_BUFFER_RECORDS (LOG_OUTPUT_BUFFER_SIZE / sizeof(struct logger_event))
+static struct logger_event events_out[EVENTS_BUFFER_RECORDS];
+static size_t events_used = 0;
+
+static void
+flush_events(void)
+{
+	if (events_used > 0 && events_fd >= 0) {
+		write_fully(events_fd, events_out, events_used * sizeof(*events_out));
+	}
+	events_used = 0;
+}
+
+/**
+ * @brief Pops one record from the ring. Text is formatted into `out' (`len' is set to the
+ * length written) and events are appended to the event buffer. Returns false if the ring is empty.
+ */
+static bool
+dequeue_record(char* out, size_t cap, size_t* len)
+{
+	struct log_slot* slot = ring + (dequeue_pos & (LOG_RING_SIZE - 1));
+	size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+	if (seq != dequeue_pos + 1) {
+		return false;
+	}
+	const struct log_record* r = &slot->record;
+	if (r->kind == RECORD_EVENT) {
+		struct logger_event* e = events_out + events_used++;
+		*e = r->event;
+		e->timestamp_ns = (uint64_t)r->time.tv_sec * 1000000000ULL + (uint64_t)r->time.tv_nsec;
+		*len = 0;
+		if (events_used == EVENTS_BUFFER_RECORDS) {
+			flush_events();
 		}
+	} else {
+		*len = format_record(out, cap, r);
 	}
+	atomic_store_explicit(&slot->sequence, dequeue_pos + LOG_RING_SIZE, memory_order_release);
+	dequeue_pos++;
+	return true;
+}
+
+/** @brief True if the next record is published (or the ring is being shut down). */
+static bool
+records_ready(void)
+{
+	const struct log_slot* slot = ring + (dequeue_pos & (LOG_RING_SIZE - 1));
+	return atomic_load_explicit(&slot->sequence, memory_order_acquire) == dequeue_pos + 1 || !atomic_load(&running);
+}
 
-	close(log_file_fd);
-	log_file_fd = -1;
+/** @brief Blocks the writer until a producer publishes a record or logger_finalize stops it. */
+static void
+wait_for_records(void)
+{
+	pthread_mutex_lock(&wakeup_mutex);
+	for (;;) {
+		// Set again after every wakeup: the producer that woke us may not own the next slot,
+		// and the one that does still has to see us idle.
+		atomic_store(&writer_idle, true);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (records_ready()) {
+			break;
+		}
+		pthread_cond_wait(&wakeup, &wakeup_mutex);
+	}
+	atomic_store(&writer_idle, false);
+	pthread_mutex_unlock(&wakeup_mutex);
 }
 
-static fd_handler fd_handler_instance = { .handle_read = NULL,
-	                                      .handle_write = fd_write_handler,
-	                                      .handle_close = fd_close_handler,
-	                                      .handle_block = NULL };
+static void*
+writer_main(void* arg)
+{
+	(void)arg;
+	static char out[LOG_OUTPUT_BUFFER_SIZE];
+	size_t used = 0;
+
+	for (;;) {
+		// Read the flag before looking at the ring, so we never exit with records pending.
+		const bool stopping = !atomic_load(&running);
+
+		size_t len;
+		if (dequeue_record(out + used, LOG_MAX_LINE_LENGTH, &len)) {
+			used += len;
+			if (used + LOG_MAX_LINE_LENGTH > sizeof(out)) {
+				flush_output(out, used);
+				used = 0;
+			}
+			continue;
+		}
+
+		unsigned long lost = atomic_exchange(&dropped, 0);
+		if (lost > 0) {
+			used += snprintf(out + used, LOG_MAX_LINE_LENGTH, "WARNING: %lu log records dropped. Slow disk?\n", lost);
+		}
+		flush_output(out, used);
+		used = 0;
+		flush_events();
+
+		if (stopping) {
+			break;
+		}
+		wait_for_records();
+	}
+	return NULL;
+}
 
 /**
  * @brief Attempts to open a file for logging. Returns the fd, or -1 if failed.
  */
 static int
-try_open_log_file(const char* log_file, struct tm tm)
+try_open_log_file(const char* log_file, const char* default_pattern, struct tm tm)
 {
 	if (log_file == NULL)
 		return -1;
@@ -171,7 +694,7 @@ try_open_log_file(const char* log_file, struct tm tm)
 	// If log_file is "", then we instead of the default log file name.
 	if (log_file[0] == '\0') {
 		snprintf(
-		    logfilebuf, DEFAULT_LOG_FILE_MAXSTRLEN, DEFAULT_LOG_FILE, tm.tm_mday, tm.tm_mon + 1, tm.tm_year + 1900);
+		    logfilebuf, DEFAULT_LOG_FILE_MAXSTRLEN, default_pattern, tm.tm_mday, tm.tm_mon + 1, tm.tm_year + 1900);
 		log_file = logfilebuf;
 
 		// If the default log folder isn't created, create it.
@@ -190,56 +713,127 @@ try_open_log_file(const char* log_file, struct tm tm)
 	return fd;
 }
 
+/** @brief Allocates the ring and starts the writer thread, if not done yet. */
+static int
+start_writer(void)
+{
+	if (ring != NULL) {
+		return 0;
+	}
+
+	ring = malloc(LOG_RING_SIZE * sizeof(*ring));
+	if (ring == NULL) {
+		fprintf(stderr, "WARNING: Failed to malloc the logging ring. Logging disabled.\n");
+		return -1;
+	}
+	for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+		atomic_init(&ring[i].sequence, i);
+	}
+	atomic_init(&enqueue_pos, 0);
+	atomic_init(&dropped, 0);
+	dequeue_pos = 0;
+	events_used = 0;
+
+	atomic_store(&running, true);
+	atomic_init(&writer_idle, false);
+	if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+		free(ring);
+		ring = NULL;
+		fprintf(stderr, "WARNING: Failed to start the logging thread. Logging disabled.\n");
+		return -1;
+	}
+	return 0;
+}
+
 int
-logger_init(fd_selector selector_param, const char* log_file, FILE* log_stream_param)
+logger_init(const char* log_file, FILE* log_stream_param)
 {
+	logger_finalize();
+
 	// Get the local time (to log when the server started)
 	time_t time_now = time(NULL);
 	struct tm tm = *localtime(&time_now);
 
-	selector = selector_param;
-	log_file_fd = selector_param == NULL ? -1 : try_open_log_file(log_file, tm);
+	log_file_fd = try_open_log_file(log_file, DEFAULT_LOG_FILE, tm);
 	log_stream = log_stream_param;
 	log_level = MIN_LOG_LEVEL;
 
-	// If we opened a file for writing logs, register it in the selector.
-	if (log_file_fd >= 0)
-		selector_register(selector, log_file_fd, &fd_handler_instance, OP_NOOP, NULL);
-
-	// If we have any form of logging enabled, allocate a buffer for logging.
-	if (log_file_fd >= 0 || log_stream != NULL) {
-		buffer = malloc(LOG_MIN_BUFFER_SIZE);
-		buffer_capacity = LOG_MIN_BUFFER_SIZE;
-		buffer_length = 0;
-		buffer_start = 0;
-		if (buffer == NULL) {
-			close(log_file_fd);
-			log_file_fd = -1;
-			fprintf(stderr, "WARNING: Failed to malloc a buffer for logging. You don't have 4KBs?\n");
-			return -1;
-		}
+	if (log_file_fd < 0 && log_stream == NULL) {
+		return 0;
 	}
 
+	if (start_writer() != 0) {
+		close(log_file_fd);
+		log_file_fd = -1;
+		log_stream = NULL;
+		return -1;
+	}
+	enabled = true;
+	return 0;
+}
+
+int
+logger_events_init(const char* events_file)
+{
+	if (events_fd >= 0) {
+		return 0;
+	}
+
+	time_t time_now = time(NULL);
+	struct tm tm = *localtime(&time_now);
+
+	int fd = try_open_log_file(events_file, DEFAULT_EVENTS_FILE, tm);
+	if (fd < 0) {
+		return events_file == NULL ? 0 : -1;
+	}
+
+	// A new file starts with the header. Existing files (earlier runs the same day) already have it.
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size == 0) {
+		struct logger_event_header header = {
+			.version = LOGGER_EVENT_VERSION,
+			.record_size = sizeof(struct logger_event),
+			.byte_order_mark = LOGGER_EVENT_BOM,
+		};
+		memcpy(header.magic, LOGGER_EVENT_MAGIC, sizeof(header.magic));
+		write_fully(fd, &header, sizeof(header));
+	}
+
+	// Set before any event can be enqueued: the writer only reads it after dequeuing one.
+	events_fd = fd;
+	if (start_writer() != 0) {
+		close(events_fd);
+		events_fd = -1;
+		return -1;
+	}
 	return 0;
 }
 
 int
 logger_finalize()
 {
-	// If a logging file is opened, flush buffers, unregister it, and close it.
-	if (log_file_fd >= 0) {
-		selector_unregister_fd(selector,
-		                       log_file_fd);  // This will also call the TFdHandler's close, and close the file.
-		selector = NULL;
+	enabled = false;
+	if (ring == NULL) {
+		return 0;
 	}
 
-	// If we allocated a buffer, free it.
-	if (buffer != NULL) {
-		free(buffer);
-		buffer = NULL;
-		buffer_capacity = 0;
-		buffer_length = 0;
-		buffer_start = 0;
+	// The writer drains whatever is left in the ring before exiting.
+	pthread_mutex_lock(&wakeup_mutex);
+	atomic_store(&running, false);
+	pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&wakeup_mutex);
+	pthread_join(writer_thread, NULL);
+
+	free(ring);
+	ring = NULL;
+
+	if (log_file_fd >= 0) {
+		close(log_file_fd);
+		log_file_fd = -1;
+	}
+	if (events_fd >= 0) {
+		close(events_fd);
+		events_fd = -1;
 	}
 
 	// The logger does not handle closing the stream. We set it to NULL and forget.
@@ -256,49 +850,7 @@ logger_set_level(log_level_t level)
 int
 logger_is_enabled_for(log_level_t level)
 {
-	return level >= log_level && (log_file_fd > 0 || log_stream != NULL);
-}
-
-void
-logger_pre_print()
-{
-	make_buffer_space(LOG_BUFFER_MAX_PRINT_LENGTH);
-}
-
-void
-logger_get_buf_start_and_max_length(char** bufstart_var, size_t* maxlen_var)
-{
-	*maxlen_var = buffer_capacity - buffer_length - buffer_start;
-	*bufstart_var = buffer + buffer_start + buffer_length;
-}
-
-/**
- * @brief Called by the logf macro to perform error checking and log flushing.
- */
-int
-logger_post_print(int written, size_t maxlen)
-{
-	if (written < 0) {
-		fprintf(stderr, "Error: snprintf(): %s\n", strerror(errno));
-		return -1;
-	}
-
-	if ((size_t)written >= maxlen) {
-		fprintf(stderr, "Error: %lu bytes of logs possibly lost. Slow disk?\n", written - maxlen + 1);
-		written = maxlen - 1;
-	}
-
-	if (log_stream != NULL) {
-		fprintf(log_stream, "%s", buffer + buffer_start + buffer_length);
-	}
-
-	// If there's no output file, then we printed the results to the stream but don't
-	// update buffer_length because we're not saving anything in the buffer.
-	if (log_file_fd >= 0) {
-		buffer_length += written;
-		try_flush_buffer_to_file();
-	}
-	return 0;
+	return level >= log_level && enabled;
 }
 
-#endif  // #ifndef DISABLE_LOGGER
\ No newline at end of file
+#endif  // #ifndef DISABLE_LOGGER
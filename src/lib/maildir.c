@@ -1,24 +1,101 @@
 #include "maildir.h"
 
+#include "mailindex.h"
 #include "smtp.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <sys/stat.h>
 #include <sys/sendfile.h>
+#include <time.h>
+#include <unistd.h>
 
+/** a list of local parts read from a file; `all' if it has a `*' line */
+struct mailbox_list
+{
+	char** names;
+	size_t qty;
+	bool all;
+};
+
+static struct mailbox_list sharded = { 0 };
+static struct mailbox_list compressed = { 0 };
+
+static pthread_once_t host_once = PTHREAD_ONCE_INIT;
+static char host[MAILDIR_HOST_SIZE];
+static atomic_uint deliveries = 0;
+
+static void
+load_host(void)
+{
+	char raw[MAILDIR_HOST_SIZE];
+	if (gethostname(raw, sizeof(raw)) != 0) {
+		snprintf(raw, sizeof(raw), "localhost");
+	}
+	raw[sizeof(raw) - 1] = '\0';
+	// como pide el formato de maildir: '/' y ':' no pueden aparecer en el nombre
+	size_t j = 0;
+	for (const char* c = raw; *c != '\0' && j + 4 < sizeof(host); c++) {
+		if (*c == '/') {
+			memcpy(host + j, "\\057", 4);
+			j += 4;
+		} else if (*c == ':') {
+			memcpy(host + j, "\\072", 4);
+			j += 4;
+		} else {
+			host[j++] = *c;
+		}
+	}
+	host[j] = '\0';
+}
 
-static char*
-rand_str(char* dest, size_t length)
+int
+maildir_unique_name(char* out, size_t size)
 {
-	char charset[] = "0123456789"
-	                 "abcdefghijklmnopqrstuvwxyz"
-	                 "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	pthread_once(&host_once, load_host);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	const unsigned q = atomic_fetch_add_explicit(&deliveries, 1, memory_order_relaxed);
+	const int n = snprintf(out, size, "%lld.M%06ldP%ldQ%u.%s", (long long)now.tv_sec, now.tv_nsec / 1000,
+	                       (long)getpid(), q, host);
+	return n >= 0 && (size_t)n < size ? 0 : -1;
+}
 
-	while (length-- > 0) {
-		size_t index = (double)rand() / RAND_MAX * (sizeof charset - 1);
-		*dest++ = charset[index];
+/** @brief fsync of a file or directory by path. */
+static int
+sync_path(const char* path)
+{
+	if (!MAILDIR_FSYNC) {
+		return 0;
 	}
-	*dest = '\0';
-	return dest;
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fsync(fd) != 0) {
+		logf(LOG_ERROR, "Error syncing %s: %s", path, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+/** @brief fsync of the directory that holds `path', so an entry created in it survives a crash. */
+static int
+sync_parent(const char* path)
+{
+	char dir[MAILDIR_PATH_SIZE];
+	snprintf(dir, sizeof(dir), "%s", path);
+	char* slash = strrchr(dir, '/');
+	if (slash == NULL) {
+		return sync_path(".");
+	}
+	*slash = '\0';
+	return sync_path(dir[0] == '\0' ? "/" : dir);
 }
 
 int
@@ -26,16 +103,260 @@ create_nonexistent_dir(char* path)
 {
 	struct stat sb;
 	if (stat(path, &sb) == -1) {
+		// otro hilo pudo crearlo entre el stat y el mkdir
 		if (mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO) == -1) {
-			logf(LOG_ERROR, "Error creating directory %s", path);
-			perror("mkdir");
+			if (errno == EEXIST) {
+				return 0;
+			}
+			logf(LOG_ERROR, "Error creating directory %s: %s", path, strerror(errno));
 			return -1;
 		}
-		return 0;
+		// lo que se entregue adentro no sirve si el directorio se pierde
+		return sync_parent(path);
 	}
 	return 0;
 }
 
+static void
+free_list(struct mailbox_list* list)
+{
+	for (size_t i = 0; i < list->qty; i++) {
+		free(list->names[i]);
+	}
+	free(list->names);
+	*list = (struct mailbox_list){ 0 };
+}
+
+/** @returns 0 on success (including a missing file), -1 on error. */
+static int
+load_list(const char* path, struct mailbox_list* list)
+{
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		return errno == ENOENT ? 0 : -1;
+	}
+	char* line = NULL;
+	size_t cap = 0;
+	int ret = 0;
+	while (getline(&line, &cap, f) > 0) {
+		char* comment = strchr(line, '#');
+		if (comment != NULL) {
+			*comment = '\0';
+		}
+		char* save = NULL;
+		char* name = strtok_r(line, " \t\r\n", &save);
+		if (name == NULL) {
+			continue;
+		}
+		if (strcmp(name, "*") == 0) {
+			list->all = true;
+			continue;
+		}
+		char** grown = realloc(list->names, (list->qty + 1) * sizeof(*list->names));
+		if (grown == NULL || (grown[list->qty] = strdup(name)) == NULL) {
+			if (grown != NULL) {
+				list->names = grown;
+			}
+			ret = -1;
+			break;
+		}
+		list->names = grown;
+		list->qty++;
+	}
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+static bool
+list_contains(const struct mailbox_list* list, const char* user)
+{
+	if (list->all) {
+		return true;
+	}
+	for (size_t i = 0; i < list->qty; i++) {
+		if (strcmp(list->names[i], user) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int
+maildir_init(const char* shards_file, const char* compress_file)
+{
+	if (load_list(shards_file, &sharded) != 0 || load_list(compress_file, &compressed) != 0) {
+		maildir_finalize();
+		return -1;
+	}
+	if (sharded.all || sharded.qty > 0) {
+		logf(LOG_INFO, "Sharded maildir layout for %s", sharded.all ? "every mailbox" : shards_file);
+	}
+	if (compressed.all || compressed.qty > 0) {
+		logf(LOG_INFO, "Compressing messages for %s", compressed.all ? "every mailbox" : compress_file);
+	}
+	return 0;
+}
+
+void
+maildir_finalize(void)
+{
+	free_list(&sharded);
+	free_list(&compressed);
+}
+
+bool
+maildir_is_sharded(const char* user)
+{
+	return list_contains(&sharded, user);
+}
+
+bool
+maildir_is_compressed(const char* user)
+{
+	return list_contains(&compressed, user);
+}
+
+/** @brief Writes the shard of `name': the first MAILDIR_SHARD_DIGITS hex digits of its FNV-1a hash. */
+static void
+shard_of(const char* name, char* out)
+{
+	// en cur/ el nombre lleva ":2,<flags>"; el shard depende sólo de la parte única
+	uint32_t h = 0x811c9dc5u;
+	for (const char* c = name; *c != '\0' && *c != ':'; c++) {
+		h ^= (uint8_t)*c;
+		h *= 0x01000193u;
+	}
+	static const char hex[] = "0123456789abcdef";
+	for (int i = MAILDIR_SHARD_DIGITS - 1; i >= 0; i--) {
+		out[i] = hex[h & 0xf];
+		h >>= 4;
+	}
+	out[MAILDIR_SHARD_DIGITS] = '\0';
+}
+
+static bool
+is_shard_name(const char* name)
+{
+	if (strlen(name) != MAILDIR_SHARD_DIGITS) {
+		return false;
+	}
+	for (const char* c = name; *c != '\0'; c++) {
+		if (!((*c >= '0' && *c <= '9') || (*c >= 'a' && *c <= 'f'))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool
+file_exists(const char* path)
+{
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/** @brief Looks in `dir' for `name' followed by the ":2," info of cur/. */
+static bool
+find_with_info(const char* dir, const char* name, char* out, size_t size)
+{
+	DIR* d = opendir(dir);
+	if (d == NULL) {
+		return false;
+	}
+	const size_t len = strlen(name);
+	bool found = false;
+	struct dirent* e;
+	while (!found && (e = readdir(d)) != NULL) {
+		if (strncmp(e->d_name, name, len) == 0 && e->d_name[len] == ':') {
+			found = snprintf(out, size, "%s/%s", dir, e->d_name) < (int)size;
+		}
+	}
+	closedir(d);
+	return found;
+}
+
+int
+maildir_message_path(const char* user, const char* name, char* out, size_t size)
+{
+	char shard[MAILDIR_SHARD_DIGITS + 1];
+	shard_of(name, shard);
+	static const char* const folders[] = { "new", "cur" };
+	char dir[MAILDIR_PATH_SIZE];
+	for (size_t i = 0; i < sizeof(folders) / sizeof(folders[0]); i++) {
+		// primero el layout con shards, después el plano de antes
+		for (int flat = 0; flat <= 1; flat++) {
+			int n = flat ? snprintf(dir, sizeof(dir), "./Maildir/%s/%s", user, folders[i])
+			             : snprintf(dir, sizeof(dir), "./Maildir/%s/%s/%s", user, folders[i], shard);
+			if (n < 0 || (size_t)n >= sizeof(dir)) {
+				return -1;
+			}
+			n = snprintf(out, size, "%s/%s", dir, name);
+			if (n >= 0 && (size_t)n < size && file_exists(out)) {
+				return 0;
+			}
+			if (i == 1 && find_with_info(dir, name, out, size)) {
+				return 0;
+			}
+		}
+	}
+	return -1;
+}
+
+long
+maildir_foreach(const char* user, const char* folder, maildir_visit_fn fn, void* arg)
+{
+	char dir[MAILDIR_PATH_SIZE];
+	int n = snprintf(dir, sizeof(dir), "./Maildir/%s/%s", user, folder);
+	if (n < 0 || (size_t)n >= sizeof(dir)) {
+		return -1;
+	}
+	DIR* d = opendir(dir);
+	if (d == NULL) {
+		return -1;
+	}
+	long visited = 0;
+	char path[MAILDIR_PATH_SIZE];
+	struct dirent* e;
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.') {
+			continue;
+		}
+		n = snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		if (n < 0 || (size_t)n >= sizeof(path)) {
+			continue;
+		}
+		struct stat st;
+		if (stat(path, &st) != 0) {
+			continue;
+		}
+		if (S_ISREG(st.st_mode)) {
+			fn(path, e->d_name, arg);
+			visited++;
+		} else if (S_ISDIR(st.st_mode) && is_shard_name(e->d_name)) {
+			DIR* sd = opendir(path);
+			if (sd == NULL) {
+				continue;
+			}
+			char inner[MAILDIR_PATH_SIZE];
+			struct dirent* se;
+			while ((se = readdir(sd)) != NULL) {
+				if (se->d_name[0] == '.') {
+					continue;
+				}
+				n = snprintf(inner, sizeof(inner), "%s/%s", path, se->d_name);
+				if (n >= 0 && (size_t)n < sizeof(inner)) {
+					fn(inner, se->d_name, arg);
+					visited++;
+				}
+			}
+			closedir(sd);
+		}
+	}
+	closedir(d);
+	return visited;
+}
+
 char*
 create_maildir(char* user)
 {
@@ -80,80 +401,165 @@ finalize:
 }
 
 int
-create_temp_mail_file(char* email, char* copy_addr, char * copy_addr_path)
+create_temp_mail_file(char* email, char* copy_addr, char * copy_addr_path, size_t size_hint)
 {
 	char* email_dup = strdup(email);
-	char* name = strtok(email_dup, "@");
-	char* maildir_path = create_maildir(name);
+	char* save = NULL;
+	char* name = email_dup == NULL ? NULL : strtok_r(email_dup, "@", &save);
+	char* maildir_path = name == NULL ? NULL : create_maildir(name);
+	free(email_dup);
 	if (maildir_path == NULL) {
 		logf(LOG_ERROR, "Error creating maildir for %s", email);
+		return -1;
 	}
 
-	if (copy_addr[0] == '\0') {
-		char random[RAND_STR_LENGTH + 1];
-		rand_str(random, RAND_STR_LENGTH);
-		snprintf(copy_addr, MAIL_FILE_NAME_LENGTH, "%lu_%s", time(NULL), random);
+	// un nombre nuevo nunca puede pisar otro archivo: si el O_EXCL falla es un error
+	const bool fresh = copy_addr[0] == '\0';
+	if (fresh && maildir_unique_name(copy_addr, MAIL_FILE_NAME_LENGTH) != 0) {
+		logf(LOG_ERROR, "Mail file name too long for %s", email);
+		free(maildir_path);
+		return -1;
+	}
+	char path[MAILDIR_PATH_SIZE];
+	const int n = snprintf(path, sizeof(path), "%s/tmp/%s", maildir_path, copy_addr);
+	free(maildir_path);
+	if (n < 0 || (size_t)n >= sizeof(path)) {
+		logf(LOG_ERROR, "Temp mail file path too long for %s", email);
+		return -1;
 	}
-	strcat(maildir_path, "/tmp/");
-	strncat(maildir_path, copy_addr, MAIL_FILE_NAME_LENGTH);
 	if (copy_addr_path[0] == '\0') {
-		snprintf(copy_addr_path, MAIL_DIR_SIZE + 1 + DOMAIN_NAME_SIZE + 1 + LOCAL_USER_NAME_SIZE + 1 + MAILBOX_INNER_DIR_SIZE + 1 + MAIL_FILE_NAME_LENGTH + 1, "%s", maildir_path);
+		snprintf(copy_addr_path, MAILDIR_PATH_SIZE, "%s", path);
 	}
 
-	int fd = open(maildir_path, O_CREAT | O_RDWR, S_IRWXU | S_IRWXG | S_IRWXO);
-	free(email_dup);
-	free(maildir_path);
+	const int flags = O_CREAT | O_RDWR | O_CLOEXEC | (fresh ? O_EXCL : 0);
+	int fd = open(path, flags, S_IRWXU | S_IRWXG | S_IRWXO);
+	if (fd < 0) {
+		logf(LOG_ERROR, "Error creating temp mail file %s: %s", path, strerror(errno));
+	} else if (size_hint > 0) {
+		// best effort: si el filesystem no lo soporta seguimos igual
+		int err = posix_fallocate(fd, 0, size_hint);
+		if (err != 0) {
+			logf(LOG_DEBUG, "posix_fallocate(%s, %zu): %s", path, size_hint, strerror(err));
+		}
+	}
 	return fd;
 }
 
 void
-copy_temp_to_new_single(char* email, char* temp_file_name, char * temp_file_full_path)
+maildir_trim_temp_file(int fd)
+{
+	off_t written = lseek(fd, 0, SEEK_CUR);
+	if (written >= 0 && ftruncate(fd, written) != 0) {
+		logf(LOG_ERROR, "Error truncating temp mail file (fd=%d): %s", fd, strerror(errno));
+	}
+}
+
+/**
+ * @brief Builds the path of `file_name' in the new/ folder of `email', creating the maildir.
+ * `shard_dir' gets the shard directory, which may not exist yet, or "" if the mailbox is flat.
+ */
+static int
+new_message_path(const char* email, const char* file_name, char* new_path, char* shard_dir)
 {
-	// we copy the mail from mail/<domain>/<user>/tmp/<timestamp> to mail/<domain>/<rcpt_to>/new/<timestamp>
-	// we need to create the new dir if it doesn't exist
-	logf(LOG_DEBUG, "Copying temp file (path=%s) to new for email %s", temp_file_full_path, email);
 	char* email_dup = strdup(email);
-	char* name = strtok(email_dup, "@");
-	char* maildir_path = create_maildir(name);
+	char* save = NULL;
+	char* name = email_dup == NULL ? NULL : strtok_r(email_dup, "@", &save);
+	char* maildir_path = name == NULL ? NULL : create_maildir(name);
 
 	if (maildir_path == NULL) {
 		logf(LOG_ERROR, "Error getting maildir for %s", email);
-		perror("get_and_create_maildir");
 		free(email_dup);
-		return;
+		return -1;
 	}
-	strcat(maildir_path, "/new/");
-	strncat(maildir_path, temp_file_name, MAIL_FILE_NAME_LENGTH);
-
-	int new_fd = open(maildir_path, O_CREAT | O_WRONLY, S_IRWXU | S_IRWXG | S_IRWXO);
-	if (new_fd < 0) {
-		logf(LOG_ERROR, "Error creating new mail file for %s", email);
-		free(email_dup);
-		free(maildir_path);
-		perror("open");
-		return;
+	int n;
+	if (maildir_is_sharded(name)) {
+		char shard[MAILDIR_SHARD_DIGITS + 1];
+		shard_of(file_name, shard);
+		snprintf(shard_dir, MAILDIR_PATH_SIZE, "%s/new/%s", maildir_path, shard);
+		n = snprintf(new_path, MAILDIR_PATH_SIZE, "%s/%.*s", shard_dir, MAIL_FILE_NAME_LENGTH, file_name);
+	} else {
+		shard_dir[0] = '\0';
+		n = snprintf(new_path, MAILDIR_PATH_SIZE, "%s/new/%.*s", maildir_path, MAIL_FILE_NAME_LENGTH, file_name);
 	}
-
 	free(email_dup);
 	free(maildir_path);
+	if (n < 0 || n >= MAILDIR_PATH_SIZE) {
+		logf(LOG_ERROR, "Mail file path too long for %s", email);
+		return -1;
+	}
+	return 0;
+}
+
+int
+copy_temp_to_new_single(const char* email, const char* temp_file_name, const char* temp_file_full_path)
+{
+	// we copy the mail from mail/<domain>/<user>/tmp/<timestamp> to mail/<domain>/<rcpt_to>/new/<timestamp>
+	// we need to create the new dir if it doesn't exist
+	logf(LOG_DEBUG, "Copying temp file (path=%s) to new for email %s", temp_file_full_path, email);
+	char shard_dir[MAILDIR_PATH_SIZE];
+	char new_path[MAILDIR_PATH_SIZE];
+	if (new_message_path(email, temp_file_name, new_path, shard_dir) != 0) {
+		return -1;
+	}
+
+	// si quedó de un intento anterior puede ser un enlace al store: nunca escribimos sobre él
+	unlink(new_path);
+	int new_fd = open(new_path, O_CREAT | O_WRONLY | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+	// el shard se crea con el primer mensaje que cae en él
+	if (new_fd < 0 && errno == ENOENT && shard_dir[0] != '\0' && create_nonexistent_dir(shard_dir) == 0) {
+		new_fd = open(new_path, O_CREAT | O_WRONLY | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+	}
+	if (new_fd < 0) {
+		logf(LOG_ERROR, "Error creating new mail file for %s: %s", email, strerror(errno));
+		return -1;
+	}
 
 
 
 	//char buffer[1024] = { 0 };
 
 	//ssize_t bytes_read = 0;
-	int temp_file_fd = open(temp_file_full_path, O_RDWR);
+	int temp_file_fd = open(temp_file_full_path, O_RDONLY | O_CLOEXEC);
 	if (temp_file_fd < 0) {
-		logf(LOG_ERROR, "Error opening temp mail file for %s (fd=%d)", email, temp_file_fd);
-		perror("open");
-		return;
+		logf(LOG_ERROR, "Error opening temp mail file for %s: %s", email, strerror(errno));
+		close(new_fd);
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(temp_file_fd, &st) != 0) {
+		logf(LOG_ERROR, "Error reading temp mail file for %s: %s", email, strerror(errno));
+		close(temp_file_fd);
+		close(new_fd);
+		unlink(new_path);
+		return -1;
+	}
+	// el destino queda contiguo en disco: ya sabemos cuánto mide
+	if (st.st_size > 0) {
+		posix_fallocate(new_fd, 0, st.st_size);
 	}
 
-	if (sendfile(new_fd, temp_file_fd, 0, INT32_MAX) == -1) {
-		logf(LOG_ERROR, "Error copying temp mail file to new for %s", email);
-		perror("sendfile");
-		return;
-	} 
+	// sendfile copia a lo sumo ~2 GiB por llamada y puede copiar menos
+	off_t copied = 0;
+	while (copied < st.st_size) {
+		errno = 0;
+		const ssize_t n = sendfile(new_fd, temp_file_fd, &copied, st.st_size - copied);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+	}
+	close(temp_file_fd);
+	if (copied != st.st_size) {
+		// uno truncado no puede quedar como entregado
+		logf(LOG_ERROR, "Error copying temp mail file to new for %s: %jd of %jd bytes: %s", email, (intmax_t)copied,
+		     (intmax_t)st.st_size, errno != 0 ? strerror(errno) : "short copy");
+		close(new_fd);
+		unlink(new_path);
+		return -1;
+	}
 
 	// This while loop is provisional. We need to read the whole file and apply the transformation if there is any
 	// The reason for doing it as a while loop is because we haven't implemented transformations yet
@@ -173,11 +579,161 @@ copy_temp_to_new_single(char* email, char* temp_file_name, char * temp_file_full
 	// 	return;
 	// }
 
+	// el spool borra su copia apenas retornamos: la nuestra tiene que estar en disco
+	if (MAILDIR_FSYNC && fsync(new_fd) != 0) {
+		logf(LOG_ERROR, "Error syncing new mail file for %s: %s", email, strerror(errno));
+		close(new_fd);
+		unlink(new_path);
+		return -1;
+	}
 	if (close(new_fd) != 0) {
-		logf(LOG_ERROR, "Error closing new mail file (fd=%d)", new_fd);
-		perror("close");
-		return;
+		logf(LOG_ERROR, "Error closing new mail file for %s: %s", email, strerror(errno));
+		unlink(new_path);
+		return -1;
+	}
+	if (sync_parent(new_path) != 0) {
+		return -1;
+	}
+	// el mensaje ya está entregado: si el índice falla se rehace al borrarlo
+	mailindex_append(email, temp_file_name, new_path);
+	return 0;
+}
+
+uint64_t
+maildir_hash(uint64_t h, const void* buf, size_t len)
+{
+	const uint8_t* p = buf;
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
 	}
+	return h;
+}
+
+void
+maildir_store_key(char* key, uint64_t hash, uint64_t size, bool compressed)
+{
+	snprintf(key, MAILDIR_STORE_KEY_SIZE, "%016llx-%llu%s", (unsigned long long)hash, (unsigned long long)size,
+	         compressed ? "z" : "");
+}
+
+/** @brief true if both files have the same bytes. */
+static bool
+same_content(const char* a, const char* b)
+{
+	const int fa = open(a, O_RDONLY | O_CLOEXEC);
+	const int fb = fa < 0 ? -1 : open(b, O_RDONLY | O_CLOEXEC);
+	struct stat sa, sb;
+	bool same = fb >= 0 && fstat(fa, &sa) == 0 && fstat(fb, &sb) == 0 && sa.st_size == sb.st_size;
+	if (same && !(sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino)) {
+		static _Thread_local uint8_t ba[16384], bb[16384];
+		ssize_t na;
+		while (same && (na = read(fa, ba, sizeof(ba))) > 0) {
+			same = read(fb, bb, na) == na && memcmp(ba, bb, na) == 0;
+		}
+		same = same && na == 0;
+	}
+	if (fa >= 0) {
+		close(fa);
+	}
+	if (fb >= 0) {
+		close(fb);
+	}
+	return same;
+}
+
+int
+maildir_store_add(const char* data_path, const char* key, char* store_path, size_t size)
+{
+	char dir[MAILDIR_PATH_SIZE];
+	snprintf(dir, sizeof(dir), "%s/%.2s", MAILDIR_STORE_DIR, key);
+	const int n = snprintf(store_path, size, "%s/%s", dir, key);
+	if (n < 0 || (size_t)n >= size || strlen(key) < 2 || strchr(key, '/') != NULL) {
+		return -1;
+	}
+	if (create_nonexistent_dir(MAILDIR_STORE_DIR) != 0 || create_nonexistent_dir(dir) != 0) {
+		return -1;
+	}
+	if (link(data_path, store_path) == 0) {
+		// el contenido ya se sincronizó al encolarlo; falta la entrada y la cuenta de enlaces
+		return sync_path(store_path) == 0 && sync_parent(store_path) == 0 ? 0 : -1;
+	}
+	if (errno != EEXIST) {
+		logf(LOG_ERROR, "Store: linking %s to %s: %s", data_path, store_path, strerror(errno));
+		return -1;
+	}
+	// ya estaba: es el mismo mensaje salvo que el hash choque, y eso se puede forzar
+	if (same_content(data_path, store_path)) {
+		return 0;
+	}
+	logf(LOG_INFO, "Store: %s has different content, delivering by copy", store_path);
+	return -1;
+}
+
+int
+maildir_link_to_new(const char* email, const char* name, const char* store_path)
+{
+	char shard_dir[MAILDIR_PATH_SIZE];
+	char new_path[MAILDIR_PATH_SIZE];
+	if (new_message_path(email, name, new_path, shard_dir) != 0) {
+		return -1;
+	}
+	int ret = link(store_path, new_path);
+	if (ret != 0 && errno == ENOENT && shard_dir[0] != '\0' && create_nonexistent_dir(shard_dir) == 0) {
+		ret = link(store_path, new_path);
+	}
+	if (ret != 0 && errno == EEXIST) {
+		// lo dejó un intento anterior, quizás una copia a medias
+		unlink(new_path);
+		ret = link(store_path, new_path);
+	}
+	if (ret != 0) {
+		logf(LOG_DEBUG, "Store: linking %s to %s: %s", store_path, new_path, strerror(errno));
+		return -1;
+	}
+	if (sync_parent(new_path) != 0) {
+		return -1;
+	}
+	mailindex_append(email, name, new_path);
+	return 0;
+}
+
+size_t
+maildir_store_gc(void)
+{
+	DIR* top = opendir(MAILDIR_STORE_DIR);
+	if (top == NULL) {
+		return 0;
+	}
+	size_t removed = 0;
+	char dir[MAILDIR_PATH_SIZE], path[MAILDIR_PATH_SIZE];
+	struct dirent* e;
+	while ((e = readdir(top)) != NULL) {
+		if (e->d_name[0] == '.' || strlen(e->d_name) != 2) {
+			continue;
+		}
+		snprintf(dir, sizeof(dir), "%s/%.2s", MAILDIR_STORE_DIR, e->d_name);
+		DIR* d = opendir(dir);
+		if (d == NULL) {
+			continue;
+		}
+		struct dirent* o;
+		while ((o = readdir(d)) != NULL) {
+			struct stat st;
+			const int n = snprintf(path, sizeof(path), "%s/%s", dir, o->d_name);
+			// un solo enlace: ningún maildir ni mensaje en el spool lo referencia
+			if (o->d_name[0] != '.' && n > 0 && (size_t)n < sizeof(path) && stat(path, &st) == 0 &&
+			    S_ISREG(st.st_mode) && st.st_nlink == 1 && unlink(path) == 0) {
+				removed++;
+			}
+		}
+		closedir(d);
+	}
+	closedir(top);
+	if (removed > 0) {
+		logf(LOG_INFO, "Store: removed %zu unreferenced messages", removed);
+	}
+	return removed;
 }
 
 char*
@@ -267,22 +823,17 @@ get_temp_file_fd(char* email, char* copy_addr)
 		return -1;
 	}
 
-	char file_path[MAIL_DIR_SIZE + 1 + DOMAIN_NAME_SIZE + 1 + LOCAL_USER_NAME_SIZE + 1 + MAILBOX_INNER_DIR_SIZE + 1 +
-	               MS_TEXT_SIZE] = { 0 };
-
-	time_t ms = time(NULL);
-
-	char* unique_str = malloc(11);
-	rand_str(unique_str, 10);
+	char file_path[MAILDIR_PATH_SIZE] = { 0 };
+	char unique_name[MAIL_FILE_NAME_LENGTH];
+	maildir_unique_name(unique_name, sizeof(unique_name));
 
 	if (copy_addr != NULL) {
-		snprintf(copy_addr, MS_TEXT_SIZE + 1, "%ld_%s", ms, unique_str);
+		snprintf(copy_addr, MAIL_FILE_NAME_LENGTH, "%s", unique_name);
 	}
-	// file_path like mail/<domain>/<user>/tmp/<timestamp>
-	snprintf(file_path, sizeof(file_path), "%s/tmp/%ld_%s", maildir, ms, unique_str);
+	// file_path like mail/<domain>/<user>/tmp/<unique name>
+	snprintf(file_path, sizeof(file_path), "%s/tmp/%s", maildir, unique_name);
 
-	free(unique_str);
-	int fd = open(file_path, O_CREAT | O_RDWR, S_IRWXU | S_IRWXG | S_IRWXO);
+	int fd = open(file_path, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
 	if (fd < 0) {
 		logf(LOG_ERROR, "Error creating temp file for %s", email);
 		perror("open");
@@ -0,0 +1,612 @@
+#include "mailindex.h"
+
+#include "compress.h"
+#include "logger.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ENVELOPE_FROM "MAIL FROM: <"
+#define ENVELOPE_DATA "DATA\r\n"
+#define SUBJECT       "Subject:"
+// <received> <size> <hash> <from> <name>\n
+#define LINE_SIZE (20 + 1 + 20 + 1 + 16 + 1 + MAILINDEX_FROM_SIZE + 1 + MAIL_FILE_NAME_LENGTH + 2)
+
+#define SHARDS      (1u << (4 * MAILDIR_SHARD_DIGITS))
+#define STAMP_SLOTS (2 * (1 + SHARDS))  // new/, cur/ y sus shards
+#define MAX_WORKERS 8
+
+// los appends son una línea por write, pero un rebuild no puede perderse los
+// que llegan mientras tanto: un lock por buzón (o por grupo de buzones)
+static pthread_mutex_t locks[MAILINDEX_LOCKS];
+static pthread_once_t locks_once = PTHREAD_ONCE_INIT;
+
+static const char* const folders[] = { "new", "cur" };
+#define N_FOLDERS (sizeof(folders) / sizeof(folders[0]))
+
+struct rebuild_job
+{
+	char user[LOCAL_USER_NAME_SIZE + 1];
+	mailindex_notify_fn notify;
+	void* ctx;
+	int fd;
+	struct rebuild_job* next;
+};
+
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_wakeup = PTHREAD_COND_INITIALIZER;
+static struct rebuild_job* jobs = NULL;
+static struct rebuild_job** jobs_tail = &jobs;
+static pthread_t workers[MAX_WORKERS];
+static unsigned workers_qty = 0;
+static bool stopping = false;
+
+static void
+init_locks(void)
+{
+	for (size_t i = 0; i < MAILINDEX_LOCKS; i++) {
+		pthread_mutex_init(&locks[i], NULL);
+	}
+}
+
+static pthread_mutex_t*
+lock_of(const char* user)
+{
+	pthread_once(&locks_once, init_locks);
+	return &locks[maildir_hash(MAILDIR_HASH_INIT, user, strlen(user)) % MAILINDEX_LOCKS];
+}
+
+/** @brief A local part we can put in a path: no '/' and not starting with '.'. */
+static bool
+valid_user(const char* user)
+{
+	const size_t len = strlen(user);
+	return len > 0 && len <= LOCAL_USER_NAME_SIZE && user[0] != '.' && strchr(user, '/') == NULL;
+}
+
+static int
+mailbox_path(const char* user, const char* file, const char* suffix, char* out)
+{
+	const int n = snprintf(out, MAILDIR_PATH_SIZE, "./Maildir/%s/%s%s", user, file, suffix);
+	return n >= 0 && n < MAILDIR_PATH_SIZE ? 0 : -1;
+}
+
+static int
+index_path(const char* user, const char* suffix, char* out)
+{
+	return mailbox_path(user, MAILINDEX_FILE, suffix, out);
+}
+
+/** @brief The folder of stamp slot `slot': new/ or cur/ for 0 and 1 + SHARDS, a shard of them otherwise. */
+static int
+slot_path(const char* user, size_t slot, char* out)
+{
+	const char* folder = folders[slot / (1 + SHARDS)];
+	const size_t shard = slot % (1 + SHARDS);
+	if (shard == 0) {
+		return mailbox_path(user, folder, "", out);
+	}
+	char name[8 + MAILDIR_SHARD_DIGITS];
+	snprintf(name, sizeof(name), "%s/%0*zx", folder, MAILDIR_SHARD_DIGITS, shard - 1);
+	return mailbox_path(user, name, "", out);
+}
+
+/** @brief The stamp slot of the folder that holds `path', a message in the maildir of `user'. @returns -1 if none. */
+static long
+slot_of(const char* user, const char* path)
+{
+	char prefix[MAILDIR_PATH_SIZE];
+	if (mailbox_path(user, "", "", prefix) != 0 || strncmp(path, prefix, strlen(prefix)) != 0) {
+		return -1;
+	}
+	const char* rel = path + strlen(prefix);
+	for (size_t f = 0; f < N_FOLDERS; f++) {
+		const size_t len = strlen(folders[f]);
+		if (strncmp(rel, folders[f], len) != 0 || rel[len] != '/') {
+			continue;
+		}
+		const char* shard = rel + len + 1;
+		const char* slash = strchr(shard, '/');
+		if (slash == NULL) {
+			return f * (1 + SHARDS);
+		}
+		char* end;
+		const unsigned long n = strtoul(shard, &end, 16);
+		if (slash - shard != MAILDIR_SHARD_DIGITS || end != slash || n >= SHARDS) {
+			return -1;
+		}
+		return f * (1 + SHARDS) + 1 + n;
+	}
+	return -1;
+}
+
+/** @brief Modification time of the folder in `slot', hashed; 0 if it does not exist. */
+static uint64_t
+slot_stamp(const char* user, size_t slot)
+{
+	char path[MAILDIR_PATH_SIZE];
+	struct stat st;
+	if (slot_path(user, slot, path) != 0 || stat(path, &st) != 0) {
+		return 0;
+	}
+	const int64_t mtime[] = { st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+	return maildir_hash(MAILDIR_HASH_INIT, mtime, sizeof(mtime)) | 1;
+}
+
+static void
+current_stamp(const char* user, uint64_t* stamp)
+{
+	for (size_t i = 0; i < STAMP_SLOTS; i++) {
+		stamp[i] = slot_stamp(user, i);
+	}
+}
+
+/** @returns 0 on success, -1 if the stamp is missing or short. */
+static int
+read_stamp(const char* user, uint64_t* stamp)
+{
+	char path[MAILDIR_PATH_SIZE];
+	if (mailbox_path(user, MAILINDEX_STAMP_FILE, "", path) != 0) {
+		return -1;
+	}
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	const size_t size = STAMP_SLOTS * sizeof(*stamp);
+	const ssize_t n = pread(fd, stamp, size, 0);
+	close(fd);
+	return n == (ssize_t)size ? 0 : -1;
+}
+
+static int
+write_stamp(const char* user, const uint64_t* stamp)
+{
+	char path[MAILDIR_PATH_SIZE], tmp[MAILDIR_PATH_SIZE];
+	if (mailbox_path(user, MAILINDEX_STAMP_FILE, "", path) != 0 ||
+	    mailbox_path(user, MAILINDEX_STAMP_FILE, ".tmp", tmp) != 0) {
+		return -1;
+	}
+	const int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return -1;
+	}
+	const size_t size = STAMP_SLOTS * sizeof(*stamp);
+	const bool ok = write(fd, stamp, size) == (ssize_t)size;
+	if (close(fd) != 0 || !ok || rename(tmp, path) != 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/** @brief Records the current time of the folder in `slot', after a delivery to it. */
+static void
+update_stamp(const char* user, size_t slot)
+{
+	char path[MAILDIR_PATH_SIZE];
+	if (mailbox_path(user, MAILINDEX_STAMP_FILE, "", path) != 0) {
+		return;
+	}
+	// sin stamp el índice ya está desactualizado: que siga así hasta el rebuild
+	const int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+	const uint64_t stamp = slot_stamp(user, slot);
+	// el primer mensaje de un shard crea su directorio, y eso cambia el del folder
+	const size_t folder = slot - slot % (1 + SHARDS);
+	const uint64_t folder_stamp = slot_stamp(user, folder);
+	bool ok = pwrite(fd, &stamp, sizeof(stamp), slot * sizeof(stamp)) == (ssize_t)sizeof(stamp);
+	if (ok && slot != folder) {
+		ok = pwrite(fd, &folder_stamp, sizeof(folder_stamp), folder * sizeof(stamp)) == (ssize_t)sizeof(stamp);
+	}
+	if (!ok) {
+		logf(LOG_ERROR, "Index: updating %s: %s", path, strerror(errno));
+	}
+	close(fd);
+}
+
+uint64_t
+mailindex_subject_hash(const char* subject, size_t len)
+{
+	while (len > 0 && (*subject == ' ' || *subject == '\t')) {
+		subject++;
+		len--;
+	}
+	while (len > 0 && isspace((unsigned char)subject[len - 1])) {
+		len--;
+	}
+	uint64_t h = MAILDIR_HASH_INIT;
+	for (size_t i = 0; i < len; i++) {
+		const uint8_t c = tolower((unsigned char)subject[i]);
+		h = maildir_hash(h, &c, 1);
+	}
+	return h;
+}
+
+/** @brief Reads the start of a message file, decompressing it if needed. @returns the bytes read. */
+static size_t
+read_head(int fd, char* buf, size_t size)
+{
+	if (compress_is_compressed(fd)) {
+		const ssize_t n = compress_read_head(fd, buf, size);
+		return n > 0 ? (size_t)n : 0;
+	}
+	size_t done = 0;
+	ssize_t n;
+	while (done < size && (n = pread(fd, buf + done, size - done, done)) > 0) {
+		done += n;
+	}
+	return done;
+}
+
+/** @brief Fills the sender and the subject hash from the envelope and headers of the message at `path'. */
+static void
+parse_head(const char* path, mailindex_entry* e)
+{
+	strcpy(e->from, "-");
+	e->subject_hash = mailindex_subject_hash("", 0);
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+	char buf[MAILINDEX_HEAD_SIZE + 1];
+	const size_t len = read_head(fd, buf, MAILINDEX_HEAD_SIZE);
+	close(fd);
+	buf[len] = '\0';
+
+	const char* headers = buf;
+	if (strncmp(buf, ENVELOPE_FROM, strlen(ENVELOPE_FROM)) == 0) {
+		const char* from = buf + strlen(ENVELOPE_FROM);
+		const size_t from_len = strcspn(from, "> \r\n");
+		if (from_len > 0 && from_len <= MAILINDEX_FROM_SIZE && from[from_len] == '>') {
+			memcpy(e->from, from, from_len);
+			e->from[from_len] = '\0';
+		}
+		// el sobre termina en la línea DATA y después vienen los headers del mensaje
+		const char* data = strstr(buf, "\r\n" ENVELOPE_DATA);
+		headers = data != NULL ? data + 2 + strlen(ENVELOPE_DATA) : buf + len;
+	}
+	for (const char* line = headers; *line != '\0' && *line != '\r' && *line != '\n';) {
+		const char* end = strchr(line, '\n');
+		if (end == NULL) {
+			break;  // cortado por MAILINDEX_HEAD_SIZE
+		}
+		if (strncasecmp(line, SUBJECT, strlen(SUBJECT)) == 0) {
+			const char* value = line + strlen(SUBJECT);
+			e->subject_hash = mailindex_subject_hash(value, end - value);
+			break;
+		}
+		line = end + 1;
+	}
+}
+
+static void
+fill_entry(mailindex_entry* e, const char* path, const char* name, time_t received)
+{
+	struct stat st;
+	e->received = received;
+	e->size = stat(path, &st) == 0 ? (uint64_t)st.st_size : 0;
+	snprintf(e->name, sizeof(e->name), "%s", name);
+	parse_head(path, e);
+}
+
+static int
+format_line(const mailindex_entry* e, char* line)
+{
+	return snprintf(line, LINE_SIZE, "%lld %llu %016llx %s %s\n", (long long)e->received,
+	                (unsigned long long)e->size, (unsigned long long)e->subject_hash, e->from, e->name);
+}
+
+/** @returns false for lines a writer left half written or that are not ours. */
+static bool
+parse_line(char* line, mailindex_entry* e)
+{
+	char* save = NULL;
+	const char* received = strtok_r(line, " ", &save);
+	const char* size = strtok_r(NULL, " ", &save);
+	const char* hash = strtok_r(NULL, " ", &save);
+	const char* from = strtok_r(NULL, " ", &save);
+	const char* name = strtok_r(NULL, " \n", &save);
+	if (name == NULL || strlen(from) > MAILINDEX_FROM_SIZE || strlen(name) > MAIL_FILE_NAME_LENGTH) {
+		return false;
+	}
+	e->received = strtoll(received, NULL, 10);
+	e->size = strtoull(size, NULL, 10);
+	e->subject_hash = strtoull(hash, NULL, 16);
+	strcpy(e->from, from);
+	strcpy(e->name, name);
+	return true;
+}
+
+struct rebuild
+{
+	FILE* out;
+	long qty;
+	bool failed;
+};
+
+static void
+index_message(const char* path, const char* name, void* arg)
+{
+	struct rebuild* r = arg;
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		return;
+	}
+	mailindex_entry e;
+	fill_entry(&e, path, name, st.st_mtime);
+	char line[LINE_SIZE];
+	const int n = format_line(&e, line);
+	if (n < 0 || n >= LINE_SIZE || fwrite(line, 1, n, r->out) != (size_t)n) {
+		r->failed = true;
+		return;
+	}
+	r->qty++;
+}
+
+/** @brief With the lock of `user' held. */
+static long
+rebuild_locked(const char* user)
+{
+	char path[MAILDIR_PATH_SIZE], tmp[MAILDIR_PATH_SIZE];
+	if (index_path(user, "", path) != 0 || index_path(user, ".tmp", tmp) != 0) {
+		return -1;
+	}
+	// antes de recorrer: lo que cambie durante el recorrido deja el índice desactualizado
+	uint64_t* stamp = malloc(STAMP_SLOTS * sizeof(*stamp));
+	if (stamp == NULL) {
+		return -1;
+	}
+	current_stamp(user, stamp);
+	struct rebuild r = { fopen(tmp, "w"), 0, false };
+	if (r.out == NULL) {
+		free(stamp);
+		return -1;
+	}
+	const long in_new = maildir_foreach(user, "new", index_message, &r);
+	const long in_cur = maildir_foreach(user, "cur", index_message, &r);
+	const bool ok = fclose(r.out) == 0 && !r.failed && in_new >= 0 && in_cur >= 0;
+	if (!ok || rename(tmp, path) != 0) {
+		logf(LOG_ERROR, "Index: rebuilding %s: %s", path, strerror(errno));
+		unlink(tmp);
+		free(stamp);
+		return -1;
+	}
+	if (write_stamp(user, stamp) != 0) {
+		// el índice sirve, pero se va a rehacer la próxima vez que se consulte
+		logf(LOG_ERROR, "Index: writing the stamp of %s: %s", path, strerror(errno));
+	}
+	free(stamp);
+	logf(LOG_INFO, "Index: rebuilt %s with %ld messages", path, r.qty);
+	return r.qty;
+}
+
+long
+mailindex_rebuild(const char* user)
+{
+	if (!valid_user(user)) {
+		return -1;
+	}
+	pthread_mutex_t* lock = lock_of(user);
+	pthread_mutex_lock(lock);
+	const long ret = rebuild_locked(user);
+	pthread_mutex_unlock(lock);
+	return ret;
+}
+
+static bool
+mailbox_exists(const char* user)
+{
+	char dir[MAILDIR_PATH_SIZE];
+	struct stat st;
+	return mailbox_path(user, "", "", dir) == 0 && stat(dir, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/** @returns like mailindex_check, for a valid `user'. */
+static int
+check(const char* user)
+{
+	if (!mailbox_exists(user)) {
+		return -1;
+	}
+	char path[MAILDIR_PATH_SIZE];
+	uint64_t* stamp = malloc(2 * STAMP_SLOTS * sizeof(*stamp));
+	if (stamp == NULL || index_path(user, "", path) != 0 || access(path, F_OK) != 0 ||
+	    read_stamp(user, stamp) != 0) {
+		free(stamp);
+		return 1;
+	}
+	uint64_t* now = stamp + STAMP_SLOTS;
+	current_stamp(user, now);
+	const int ret = memcmp(stamp, now, STAMP_SLOTS * sizeof(*stamp)) == 0 ? 0 : 1;
+	free(stamp);
+	return ret;
+}
+
+int
+mailindex_check(const char* user)
+{
+	return valid_user(user) ? check(user) : -1;
+}
+
+int
+mailindex_append(const char* email, const char* name, const char* path)
+{
+	char user[LOCAL_USER_NAME_SIZE + 1];
+	const size_t len = strcspn(email, "@");
+	if (len > LOCAL_USER_NAME_SIZE) {
+		return -1;
+	}
+	memcpy(user, email, len);
+	user[len] = '\0';
+	char index[MAILDIR_PATH_SIZE];
+	if (!valid_user(user) || index_path(user, "", index) != 0) {
+		return -1;
+	}
+	mailindex_entry e;
+	fill_entry(&e, path, name, time(NULL));
+	char line[LINE_SIZE];
+	const int n = format_line(&e, line);
+	if (n < 0 || n >= LINE_SIZE) {
+		return -1;
+	}
+
+	int ret = 0;
+	pthread_mutex_t* lock = lock_of(user);
+	pthread_mutex_lock(lock);
+	const int fd = open(index, O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (fd >= 0) {
+		ret = write(fd, line, n) == n ? 0 : -1;
+		close(fd);
+		const long slot = slot_of(user, path);
+		if (ret == 0 && slot >= 0) {
+			update_stamp(user, slot);
+		}
+	} else if (errno == ENOENT) {
+		// sin índice check() lo da por desactualizado y el próximo XLIST lo arma
+		// en un hilo del índice, no en el del spool
+		ret = 0;
+	} else {
+		ret = -1;
+	}
+	pthread_mutex_unlock(lock);
+	if (ret != 0) {
+		logf(LOG_ERROR, "Index: adding %s to %s: %s", name, index, strerror(errno));
+	}
+	return ret;
+}
+
+long
+mailindex_foreach(const char* user, mailindex_visit_fn fn, void* arg)
+{
+	char path[MAILDIR_PATH_SIZE];
+	if (!valid_user(user) || index_path(user, "", path) != 0) {
+		return -1;
+	}
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		return errno == ENOENT && mailbox_exists(user) ? 0 : -1;
+	}
+	char* line = NULL;
+	size_t cap = 0;
+	ssize_t n;
+	long qty = 0;
+	mailindex_entry e;
+	while ((n = getline(&line, &cap, f)) > 0) {
+		if (line[n - 1] == '\n' && parse_line(line, &e)) {
+			fn(&e, arg);
+			qty++;
+		}
+	}
+	free(line);
+	fclose(f);
+	return qty;
+}
+
+static void*
+worker_main(void* arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&jobs_mutex);
+	for (;;) {
+		while (jobs == NULL && !stopping) {
+			pthread_cond_wait(&jobs_wakeup, &jobs_mutex);
+		}
+		if (stopping) {
+			break;
+		}
+		struct rebuild_job* job = jobs;
+		jobs = job->next;
+		if (jobs == NULL) {
+			jobs_tail = &jobs;
+		}
+		pthread_mutex_unlock(&jobs_mutex);
+
+		// otro pedido del mismo buzón pudo haberlo rehecho mientras esperaba
+		pthread_mutex_t* lock = lock_of(job->user);
+		pthread_mutex_lock(lock);
+		if (check(job->user) == 1) {
+			rebuild_locked(job->user);
+		}
+		pthread_mutex_unlock(lock);
+		job->notify(job->ctx, job->fd);
+		free(job);
+
+		pthread_mutex_lock(&jobs_mutex);
+	}
+	pthread_mutex_unlock(&jobs_mutex);
+	return NULL;
+}
+
+int
+mailindex_init(unsigned qty)
+{
+	stopping = false;
+	if (qty > MAX_WORKERS) {
+		qty = MAX_WORKERS;
+	}
+	for (workers_qty = 0; workers_qty < qty; workers_qty++) {
+		if (pthread_create(&workers[workers_qty], NULL, worker_main, NULL) != 0) {
+			logf(LOG_ERROR, "Index: pthread_create: %s", strerror(errno));
+			break;
+		}
+	}
+	return workers_qty > 0 ? 0 : -1;
+}
+
+int
+mailindex_rebuild_async(const char* user, mailindex_notify_fn notify, void* ctx, int fd)
+{
+	if (!valid_user(user)) {
+		return -1;
+	}
+	struct rebuild_job* job = malloc(sizeof(*job));
+	if (job == NULL) {
+		return -1;
+	}
+	strcpy(job->user, user);
+	job->notify = notify;
+	job->ctx = ctx;
+	job->fd = fd;
+	job->next = NULL;
+
+	pthread_mutex_lock(&jobs_mutex);
+	if (workers_qty == 0 || stopping) {
+		pthread_mutex_unlock(&jobs_mutex);
+		free(job);
+		return -1;
+	}
+	*jobs_tail = job;
+	jobs_tail = &job->next;
+	pthread_cond_signal(&jobs_wakeup);
+	pthread_mutex_unlock(&jobs_mutex);
+	return 0;
+}
+
+void
+mailindex_finalize(void)
+{
+	pthread_mutex_lock(&jobs_mutex);
+	stopping = true;
+	pthread_cond_broadcast(&jobs_wakeup);
+	pthread_mutex_unlock(&jobs_mutex);
+	for (unsigned i = 0; i < workers_qty; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	workers_qty = 0;
+	while (jobs != NULL) {
+		struct rebuild_job* next = jobs->next;
+		free(jobs);
+		jobs = next;
+	}
+	jobs_tail = &jobs;
+}
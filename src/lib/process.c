@@ -3,9 +3,17 @@
 
 #include "access_registry.h"
 #include "maildir.h"
+#include "mailindex.h"
+#include "quota.h"
+#include "recipients.h"
+#include "relay.h"
 #include "smtp.h"
 #include "states.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 
 #define NUM_COMMANDS (sizeof(valid_commands) / sizeof(valid_commands[0]))
@@ -21,17 +29,23 @@ static void bad_syntax(char* buf, char* syntax);
 static void bad_pwd(char* buf);
 static void ok(char* buf, char* code);
 static void welcome(char* buf);
+static void ehlo_welcome(char* buf);
+static bool parse_mail_params(smtp_data* data, char* params, char* msg);
 static void ok_data(char* buf);
-static void ok_body(char* buf);
+static void ok_body(char* buf, const smtp_data* data);
 static bool is_valid(char* verb, char* state_verb, char* msg);
 static void bad_user(char* buf);
 static void mail_from_unknown(char* buf, char* mail);
 static void rcpt_to_unkown(char* buf, char* mail);
+static void rcpt_to_no_mailbox(char* buf, char* mail);
+static void rcpt_to_relay_denied(char* buf, char* mail);
+static void rcpt_to_over_quota(char* buf, char* mail, quota_result result);
 // static void clean_request(struct selector_key* key);
 static void auth_msg(char* buf);
 
-static const char* valid_commands[] = { HELO_VERB,  EHLO_VERB,  MAIL_VERB, RCPT_VERB, DATA_VERB,
-	                                    XFROM_VERB, XAUTH_VERB, XGET_VERB, XQUIT_VERB, XTRAN_VERB };
+static const char* valid_commands[] = { HELO_VERB,  EHLO_VERB,  MAIL_VERB, RCPT_VERB,  DATA_VERB, BDAT_VERB,
+	                                    XFROM_VERB, XAUTH_VERB, XGET_VERB, XQUIT_VERB, XTRAN_VERB,
+	                                    XLIST_VERB, XFIND_VERB };
 
 bool
 handle_reset(struct selector_key* key, char* msg)
@@ -47,6 +61,13 @@ handle_reset(struct selector_key* key, char* msg)
 		return true;
 	}
 	// msg = state_table[FROM].success_msg;
+	// un RSET entre dos BDAT descarta lo recibido hasta ahora
+	smtp_discard_body(key);
+	data->rcpt_qty = 0;
+	data->binarymime = false;
+	data->declared_size = 0;
+	data->body_size = 0;
+	data->too_big = false;
 	ok(msg, OK_RSET);
 	data->state = FROM;
 	return true;
@@ -114,7 +135,11 @@ handle_helo(struct selector_key* key, char* msg)
 	}
 	// msg = state_table[FROM].success_msg;
 
-	welcome(msg);
+	if (strcasecmp(verb, EHLO_VERB) == 0) {
+		ehlo_welcome(msg);
+	} else {
+		welcome(msg);
+	}
 
 	return FROM;
 }
@@ -144,6 +169,12 @@ handle_from(struct selector_key* key, char* msg)
 	arg += strlen(FROM_PREFIX);
 	char mail[MAIL_SIZE];
 
+	// parámetros ESMTP (RFC 5321 4.1.2): MAIL FROM:<address> [param ...]
+	char* params = strchr(arg, ' ');
+	if (params != NULL) {
+		*params++ = '\0';
+	}
+
 	// check mail and extract
 	bool valid = extract_email(arg, mail, MAIL_SIZE);
 	if (!valid) {
@@ -156,7 +187,8 @@ handle_from(struct selector_key* key, char* msg)
 	if (domain != NULL) {
 		domain++;
 
-		if (strcmp(domain, LOCAL_DOMAIN) != 0) {
+		// los dominios remotos sólo se aceptan si hay a dónde reenviarlos
+		if (strcmp(domain, LOCAL_DOMAIN) != 0 && !relay_has_route(domain)) {
 			// send error message to the client
 			mail_from_unknown(msg, mail);
 			// we return to previous state
@@ -164,6 +196,12 @@ handle_from(struct selector_key* key, char* msg)
 		}
 	}
 
+	if (!parse_mail_params(data, params, msg)) {
+		return FROM;
+	}
+	data->body_size = 0;
+	data->too_big = false;
+
 	strcpy((char*)data->mail_from, mail);
 	ok(msg, OK_MAIL);
 
@@ -197,15 +235,32 @@ handle_to(struct selector_key* key, char* msg)
 
 	// if the data->mail_from's domain is not LOCAL_DOMAIN, we need to show an error message to the client
 	char* domain = strchr(mail, '@');
-	if (domain != NULL) {
-		domain++;
-
-		if (strcmp(domain, LOCAL_DOMAIN) != 0) {
+	const bool local = domain == NULL || strcmp(domain + 1, LOCAL_DOMAIN) == 0;
+	if (!local) {
+		// los dominios remotos sólo se aceptan de clientes de confianza y si hay a dónde reenviarlos
+		if (!relay_allowed(&data->client_addr)) {
+			rcpt_to_relay_denied(msg, mail);
+			return TO;
+		}
+		if (!relay_has_route(domain + 1)) {
 			// send error message to the client
 			rcpt_to_unkown(msg, mail);
 			// we return to previous state
 			return TO;
 		}
+	} else {
+		const size_t len = domain != NULL ? (size_t)(domain - mail) : strlen(mail);
+		if (!recipients_exists(mail, len)) {
+			// sin buzón: lo rechazamos antes de que mande el cuerpo
+			rcpt_to_no_mailbox(msg, mail);
+			return TO;
+		}
+		// con el SIZE declarado en MAIL FROM, si lo hubo
+		const quota_result quota = quota_check(mail, len, data->declared_size);
+		if (quota != QUOTA_OK) {
+			rcpt_to_over_quota(msg, mail, quota);
+			return TO;
+		}
 	}
 
 	strcpy((char*)data->rcpt_to[data->rcpt_qty++], mail);
@@ -224,7 +279,7 @@ handle_body(struct selector_key* key, char* msg)
 	// sprintf(msg, "501 5.1.3 Bad recipient address syntax");  // TODO NO est abien
 	char* body = (char*)data->data;
 
-	ok_body(msg);
+	ok_body(msg, data);
 	strcpy((char*)body, data->request.data);
 
 	data->state = EHLO;
@@ -238,10 +293,14 @@ handle_data(struct selector_key* key, char* msg)
 	char* verb = data->request.verb;
 
 	if (strcasecmp(verb, RCPT_VERB) == 0) {
-		smtp_state ret = handle_to(key, msg);  // lidio con la no determinacion
-		if (ret == DATA) {
-			return DATA;
-		}
+		// lidio con la no determinacion: un destinatario rechazado deja la
+		// respuesta de handle_to y seguimos con los que ya teníamos
+		handle_to(key, msg);
+		return DATA;
+	}
+
+	if (strcasecmp(verb, BDAT_VERB) == 0) {
+		return handle_bdat(key, msg);
 	}
 
 	if (strcasecmp(verb, DATA_VERB) != 0) {
@@ -249,6 +308,11 @@ handle_data(struct selector_key* key, char* msg)
 		// msg = state_table->success_msg;
 		return DATA;
 	}
+	if (data->binarymime) {
+		// RFC 3030 3: un cuerpo binario no se puede mandar con DATA
+		sprintf(msg, "503 5.5.1 Error: BDAT required for BODY=BINARYMIME\n");
+		return DATA;
+	}
 	ok_data(msg);
 
 	// acá vamos a querer crear un socke
@@ -256,6 +320,68 @@ handle_data(struct selector_key* key, char* msg)
 	return BODY;
 }
 
+smtp_state
+handle_bdat(struct selector_key* key, char* msg)
+{
+	smtp_data* data = ATTACHMENT(key);
+	char* verb = data->request.verb;
+
+	if (!is_valid(verb, BDAT_VERB, msg)) {
+		return data->state;
+	}
+
+	// BDAT <chunk-size> [LAST]
+	char* arg = data->request.arg;
+	char* end = NULL;
+	errno = 0;
+	unsigned long size = strtoul(arg, &end, 10);
+	if (end == arg || *arg == '-' || errno == ERANGE || size > UINT_MAX) {
+		bad_syntax(msg, "BDAT <size> [LAST]");
+		return data->state;
+	}
+	bool last = false;
+	if (*end == ' ') {
+		while (*end == ' ') {
+			end++;
+		}
+		if (strcasecmp(end, BDAT_LAST) == 0) {
+			last = true;
+			end += strlen(BDAT_LAST);
+		}
+	}
+	if (*end != '\0') {
+		bad_syntax(msg, "BDAT <size> [LAST]");
+		return data->state;
+	}
+
+	// un bloque puede anunciar hasta UINT_MAX: el límite es sobre el total.
+	// Igual hay que leerlo entero, pero no se escribe (ver mail_body_write)
+	if (data->body_size + size > SMTP_MAX_MESSAGE_SIZE) {
+		data->too_big = true;
+	}
+	// sin respuesta hasta recibir el bloque entero (ver handle_chunk)
+	data->chunk_last = last;
+	request_parser_chunk_init(&data->request_parser, size);
+	msg[0] = '\0';
+
+	return CHUNK;
+}
+
+smtp_state
+handle_chunk(struct selector_key* key, char* msg)
+{
+	// ya tengo el bloque entero en el archivo
+	smtp_data* data = ATTACHMENT(key);
+
+	// uno demasiado grande termina la transacción aunque no sea el último (RFC 3030 2)
+	if (data->chunk_last || data->too_big) {
+		ok_body(msg, data);
+		return EHLO;
+	}
+	sprintf(msg, "250 2.0.0 %u octets received\n", data->request_parser.n);
+	return BDAT;
+}
+
 smtp_state
 handle_xauth(struct selector_key* key, char* msg)
 {
@@ -296,6 +422,9 @@ handle_xfrom(struct selector_key* key, char* msg)
 	if (strcasecmp(verb, XTRAN_VERB) == 0) {
 		return handle_xtran(key, msg);
 	}
+	if (strcasecmp(verb, XLIST_VERB) == 0 || strcasecmp(verb, XFIND_VERB) == 0) {
+		return handle_xlist(key, msg);
+	}
 
 	if (!is_valid(verb, XFROM_VERB, msg)) {
 		return XFROM;
@@ -332,11 +461,22 @@ handle_xtran(struct selector_key* key, char* msg)
 		ok(msg, "XTRAN OFF");
 		set_status(false);
 	}
-	if(strcasecmp(arg, "ON") == 0){
+	else if(strcasecmp(arg, "ON") == 0){
 		ok(msg, "XTRAN ON");
 		set_status(true);
 		
 	}
+	else if (*arg == '\0' || strchr(arg, '/') != NULL || strstr(arg, "..") != NULL) {
+		// sólo el nombre de un plugin ya cargado, nunca una ruta
+		bad_syntax(msg, "XTRAN ON | OFF | <plugin>");
+	}
+	else if (set_plugin(arg) == 0) {
+		// los mensajes en curso terminan con el plugin que tenían
+		ok(msg, "XTRAN PLUGIN");
+	}
+	else {
+		sprintf(msg, "550 5.3.0 No plugin %.200s loaded\n", arg);
+	}
 
 	return XFROM;
 }
@@ -356,7 +496,8 @@ handle_xget(struct selector_key* key, char* msg)
 	smtp_data* data = ATTACHMENT(key);
 	char* verb = data->request.verb;
 
-	if (strcasecmp(verb, XFROM_VERB) == 0) {
+	if (strcasecmp(verb, XFROM_VERB) == 0 || strcasecmp(verb, XLIST_VERB) == 0 ||
+	    strcasecmp(verb, XFIND_VERB) == 0) {
 		return handle_xfrom(key, msg);  // lidio con la no determinacion
 	}
 
@@ -387,6 +528,102 @@ handle_xget(struct selector_key* key, char* msg)
 	return XGET;
 }
 
+struct listing
+{
+	buffer_chain* out;
+	size_t first;
+	bool by_subject;
+	uint64_t subject_hash;
+	size_t seen;
+	size_t shown;
+	bool truncated;
+	size_t next;
+};
+
+static void
+list_entry(const mailindex_entry* e, void* arg)
+{
+	struct listing* l = arg;
+	const size_t n = l->seen++;
+	if (l->truncated || n < l->first || (l->by_subject && e->subject_hash != l->subject_hash)) {
+		return;
+	}
+	char line[RESPONSE_SIZE];
+	const int len = snprintf(line, sizeof(line), "%zu %lld %llu %s %s\n", n, (long long)e->received,
+	                         (unsigned long long)e->size, e->from, e->name);
+	// dejamos lugar para la respuesta final
+	if (buffer_chain_len(l->out) + len + RESPONSE_SIZE > SMTP_WRITE_LIMIT) {
+		l->truncated = true;
+		l->next = n;
+		return;
+	}
+	buffer_chain_write(l->out, line, len);
+	l->shown++;
+}
+
+/** lo llama un hilo del índice: el selector lo despacha en el block_handler de la sesión */
+static void
+index_rebuilt(void* s, int fd)
+{
+	selector_notify_block(s, fd);
+}
+
+smtp_state
+handle_xlist(struct selector_key* key, char* msg)
+{
+	/*
+	    XLIST <buzón> [<desde>]: los mensajes del índice del buzón
+	    XFIND <buzón> <asunto>: los que tienen ese Subject
+
+	    Una línea por mensaje, "<n> <recibido> <tamaño> <remitente> <archivo>",
+	    y al final cuántos hay. Si no entran todos, la última línea dice desde
+	    dónde seguir.
+	*/
+	smtp_data* data = ATTACHMENT(key);
+	const bool find = strcasecmp(data->request.verb, XFIND_VERB) == 0;
+	char* arg = data->request.arg;
+	char* rest = strchr(arg, ' ');
+	if (rest != NULL) {
+		*rest++ = '\0';
+	}
+	if (*arg == '\0' || (find && (rest == NULL || *rest == '\0'))) {
+		bad_syntax(msg, find ? "XFIND <mailbox> <subject>" : "XLIST <mailbox> [<first>]");
+		return data->state;
+	}
+
+	struct listing l = { .out = &data->write_chain };
+	if (find) {
+		l.by_subject = true;
+		l.subject_hash = mailindex_subject_hash(rest, strlen(rest));
+	} else if (rest != NULL) {
+		char* end;
+		l.first = strtoul(rest, &end, 10);
+		if (*end != '\0') {
+			bad_syntax(msg, "XLIST <mailbox> [<first>]");
+			return data->state;
+		}
+	}
+	// rehacer el índice recorre todo el maildir: no en el hilo del selector
+	if (!data->index_rebuilt && mailindex_check(arg) > 0 &&
+	    mailindex_rebuild_async(arg, index_rebuilt, key->s, data->fd) == 0) {
+		if (rest != NULL) {
+			rest[-1] = ' ';  // el comando se vuelve a procesar cuando termine
+		}
+		data->index_wait = true;
+		return data->state;
+	}
+	data->index_rebuilt = false;
+	const long total = mailindex_foreach(arg, list_entry, &l);
+	if (total < 0) {
+		sprintf(msg, "550 5.1.1 <%.64s>: No such mailbox\n", arg);
+	} else if (l.truncated) {
+		sprintf(msg, "250 2.0.0 %zu of %ld messages, more from %zu\n", l.shown, total, l.next);
+	} else {
+		sprintf(msg, "250 2.0.0 %zu of %ld messages\n", l.shown, total);
+	}
+	return data->state;
+}
+
 static void
 auth_msg(char* buf)
 {
@@ -443,6 +680,28 @@ rcpt_to_unkown(char* buf, char* mail)
 	sprintf(buf, "553 5.1.8 <%s>: Sender address rejected: Domain not allowed\n", mail);
 }
 
+static void
+rcpt_to_no_mailbox(char* buf, char* mail)
+{
+	sprintf(buf, "550 5.1.1 <%s>: Recipient address rejected: User unknown in local recipient table\n", mail);
+}
+
+static void
+rcpt_to_relay_denied(char* buf, char* mail)
+{
+	sprintf(buf, "550 5.7.1 <%s>: Relay access denied\n", mail);
+}
+
+static void
+rcpt_to_over_quota(char* buf, char* mail, quota_result result)
+{
+	if (result == QUOTA_TOO_BIG) {
+		sprintf(buf, "552 5.2.2 <%s>: Message exceeds the mailbox quota\n", mail);
+	} else {
+		sprintf(buf, "452 4.2.2 <%s>: Mailbox full\n", mail);
+	}
+}
+
 static void
 ok(char* buf, char* code)
 {
@@ -458,16 +717,86 @@ welcome(char* buf)
 	                             // CHUNKING\n
 }
 
+static void
+ehlo_welcome(char* buf)
+{
+	sprintf(buf,
+	        "250-EHLO recieved\n250-SIZE %d\n250-8BITMIME\n250-CHUNKING\n250 BINARYMIME\n",
+	        SMTP_MAX_MESSAGE_SIZE);
+}
+
+/**
+ * valida los parámetros de MAIL FROM. Entendemos BODY= (RFC 6152 y RFC 3030)
+ * y SIZE= (RFC 1870); cualquier otro se rechaza con 555.
+ */
+static bool
+parse_mail_params(smtp_data* data, char* params, char* msg)
+{
+	bool binarymime = false;
+	size_t declared_size = 0;
+	char* save = NULL;
+
+	for (char* p = params == NULL ? NULL : strtok_r(params, " ", &save); p != NULL; p = strtok_r(NULL, " ", &save)) {
+		if (strncasecmp(p, BODY_PARAM, strlen(BODY_PARAM)) == 0) {
+			const char* body = p + strlen(BODY_PARAM);
+			if (strcasecmp(body, "BINARYMIME") == 0) {
+				binarymime = true;
+			} else if (strcasecmp(body, "7BIT") != 0 && strcasecmp(body, "8BITMIME") != 0) {
+				bad_syntax(msg, "BODY=7BIT|8BITMIME|BINARYMIME");
+				return false;
+			}
+		} else if (strncasecmp(p, SIZE_PARAM, strlen(SIZE_PARAM)) == 0) {
+			const char* size = p + strlen(SIZE_PARAM);
+			char* end = NULL;
+			errno = 0;
+			unsigned long long n = strtoull(size, &end, 10);
+			if (end == size || *end != '\0' || *size < '0' || *size > '9') {
+				bad_syntax(msg, "SIZE=<bytes>");
+				return false;
+			}
+			if (errno == ERANGE || n > SMTP_MAX_MESSAGE_SIZE) {
+				// no tiene sentido recibir el cuerpo para descartarlo después
+				sprintf(msg, "552 5.3.4 Message size exceeds fixed maximum message size\n");
+				return false;
+			}
+			declared_size = n;
+		} else {
+			sprintf(msg, "555 5.5.4 Unsupported option: %.64s\n", p);
+			return false;
+		}
+	}
+
+	data->binarymime = binarymime;
+	data->declared_size = declared_size;
+	return true;
+}
+
 static void
 ok_data(char* buf)
 {
 	sprintf(buf, "354 End data with <CR><LF>.<CR><LF> \n");
 }
 
+/**
+ * `queue_id' vacío: no se pudo encolar y el mensaje se descartó, por un error,
+ * porque pasó SMTP_MAX_MESSAGE_SIZE (`too_big') o porque no entraba en el
+ * buzón de ningún destinatario (`quota_refused')
+ */
 static void
-ok_body(char* buf)
+ok_body(char* buf, const smtp_data* data)
 {
-	sprintf(buf, "250 2.0.0 Ok: (queued as ?) EMAIL SENT \n");
+	const quota_result quota = data->quota_refused;
+	if (data->too_big) {
+		sprintf(buf, "552 5.3.4 Message size exceeds fixed maximum message size\n");
+	} else if (quota == QUOTA_TOO_BIG) {
+		sprintf(buf, "552 5.2.2 Message exceeds the mailbox quota of every recipient\n");
+	} else if (quota == QUOTA_FULL) {
+		sprintf(buf, "452 4.2.2 Mailbox full\n");
+	} else if (data->queue_id[0] == '\0') {
+		sprintf(buf, "451 4.3.0 Error: queue file write error \n");
+	} else {
+		sprintf(buf, "250 2.0.0 Ok: queued as %s \n", data->queue_id);
+	}
 }
 
 static bool
@@ -0,0 +1,568 @@
+#include "quota.h"
+
+#include "logger.h"
+#include "maildir.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum scan_state
+{
+	SCAN_PENDING,
+	SCAN_RUNNING,
+	SCAN_DONE,
+};
+
+typedef struct entry
+{
+	struct entry* next;
+	uint64_t hash;
+	uint64_t bytes;
+	uint64_t messages;
+	/** limits from the quota file; 0 means no limit */
+	bool limited;
+	uint64_t max_bytes;
+	uint64_t max_messages;
+	/** deliveries charged while the rebuild had not finished with this mailbox */
+	enum scan_state scan;
+	uint64_t delta_bytes;
+	uint64_t delta_messages;
+	size_t len;
+	char name[];
+} entry;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static entry** buckets = NULL;
+static size_t buckets_qty = 0;
+static size_t entries_qty = 0;
+static bool initialized = false;
+static bool started = false;  // quota_start: mientras no, la tabla del archivo es de otro proceso
+static bool dirty = false;
+static char* usage_path = NULL;
+
+static bool default_limited = false;
+static uint64_t default_max_bytes = 0;
+static uint64_t default_max_messages = 0;
+
+static fd_selector selector = NULL;
+static struct wheel_timer save_timer;
+
+static pthread_t scan_threads[QUOTA_SCAN_THREADS];
+static unsigned scan_threads_qty = 0;
+static unsigned scan_left = 0;
+static char** scan_users = NULL;
+static size_t scan_users_qty = 0;
+static size_t scan_next = 0;
+static bool scanning = false;
+static bool scan_stop = false;
+
+static uint64_t
+hash_name(const char* s, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t)s[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/** @brief Doubles the table so chains stay short. With the mutex held. */
+static void
+grow(void)
+{
+	const size_t qty = buckets_qty == 0 ? 64 : buckets_qty * 2;
+	entry** grown = calloc(qty, sizeof(*grown));
+	if (grown == NULL) {
+		return;  // longer chains, still correct
+	}
+	for (size_t i = 0; i < buckets_qty; i++) {
+		entry* e = buckets[i];
+		while (e != NULL) {
+			entry* next = e->next;
+			e->next = grown[e->hash & (qty - 1)];
+			grown[e->hash & (qty - 1)] = e;
+			e = next;
+		}
+	}
+	free(buckets);
+	buckets = grown;
+	buckets_qty = qty;
+}
+
+/** @returns the entry for `name', creating it if `create'; NULL if absent or out of memory. With the mutex held. */
+static entry*
+find(const char* name, size_t len, bool create)
+{
+	const uint64_t h = hash_name(name, len);
+	if (buckets_qty > 0) {
+		for (entry* e = buckets[h & (buckets_qty - 1)]; e != NULL; e = e->next) {
+			if (e->hash == h && e->len == len && memcmp(e->name, name, len) == 0) {
+				return e;
+			}
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+	if (entries_qty >= buckets_qty) {
+		grow();
+		if (buckets_qty == 0) {
+			return NULL;
+		}
+	}
+	entry* e = calloc(1, sizeof(*e) + len + 1);
+	if (e == NULL) {
+		return NULL;
+	}
+	e->hash = h;
+	e->len = len;
+	memcpy(e->name, name, len);
+	e->scan = scanning ? SCAN_PENDING : SCAN_DONE;
+	e->next = buckets[h & (buckets_qty - 1)];
+	buckets[h & (buckets_qty - 1)] = e;
+	entries_qty++;
+	return e;
+}
+
+static void
+free_table(void)
+{
+	for (size_t i = 0; i < buckets_qty; i++) {
+		entry* e = buckets[i];
+		while (e != NULL) {
+			entry* next = e->next;
+			free(e);
+			e = next;
+		}
+	}
+	free(buckets);
+	buckets = NULL;
+	buckets_qty = 0;
+	entries_qty = 0;
+}
+
+/** @brief Parses `<n>[K|M|G]'. @returns false if it is not a size. */
+static bool
+parse_size(const char* s, uint64_t* out)
+{
+	char* end = NULL;
+	errno = 0;
+	unsigned long long n = strtoull(s, &end, 10);
+	if (end == s || *s == '-' || errno == ERANGE) {
+		return false;
+	}
+	switch (*end) {
+		case 'K':
+		case 'k':
+			n <<= 10;
+			end++;
+			break;
+		case 'M':
+		case 'm':
+			n <<= 20;
+			end++;
+			break;
+		case 'G':
+		case 'g':
+			n <<= 30;
+			end++;
+			break;
+		default:
+			break;
+	}
+	*out = n;
+	return *end == '\0';
+}
+
+static int
+load_limits(const char* path)
+{
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		return errno == ENOENT ? 0 : -1;
+	}
+	char* line = NULL;
+	size_t cap = 0;
+	unsigned lineno = 0;
+	size_t qty = 0;
+	while (getline(&line, &cap, f) > 0) {
+		lineno++;
+		char* comment = strchr(line, '#');
+		if (comment != NULL) {
+			*comment = '\0';
+		}
+		char* save = NULL;
+		const char* name = strtok_r(line, " \t\r\n", &save);
+		const char* bytes = strtok_r(NULL, " \t\r\n", &save);
+		const char* messages = strtok_r(NULL, " \t\r\n", &save);
+		if (name == NULL) {
+			continue;
+		}
+		uint64_t max_bytes = 0, max_messages = 0;
+		if (bytes == NULL || !parse_size(bytes, &max_bytes) ||
+		    (messages != NULL && !parse_size(messages, &max_messages))) {
+			logf(LOG_ERROR, "Quota: %s:%u: expected `<local part> <bytes> [<messages>]'", path, lineno);
+			continue;
+		}
+		if (strcmp(name, "*") == 0) {
+			default_limited = true;
+			default_max_bytes = max_bytes;
+			default_max_messages = max_messages;
+		} else {
+			entry* e = find(name, strlen(name), true);
+			if (e == NULL) {
+				break;
+			}
+			e->limited = true;
+			e->max_bytes = max_bytes;
+			e->max_messages = max_messages;
+		}
+		qty++;
+	}
+	free(line);
+	fclose(f);
+	logf(LOG_INFO, "Quota: loaded %zu limits from %s", qty, path);
+	return 0;
+}
+
+static void
+load_usage(void)
+{
+	FILE* f = fopen(usage_path, "r");
+	if (f == NULL) {
+		return;
+	}
+	char name[LOCAL_USER_NAME_SIZE + 1];
+	unsigned long long bytes, messages;
+	while (fscanf(f, "%64s %llu %llu", name, &bytes, &messages) == 3) {
+		entry* e = find(name, strlen(name), true);
+		if (e != NULL) {
+			e->bytes = bytes;
+			e->messages = messages;
+		}
+	}
+	fclose(f);
+}
+
+struct walk
+{
+	uint64_t bytes;
+	uint64_t messages;
+};
+
+static void
+add_message(const char* path, const char* name, void* arg)
+{
+	(void)name;
+	struct walk* w = arg;
+	struct stat st;
+	if (stat(path, &st) == 0) {
+		w->bytes += st.st_size;
+		w->messages++;
+	}
+}
+
+/** @brief The rebuild is over: mailboxes without a maildir only keep what was delivered meanwhile. */
+static void
+finish_rebuild(void)
+{
+	for (size_t i = 0; i < buckets_qty; i++) {
+		for (entry* e = buckets[i]; e != NULL; e = e->next) {
+			if (e->scan != SCAN_DONE && !scan_stop) {
+				e->bytes = e->delta_bytes;
+				e->messages = e->delta_messages;
+			}
+			e->scan = SCAN_DONE;
+			e->delta_bytes = e->delta_messages = 0;
+		}
+	}
+	scanning = false;
+	dirty = true;
+}
+
+static void*
+scan_main(void* arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&mutex);
+	while (!scan_stop && scan_next < scan_users_qty) {
+		const char* user = scan_users[scan_next++];
+		entry* e = find(user, strlen(user), true);
+		if (e == NULL) {
+			continue;
+		}
+		// lo que se entregue desde acá se suma aparte; lo anterior lo ve el recorrido
+		e->scan = SCAN_RUNNING;
+		e->delta_bytes = e->delta_messages = 0;
+		pthread_mutex_unlock(&mutex);
+
+		struct walk w = { 0 };
+		maildir_foreach(user, "new", add_message, &w);
+		maildir_foreach(user, "cur", add_message, &w);
+
+		pthread_mutex_lock(&mutex);
+		e->bytes = w.bytes + e->delta_bytes;
+		e->messages = w.messages + e->delta_messages;
+		e->delta_bytes = e->delta_messages = 0;
+		e->scan = SCAN_DONE;
+	}
+	if (--scan_left == 0) {
+		finish_rebuild();
+		logf(LOG_INFO, "Quota: usage rebuilt for %zu mailboxes", scan_users_qty);
+	}
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+/** @brief Lists the maildirs and starts the threads that walk them. */
+static void
+start_rebuild(void)
+{
+	DIR* d = opendir("./Maildir");
+	if (d == NULL) {
+		return;
+	}
+	struct dirent* de;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.' || strlen(de->d_name) > LOCAL_USER_NAME_SIZE) {
+			continue;
+		}
+		char** grown = realloc(scan_users, (scan_users_qty + 1) * sizeof(*scan_users));
+		if (grown == NULL || (grown[scan_users_qty] = strdup(de->d_name)) == NULL) {
+			if (grown != NULL) {
+				scan_users = grown;
+			}
+			break;
+		}
+		scan_users = grown;
+		scan_users_qty++;
+	}
+	closedir(d);
+
+	pthread_mutex_lock(&mutex);
+	scanning = true;
+	scan_stop = false;
+	scan_next = 0;
+	for (size_t i = 0; i < buckets_qty; i++) {
+		for (entry* e = buckets[i]; e != NULL; e = e->next) {
+			e->scan = SCAN_PENDING;
+		}
+	}
+	scan_left = QUOTA_SCAN_THREADS;
+	for (scan_threads_qty = 0; scan_threads_qty < QUOTA_SCAN_THREADS; scan_threads_qty++) {
+		if (pthread_create(&scan_threads[scan_threads_qty], NULL, scan_main, NULL) != 0) {
+			logf(LOG_ERROR, "Quota: pthread_create: %s", strerror(errno));
+			break;
+		}
+	}
+	scan_left = scan_threads_qty;
+	if (scan_threads_qty == 0) {
+		// sin hilos nos quedamos con lo que estaba guardado
+		scan_stop = true;
+		finish_rebuild();
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+static void
+save_timer_handler(struct wheel_timer* t, void* data)
+{
+	(void)data;
+	pthread_mutex_lock(&mutex);
+	const bool changed = dirty;
+	pthread_mutex_unlock(&mutex);
+	if (changed) {
+		quota_save();
+	}
+	selector_timer_schedule(selector, t, QUOTA_SAVE_MS);
+}
+
+int
+quota_init(fd_selector selector_param, const char* limits_path, const char* usage_path_param, bool deferred)
+{
+	usage_path = strdup(usage_path_param);
+	if (usage_path == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&mutex);
+	const int ret = load_limits(limits_path);
+	load_usage();
+	initialized = true;
+	pthread_mutex_unlock(&mutex);
+	if (ret != 0) {
+		logf(LOG_ERROR, "Quota: reading %s: %s", limits_path, strerror(errno));
+		return -1;
+	}
+	selector = selector_param;
+	if (!deferred) {
+		quota_start();
+	}
+	return 0;
+}
+
+void
+quota_start(void)
+{
+	pthread_mutex_lock(&mutex);
+	const bool start = initialized && !started;
+	started = started || start;
+	pthread_mutex_unlock(&mutex);
+	if (!start) {
+		return;
+	}
+	start_rebuild();
+	if (selector != NULL) {
+		wheel_timer_init(&save_timer, save_timer_handler, NULL);
+		selector_timer_schedule(selector, &save_timer, QUOTA_SAVE_MS);
+	}
+}
+
+quota_result
+quota_check(const char* user, size_t len, uint64_t size)
+{
+	quota_result ret = QUOTA_OK;
+	pthread_mutex_lock(&mutex);
+	if (initialized) {
+		const entry* e = find(user, len, false);
+		const bool own = e != NULL && e->limited;
+		const bool limited = own || default_limited;
+		const uint64_t max_bytes = own ? e->max_bytes : default_max_bytes;
+		const uint64_t max_messages = own ? e->max_messages : default_max_messages;
+		const uint64_t bytes = e == NULL ? 0 : e->bytes;
+		const uint64_t messages = e == NULL ? 0 : e->messages;
+		if (!limited) {
+			ret = QUOTA_OK;
+		} else if (max_bytes > 0 && size > max_bytes) {
+			ret = QUOTA_TOO_BIG;
+		} else if ((max_bytes > 0 && (bytes >= max_bytes || size > max_bytes - bytes)) ||
+		           (max_messages > 0 && messages >= max_messages)) {
+			ret = QUOTA_FULL;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
+
+void
+quota_charge(const char* user, size_t len, uint64_t bytes)
+{
+	pthread_mutex_lock(&mutex);
+	entry* e = initialized ? find(user, len, true) : NULL;
+	if (e != NULL) {
+		e->bytes += bytes;
+		e->messages++;
+		if (e->scan != SCAN_DONE) {
+			e->delta_bytes += bytes;
+			e->delta_messages++;
+		}
+		dirty = true;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+int
+quota_usage(const char* user, uint64_t* bytes, uint64_t* messages)
+{
+	pthread_mutex_lock(&mutex);
+	const entry* e = initialized ? find(user, strlen(user), false) : NULL;
+	if (e != NULL) {
+		*bytes = e->bytes;
+		*messages = e->messages;
+	}
+	pthread_mutex_unlock(&mutex);
+	return e != NULL ? 0 : -1;
+}
+
+bool
+quota_rebuilt(void)
+{
+	pthread_mutex_lock(&mutex);
+	const bool ret = started && !scanning;
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
+
+int
+quota_save(void)
+{
+	// armamos el contenido con el mutex tomado y lo escribimos sin él
+	char* buf = NULL;
+	size_t size = 0;
+	FILE* mem = open_memstream(&buf, &size);
+	if (mem == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&mutex);
+	for (size_t i = 0; i < buckets_qty; i++) {
+		for (const entry* e = buckets[i]; e != NULL; e = e->next) {
+			if (e->messages > 0 || e->bytes > 0) {
+				fprintf(mem, "%s %llu %llu\n", e->name, (unsigned long long)e->bytes,
+				        (unsigned long long)e->messages);
+			}
+		}
+	}
+	dirty = false;
+	pthread_mutex_unlock(&mutex);
+	fclose(mem);
+
+	char tmp[MAILDIR_PATH_SIZE];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", usage_path);
+	FILE* f = fopen(tmp, "w");
+	bool ok = f != NULL && fwrite(buf, 1, size, f) == size;
+	ok = f != NULL && fclose(f) == 0 && ok;
+	free(buf);
+	if (!ok || rename(tmp, usage_path) != 0) {
+		logf(LOG_ERROR, "Quota: writing %s: %s", usage_path, strerror(errno));
+		unlink(tmp);
+		pthread_mutex_lock(&mutex);
+		dirty = true;
+		pthread_mutex_unlock(&mutex);
+		return -1;
+	}
+	return 0;
+}
+
+void
+quota_finalize(void)
+{
+	if (!initialized) {
+		return;
+	}
+	if (selector != NULL && started) {
+		selector_timer_cancel(selector, &save_timer);
+	}
+	selector = NULL;
+	pthread_mutex_lock(&mutex);
+	scan_stop = true;
+	pthread_mutex_unlock(&mutex);
+	for (unsigned i = 0; i < scan_threads_qty; i++) {
+		pthread_join(scan_threads[i], NULL);
+	}
+	scan_threads_qty = 0;
+	if (started) {
+		quota_save();
+	}
+
+	pthread_mutex_lock(&mutex);
+	for (size_t i = 0; i < scan_users_qty; i++) {
+		free(scan_users[i]);
+	}
+	free(scan_users);
+	scan_users = NULL;
+	scan_users_qty = 0;
+	free_table();
+	initialized = false;
+	started = false;
+	scanning = false;
+	default_limited = false;
+	pthread_mutex_unlock(&mutex);
+	free(usage_path);
+	usage_path = NULL;
+}
@@ -0,0 +1,316 @@
+#include "recipients.h"
+
+#include "logger.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define POSTMASTER "postmaster"
+
+typedef struct slot
+{
+	uint64_t hash;
+	/** points into directory.names; NULL if the slot is empty */
+	const char* name;
+	size_t len;
+} slot;
+
+typedef struct directory
+{
+	uint64_t* bloom;
+	uint64_t bloom_mask;  // bits - 1
+	slot* slots;
+	size_t slots_mask;
+	size_t qty;
+	/** the file contents, with every name NUL terminated in place */
+	char* names;
+} directory;
+
+static directory* current = NULL;
+static char* path = NULL;
+/** identity of the file `current' was built from */
+static struct stat loaded;
+static bool file_present = false;
+static fd_selector selector = NULL;
+static struct wheel_timer reload_timer;
+
+static uint64_t
+hash_name(const char* s, size_t len)
+{
+	// FNV-1a, then a final mix so the high bits are usable by the Bloom filter
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t)s[i];
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static size_t
+pow2_at_least(size_t n)
+{
+	size_t p = 1;
+	while (p < n) {
+		p <<= 1;
+	}
+	return p;
+}
+
+/*
+ * The k probes are derived from a single hash (Kirsch and Mitzenmacher):
+ * bit_i = h1 + i * h2, with h2 odd so the probes never collapse.
+ */
+static void
+bloom_add(directory* d, uint64_t h)
+{
+	const uint64_t h2 = (h >> 32) | 1;
+	for (unsigned i = 0; i < RECIPIENTS_BLOOM_K; i++) {
+		const uint64_t bit = (h + i * h2) & d->bloom_mask;
+		d->bloom[bit >> 6] |= 1ULL << (bit & 63);
+	}
+}
+
+static bool
+bloom_test(const directory* d, uint64_t h)
+{
+	const uint64_t h2 = (h >> 32) | 1;
+	for (unsigned i = 0; i < RECIPIENTS_BLOOM_K; i++) {
+		const uint64_t bit = (h + i * h2) & d->bloom_mask;
+		if ((d->bloom[bit >> 6] & (1ULL << (bit & 63))) == 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/** @brief Finds `name' or the empty slot where it belongs. */
+static slot*
+find_slot(const directory* d, const char* name, size_t len, uint64_t h)
+{
+	size_t i = h & d->slots_mask;
+	while (d->slots[i].name != NULL) {
+		if (d->slots[i].hash == h && d->slots[i].len == len && memcmp(d->slots[i].name, name, len) == 0) {
+			break;
+		}
+		i = (i + 1) & d->slots_mask;
+	}
+	return &d->slots[i];
+}
+
+static void
+free_directory(directory* d)
+{
+	if (d != NULL) {
+		free(d->bloom);
+		free(d->slots);
+		free(d->names);
+		free(d);
+	}
+}
+
+/** @brief Builds a directory over `names' (size bytes plus a NUL), taking ownership of it. */
+static directory*
+build(char* names, size_t size)
+{
+	directory* d = calloc(1, sizeof(*d));
+	if (d == NULL) {
+		free(names);
+		return NULL;
+	}
+	d->names = names;
+
+	size_t lines = 1;
+	for (size_t i = 0; i < size; i++) {
+		lines += names[i] == '\n';
+	}
+	// at most half full, so probe sequences stay short
+	const size_t slots = pow2_at_least(lines * 2 < 16 ? 16 : lines * 2);
+	const size_t bits = pow2_at_least(lines * RECIPIENTS_BLOOM_BITS < 64 ? 64 : lines * RECIPIENTS_BLOOM_BITS);
+	d->slots = calloc(slots, sizeof(*d->slots));
+	d->bloom = calloc(bits / 64, sizeof(*d->bloom));
+	if (d->slots == NULL || d->bloom == NULL) {
+		free_directory(d);
+		return NULL;
+	}
+	d->slots_mask = slots - 1;
+	d->bloom_mask = bits - 1;
+
+	char* line = names;
+	while (line < names + size) {
+		char* end = memchr(line, '\n', names + size - line);
+		if (end == NULL) {
+			end = names + size;
+		}
+		*end = '\0';
+		char* comment = strchr(line, '#');
+		char* last = comment != NULL ? comment : end;
+		while (line < last && (*line == ' ' || *line == '\t')) {
+			line++;
+		}
+		while (last > line && (last[-1] == ' ' || last[-1] == '\t' || last[-1] == '\r')) {
+			last--;
+		}
+		const size_t len = last - line;
+		if (len > 0) {
+			*last = '\0';
+			const uint64_t h = hash_name(line, len);
+			slot* s = find_slot(d, line, len, h);
+			if (s->name == NULL) {
+				*s = (slot){ .hash = h, .name = line, .len = len };
+				bloom_add(d, h);
+				d->qty++;
+			}
+		}
+		line = end + 1;
+	}
+	return d;
+}
+
+/**
+ * @brief Reads and indexes the file at `path'.
+ * @returns 0 with *out set (NULL if the file does not exist), or -1.
+ */
+static int
+load(directory** out, struct stat* st)
+{
+	*out = NULL;
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT) {
+			return 0;
+		}
+		logf(LOG_ERROR, "Opening recipient directory %s: %s", path, strerror(errno));
+		return -1;
+	}
+	char* names = NULL;
+	ssize_t n = 0;
+	size_t size = 0;
+	if (fstat(fd, st) == 0 && (names = malloc((size_t)st->st_size + 1)) != NULL) {
+		while (size < (size_t)st->st_size && (n = read(fd, names + size, st->st_size - size)) > 0) {
+			size += n;
+		}
+	}
+	close(fd);
+	if (names == NULL || n < 0) {
+		logf(LOG_ERROR, "Reading recipient directory %s: %s", path, strerror(errno));
+		free(names);
+		return -1;
+	}
+	names[size] = '\0';
+	if ((*out = build(names, size)) == NULL) {
+		log(LOG_ERROR, "Could not allocate memory for the recipient directory");
+		return -1;
+	}
+	return 0;
+}
+
+static bool
+same_file(const struct stat* a, const struct stat* b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+	       a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static void
+reload_timer_handler(struct wheel_timer* t, void* data)
+{
+	(void)data;
+	recipients_reload();
+	selector_timer_schedule(selector, t, RECIPIENTS_RELOAD_MS);
+}
+
+int
+recipients_init(fd_selector selector_param, const char* path_param)
+{
+	path = strdup(path_param);
+	if (path == NULL) {
+		return -1;
+	}
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	if (load(&current, &st) != 0) {
+		return -1;
+	}
+	file_present = current != NULL;
+	loaded = st;
+	if (current != NULL) {
+		logf(LOG_INFO, "Loaded %zu recipients from %s", current->qty, path);
+	}
+
+	selector = selector_param;
+	if (selector != NULL) {
+		wheel_timer_init(&reload_timer, reload_timer_handler, NULL);
+		selector_timer_schedule(selector, &reload_timer, RECIPIENTS_RELOAD_MS);
+	}
+	return 0;
+}
+
+int
+recipients_reload(void)
+{
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	const bool present = stat(path, &st) == 0;
+	if (present == file_present && (!present || same_file(&st, &loaded))) {
+		return 0;
+	}
+	directory* d;
+	if (load(&d, &st) != 0) {
+		return -1;
+	}
+	free_directory(current);
+	current = d;
+	file_present = d != NULL;
+	loaded = st;
+	if (d != NULL) {
+		logf(LOG_INFO, "Reloaded %zu recipients from %s", d->qty, path);
+	} else {
+		logf(LOG_INFO, "Recipient directory %s removed, accepting every local recipient", path);
+	}
+	return 1;
+}
+
+bool
+recipients_exists(const char* local_part, size_t len)
+{
+	if (current == NULL) {
+		return true;
+	}
+	if (len == strlen(POSTMASTER) && strncasecmp(local_part, POSTMASTER, len) == 0) {
+		return true;
+	}
+	const uint64_t h = hash_name(local_part, len);
+	if (!bloom_test(current, h)) {
+		return false;
+	}
+	return find_slot(current, local_part, len, h)->name != NULL;
+}
+
+size_t
+recipients_count(void)
+{
+	return current == NULL ? 0 : current->qty;
+}
+
+void
+recipients_destroy(void)
+{
+	if (selector != NULL) {
+		selector_timer_cancel(selector, &reload_timer);
+		selector = NULL;
+	}
+	free_directory(current);
+	current = NULL;
+	free(path);
+	path = NULL;
+	file_present = false;
+}
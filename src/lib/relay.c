@@ -0,0 +1,1797 @@
+/**
+ * relay.c - entrega saliente por SMTP (ver relay.h)
+ */
+#include "relay.h"
+
+#include "buffer_chain.h"
+#include "logger.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ENVELOPE_EXT ".env"
+#define MESSAGE_EXT  ".msg"
+#define TEMP_EXT     ".tmp"
+#define FAILED_EXT   ".failed"
+#define PATH_SIZE    (sizeof(RELAY_DIR) + 1 + RELAY_ID_SIZE + sizeof(FAILED_EXT))
+#define FIELD_SIZE   512
+#define HOST_SIZE    256
+#define PORT_SIZE    8
+#define MAX_ROUTES   64
+#define MAX_CLIENTS  64
+// las respuestas son de a lo sumo 512 bytes (RFC 5321 4.5.3.1.5); lo demás se descarta
+#define LINE_SIZE    1024
+// cuánto del cuerpo se lee por vez; con stuffing puede duplicarse
+#define BODY_CHUNK   8192
+#define OUTPUT_LIMIT (4 * BODY_CHUNK)
+// un temporal más viejo que esto quedó de un proceso que murió escribiéndolo
+#define STALE_S 60
+
+/** un sobre en la cola de un salto; el contenido sólo está en disco */
+struct message
+{
+	char id[RELAY_ID_SIZE];
+	unsigned attempts;
+	/** cuándo intentar el envío, en ms de CLOCK_MONOTONIC */
+	uint64_t due_ms;
+	struct message* next;
+};
+
+enum conn_state
+{
+	CONN_NONE,
+	CONN_CONNECTING,
+	CONN_GREETING,
+	CONN_EHLO,
+	CONN_HELO,
+	/** respuestas a MAIL, los RCPT y DATA */
+	CONN_ENVELOPE,
+	/** enviando el cuerpo; la respuesta llega al terminar */
+	CONN_BODY,
+	CONN_RSET,
+	CONN_IDLE,
+	CONN_QUIT,
+};
+
+enum rcpt_status
+{
+	RCPT_PENDING,
+	/** 2xx al RCPT, falta el del cuerpo */
+	RCPT_ACCEPTED,
+	RCPT_OK,
+	RCPT_TEMP,
+	RCPT_PERM,
+};
+
+/** el mensaje que se está enviando por una conexión */
+struct transaction
+{
+	struct message* msg;
+	/** el sobre, bloqueado mientras dure la transacción */
+	FILE* envelope;
+	FILE* body;
+	uint32_t session;
+	bool stuffed;
+	/** el cuerpo va con BDAT; si no, con DATA */
+	bool bdat;
+	off_t body_size;
+	char from[FIELD_SIZE];
+	char** rcpt;
+	size_t rcpt_qty;
+	enum rcpt_status* status;
+	unsigned* code;
+	/** MAIL, los RCPT y DATA si corresponde */
+	size_t commands;
+	size_t sent;
+	size_t replies;
+	size_t accepted;
+	unsigned mail_code;
+	unsigned data_code;
+	size_t body_sent;
+	/** stuffing al vuelo: el próximo byte empieza una línea */
+	bool line_start;
+	bool body_done;
+};
+
+/** un próximo salto: su cola y su conexión */
+struct destination
+{
+	char host[HOST_SIZE];
+	char port[PORT_SIZE];
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+
+	struct message* queue;
+	size_t queue_qty;
+
+	int fd;
+	enum conn_state state;
+	bool pipelining;
+	bool chunking;
+	char line[LINE_SIZE];
+	size_t line_len;
+	buffer_chain output;
+	struct transaction tx;
+	bool in_tx;
+
+	/** fallas de conexión seguidas */
+	unsigned failures;
+	/** no se reconecta antes de esto */
+	uint64_t retry_at;
+	/** timeout de la respuesta, o cierre por inactividad */
+	struct wheel_timer timer;
+	/** próximo mensaje vencido */
+	struct wheel_timer wake;
+};
+
+static fd_selector selector = NULL;
+/** un dominio y su próximo salto; los dominios con el mismo host y puerto lo comparten */
+struct route
+{
+	char domain[HOST_SIZE];
+	struct destination* d;
+};
+
+static struct route routes[MAX_ROUTES];
+static size_t routes_qty = 0;
+
+/** una red de clientes que pueden usar el relay */
+struct client_net
+{
+	int family;
+	uint8_t addr[16];
+	unsigned prefix;
+};
+
+static struct client_net clients[MAX_CLIENTS];
+static size_t clients_qty = 0;
+static struct destination* hops[MAX_ROUTES];
+static size_t hops_qty = 0;
+static struct wheel_timer scan_timer;
+/** RELAY_DIR abierto, para fsync de los renombres */
+static int dir_fd = -1;
+
+/** el sobre de un grupo de destinatarios con el mismo salto */
+struct relay_group
+{
+	struct destination* d;
+	char id[RELAY_ID_SIZE];
+};
+
+/** ver relay_submit */
+struct relay_commit
+{
+	char data_path[FIELD_SIZE];
+	spool_commit_status status;
+	/** quien lo envió y el hilo de commits; se libera cuando lo sueltan los dos */
+	unsigned refs;
+	/** quien lo envió lo soltó sin ver el resultado: nadie confirmó el mensaje */
+	bool abandoned;
+	spool_notify_fn notify;
+	void* ctx;
+	int fd;
+	/** sólo los usa el hilo de commits mientras procesa la tanda */
+	bool synced;
+	bool renamed;
+	bool waiting;
+	struct relay_commit* next;
+	size_t groups_qty;
+	struct relay_group groups[];
+};
+
+// el hilo de commits sólo toca los archivos; la cola es del hilo del selector
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_wakeup = PTHREAD_COND_INITIALIZER;
+// commits esperando su tanda, en orden de llegada
+static struct relay_commit* commits = NULL;
+static struct relay_commit** commits_tail = &commits;
+static pthread_t committer;
+static bool committer_started = false;
+static bool stopping = false;
+
+static void relay_read(struct selector_key* key);
+static void relay_write(struct selector_key* key);
+static void pump(struct destination* d);
+static void* committer_main(void* arg);
+
+static const struct fd_handler relay_handler = {
+	.handle_read = relay_read,
+	.handle_write = relay_write,
+	.handle_close = NULL,  // el fd lo cierra close_connection
+};
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t
+backoff(unsigned attempts)
+{
+	const uint64_t delay = (uint64_t)RELAY_RETRY_MS << (attempts > 20 ? 20 : attempts - 1);
+	return delay < RELAY_RETRY_MAX_MS ? delay : RELAY_RETRY_MAX_MS;
+}
+
+static void
+relay_path(char* buf, const char* id, const char* ext)
+{
+	snprintf(buf, PATH_SIZE, "%s/%s%s", RELAY_DIR, id, ext);
+}
+
+static const char*
+domain_of(const char* mail)
+{
+	const char* at = strrchr(mail, '@');
+	return at == NULL ? "" : at + 1;
+}
+
+/** la ruta de `domain', o la ruta por defecto */
+static struct destination*
+route_for(const char* domain)
+{
+	struct destination* fallback = NULL;
+	for (size_t i = 0; i < routes_qty; i++) {
+		if (strcasecmp(routes[i].domain, domain) == 0) {
+			return routes[i].d;
+		}
+		if (fallback == NULL && strcmp(routes[i].domain, "*") == 0) {
+			fallback = routes[i].d;
+		}
+	}
+	return fallback;
+}
+
+static bool
+has_newline(const char* s)
+{
+	return strchr(s, '\n') != NULL || strchr(s, '\r') != NULL;
+}
+
+/* ----------------------------------------------------------------------------
+ * sobres
+ */
+
+/** escribe el sobre `id' en su temporal, sin fsync */
+static int
+write_temp_envelope(const char* id, uint32_t session, const char* from, const char* const* rcpt, size_t rcpt_qty,
+                    bool stuffed)
+{
+	char tmp[PATH_SIZE];
+	relay_path(tmp, id, TEMP_EXT);
+
+	const int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		logf(LOG_ERROR, "Relay: creating %s: %s", tmp, strerror(errno));
+		return -1;
+	}
+	FILE* f = fdopen(fd, "w");
+	if (f == NULL) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	fprintf(f, "session %u\nbody %s\nfrom %s\n", session, stuffed ? "stuffed" : "raw", from);
+	for (size_t i = 0; i < rcpt_qty; i++) {
+		fprintf(f, "rcpt %s\n", rcpt[i]);
+	}
+	bool ok = fflush(f) == 0 && !ferror(f);
+	ok = fclose(f) == 0 && ok;
+	if (!ok) {
+		logf(LOG_ERROR, "Relay: writing %s: %s", tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/** publica el temporal de `id' como su sobre, reemplazando al anterior */
+static int
+rename_envelope(const char* id)
+{
+	char tmp[PATH_SIZE], env[PATH_SIZE];
+	relay_path(tmp, id, TEMP_EXT);
+	relay_path(env, id, ENVELOPE_EXT);
+	if (rename(tmp, env) != 0) {
+		logf(LOG_ERROR, "Relay: writing %s: %s", env, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * reescribe el sobre `id' tras una entrega parcial. Sin fsync, porque corre
+ * en el hilo del selector: si una caída se lo lleva vuelve el anterior, y a
+ * lo sumo se reenvía a destinatarios que ya lo recibieron
+ */
+static int
+write_envelope(const char* id, uint32_t session, const char* from, const char* const* rcpt, size_t rcpt_qty,
+               bool stuffed)
+{
+	if (write_temp_envelope(id, session, from, rcpt, rcpt_qty, stuffed) != 0) {
+		return -1;
+	}
+	return rename_envelope(id);
+}
+
+static void
+free_rcpt(struct transaction* tx)
+{
+	for (size_t i = 0; i < tx->rcpt_qty; i++) {
+		free(tx->rcpt[i]);
+	}
+	free(tx->rcpt);
+	free(tx->status);
+	free(tx->code);
+	tx->rcpt = NULL;
+	tx->status = NULL;
+	tx->code = NULL;
+	tx->rcpt_qty = 0;
+}
+
+static int
+read_envelope(FILE* f, struct transaction* tx)
+{
+	char* line = NULL;
+	size_t cap = 0;
+	ssize_t n;
+	int ret = 0;
+	while (ret == 0 && (n = getline(&line, &cap, f)) > 0) {
+		if (line[n - 1] == '\n') {
+			line[--n] = '\0';
+		}
+		char* value = strchr(line, ' ');
+		if (value == NULL) {
+			continue;
+		}
+		*value++ = '\0';
+		if (strcmp(line, "session") == 0) {
+			tx->session = strtoul(value, NULL, 10);
+		} else if (strcmp(line, "body") == 0) {
+			tx->stuffed = strcmp(value, "stuffed") == 0;
+		} else if (strcmp(line, "from") == 0) {
+			snprintf(tx->from, sizeof(tx->from), "%s", value);
+		} else if (strcmp(line, "rcpt") == 0) {
+			char** rcpt = realloc(tx->rcpt, (tx->rcpt_qty + 1) * sizeof(*rcpt));
+			char* dup = strdup(value);
+			if (rcpt == NULL || dup == NULL) {
+				free(dup);
+				ret = -1;
+			}
+			if (rcpt != NULL) {
+				tx->rcpt = rcpt;
+			}
+			if (ret == 0) {
+				tx->rcpt[tx->rcpt_qty++] = dup;
+			}
+		}
+	}
+	free(line);
+	if (ret == 0 && tx->rcpt_qty > 0) {
+		tx->status = calloc(tx->rcpt_qty, sizeof(*tx->status));
+		tx->code = calloc(tx->rcpt_qty, sizeof(*tx->code));
+		if (tx->status == NULL || tx->code == NULL) {
+			ret = -1;
+		}
+	}
+	if (ret == 0 && tx->rcpt_qty == 0) {
+		ret = -1;
+	}
+	if (ret != 0) {
+		free_rcpt(tx);
+	}
+	return ret;
+}
+
+static void
+remove_files(const char* id)
+{
+	char path[PATH_SIZE];
+	relay_path(path, id, ENVELOPE_EXT);
+	unlink(path);
+	relay_path(path, id, TEMP_EXT);
+	unlink(path);
+	relay_path(path, id, MESSAGE_EXT);
+	unlink(path);
+}
+
+static void
+give_up(const char* id, unsigned attempts)
+{
+	char from[PATH_SIZE], to[PATH_SIZE];
+	relay_path(from, id, ENVELOPE_EXT);
+	relay_path(to, id, FAILED_EXT);
+	logf(LOG_ERROR, "Relay: giving up on %s after %u attempts", id, attempts);
+	rename(from, to);
+}
+
+/* ----------------------------------------------------------------------------
+ * cola de cada salto
+ */
+
+static struct message*
+find_message(const char* id)
+{
+	for (size_t i = 0; i < hops_qty; i++) {
+		for (struct message* m = hops[i]->queue; m != NULL; m = m->next) {
+			if (strcmp(m->id, id) == 0) {
+				return m;
+			}
+		}
+	}
+	return NULL;
+}
+
+/** agrega un sobre al final de la cola del salto */
+static void
+add_message(struct destination* d, const char* id, uint64_t due_ms)
+{
+	struct message* m = calloc(1, sizeof(*m));
+	if (m == NULL) {
+		// sigue en disco: lo levanta el próximo escaneo
+		logf(LOG_ERROR, "Relay: no memory to queue %s", id);
+		return;
+	}
+	snprintf(m->id, sizeof(m->id), "%s", id);
+	m->due_ms = due_ms;
+	struct message** p = &d->queue;
+	while (*p != NULL) {
+		p = &(*p)->next;
+	}
+	*p = m;
+	d->queue_qty++;
+}
+
+static void
+remove_message(struct destination* d, struct message* m)
+{
+	for (struct message** p = &d->queue; *p != NULL; p = &(*p)->next) {
+		if (*p == m) {
+			*p = m->next;
+			d->queue_qty--;
+			free(m);
+			return;
+		}
+	}
+}
+
+/** el primer mensaje vencido que no se está enviando */
+static struct message*
+next_message(struct destination* d, uint64_t now)
+{
+	for (struct message* m = d->queue; m != NULL; m = m->next) {
+		if (m->due_ms <= now && !(d->in_tx && d->tx.msg == m)) {
+			return m;
+		}
+	}
+	return NULL;
+}
+
+/** arma `wake' para el próximo vencimiento, respetando la espera del salto */
+static void
+schedule_wake(struct destination* d)
+{
+	uint64_t due = UINT64_MAX;
+	for (struct message* m = d->queue; m != NULL; m = m->next) {
+		if (m->due_ms < due && !(d->in_tx && d->tx.msg == m)) {
+			due = m->due_ms;
+		}
+	}
+	if (due == UINT64_MAX) {
+		selector_timer_cancel(selector, &d->wake);
+		return;
+	}
+	if (d->state == CONN_NONE && d->retry_at > due) {
+		due = d->retry_at;
+	}
+	const uint64_t now = now_ms();
+	selector_timer_schedule(selector, &d->wake, due > now ? due - now : 0);
+}
+
+/* ----------------------------------------------------------------------------
+ * conexión
+ */
+
+static void
+update_interest(struct destination* d)
+{
+	fd_interest i = OP_READ;
+	if (d->state == CONN_CONNECTING || buffer_chain_can_read(&d->output) ||
+	    (d->state == CONN_BODY && !d->tx.body_done)) {
+		i |= OP_WRITE;
+	}
+	selector_set_interest(selector, d->fd, i);
+}
+
+static void
+send_line(struct destination* d, const char* fmt, ...)
+{
+	char line[FIELD_SIZE + 32];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (n > 0) {
+		buffer_chain_write(&d->output, line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1);
+	}
+	update_interest(d);
+}
+
+static void
+end_transaction(struct destination* d)
+{
+	if (!d->in_tx) {
+		return;
+	}
+	if (d->tx.body != NULL) {
+		fclose(d->tx.body);
+	}
+	if (d->tx.envelope != NULL) {
+		// cerrarlo libera el bloqueo
+		fclose(d->tx.envelope);
+	}
+	free_rcpt(&d->tx);
+	memset(&d->tx, 0, sizeof(d->tx));
+	d->in_tx = false;
+}
+
+static void
+close_connection(struct destination* d)
+{
+	if (d->fd >= 0) {
+		selector_unregister_fd(selector, d->fd);
+		close(d->fd);
+		d->fd = -1;
+	}
+	d->state = CONN_NONE;
+	d->line_len = 0;
+	buffer_chain_reset(&d->output);
+	selector_timer_cancel(selector, &d->timer);
+}
+
+/**
+ * la conexión falló: el mensaje en curso se reintenta más tarde y el salto
+ * espera antes de reconectar
+ */
+static void
+fail_connection(struct destination* d, const char* reason)
+{
+	logf(LOG_INFO, "Relay: %s:%s: %s", d->host, d->port, reason);
+	if (d->in_tx) {
+		struct message* m = d->tx.msg;
+		end_transaction(d);
+		if (++m->attempts >= RELAY_MAX_ATTEMPTS) {
+			give_up(m->id, m->attempts);
+			remove_message(d, m);
+		} else {
+			m->due_ms = now_ms() + backoff(m->attempts);
+		}
+	}
+	close_connection(d);
+	d->failures++;
+	d->retry_at = now_ms() + backoff(d->failures);
+	schedule_wake(d);
+}
+
+static void
+connect_to(struct destination* d)
+{
+	const int fd = socket(d->addr.ss_family, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fail_connection(d, strerror(errno));
+		return;
+	}
+	if (selector_fd_set_nio(fd) == -1 || fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+		close(fd);
+		fail_connection(d, strerror(errno));
+		return;
+	}
+	if (connect(fd, (struct sockaddr*)&d->addr, d->addr_len) != 0 && errno != EINPROGRESS) {
+		const int err = errno;
+		close(fd);
+		fail_connection(d, strerror(err));
+		return;
+	}
+	if (selector_register(selector, fd, &relay_handler, OP_WRITE, d) != SELECTOR_SUCCESS) {
+		close(fd);
+		fail_connection(d, "unable to register socket");
+		return;
+	}
+	d->fd = fd;
+	d->state = CONN_CONNECTING;
+	d->line_len = 0;
+	selector_timer_schedule(selector, &d->timer, RELAY_TIMEOUT_MS);
+}
+
+/** la conexión quedó libre: sigue con el próximo mensaje o espera inactiva */
+static void
+ready(struct destination* d)
+{
+	d->failures = 0;
+	d->retry_at = 0;
+	d->state = CONN_IDLE;
+	selector_timer_schedule(selector, &d->timer, RELAY_IDLE_MS);
+	pump(d);
+}
+
+static void
+quit(struct destination* d)
+{
+	d->state = CONN_QUIT;
+	send_line(d, "QUIT\r\n");
+	selector_timer_schedule(selector, &d->timer, RELAY_TIMEOUT_MS);
+}
+
+/* ----------------------------------------------------------------------------
+ * transacción
+ */
+
+enum start
+{
+	START_OK,
+	/** otro proceso lo está enviando */
+	START_BUSY,
+	/** ya no existe o no se puede enviar */
+	START_GONE,
+};
+
+/** saltea el encabezado que open_mail_file escribe antes del cuerpo */
+static int
+skip_header(FILE* body)
+{
+	char* line = NULL;
+	size_t cap = 0;
+	ssize_t n = getline(&line, &cap, body);
+	bool header = n > 0 && strncmp(line, "MAIL FROM:", strlen("MAIL FROM:")) == 0;
+	while (header && n > 0 && strcmp(line, "DATA\r\n") != 0) {
+		n = getline(&line, &cap, body);
+	}
+	free(line);
+	if (!header) {
+		return fseeko(body, 0, SEEK_SET);
+	}
+	return n > 0 ? 0 : -1;
+}
+
+static void
+send_command(struct destination* d, size_t i)
+{
+	struct transaction* tx = &d->tx;
+	if (i == 0) {
+		send_line(d, "MAIL FROM:<%s>\r\n", tx->from);
+	} else if (i <= tx->rcpt_qty) {
+		send_line(d, "RCPT TO:<%s>\r\n", tx->rcpt[i - 1]);
+	} else {
+		send_line(d, "DATA\r\n");
+	}
+}
+
+/** con PIPELINING manda todos los comandos juntos; si no, de a uno */
+static void
+send_commands(struct destination* d)
+{
+	struct transaction* tx = &d->tx;
+	while (tx->sent < tx->commands && (d->pipelining || tx->sent == tx->replies)) {
+		send_command(d, tx->sent++);
+	}
+}
+
+static enum start
+start_transaction(struct destination* d, struct message* m)
+{
+	char path[PATH_SIZE];
+	relay_path(path, m->id, ENVELOPE_EXT);
+	const int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		return errno == ENOENT ? START_GONE : START_BUSY;
+	}
+	// mientras lo tengamos bloqueado ningún otro proceso lo envía
+	struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	struct stat st;
+	if (fcntl(fd, F_SETLK, &fl) != 0 || fstat(fd, &st) != 0 || st.st_nlink == 0) {
+		close(fd);
+		return START_BUSY;
+	}
+	struct transaction* tx = &d->tx;
+	memset(tx, 0, sizeof(*tx));
+	tx->msg = m;
+	tx->envelope = fdopen(fd, "r+");
+	if (tx->envelope == NULL) {
+		close(fd);
+		return START_BUSY;
+	}
+	d->in_tx = true;
+
+	relay_path(path, m->id, MESSAGE_EXT);
+	if (read_envelope(tx->envelope, tx) != 0 || (tx->body = fopen(path, "r")) == NULL ||
+	    skip_header(tx->body) != 0) {
+		logf(LOG_ERROR, "Relay: malformed message %s", m->id);
+		end_transaction(d);
+		give_up(m->id, m->attempts);
+		return START_GONE;
+	}
+	if (fstat(fileno(tx->body), &st) == 0) {
+		tx->body_size = st.st_size - ftello(tx->body);
+	}
+
+	tx->bdat = !tx->stuffed && d->chunking;
+	tx->commands = 1 + tx->rcpt_qty + (tx->bdat ? 0 : 1);
+	tx->line_start = true;
+	d->state = CONN_ENVELOPE;
+	selector_timer_schedule(selector, &d->timer, RELAY_TIMEOUT_MS);
+	send_commands(d);
+	return START_OK;
+}
+
+/**
+ * lee el próximo bloque del cuerpo a la salida, terminándolo como
+ * corresponde al llegar al final
+ */
+static int
+fill_body(struct destination* d)
+{
+	struct transaction* tx = &d->tx;
+	uint8_t in[BODY_CHUNK];
+	const size_t n = fread(in, 1, sizeof(in), tx->body);
+	if (n == 0) {
+		if (ferror(tx->body)) {
+			return -1;
+		}
+		if (tx->bdat) {
+			// el tamaño ya se declaró en el BDAT
+		} else if (tx->stuffed) {
+			// como llegó por DATA: falta el CRLF final y el punto
+			const char* end = tx->body_sent == 0 ? ".\r\n" : "\r\n.\r\n";
+			buffer_chain_write(&d->output, end, strlen(end));
+		} else {
+			const char* end = tx->line_start ? ".\r\n" : "\r\n.\r\n";
+			buffer_chain_write(&d->output, end, strlen(end));
+		}
+		tx->body_done = true;
+		return 0;
+	}
+	tx->body_sent += n;
+	if (tx->bdat || tx->stuffed) {
+		buffer_chain_write(&d->output, in, n);
+		return 0;
+	}
+	// un cuerpo de BDAT que sale por DATA: duplicamos los puntos al inicio de línea
+	uint8_t out[2 * BODY_CHUNK];
+	size_t len = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (tx->line_start && in[i] == '.') {
+			out[len++] = '.';
+		}
+		out[len++] = in[i];
+		tx->line_start = in[i] == '\n';
+	}
+	buffer_chain_write(&d->output, out, len);
+	return 0;
+}
+
+static void
+start_body(struct destination* d)
+{
+	d->state = CONN_BODY;
+	if (d->tx.bdat) {
+		send_line(d, "BDAT %lld LAST\r\n", (long long)d->tx.body_size);
+	}
+	update_interest(d);
+}
+
+static enum rcpt_status
+status_of(unsigned code)
+{
+	if (code >= 200 && code < 300) {
+		return RCPT_OK;
+	}
+	return code >= 500 ? RCPT_PERM : RCPT_TEMP;
+}
+
+/** asigna `code' a los destinatarios aceptados por RCPT */
+static void
+resolve_accepted(struct transaction* tx, unsigned code)
+{
+	for (size_t i = 0; i < tx->rcpt_qty; i++) {
+		if (tx->status[i] == RCPT_ACCEPTED) {
+			tx->status[i] = status_of(code);
+			tx->code[i] = code;
+		}
+	}
+}
+
+/**
+ * terminó la transacción: borra el mensaje o reescribe el sobre con los
+ * destinatarios que hay que reintentar
+ */
+static void
+finish_message(struct destination* d)
+{
+	struct transaction* tx = &d->tx;
+	struct message* m = tx->msg;
+	size_t temp = 0;
+	for (size_t i = 0; i < tx->rcpt_qty; i++) {
+		if (tx->status[i] == RCPT_ACCEPTED || tx->status[i] == RCPT_PENDING) {
+			// sin respuesta (p.ej. RSET tras un MAIL rechazado): se reintenta
+			tx->status[i] = RCPT_TEMP;
+		}
+		logger_event(LOG_EV_RELAYED, tx->session, i, tx->rcpt_qty, tx->code[i]);
+		if (tx->status[i] == RCPT_PERM) {
+			logf(LOG_ERROR, "Relay: %s: %s rejected by %s (%u)", m->id, tx->rcpt[i], d->host, tx->code[i]);
+			free(tx->rcpt[i]);
+		} else if (tx->status[i] == RCPT_TEMP) {
+			tx->rcpt[temp++] = tx->rcpt[i];
+		} else {
+			free(tx->rcpt[i]);
+		}
+	}
+	const size_t total = tx->rcpt_qty;
+	tx->rcpt_qty = temp;
+
+	if (temp == 0) {
+		remove_files(m->id);
+		end_transaction(d);
+		remove_message(d, m);
+		return;
+	}
+	logf(LOG_INFO, "Relay: %s: %zu of %zu recipients deferred", m->id, temp, total);
+	if (temp < total) {
+		write_envelope(m->id, tx->session, tx->from, (const char* const*)tx->rcpt, temp, tx->stuffed);
+	}
+	end_transaction(d);
+	if (++m->attempts >= RELAY_MAX_ATTEMPTS) {
+		give_up(m->id, m->attempts);
+		remove_message(d, m);
+	} else {
+		m->due_ms = now_ms() + backoff(m->attempts);
+	}
+}
+
+static void
+reset(struct destination* d)
+{
+	d->state = CONN_RSET;
+	send_line(d, "RSET\r\n");
+}
+
+/** respuesta a MAIL, a un RCPT o a DATA */
+static void
+envelope_reply(struct destination* d, unsigned code)
+{
+	struct transaction* tx = &d->tx;
+	const size_t i = tx->replies++;
+	if (i == 0) {
+		tx->mail_code = code;
+		if (status_of(code) != RCPT_OK) {
+			for (size_t r = 0; r < tx->rcpt_qty; r++) {
+				tx->status[r] = status_of(code);
+				tx->code[r] = code;
+			}
+			if (!d->pipelining) {
+				// los RCPT no llegaron a mandarse
+				tx->commands = tx->sent;
+			}
+		}
+	} else if (i <= tx->rcpt_qty) {
+		if (status_of(tx->mail_code) == RCPT_OK) {
+			tx->status[i - 1] = status_of(code) == RCPT_OK ? RCPT_ACCEPTED : status_of(code);
+			tx->code[i - 1] = code;
+			tx->accepted += tx->status[i - 1] == RCPT_ACCEPTED;
+		}
+		if (!d->pipelining && i == tx->rcpt_qty && tx->accepted == 0) {
+			// nadie aceptado: no tiene sentido el DATA
+			tx->commands = tx->sent;
+		}
+	} else {
+		tx->data_code = code;
+	}
+
+	if (tx->replies < tx->commands) {
+		send_commands(d);
+		return;
+	}
+	if (tx->accepted == 0 && tx->data_code == 354) {
+		// con PIPELINING el DATA ya se mandó y el servidor lo aceptó sin
+		// destinatarios: un mensaje vacío cierra la transacción (RFC 2920 3.1)
+		tx->body_done = true;
+		d->state = CONN_BODY;
+		send_line(d, ".\r\n");
+	} else if (tx->accepted == 0) {
+		reset(d);
+	} else if (tx->bdat || tx->data_code == 354) {
+		start_body(d);
+	} else {
+		resolve_accepted(tx, code);
+		reset(d);
+	}
+}
+
+static void
+on_reply(struct destination* d, unsigned code, const char* text)
+{
+	if (d->state == CONN_IDLE) {
+		// nadie preguntó nada: suele ser un 421 antes de cerrar por inactividad
+		close_connection(d);
+		schedule_wake(d);
+		return;
+	}
+	if (code == 421 && d->state != CONN_QUIT) {
+		fail_connection(d, text);
+		return;
+	}
+	selector_timer_schedule(selector, &d->timer, RELAY_TIMEOUT_MS);
+	switch (d->state) {
+		case CONN_GREETING:
+			if (code != 220) {
+				fail_connection(d, text);
+				return;
+			}
+			d->pipelining = d->chunking = false;
+			d->state = CONN_EHLO;
+			send_line(d, "EHLO %s\r\n", RELAY_HELO_DOMAIN);
+			break;
+		case CONN_EHLO:
+			if (status_of(code) == RCPT_OK) {
+				ready(d);
+			} else if (status_of(code) == RCPT_PERM) {
+				d->state = CONN_HELO;
+				send_line(d, "HELO %s\r\n", RELAY_HELO_DOMAIN);
+			} else {
+				fail_connection(d, text);
+			}
+			break;
+		case CONN_HELO:
+			if (status_of(code) == RCPT_OK) {
+				ready(d);
+			} else {
+				fail_connection(d, text);
+			}
+			break;
+		case CONN_ENVELOPE:
+			envelope_reply(d, code);
+			break;
+		case CONN_BODY:
+			resolve_accepted(&d->tx, code);
+			finish_message(d);
+			ready(d);
+			break;
+		case CONN_RSET:
+			finish_message(d);
+			if (status_of(code) == RCPT_OK) {
+				ready(d);
+			} else {
+				quit(d);
+			}
+			break;
+		case CONN_QUIT:
+			close_connection(d);
+			schedule_wake(d);
+			break;
+		default:
+			fail_connection(d, text);
+			break;
+	}
+}
+
+/** una línea de respuesta completa, sin el CRLF */
+static void
+on_line(struct destination* d, const char* line)
+{
+	if (strlen(line) < 3 || !isdigit((unsigned char)line[0]) || !isdigit((unsigned char)line[1]) ||
+	    !isdigit((unsigned char)line[2])) {
+		fail_connection(d, "malformed reply");
+		return;
+	}
+	if (d->state == CONN_EHLO && strlen(line) > 4) {
+		const char* keyword = line + 4;
+		if (strcasecmp(keyword, "PIPELINING") == 0) {
+			d->pipelining = true;
+		} else if (strcasecmp(keyword, "CHUNKING") == 0) {
+			d->chunking = true;
+		}
+	}
+	if (line[3] == '-') {
+		// sigue en la próxima línea
+		return;
+	}
+	on_reply(d, (unsigned)strtoul(line, NULL, 10), line);
+}
+
+static void
+relay_read(struct selector_key* key)
+{
+	struct destination* d = key->data;
+	char buf[LINE_SIZE];
+	const ssize_t n = recv(d->fd, buf, sizeof(buf), 0);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (n <= 0) {
+		if (d->state == CONN_IDLE || d->state == CONN_QUIT) {
+			// el servidor cerró una conexión que no estábamos usando
+			close_connection(d);
+			schedule_wake(d);
+		} else {
+			fail_connection(d, n == 0 ? "connection closed" : strerror(errno));
+		}
+		return;
+	}
+	for (ssize_t i = 0; i < n; i++) {
+		if (buf[i] != '\n') {
+			if (d->line_len < sizeof(d->line) - 1) {
+				d->line[d->line_len++] = buf[i];
+			}
+			continue;
+		}
+		if (d->line_len > 0 && d->line[d->line_len - 1] == '\r') {
+			d->line_len--;
+		}
+		d->line[d->line_len] = '\0';
+		d->line_len = 0;
+		const int fd = d->fd;
+		on_line(d, d->line);
+		if (d->fd != fd) {
+			// la respuesta cerró la conexión
+			return;
+		}
+	}
+}
+
+static void
+relay_write(struct selector_key* key)
+{
+	struct destination* d = key->data;
+	if (d->state == CONN_CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(d->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+			fail_connection(d, strerror(err != 0 ? err : errno));
+			return;
+		}
+		d->state = CONN_GREETING;
+		update_interest(d);
+		return;
+	}
+	if (d->state == CONN_BODY && !d->tx.body_done && buffer_chain_len(&d->output) < BODY_CHUNK &&
+	    fill_body(d) != 0) {
+		fail_connection(d, "error reading message");
+		return;
+	}
+	if (buffer_chain_can_read(&d->output) && buffer_chain_send(&d->output, d->fd, MSG_NOSIGNAL) < 0 &&
+	    errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		fail_connection(d, strerror(errno));
+		return;
+	}
+	update_interest(d);
+}
+
+/** vence esperando una respuesta, o tras RELAY_IDLE_MS sin mensajes */
+static void
+timer_handler(struct wheel_timer* t, void* data)
+{
+	(void)t;
+	struct destination* d = data;
+	if (d->state == CONN_IDLE) {
+		quit(d);
+	} else if (d->state == CONN_QUIT) {
+		close_connection(d);
+		schedule_wake(d);
+	} else {
+		fail_connection(d, "timeout");
+	}
+}
+
+static void
+wake_handler(struct wheel_timer* t, void* data)
+{
+	(void)t;
+	pump(data);
+}
+
+/** arranca el próximo mensaje vencido, conectando si hace falta */
+static void
+pump(struct destination* d)
+{
+	const uint64_t now = now_ms();
+	if (d->state == CONN_NONE) {
+		if (next_message(d, now) != NULL && now >= d->retry_at) {
+			connect_to(d);
+			return;
+		}
+	} else if (d->state == CONN_IDLE) {
+		struct message* m;
+		while ((m = next_message(d, now)) != NULL) {
+			const enum start r = start_transaction(d, m);
+			if (r == START_OK) {
+				return;
+			}
+			if (r == START_GONE) {
+				remove_message(d, m);
+			} else {
+				m->due_ms = now + RELAY_RETRY_MS;
+			}
+		}
+	}
+	schedule_wake(d);
+}
+
+/* ----------------------------------------------------------------------------
+ * inicialización
+ */
+
+/** resuelve `host' y arma un salto sin conexión */
+static struct destination*
+new_destination(const char* host, const char* port)
+{
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct addrinfo* res;
+	const int err = getaddrinfo(host, port, &hints, &res);
+	if (err != 0) {
+		logf(LOG_ERROR, "Relay: resolving %s: %s", host, gai_strerror(err));
+		return NULL;
+	}
+	struct destination* d = calloc(1, sizeof(*d));
+	if (d != NULL) {
+		snprintf(d->host, sizeof(d->host), "%s", host);
+		snprintf(d->port, sizeof(d->port), "%s", port);
+		memcpy(&d->addr, res->ai_addr, res->ai_addrlen);
+		d->addr_len = res->ai_addrlen;
+		d->fd = -1;
+		buffer_chain_init(&d->output, OUTPUT_LIMIT);
+		wheel_timer_init(&d->timer, timer_handler, d);
+		wheel_timer_init(&d->wake, wake_handler, d);
+		hops[hops_qty++] = d;
+	}
+	freeaddrinfo(res);
+	return d;
+}
+
+static int
+load_routes(const char* file)
+{
+	FILE* f = fopen(file, "r");
+	if (f == NULL) {
+		if (errno == ENOENT) {
+			return 0;
+		}
+		logf(LOG_ERROR, "Relay: opening %s: %s", file, strerror(errno));
+		return -1;
+	}
+	char* line = NULL;
+	size_t cap = 0;
+	unsigned n = 0;
+	int ret = 0;
+	while (ret == 0 && getline(&line, &cap, f) > 0) {
+		n++;
+		char* comment = strchr(line, '#');
+		if (comment != NULL) {
+			*comment = '\0';
+		}
+		char domain[HOST_SIZE], host[HOST_SIZE], port[PORT_SIZE];
+		const int fields = sscanf(line, "%255s %255s %7s", domain, host, port);
+		if (fields <= 0) {
+			continue;
+		}
+		if (fields != 3 || routes_qty == MAX_ROUTES) {
+			logf(LOG_ERROR, "Relay: %s:%u: expected <domain> <host> <port>", file, n);
+			ret = -1;
+			break;
+		}
+		struct destination* d = NULL;
+		for (size_t h = 0; h < hops_qty && d == NULL; h++) {
+			if (strcmp(hops[h]->host, host) == 0 && strcmp(hops[h]->port, port) == 0) {
+				d = hops[h];
+			}
+		}
+		if (d == NULL && (d = new_destination(host, port)) == NULL) {
+			logf(LOG_ERROR, "Relay: %s:%u: unable to use %s:%s", file, n, host, port);
+			ret = -1;
+			break;
+		}
+		snprintf(routes[routes_qty].domain, sizeof(routes[routes_qty].domain), "%s", domain);
+		routes[routes_qty++].d = d;
+	}
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+/** `<dirección>[/<bits>]'. @return 0, o -1 si no es una red */
+static int
+parse_client_net(const char* text, struct client_net* net)
+{
+	char addr[INET6_ADDRSTRLEN];
+	const size_t len = strcspn(text, "/");
+	if (len >= sizeof(addr)) {
+		return -1;
+	}
+	memcpy(addr, text, len);
+	addr[len] = '\0';
+	net->family = strchr(addr, ':') != NULL ? AF_INET6 : AF_INET;
+	const unsigned bits = net->family == AF_INET6 ? 128 : 32;
+	if (inet_pton(net->family, addr, net->addr) != 1) {
+		return -1;
+	}
+	net->prefix = bits;
+	if (text[len] == '/') {
+		char* end;
+		const unsigned long prefix = strtoul(text + len + 1, &end, 10);
+		if (end == text + len + 1 || *end != '\0' || prefix > bits) {
+			return -1;
+		}
+		net->prefix = prefix;
+	}
+	return 0;
+}
+
+/** sin archivo sólo se confía en los clientes de la misma máquina */
+static int
+load_clients(const char* file)
+{
+	FILE* f = fopen(file, "r");
+	if (f == NULL) {
+		if (errno != ENOENT) {
+			logf(LOG_ERROR, "Relay: opening %s: %s", file, strerror(errno));
+			return -1;
+		}
+		parse_client_net("127.0.0.0/8", &clients[clients_qty++]);
+		parse_client_net("::1", &clients[clients_qty++]);
+		return 0;
+	}
+	char* line = NULL;
+	size_t cap = 0;
+	unsigned n = 0;
+	int ret = 0;
+	while (ret == 0 && getline(&line, &cap, f) > 0) {
+		n++;
+		char* comment = strchr(line, '#');
+		if (comment != NULL) {
+			*comment = '\0';
+		}
+		char net[INET6_ADDRSTRLEN + 5];
+		const int fields = sscanf(line, "%50s", net);
+		if (fields <= 0) {
+			continue;
+		}
+		if (clients_qty == MAX_CLIENTS || parse_client_net(net, &clients[clients_qty]) != 0) {
+			logf(LOG_ERROR, "Relay: %s:%u: expected <address>[/<prefix>]", file, n);
+			ret = -1;
+			break;
+		}
+		clients_qty++;
+	}
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+/** el salto de un sobre encontrado en disco, según su primer destinatario */
+static struct destination*
+route_of_envelope(const char* id)
+{
+	char path[PATH_SIZE];
+	relay_path(path, id, ENVELOPE_EXT);
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		return NULL;
+	}
+	struct transaction tx;
+	memset(&tx, 0, sizeof(tx));
+	struct destination* d = NULL;
+	if (read_envelope(f, &tx) == 0) {
+		d = route_for(domain_of(tx.rcpt[0]));
+		if (d == NULL) {
+			logf(LOG_ERROR, "Relay: no route for %s in %s", tx.rcpt[0], id);
+			give_up(id, 0);
+		}
+		free_rcpt(&tx);
+	}
+	fclose(f);
+	return d;
+}
+
+/** encola los sobres del directorio que no conocíamos */
+static void
+scan(bool remove_stale)
+{
+	DIR* dir = opendir(RELAY_DIR);
+	if (dir == NULL) {
+		logf(LOG_ERROR, "Relay: opendir %s: %s", RELAY_DIR, strerror(errno));
+		return;
+	}
+	const time_t now = time(NULL);
+	const uint64_t due = now_ms();
+	struct dirent* e;
+	while ((e = readdir(dir)) != NULL) {
+		const size_t len = strlen(e->d_name);
+		const size_t ext = strlen(ENVELOPE_EXT);
+		if (len > ext && len - ext < RELAY_ID_SIZE && strcmp(e->d_name + len - ext, ENVELOPE_EXT) == 0) {
+			char id[RELAY_ID_SIZE];
+			snprintf(id, sizeof(id), "%.*s", (int)(len - ext), e->d_name);
+			struct destination* d;
+			if (find_message(id) == NULL && (d = route_of_envelope(id)) != NULL) {
+				add_message(d, id, due);
+				schedule_wake(d);
+			}
+		} else if (remove_stale && len > ext && (strcmp(e->d_name + len - ext, TEMP_EXT) == 0 ||
+		                                          strcmp(e->d_name + len - ext, MESSAGE_EXT) == 0)) {
+			// temporales de sobres, y mensajes cuyo sobre nunca se escribió o ya se borró
+			char env[PATH_SIZE];
+			snprintf(env, sizeof(env), "%s/%.*s%s", RELAY_DIR, (int)(len - ext), e->d_name, ENVELOPE_EXT);
+			struct stat st;
+			if (access(env, F_OK) != 0 && fstatat(dir_fd, e->d_name, &st, 0) == 0 && now - st.st_mtime > STALE_S) {
+				unlinkat(dir_fd, e->d_name, 0);
+			}
+		}
+	}
+	closedir(dir);
+}
+
+static void
+scan_handler(struct wheel_timer* t, void* data)
+{
+	(void)data;
+	scan(false);
+	selector_timer_schedule(selector, t, RELAY_SCAN_INTERVAL_MS);
+}
+
+int
+relay_init(fd_selector s, const char* routes_file, const char* clients_file)
+{
+	selector = s;
+	if (load_clients(clients_file) != 0 || load_routes(routes_file) != 0) {
+		relay_finalize();
+		return -1;
+	}
+	if (routes_qty == 0) {
+		return 0;
+	}
+	if (mkdir(RELAY_DIR, S_IRWXU | S_IRWXG | S_IRWXO) != 0 && errno != EEXIST) {
+		logf(LOG_ERROR, "Relay: creating %s: %s", RELAY_DIR, strerror(errno));
+		relay_finalize();
+		return -1;
+	}
+	dir_fd = open(RELAY_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	stopping = false;
+	if (SPOOL_FSYNC && pthread_create(&committer, NULL, committer_main, NULL) != 0) {
+		logf(LOG_ERROR, "Relay: pthread_create: %s", strerror(errno));
+		relay_finalize();
+		return -1;
+	}
+	committer_started = SPOOL_FSYNC;
+
+	scan(true);
+	if (relay_pending() > 0) {
+		logf(LOG_INFO, "Relay: %zu messages pending from a previous run", relay_pending());
+	}
+	logf(LOG_INFO, "Relay: %zu routes to %zu hosts loaded from %s", routes_qty, hops_qty, routes_file);
+	wheel_timer_init(&scan_timer, scan_handler, NULL);
+	selector_timer_schedule(selector, &scan_timer, RELAY_SCAN_INTERVAL_MS);
+	return 0;
+}
+
+bool
+relay_has_route(const char* domain)
+{
+	return route_for(domain) != NULL;
+}
+
+bool
+relay_allowed(const struct sockaddr_storage* client)
+{
+	int family = client->ss_family;
+	const uint8_t* addr;
+	if (family == AF_INET) {
+		addr = (const uint8_t*)&((const struct sockaddr_in*)client)->sin_addr;
+	} else if (family == AF_INET6) {
+		addr = (const uint8_t*)&((const struct sockaddr_in6*)client)->sin6_addr;
+		// un cliente IPv4 en un socket IPv6 (::ffff:a.b.c.d) se compara con las redes IPv4
+		static const uint8_t mapped[12] = { [10] = 0xff, [11] = 0xff };
+		if (memcmp(addr, mapped, sizeof(mapped)) == 0) {
+			family = AF_INET;
+			addr += sizeof(mapped);
+		}
+	} else {
+		return false;
+	}
+	for (size_t i = 0; i < clients_qty; i++) {
+		const struct client_net* net = &clients[i];
+		if (net->family != family) {
+			continue;
+		}
+		const unsigned bytes = net->prefix / 8, bits = net->prefix % 8;
+		if (memcmp(addr, net->addr, bytes) != 0) {
+			continue;
+		}
+		const uint8_t mask = (uint8_t)(0xff << (8 - bits));
+		if (bits == 0 || (addr[bytes] & mask) == (net->addr[bytes] & mask)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/** fsync de `path', sólo de los datos si `data_only' */
+static int
+sync_file(const char* path, bool data_only)
+{
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || (data_only ? fdatasync(fd) : fsync(fd)) != 0) {
+		logf(LOG_ERROR, "Relay: syncing %s: %s", path, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+/** borra los sobres, sus temporales y los enlaces al mensaje de un commit */
+static void
+remove_commit_files(struct relay_commit* c)
+{
+	for (size_t h = 0; h < c->groups_qty; h++) {
+		remove_files(c->groups[h].id);
+	}
+}
+
+/**
+ * agrupa los destinatarios por próximo salto y escribe, por grupo, un enlace
+ * al mensaje y el sobre en su temporal. Sin fsync: eso es de commit_batch
+ */
+static struct relay_commit*
+commit_new(uint32_t session, const char* from, const char* const* rcpt, size_t rcpt_qty, const char* data_path,
+           const char* id, bool stuffed)
+{
+	if (rcpt_qty == 0 || has_newline(from) || strlen(data_path) >= FIELD_SIZE) {
+		return NULL;
+	}
+	// grupos por próximo salto, en el orden en que aparecen
+	struct destination* groups[rcpt_qty];
+	size_t groups_qty = 0;
+	for (size_t i = 0; i < rcpt_qty; i++) {
+		struct destination* d = route_for(domain_of(rcpt[i]));
+		if (d == NULL || has_newline(rcpt[i])) {
+			logf(LOG_ERROR, "Relay: no route for %s", rcpt[i]);
+			return NULL;
+		}
+		size_t h = 0;
+		while (h < groups_qty && groups[h] != d) {
+			h++;
+		}
+		if (h == groups_qty) {
+			groups[groups_qty++] = d;
+		}
+	}
+	struct relay_commit* c = calloc(1, sizeof(*c) + groups_qty * sizeof(c->groups[0]));
+	if (c == NULL) {
+		logf(LOG_ERROR, "Relay: no memory to queue %s", id);
+		return NULL;
+	}
+	snprintf(c->data_path, sizeof(c->data_path), "%s", data_path);
+
+	const char* group[rcpt_qty];
+	for (size_t h = 0; h < groups_qty; h++) {
+		size_t n = 0;
+		for (size_t i = 0; i < rcpt_qty; i++) {
+			if (route_for(domain_of(rcpt[i])) == groups[h]) {
+				group[n++] = rcpt[i];
+			}
+		}
+		struct relay_group* g = &c->groups[c->groups_qty++];
+		g->d = groups[h];
+		snprintf(g->id, RELAY_ID_SIZE, "%s.%zu", id, h);
+		char msg[PATH_SIZE];
+		relay_path(msg, g->id, MESSAGE_EXT);
+		const bool linked = link(data_path, msg) == 0;
+		if (!linked) {
+			logf(LOG_ERROR, "Relay: linking %s to %s: %s", data_path, msg, strerror(errno));
+		}
+		if (!linked || write_temp_envelope(g->id, session, from, group, n, stuffed) != 0) {
+			remove_commit_files(c);
+			free(c);
+			return NULL;
+		}
+	}
+	return c;
+}
+
+/** el mensaje y los sobres temporales de un commit a disco */
+static bool
+commit_sync(struct relay_commit* c)
+{
+	if (sync_file(c->data_path, true) != 0) {
+		return false;
+	}
+	for (size_t h = 0; h < c->groups_qty; h++) {
+		char tmp[PATH_SIZE];
+		relay_path(tmp, c->groups[h].id, TEMP_EXT);
+		if (sync_file(tmp, false) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool
+commit_rename(struct relay_commit* c)
+{
+	for (size_t h = 0; h < c->groups_qty; h++) {
+		if (rename_envelope(c->groups[h].id) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * publica los sobres de una tanda de commits, dejando en `renamed' cuáles
+ * quedaron en disco. Los que fallan se borran. Sin el mutex
+ */
+static void
+commit_batch(struct relay_commit* batch)
+{
+	size_t synced = 0;
+	for (struct relay_commit* c = batch; c != NULL; c = c->next) {
+		c->synced = !SPOOL_FSYNC || commit_sync(c);
+		synced += c->synced;
+	}
+	// los enlaces al mensaje tienen que estar en disco antes que los sobres que los usan
+	if (SPOOL_FSYNC && synced > 0 && fsync(dir_fd) != 0) {
+		logf(LOG_ERROR, "Relay: syncing %s: %s", RELAY_DIR, strerror(errno));
+		for (struct relay_commit* c = batch; c != NULL; c = c->next) {
+			c->synced = false;
+		}
+	}
+	size_t renamed = 0;
+	for (struct relay_commit* c = batch; c != NULL; c = c->next) {
+		c->renamed = c->synced && commit_rename(c);
+		renamed += c->renamed;
+	}
+	if (SPOOL_FSYNC && renamed > 0 && fsync(dir_fd) != 0) {
+		logf(LOG_ERROR, "Relay: syncing %s: %s", RELAY_DIR, strerror(errno));
+		for (struct relay_commit* c = batch; c != NULL; c = c->next) {
+			c->renamed = false;
+		}
+	}
+	for (struct relay_commit* c = batch; c != NULL; c = c->next) {
+		if (!c->renamed) {
+			remove_commit_files(c);
+		}
+	}
+}
+
+/** pone los mensajes de un commit terminado en la cola de sus saltos */
+static void
+commit_queue(struct relay_commit* c)
+{
+	const uint64_t now = now_ms();
+	for (size_t h = 0; h < c->groups_qty; h++) {
+		// puede haberlo encontrado un escaneo desde el rename
+		if (find_message(c->groups[h].id) == NULL) {
+			add_message(c->groups[h].d, c->groups[h].id, now);
+		}
+		// se arranca después de despachar la E/S, así quien llama todavía puede cancelarlo
+		schedule_wake(c->groups[h].d);
+	}
+}
+
+/** suelta una referencia a un commit. Con el mutex tomado */
+static void
+commit_put(struct relay_commit* c)
+{
+	if (--c->refs > 0) {
+		return;
+	}
+	if (c->abandoned && c->status == SPOOL_COMMIT_DONE) {
+		remove_commit_files(c);
+	}
+	free(c);
+}
+
+/**
+ * hace los commits de a tandas: todos los que llegaron mientras se
+ * sincronizaba la anterior comparten los fsync de RELAY_DIR
+ */
+static void*
+committer_main(void* arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&mutex);
+	for (;;) {
+		if (commits == NULL) {
+			if (stopping) {
+				break;
+			}
+			pthread_cond_wait(&commit_wakeup, &mutex);
+			continue;
+		}
+		struct relay_commit* batch = commits;
+		commits = NULL;
+		commits_tail = &commits;
+		pthread_mutex_unlock(&mutex);
+
+		commit_batch(batch);
+
+		pthread_mutex_lock(&mutex);
+		for (struct relay_commit* c = batch; c != NULL; c = c->next) {
+			c->status = c->renamed ? SPOOL_COMMIT_DONE : SPOOL_COMMIT_FAILED;
+			c->waiting = c->refs > 1;
+		}
+		pthread_mutex_unlock(&mutex);
+		// sin el mutex: quien recibe el aviso consulta el estado
+		for (struct relay_commit* c = batch; c != NULL; c = c->next) {
+			if (c->waiting) {
+				c->notify(c->ctx, c->fd);
+			}
+		}
+		pthread_mutex_lock(&mutex);
+		while (batch != NULL) {
+			struct relay_commit* next = batch->next;
+			commit_put(batch);
+			batch = next;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+int
+relay_enqueue(uint32_t session, const char* from, const char* const* rcpt, size_t rcpt_qty,
+              const char* data_path, const char* id, bool stuffed)
+{
+	if (rcpt_qty == 0) {
+		return 0;
+	}
+	struct relay_commit* c = commit_new(session, from, rcpt, rcpt_qty, data_path, id, stuffed);
+	if (c == NULL) {
+		return -1;
+	}
+	commit_batch(c);
+	const int ret = c->renamed ? 0 : -1;
+	if (c->renamed) {
+		commit_queue(c);
+	}
+	free(c);
+	return ret;
+}
+
+struct relay_commit*
+relay_submit(uint32_t session, const char* from, const char* const* rcpt, size_t rcpt_qty,
+             const char* data_path, const char* id, bool stuffed, spool_notify_fn notify, void* ctx, int fd)
+{
+	struct relay_commit* c = commit_new(session, from, rcpt, rcpt_qty, data_path, id, stuffed);
+	if (c == NULL) {
+		return NULL;
+	}
+	c->notify = notify;
+	c->ctx = ctx;
+	c->fd = fd;
+	if (!SPOOL_FSYNC || !committer_started) {
+		// no hay nada que esperar
+		commit_batch(c);
+		if (!c->renamed) {
+			free(c);
+			return NULL;
+		}
+		c->status = SPOOL_COMMIT_DONE;
+		c->refs = 1;
+		return c;
+	}
+	c->status = SPOOL_COMMIT_PENDING;
+	c->refs = 2;
+	pthread_mutex_lock(&mutex);
+	*commits_tail = c;
+	commits_tail = &c->next;
+	pthread_cond_signal(&commit_wakeup);
+	pthread_mutex_unlock(&mutex);
+	return c;
+}
+
+spool_commit_status
+relay_commit_status_of(struct relay_commit* commit)
+{
+	pthread_mutex_lock(&mutex);
+	const spool_commit_status ret = commit->status;
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
+
+void
+relay_commit_release(struct relay_commit* commit)
+{
+	if (commit == NULL) {
+		return;
+	}
+	const spool_commit_status status = relay_commit_status_of(commit);
+	if (status == SPOOL_COMMIT_DONE && hops_qty > 0) {
+		commit_queue(commit);
+	}
+	pthread_mutex_lock(&mutex);
+	commit->abandoned = status == SPOOL_COMMIT_PENDING;
+	commit_put(commit);
+	pthread_mutex_unlock(&mutex);
+}
+
+void
+relay_cancel(const char* id)
+{
+	const size_t len = strlen(id);
+	for (size_t i = 0; i < hops_qty; i++) {
+		struct destination* d = hops[i];
+		struct message* m = d->queue;
+		while (m != NULL) {
+			struct message* next = m->next;
+			const bool started = d->in_tx && d->tx.msg == m;
+			if (!started && strncmp(m->id, id, len) == 0 && m->id[len] == '.') {
+				remove_files(m->id);
+				remove_message(d, m);
+			}
+			m = next;
+		}
+		schedule_wake(d);
+	}
+}
+
+size_t
+relay_pending(void)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < hops_qty; i++) {
+		n += hops[i]->queue_qty;
+	}
+	return n;
+}
+
+void
+relay_finalize(void)
+{
+	// termina los commits que quedaban: sus sobres ya están escritos
+	if (committer_started) {
+		pthread_mutex_lock(&mutex);
+		stopping = true;
+		pthread_cond_signal(&commit_wakeup);
+		pthread_mutex_unlock(&mutex);
+		pthread_join(committer, NULL);
+		committer_started = false;
+	}
+	for (size_t i = 0; i < hops_qty; i++) {
+		struct destination* d = hops[i];
+		end_transaction(d);
+		close_connection(d);
+		selector_timer_cancel(selector, &d->wake);
+		while (d->queue != NULL) {
+			remove_message(d, d->queue);
+		}
+		free(d);
+		hops[i] = NULL;
+	}
+	if (hops_qty > 0) {
+		selector_timer_cancel(selector, &scan_timer);
+	}
+	hops_qty = 0;
+	routes_qty = 0;
+	clients_qty = 0;
+	if (dir_fd >= 0) {
+		close(dir_fd);
+		dir_fd = -1;
+	}
+}
@@ -23,9 +23,67 @@ request_parser_init(struct request_parser* p)
 	memset(p->request, 0, sizeof(*(p->request)));
 }
 
+/** un comando sin argumentos debe ser uno de estos (ver `verb') */
+static bool
+smtp_bare_verb(const uint8_t* v, size_t n)
+{
+	static const char* const bare[] = { DATA, RSET, QUIT, NOOP };
+	for (size_t i = 0; i < sizeof(bare) / sizeof(*bare); i++) {
+		const size_t len = strlen(bare[i]);
+		if (n >= len && strncasecmp((const char*)v, bare[i], len) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+extern bool
+request_consume_line(buffer* b, struct request_parser* p, bool (*bare)(const uint8_t* verb, size_t n))
+{
+	if (p->state != request_verb || p->i != 0) {
+		return false;
+	}
+	size_t n;
+	const uint8_t* line = buffer_read_ptr(b, &n);
+	const uint8_t* cr = memchr(line, '\r', n);
+	if (cr == NULL || (size_t)(cr - line) + 1 >= n || cr[1] != '\n') {
+		return false;
+	}
+	const size_t line_len = cr - line;
+	const uint8_t* sp = memchr(line, ' ', line_len);
+	const size_t verb_len = sp == NULL ? line_len : (size_t)(sp - line);
+	if (verb_len >= sizeof(p->request->verb)) {
+		return false;
+	}
+
+	if (sp == NULL) {
+		if (!bare(line, verb_len)) {
+			return false;
+		}
+		memcpy(p->request->verb, line, verb_len);
+		p->request->verb[verb_len] = '\0';
+	} else {
+		const size_t arg_len = line_len - verb_len - 1;
+		if (arg_len >= sizeof(p->request->arg)) {
+			return false;
+		}
+		memcpy(p->request->verb, line, verb_len);
+		p->request->verb[verb_len] = '\0';
+		memcpy(p->request->arg, sp + 1, arg_len);
+		p->request->arg[arg_len] = '\0';
+	}
+
+	buffer_read_adv(b, line_len + 2);
+	p->state = request_done;
+	return true;
+}
+
 extern enum request_state
 request_consume(buffer* b, struct request_parser* p, bool* errored)
 {
+	if (request_consume_line(b, p, smtp_bare_verb)) {
+		return p->state;
+	}
 	enum request_state st = p->state;
 
 	while (buffer_can_read(b)) {
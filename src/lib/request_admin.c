@@ -15,9 +15,20 @@ request_parser_admin_init(struct request_parser* p)
 	memset(p->request, 0, sizeof(*(p->request)));
 }
 
+/** el único comando de admin sin argumentos (ver `command') */
+static bool
+admin_bare_verb(const uint8_t* v, size_t n)
+{
+	const size_t len = strlen(XQUIT_VERB);
+	return n >= len && strncasecmp((const char*)v, XQUIT_VERB, len) == 0;
+}
+
 extern enum request_state
 request_consume_admin(buffer* b, struct request_parser* p, bool* errored)
 {
+	if (request_consume_line(b, p, admin_bare_verb)) {
+		return p->state;
+	}
 	enum request_state st = p->state;
 
 	while (buffer_can_read(b)) {
@@ -89,6 +100,8 @@ command(const uint8_t c, struct request_parser* p)
 	if (p->i < sizeof(p->request->verb) - 1) {
 		p->request->verb[p->i++] = (char)c;
 		next = request_verb;
+	} else {
+		next = request_error;
 	}
 	return next;
 }
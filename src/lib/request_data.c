@@ -103,7 +103,8 @@ body(const uint8_t c, struct request_parser* p)
 	switch (c) {
 		case '\r':
 			if (p->i > 1 && p->request->data[p->i - 1] == '.' && p->request->data[p->i - 2] == '\n') {
-				p->request->data[p->i - 3] = '\0';
+				// si el bloque empieza en "\n." el '\r' quedó en el bloque anterior
+				p->request->data[p->i > 2 ? p->i - 3 : 0] = '\0';
 				// write_partial(*p->output_fd, p->request->data, p->i - 3);
 				return request_cr;
 			}
@@ -129,3 +130,20 @@ body(const uint8_t c, struct request_parser* p)
 	return next;
 }
 
+
+extern void
+request_parser_chunk_init(struct request_parser* p, unsigned int n)
+{
+	p->n = n;
+	p->i = 0;
+	p->state = n == 0 ? request_done : request_chunk;
+}
+
+extern enum request_state
+request_consume_chunk(buffer* b, struct request_parser* p, bool* errored)
+{
+	(void)b;
+	(void)errored;
+	p->state = p->i < p->n ? request_chunk : request_done;
+	return p->state;
+}
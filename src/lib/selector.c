@@ -3,6 +3,8 @@
  */
 #include "selector.h"
 
+#include "logger.h"
+
 #include <assert.h>  // :)
 #include <errno.h>   // :)
 #include <fcntl.h>
@@ -21,6 +23,9 @@
 
 #define ERROR_DEFAULT_MSG "something failed"
 
+/** granularidad de los timers del selector */
+#define SELECTOR_TIMER_TICK_MS 100
+
 /** retorna una descripción humana del fallo */
 const char*
 selector_error(const selector_status status)
@@ -51,7 +56,7 @@ selector_error(const selector_status status)
 static void
 wake_handler(const int signal)
 {
-	printf("Tengo que hacer algo con este parámetro %d", signal);
+	(void)signal;
 	// nada que hacer. está solo para interrumpir el select
 }
 
@@ -164,6 +169,9 @@ struct fdselector
 	 * notificados.
 	 */
 	struct blocking_job* resolution_jobs;
+
+	/** timers (timeouts de sesión, reintentos, ...) */
+	timer_wheel timers;
 };
 
 /** cantidad máxima de file descriptors que la plataforma puede manejar */
@@ -310,7 +318,8 @@ selector_new(const size_t initial_elements)
 		assert(ret->max_fd == 0);
 		ret->resolution_jobs = 0;
 		pthread_mutex_init(&ret->resolution_mutex, 0);
-		if (0 != ensure_capacity(ret, initial_elements)) {
+		ret->timers = timer_wheel_new(SELECTOR_TIMER_TICK_MS, timer_wheel_now_ms());
+		if (NULL == ret->timers || 0 != ensure_capacity(ret, initial_elements)) {
 			selector_destroy(ret);
 			ret = NULL;
 		}
@@ -343,6 +352,7 @@ selector_destroy(fd_selector s)
 			s->fds = NULL;
 			s->fd_size = 0;
 		}
+		timer_wheel_destroy(s->timers);
 		free(s);
 	}
 }
@@ -508,7 +518,8 @@ handle_block_notifications(fd_selector s)
 	struct blocking_job* j = s->resolution_jobs;
 	while (j != NULL) {
 		struct item* item = s->fds + j->fd;
-		if (ITEM_USED(item)) {
+		// el fd pudo cerrarse y reusarse para otra cosa mientras tanto
+		if (ITEM_USED(item) && item->handler->handle_block != NULL) {
 			key.fd = item->fd;
 			key.data = item->data;
 			item->handler->handle_block(&key);
@@ -549,6 +560,45 @@ finally:
 	return ret;
 }
 
+selector_status
+selector_timer_schedule(fd_selector s, struct wheel_timer* t, const uint64_t ms)
+{
+	if (NULL == s || NULL == t || NULL == t->on_expire) {
+		return SELECTOR_IARGS;
+	}
+	timer_wheel_schedule(s->timers, t, timer_wheel_now_ms(), ms);
+	return SELECTOR_SUCCESS;
+}
+
+selector_status
+selector_timer_cancel(fd_selector s, struct wheel_timer* t)
+{
+	if (NULL == s || NULL == t) {
+		return SELECTOR_IARGS;
+	}
+	timer_wheel_cancel(s->timers, t);
+	return SELECTOR_SUCCESS;
+}
+
+/**
+ * acota el timeout del select al próximo vencimiento de un timer, así los
+ * timeouts se disparan a tiempo sin tener que recorrer las sesiones.
+ */
+static void
+compute_select_timeout(fd_selector s)
+{
+	memcpy(&s->slave_t, &s->master_t, sizeof(s->slave_t));
+
+	const int64_t next = timer_wheel_next_ms(s->timers, timer_wheel_now_ms());
+	if (next >= 0) {
+		const int64_t master_ms = (int64_t)s->master_t.tv_sec * 1000 + s->master_t.tv_nsec / 1000000;
+		if (next < master_ms) {
+			s->slave_t.tv_sec = next / 1000;
+			s->slave_t.tv_nsec = (next % 1000) * 1000000;
+		}
+	}
+}
+
 selector_status
 selector_select(fd_selector s)
 {
@@ -556,7 +606,7 @@ selector_select(fd_selector s)
 
 	memcpy(&s->slave_r, &s->master_r, sizeof(s->slave_r));
 	memcpy(&s->slave_w, &s->master_w, sizeof(s->slave_w));
-	memcpy(&s->slave_t, &s->master_t, sizeof(s->slave_t));
+	compute_select_timeout(s);
 
 	s->selector_thread = pthread_self();
 
@@ -573,7 +623,7 @@ selector_select(fd_selector s)
 				for (int i = 0; i < s->max_fd; i++) {
 					if (FD_ISSET(i, &s->master_r) || FD_ISSET(i, &s->master_w)) {
 						if (-1 == fcntl(i, F_GETFD, 0)) {
-							fprintf(stderr, "Bad descriptor detected: %d\n", i);
+							logf(LOG_ERROR, "Bad descriptor detected: %d", i);
 						}
 					}
 				}
@@ -588,6 +638,7 @@ selector_select(fd_selector s)
 	}
 	if (ret == SELECTOR_SUCCESS) {
 		handle_block_notifications(s);
+		timer_wheel_advance(s->timers, timer_wheel_now_ms());
 	}
 finally:
 	return ret;
@@ -51,27 +51,36 @@ Cada estado va a tener un handlers que hay que definir
 
 */
 
+#define _GNU_SOURCE  // accept4
 #include "smtp.h"
 
 #include "access_registry.h"
 #include "buffer.h"
+#include "conn_table.h"
 #include "logger.h"
 #include "process.h"
+#include "relay.h"
 #include "request.h"
 #include "selector.h"
 #include "states.h"
+#include "transform.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <monitor.h>
 #include <netdb.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <signal.h>
+#include <sys/pidfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -79,6 +88,10 @@ Cada estado va a tener un handlers que hay que definir
 #define MAILBOX_INNER_DIR_SIZE 3  // cur, new, tmp (3)
 
 char* welcome_message = "220 local ESMTP Postfix (Ubuntu)\n";
+char* timeout_message = "421 4.4.2 local Error: timeout exceeded\n";
+char* too_many_message = "421 4.7.0 local Error: too many connections from your host\n";
+char* too_fast_message = "421 4.7.0 local Error: connection rate limit exceeded\n";
+char* shutdown_message = "421 4.3.2 local Service shutting down\n";
 
 typedef enum request_state (*state_handler)(const uint8_t c, struct request_parser* p);
 const fd_handler* get_smtp_handler(void);
@@ -87,6 +100,7 @@ unsigned int request_read_handler(struct selector_key* key);
 void request_read_init(unsigned int state, struct selector_key* key);
 void request_read_close(unsigned int state, struct selector_key* key);
 static socket_state request_actual_read(struct selector_key* key);
+static int open_mail_file(struct selector_key* key);
 
 unsigned int request_write_handler(struct selector_key* key);
 
@@ -102,7 +116,10 @@ void request_admin_close(unsigned int state, struct selector_key* key);
 void on_done_init(const unsigned state, struct selector_key* key);
 
 unsigned int write_file_handler(struct selector_key* key);
-void init_status(char* program);
+unsigned int transform_exit_handler(struct selector_key* key);
+unsigned int spool_commit_handler(struct selector_key* key);
+unsigned int index_rebuilt_handler(struct selector_key* key);
+int init_status(char* program);
 bool read_complete(enum request_state st);
 static inline void clean_request(struct selector_key* key);
 
@@ -129,11 +146,13 @@ static const struct state_definition states_handlers[] = { {
 	                                                           .on_read_ready = request_read_handler,
 	                                                           .on_arrival = request_admin_init,
 	                                                           .on_departure = request_admin_close,
+	                                                           .on_block_ready = index_rebuilt_handler,
 	                                                       },
 	                                                       {
 	                                                           .state = REQUEST_DATA_WRITE,
 	                                                           .on_write_ready = write_file_handler,
-
+	                                                           .on_read_ready = transform_exit_handler,
+	                                                           .on_block_ready = spool_commit_handler,
 	                                                       },
 
 	                                                       {
@@ -146,8 +165,9 @@ static const struct state_definition states_handlers[] = { {
 };
 
 process_handler handlers_table[] = {
-	[EHLO] = handle_helo, [FROM] = handle_from,   [TO] = handle_to,       [DATA] = handle_data, [BODY] = handle_body,
-	[ERROR] = NULL,       [XAUTH] = handle_xauth, [XFROM] = handle_xfrom, [XGET] = handle_xget, [XTRAN] = handle_xtran,
+	[EHLO] = handle_helo,   [FROM] = handle_from,   [TO] = handle_to,       [DATA] = handle_data, [BODY] = handle_body,
+	[CHUNK] = handle_chunk, [BDAT] = handle_bdat,   [ERROR] = NULL,         [XAUTH] = handle_xauth,
+	[XFROM] = handle_xfrom, [XGET] = handle_xget,   [XTRAN] = handle_xtran,
 };
 
 consume_handler consumers_table[] = { [REQUEST_READ] = request_consume,
@@ -160,28 +180,112 @@ static void read_handler(struct selector_key* key);
 static void write_handler(struct selector_key* key);
 static void close_handler(struct selector_key* key);
 static void write_file(struct selector_key* key);
+static void session_timeout(struct wheel_timer* t, void* ptr);
+static void session_timeout_arm(struct selector_key* key);
+static int plugin_finish(smtp_data* data, bool keep);
+static void transform_abort(fd_selector s, smtp_data* data);
 
 // BASICAMENTE LLAMAN A LOS HANDLERS DE LA MAQUINA DE ESTADOS
 
-void
+int
 init_status(char* program)
 {
+	// los plugins se cargan sólo acá: después XTRAN elige entre ellos por nombre.
+	// El nombrado va primero, así un homónimo en SMTPD_PLUGIN_DIR no lo tapa
+	const bool plugin = program != NULL && transform_is_plugin(program);
+	if (plugin && transform_load_file(program) != 0) {
+		return -1;
+	}
+	const char* dir = getenv(TRANSFORM_PLUGIN_DIR_ENV);
+	if (dir != NULL) {
+		transform_load_dir(dir);
+	}
+	if (plugin) {
+		const char* slash = strrchr(program, '/');
+		return set_plugin(slash != NULL ? slash + 1 : program);
+	}
 	config.program = program;
 	config.transform = program != NULL ? true : false;
+	return 0;
 }
 void
 set_status(bool value)
 {
 	config.transform = value;
 }
+int
+set_plugin(const char* name)
+{
+	if (transform_select(name) != 0) {
+		return -1;
+	}
+	config.plugin = true;
+	config.transform = true;
+	return 0;
+}
+
+// id de la próxima sesión, para correlacionar los eventos de una misma conexión
+static uint32_t next_session_id = 0;
+
+// sesiones vivas (lista doblemente enlazada)
+static smtp_data* sessions = NULL;
+static unsigned sessions_qty = 0;
+static bool draining = false;
+
+// buffer de lectura de una sesión sin segmento: vacío y sin lugar
+static uint8_t no_read_segment[1];
+
+/** toma un segmento del pool para el buffer de lectura, si no tiene uno */
+static bool
+read_buffer_acquire(smtp_data* data)
+{
+	if (data->read_segment != NULL) {
+		return true;
+	}
+	data->read_segment = buffer_segment_get();
+	if (data->read_segment == NULL) {
+		logf(LOG_ERROR, "No memory for the read buffer of fd %d", data->fd);
+		return false;
+	}
+	buffer_init(&data->read_buffer, N(data->read_segment->data), data->read_segment->data);
+	return true;
+}
+
+/** devuelve el segmento al pool si ya se consumió todo lo leído */
+static void
+read_buffer_release(smtp_data* data)
+{
+	if (data->read_segment == NULL || buffer_can_read(&data->read_buffer)) {
+		return;
+	}
+	buffer_segment_put(data->read_segment);
+	data->read_segment = NULL;
+	buffer_init(&data->read_buffer, 0, no_read_segment);
+}
+
+static inline void
+socket_state_event(smtp_data* data, const unsigned from, const unsigned to)
+{
+	if (from != to) {
+		logger_event(LOG_EV_SOCKET_STATE, data->id, from, to, 0);
+	}
+}
 
 static void
 read_handler(struct selector_key* key)
 {
 	smtp_data* data = ATTACHMENT(key);
+	const unsigned from = stm_state(&data->stm);
 	const socket_state st = stm_handler_read(&data->stm, key);
+	socket_state_event(data, from, st);
 	if (REQUEST_ERROR == st || REQUEST_DONE == st) {
 		smtp_done(key);
+	} else {
+		if (data->state == BODY || data->state == CHUNK) {
+			// el cuerpo puede tardar: el timeout es entre bloques, no del mensaje entero
+			session_timeout_arm(key);
+		}
+		read_buffer_release(data);
 	}
 }
 
@@ -189,11 +293,15 @@ static void
 write_handler(struct selector_key* key)
 {
 	smtp_data* data = ATTACHMENT(key);
+	const unsigned from = stm_state(&data->stm);
 	const socket_state st = stm_handler_write(&data->stm, key);
+	socket_state_event(data, from, st);
 
 	if (REQUEST_DONE == st || REQUEST_ERROR == st) {
 		smtp_done(key);
-	} else if (REQUEST_READ == st || REQUEST_DATA == st) {
+		return;
+	}
+	if (REQUEST_READ == st || REQUEST_DATA == st) {
 		buffer* rb = &ATTACHMENT(key)->read_buffer;
 		if (buffer_can_read(rb)) {
 			read_handler(key);  // Si hay para leer en el buffer, sigo leyendo sin bloquearme
@@ -211,12 +319,64 @@ static void
 write_file(struct selector_key* key)
 {
 	smtp_data* data = ATTACHMENT(key);
-	stm_handler_write(&data->stm, key);
+	const unsigned from = stm_state(&data->stm);
+	socket_state_event(data, from, stm_handler_write(&data->stm, key));
+	// un bloque de BDAT se escribe directo desde el buffer de lectura
+	read_buffer_release(data);
+}
+
+/**
+ * terminó el programa de transformación (se puede leer su pidfd). La sesión
+ * sigue en REQUEST_DATA_WRITE hasta acá
+ */
+static void
+transform_exited(struct selector_key* key)
+{
+	smtp_data* data = ATTACHMENT(key);
+	const unsigned from = stm_state(&data->stm);
+	const socket_state st = stm_handler_read(&data->stm, key);
+	socket_state_event(data, from, st);
+
+	if (REQUEST_DONE == st || REQUEST_ERROR == st) {
+		struct selector_key client = {
+			.s = key->s,
+			.fd = data->fd,
+			.data = data,
+		};
+		smtp_done(&client);
+	}
+}
+
+/**
+ * el spool o el relay terminó un commit, o un hilo del índice un rebuild, de esta sesión
+ * o de una anterior con el mismo fd: sólo una que espera algo tiene qué hacer
+ */
+static void
+block_handler(struct selector_key* key)
+{
+	smtp_data* data = ATTACHMENT(key);
+	if (data->commit == NULL && data->relay_commit == NULL && !data->index_wait) {
+		return;
+	}
+	const unsigned from = stm_state(&data->stm);
+	const socket_state st = stm_handler_block(&data->stm, key);
+	socket_state_event(data, from, st);
+	if (REQUEST_DONE == st || REQUEST_ERROR == st) {
+		smtp_done(key);
+	}
+}
+
+/** lo llama un hilo del spool o del relay: el selector lo despacha en block_handler */
+static void
+spool_committed(void* s, int fd)
+{
+	selector_notify_block(s, fd);
 }
 
 static fd_handler smtp_handler = {
 	.handle_read = read_handler,
 	.handle_write = write_handler,
+	.handle_block = block_handler,
 	.handle_close = close_handler,
 };
 static fd_handler file_handler = {
@@ -224,6 +384,11 @@ static fd_handler file_handler = {
 	.handle_write = write_file,
 	.handle_close = NULL,
 };
+static fd_handler child_handler = {
+	.handle_read = transform_exited,
+	.handle_write = NULL,
+	.handle_close = NULL,
+};
 
 const fd_handler*
 get_smtp_handler(void)
@@ -231,70 +396,289 @@ get_smtp_handler(void)
 	return &smtp_handler;
 }
 
+/**
+ * elige el timeout según lo que estamos esperando del cliente
+ */
+static uint64_t
+session_timeout_ms(smtp_data* data)
+{
+	const unsigned st = stm_state(&data->stm);
+	if (st == REQUEST_DATA || st == REQUEST_DATA_WRITE || data->state == BODY || data->state == CHUNK) {
+		return SMTP_DATA_BLOCK_TIMEOUT_MS;
+	}
+	switch (data->state) {
+		case EHLO:
+		case FROM:
+			if (draining) {
+				return SMTP_DRAIN_IDLE_TIMEOUT_MS;
+			}
+			return data->state == EHLO ? SMTP_GREETING_TIMEOUT_MS : SMTP_IDLE_TIMEOUT_MS;
+		case TO:
+		case DATA:
+		case BDAT:
+			return SMTP_COMMAND_TIMEOUT_MS;
+		default:
+			return SMTP_IDLE_TIMEOUT_MS;
+	}
+}
+
+static void
+session_timeout_arm(struct selector_key* key)
+{
+	smtp_data* data = ATTACHMENT(key);
+	selector_timer_schedule(key->s, &data->timeout, session_timeout_ms(data));
+}
+
+static void
+session_timeout(struct wheel_timer* t, void* ptr)
+{
+	(void)t;
+	smtp_data* data = ptr;
+	logf(LOG_INFO, "Session on fd %d timed out, closing", data->fd);
+	logger_event(LOG_EV_SESSION_TIMEOUT, data->id, data->fd, stm_state(&data->stm), data->state);
+
+	// best effort: si el cliente no lee, no esperamos
+	const char* msg = draining ? shutdown_message : timeout_message;
+	send(data->fd, msg, strlen(msg), MSG_NOSIGNAL | MSG_DONTWAIT);
+
+	struct selector_key key = {
+		.s = data->selector,
+		.fd = data->fd,
+		.data = data,
+	};
+	smtp_done(&key);
+}
+
 void
 smtp_done(selector_key* key)
 {
+	smtp_data* data = ATTACHMENT(key);
+	logger_event(LOG_EV_SESSION_CLOSE, data->id, data->fd, stm_state(&data->stm), 0);
+	selector_timer_cancel(key->s, &data->timeout);
+
+	// cortaron en medio de un DATA o entre dos BDAT
+	smtp_discard_body(key);
+
 	selector_status status = selector_unregister_fd(key->s, key->fd);
 	if (status != SELECTOR_SUCCESS) {
-		perror("selector_unregister_fd");
+		logf(LOG_ERROR, "selector_unregister_fd: %s", selector_error(status));
+	}
+	close(data->fd);
+	conn_table_release(&data->client_addr);
+
+	if (data->prev != NULL) {
+		data->prev->next = data->next;
+	} else {
+		sessions = data->next;
+	}
+	if (data->next != NULL) {
+		data->next->prev = data->prev;
+	}
+	sessions_qty--;
+	buffer_chain_reset(&data->write_chain);
+	if (data->read_segment != NULL) {
+		buffer_segment_put(data->read_segment);
 	}
-	smtp_data* data = ATTACHMENT(key);
 	free(data);
 }
+
 void
-smtp_passive_accept(selector_key* key)
+smtp_discard_body(struct selector_key* key)
 {
-	log(LOG_DEBUG, "Accepted new connection");
-	// Crear un nuevo socket
-
-	// this struct may hold ipv4 or ipv6
-	struct sockaddr_storage client_addr;
+	smtp_data* data = ATTACHMENT(key);
+	if (!data->is_body) {
+		return;
+	}
+	if (data->output_fd >= 0) {
+		selector_unregister_fd(key->s, data->output_fd);
+		close(data->output_fd);
+		data->output_fd = -1;
+	}
+	plugin_finish(data, false);
+	transform_abort(key->s, data);
+	compressor_free(data->compressor);
+	data->compressor = NULL;
+	// los sobres remotos que nadie confirmó se borran
+	relay_commit_release(data->relay_commit);
+	data->relay_commit = NULL;
+	if (data->commit != NULL) {
+		// el archivo ya es del spool
+		spool_commit_release(data->commit);
+		data->commit = NULL;
+	} else {
+		unlink(data->temp_full_path);
+	}
+	data->filename_fd[0] = '\0';
+	data->temp_full_path[0] = '\0';
+	data->is_body = false;
+}
 
-	socklen_t client_addr_len = sizeof(client_addr);
+/** un socket pasivo que dejó de mirarse hasta que vuelva a haber fds */
+struct paused_listener
+{
+	struct wheel_timer timer;
+	fd_selector s;
+	int fd;
+};
 
-	int new_socket = accept(key->fd, (struct sockaddr*)&client_addr, &client_addr_len);
+// uno por socket pasivo (IPv4 e IPv6)
+static struct paused_listener paused[4];
 
-	if (new_socket < 0) {
-		log(LOG_ERROR, "Error opening connection accepting socket");
-		perror("accept");
-		return;
+void
+smtp_drain(fd_selector s)
+{
+	draining = true;
+	// los sockets pasivos ya no se miran más
+	for (size_t i = 0; i < N(paused); i++) {
+		if (paused[i].s != NULL) {
+			selector_timer_cancel(s, &paused[i].timer);
+			paused[i].s = NULL;
+		}
 	}
+	for (smtp_data* data = sessions; data != NULL; data = data->next) {
+		selector_timer_schedule(s, &data->timeout, session_timeout_ms(data));
+	}
+}
 
+unsigned
+smtp_active_sessions(void)
+{
+	return sessions_qty;
+}
+/**
+ * crea la sesión para un socket recién aceptado y la registra en el selector.
+ * Si falla, el socket se cierra y retorna false.
+ */
+static bool
+smtp_session_new(fd_selector s, const int new_socket, const struct sockaddr_storage* client_addr)
+{
 	smtp_data* data = calloc(1, sizeof(*data));
 
 	if (data == NULL) {
-		log(LOG_ERROR, "Error allocating memory for smtp data struct");
-		perror("calloc");
-		return;
+		logf(LOG_ERROR, "Error allocating memory for smtp data struct: %s", strerror(errno));
+		close(new_socket);
+		return false;
 	}
 
 	data->fd = new_socket;
-	data->client_addr = client_addr;
+	data->selector = s;
+	wheel_timer_init(&data->timeout, session_timeout, data);
+	data->client_addr = *client_addr;
 	data->stm.initial = REQUEST_WRITE;
 	data->stm.max_state = REQUEST_ERROR;
 	data->stm.states = states_handlers;
 	data->rcpt_qty = 0;
 	data->is_body = false;
+	data->output_fd = -1;
 
-	buffer_init(&data->read_buffer, N(data->raw_buff_read), data->raw_buff_read);
-	buffer_init(&data->write_buffer, N(data->raw_buff_write), data->raw_buff_write);
+	buffer_init(&data->read_buffer, 0, no_read_segment);
+	buffer_chain_init(&data->write_chain, SMTP_WRITE_LIMIT);
 
 	stm_init(&data->stm);
 
-	memcpy(&data->raw_buff_write, welcome_message, strlen(welcome_message));
-	buffer_write_adv(&data->write_buffer, strlen(welcome_message));
+	buffer_chain_write(&data->write_chain, welcome_message, strlen(welcome_message));
 
-	selector_status status = selector_register(key->s, new_socket, get_smtp_handler(), OP_WRITE, data);
+	selector_status status = selector_register(s, new_socket, get_smtp_handler(), OP_WRITE, data);
 
 	if (status != SELECTOR_SUCCESS) {
-		perror("selector_register");
-		smtp_done(key);
-		return;
+		logf(LOG_ERROR, "Error registering fd %d: %s", new_socket, selector_error(status));
+		close(new_socket);
+		buffer_chain_reset(&data->write_chain);
+		free(data);
+		return false;
+	}
+
+	data->id = ++next_session_id;
+	data->next = sessions;
+	if (sessions != NULL) {
+		sessions->prev = data;
 	}
+	sessions = data;
+	sessions_qty++;
 
+	logger_event(LOG_EV_SESSION_OPEN, data->id, new_socket, client_addr->ss_family, 0);
+	selector_timer_schedule(s, &data->timeout, session_timeout_ms(data));
 	monitor_add_connection();
+	return true;
+}
 
-	return;
+static void
+accept_resume(struct wheel_timer* t, void* arg)
+{
+	(void)t;
+	struct paused_listener* l = arg;
+	if (selector_set_interest(l->s, l->fd, OP_READ) != SELECTOR_SUCCESS) {
+		logf(LOG_ERROR, "Could not resume accepting on fd %d", l->fd);
+	}
+	l->s = NULL;
+}
+
+/** deja de aceptar en `key->fd' por SMTP_ACCEPT_BACKOFF_MS */
+static void
+accept_pause(selector_key* key)
+{
+	struct paused_listener* l = NULL;
+	for (size_t i = 0; i < N(paused) && l == NULL; i++) {
+		if (paused[i].s == NULL || paused[i].fd == key->fd) {
+			l = &paused[i];
+		}
+	}
+	if (l == NULL || selector_set_interest_key(key, OP_NOOP) != SELECTOR_SUCCESS) {
+		return;
+	}
+	l->s = key->s;
+	l->fd = key->fd;
+	wheel_timer_init(&l->timer, accept_resume, l);
+	selector_timer_schedule(key->s, &l->timer, SMTP_ACCEPT_BACKOFF_MS);
+}
+
+void
+smtp_passive_accept(selector_key* key)
+{
+	// Vaciamos la cola de conexiones pendientes, pero a lo sumo
+	// SMTP_ACCEPT_BUDGET por iteración: el socket pasivo sigue listo en el
+	// próximo select y así las sesiones existentes no se quedan sin atender
+	// durante una ráfaga de conexiones.
+	for (unsigned i = 0; i < SMTP_ACCEPT_BUDGET; i++) {
+		// this struct may hold ipv4 or ipv6
+		struct sockaddr_storage client_addr;
+		socklen_t client_addr_len = sizeof(client_addr);
+
+		int new_socket =
+		    accept4(key->fd, (struct sockaddr*)&client_addr, &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (new_socket < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+				// la conexión sigue en la cola: esperamos a que se liberen recursos
+				logf(LOG_ERROR, "Error accepting connection: %s, pausing for %d ms", strerror(errno),
+				     SMTP_ACCEPT_BACKOFF_MS);
+				accept_pause(key);
+			} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				logf(LOG_ERROR, "Error accepting connection: %s", strerror(errno));
+			}
+			return;
+		}
+
+		// admisión antes de alocar la sesión: un único cliente abusivo no
+		// puede agotar los fds ni la memoria de sesiones
+		const conn_verdict verdict = conn_table_acquire(&client_addr, time(NULL));
+		if (verdict != CONN_ADMIT) {
+			const char* msg = verdict == CONN_TOO_FAST ? too_fast_message : too_many_message;
+			logf(LOG_INFO, "Refusing connection on fd %d: %s", new_socket, msg);
+			logger_event(LOG_EV_SESSION_REFUSED, 0, new_socket, verdict, 0);
+			send(new_socket, msg, strlen(msg), MSG_NOSIGNAL | MSG_DONTWAIT);
+			close(new_socket);
+			continue;
+		}
+
+		logf(LOG_DEBUG, "Accepted new connection on fd %d", new_socket);
+		if (!smtp_session_new(key->s, new_socket, &client_addr)) {
+			conn_table_release(&client_addr);
+		}
+	}
 }
 
 // REQUEST WRITE HANDLERS
@@ -311,9 +695,6 @@ request_process(struct selector_key* key)
 	// if (SELECTOR_SUCCESS != selector_set_interest_key(key, OP_WRITE)) {
 	// 	return REQUEST_ERROR;
 	// }
-	size_t count;
-
-	uint8_t* ptr = buffer_write_ptr(&data->write_buffer, &count);
 
 	// LLAMAR A HANDLERS NO SECUENCIALES
 	bool is_noop = handle_noop(key, msg);
@@ -328,12 +709,41 @@ request_process(struct selector_key* key)
 	if (!(is_noop || is_rset || is_xquit)) {
 		process_handler fn = handlers_table[st];
 		smtp_state next = fn(key, msg);
+		if (next != st) {
+			logger_event(LOG_EV_SMTP_STATE, data->id, st, next, 0);
+		}
 		data->state = next;
 	}
+	// los timeouts de saludo, comando e inactividad cuentan desde el último
+	// comando completo: leer de a un byte no los estira
+	session_timeout_arm(key);
+
+	if (data->state == CHUNK) {
+		// BDAT no tiene respuesta intermedia: el bloque sigue al comando y
+		// puede estar ya en el buffer, así que vamos directo a escribirlo
+		if (!data->is_body && open_mail_file(key) != 0) {
+			return REQUEST_ERROR;
+		}
+		if (SELECTOR_SUCCESS != selector_set_interest_key(key, OP_NOOP) ||
+		    SELECTOR_SUCCESS != selector_set_interest(key->s, data->output_fd, OP_WRITE)) {
+			return REQUEST_ERROR;
+		}
+		return REQUEST_DATA_WRITE;
+	}
+
+	if (data->index_wait) {
+		// sin respuesta hasta que avise el hilo del índice (ver index_rebuilt_handler)
+		if (SELECTOR_SUCCESS != selector_set_interest_key(key, OP_NOOP)) {
+			return REQUEST_ERROR;
+		}
+		return REQUEST_ADMIN;
+	}
 
 	size_t len = strlen(msg);
-	memcpy(ptr, msg, len);
-	buffer_write_adv(&data->write_buffer, len);
+	if (buffer_chain_write(&data->write_chain, msg, len) < len) {
+		logf(LOG_ERROR, "Reply dropped on fd %d: too much pending output", data->fd);
+		return REQUEST_ERROR;
+	}
 
 	return REQUEST_WRITE;
 }
@@ -343,21 +753,21 @@ socket_state
 request_write_handler(struct selector_key* key)
 {
 	smtp_data* data = ATTACHMENT(key);
-	uint8_t* ptr;
-	size_t count;
 	ssize_t send_bytes;
-	buffer* buff = &data->write_buffer;
+	buffer_chain* chain = &data->write_chain;
 
-	ptr = buffer_read_ptr(buff, &count);
+	logf(LOG_DEBUG, "key->fd: %d, pending=%zu", key->fd, buffer_chain_len(chain));
+	// todos los segmentos pendientes en un único sendmsg
+	send_bytes = buffer_chain_send(chain, key->fd, MSG_NOSIGNAL);
 
-	logf(LOG_DEBUG, "key->fd: %d, ptr=%p, count=%lu", key->fd, ptr, count);
-	send_bytes = send(key->fd, ptr, count, MSG_NOSIGNAL);
+	int ret = REQUEST_WRITE;
+	if (send_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		// el socket es no bloqueante: reintentamos cuando el selector avise
+		return ret;
+	}
 	monitor_add_sent_bytes(send_bytes);
-
-	int ret;
 	if (send_bytes >= 0) {
-		buffer_read_adv(buff, send_bytes);  // avisa que hay send_bytes bytes menos por mandar (leer del buffer)
-		if (!buffer_can_read(buff)) {
+		if (!buffer_chain_can_read(chain)) {
 			// si no queda nada para mandar (leer del buffer write)
 			if (data->state == BODY) {
 				if (SELECTOR_SUCCESS == selector_set_interest_key(key, OP_READ)) {
@@ -376,8 +786,7 @@ request_write_handler(struct selector_key* key)
 			}
 		}
 	} else {
-		perror("Send effed");
-		log(LOG_FATAL, "Send error in write handler");
+		logf(LOG_FATAL, "Send error in write handler: %s", strerror(errno));
 		ret = REQUEST_ERROR;
 	}
 	return ret;
@@ -402,6 +811,9 @@ request_actual_read(struct selector_key* key)
 	bool error = false;
 
 	consume_handler consumer = consumers_table[data->stm.current->state];
+	if (data->state == CHUNK) {
+		consumer = request_consume_chunk;
+	}
 
 	enum request_state state = consumer(&data->read_buffer, &data->request_parser, &error);
 
@@ -439,10 +851,16 @@ request_read_handler(struct selector_key* key)
 		return request_actual_read(key);
 	}
 
+	if (!read_buffer_acquire(data)) {
+		return REQUEST_ERROR;
+	}
 	size_t count;
 	uint8_t* ptr = buffer_write_ptr(&data->read_buffer, &count);
 	ssize_t recv_bytes = recv(key->fd, ptr, count, 0);
 
+	if (recv_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return data->stm.current->state;
+	}
 	if (recv_bytes <= 0) {
 		return REQUEST_ERROR;
 	}
@@ -467,6 +885,9 @@ unsigned int
 request_admin_handler(struct selector_key* key)
 {
 	smtp_data* data = ATTACHMENT(key);
+	if (!read_buffer_acquire(data)) {
+		return REQUEST_ERROR;
+	}
 	size_t count;
 	uint8_t* ptr = buffer_write_ptr(&data->read_buffer, &count);
 	ssize_t recv_bytes = recv(key->fd, ptr, count, 0);
@@ -511,10 +932,29 @@ request_admin_close(unsigned int state, struct selector_key* key)
 	}
 }
 
+/** el índice que esperaba XLIST/XFIND está rehecho: volvemos a procesar el comando */
+unsigned int
+index_rebuilt_handler(struct selector_key* key)
+{
+	smtp_data* data = ATTACHMENT(key);
+	if (!data->index_wait) {
+		return REQUEST_ADMIN;
+	}
+	data->index_wait = false;
+	data->index_rebuilt = true;
+	if (SELECTOR_SUCCESS != selector_set_interest_key(key, OP_WRITE)) {
+		return REQUEST_ERROR;
+	}
+	return request_process(key);
+}
+
 unsigned int
 request_data_handler(struct selector_key* key)
 {
 	smtp_data* data = ATTACHMENT(key);
+	if (!read_buffer_acquire(data)) {
+		return REQUEST_ERROR;
+	}
 	size_t count;
 	uint8_t* ptr = buffer_write_ptr(&data->read_buffer, &count);
 	ssize_t recv_bytes = recv(key->fd, ptr, count, 0);
@@ -537,65 +977,338 @@ request_data_handler(struct selector_key* key)
 
 	return ret;
 }
-void
-request_data_init(unsigned int state, struct selector_key* key)
+/** true si el destinatario es de LOCAL_DOMAIN; los demás van al relay */
+static bool
+is_local_rcpt(const char* rcpt)
 {
-	logf(LOG_DEBUG, "Request data initiated, currently in state: %d", state);
-	smtp_data* data = ATTACHMENT(key);
-	data->request_parser.request = &data->request;
-	data->request_parser.output_fd = &data->output_fd;
-	request_parser_data_init(&data->request_parser);
+	const char* at = strrchr(rcpt, '@');
+	return at == NULL || strcmp(at + 1, LOCAL_DOMAIN) == 0;
+}
 
-	int file = create_temp_mail_file((char*)data->rcpt_to[0], data->filename_fd, data->temp_full_path);
+/**
+ * se comprime si todos los destinatarios son buzones configurados para eso:
+ * hay un solo archivo para todos, y el relay y la transformación necesitan
+ * el mensaje plano
+ */
+static bool
+should_compress(smtp_data* data)
+{
+	if ((config.transform && !config.plugin) || data->rcpt_qty == 0) {
+		return false;
+	}
+	for (size_t i = 0; i < data->rcpt_qty; i++) {
+		const char* rcpt = (const char*)data->rcpt_to[i];
+		if (!is_local_rcpt(rcpt)) {
+			return false;
+		}
+		const char* at = strchr(rcpt, '@');
+		char user[LOCAL_USER_NAME_SIZE + 1];
+		snprintf(user, sizeof(user), "%.*s", at == NULL ? (int)strlen(rcpt) : (int)(at - rcpt), rcpt);
+		if (!maildir_is_compressed(user)) {
+			return false;
+		}
+	}
+	return true;
+}
 
-		if (config.transform) {
-			int pipe_fd[2];
-			if (pipe(pipe_fd) != 0) {
-				perror("Error while creating pipe");
-				exit(EXIT_FAILURE);
-			}
+/**
+ * escribe en el archivo del mail, a través del compresor si hay uno, y va
+ * calculando la clave del mensaje para el store
+ */
+static ssize_t
+mail_file_write(smtp_data* data, const void* buf, size_t len)
+{
+	const ssize_t n =
+	    data->compressor != NULL ? compressor_write(data->compressor, buf, len) : write(data->output_fd, buf, len);
+	if (n > 0 && data->content_hashed) {
+		data->content_hash = maildir_hash(data->content_hash, buf, n);
+		data->content_size += n;
+	}
+	return n;
+}
 
-			int pid = fork();
-			if (pid < 0) {
-				perror("Error while creating slave");
-				exit(EXIT_FAILURE);
-			}
+static ssize_t
+plugin_emit(void* sink, const void* buf, size_t len)
+{
+	return mail_file_write(sink, buf, len) == (ssize_t)len ? (ssize_t)len : -1;
+}
 
-			if (pid == 0) {  // Child process
-				close(STDIN_FILENO);
-				dup2(pipe_fd[0], STDIN_FILENO);  // Correctly duplicate to stdin
-				close(STDOUT_FILENO);
-				dup2(file, STDOUT_FILENO);  // Correctly duplicate to stdout
+static ssize_t
+plugin_drop(void* sink, const void* buf, size_t len)
+{
+	(void)sink;
+	(void)buf;
+	return len;
+}
 
-				close(pipe_fd[0]);
-				close(pipe_fd[1]);
-				close(file);
+/** arranca el plugin para el mensaje en curso; si no lo quiere, se guarda tal cual */
+static void
+plugin_start(smtp_data* data)
+{
+	const transform_plugin* plugin = transform_current();
+	if (plugin == NULL) {
+		return;
+	}
+	const char* rcpt[N(data->rcpt_to)];
+	const size_t rcpt_qty = data->rcpt_qty < N(rcpt) ? data->rcpt_qty : N(rcpt);
+	for (size_t i = 0; i < rcpt_qty; i++) {
+		rcpt[i] = (const char*)data->rcpt_to[i];
+	}
+	// lo que llega por DATA queda con los puntos duplicados
+	data->plugin_state = plugin->init((const char*)data->mail_from, rcpt, rcpt_qty, data->state != CHUNK);
+	if (data->plugin_state == NULL) {
+		logf(LOG_ERROR, "Transform: %s did not take the message, storing it as is", plugin->name);
+		return;
+	}
+	data->plugin = plugin;
+	data->plugin_failed = false;
+}
 
-				execlp(config.program, config.program, (char*)NULL);
-				perror("Error while executing transformation program");
-				exit(EXIT_FAILURE);
-			}
+/**
+ * cierra el plugin del mensaje en curso; si se descarta (`keep' false) lo que
+ * emita se pierde
+ * @returns 0 si el cuerpo transformado quedó completo
+ */
+static int
+plugin_finish(smtp_data* data, bool keep)
+{
+	if (data->plugin == NULL) {
+		return 0;
+	}
+	const int ret = data->plugin->finish(data->plugin_state, keep ? plugin_emit : plugin_drop, data);
+	const bool failed = data->plugin_failed || ret != 0;
+	if (keep && failed) {
+		logf(LOG_ERROR, "Transform: %s refused %s", data->plugin->name, data->temp_full_path);
+	}
+	data->plugin = NULL;
+	data->plugin_state = NULL;
+	data->plugin_failed = false;
+	return failed ? -1 : 0;
+}
 
-			// Parent process
-			close(pipe_fd[0]);             // Close read end, not used by parent
-			close(file);                   // Close file, as it's now handled by child
-			data->output_fd = pipe_fd[1];  // Use write end of the pipe to write data
-		} else {
-			data->output_fd = file;
+/** escribe un pedazo del cuerpo, a través del plugin si hay uno */
+static ssize_t
+mail_body_write(smtp_data* data, const void* buf, size_t len)
+{
+	// pasado el límite seguimos leyendo hasta el final sin escribir nada
+	data->body_size += len;
+	if (!data->too_big && data->body_size > SMTP_MAX_MESSAGE_SIZE) {
+		logf(LOG_INFO, "Session %u: message over %d bytes, discarding it", data->id, SMTP_MAX_MESSAGE_SIZE);
+		data->too_big = true;
+	}
+	if (data->too_big) {
+		return len;
+	}
+	if (data->plugin == NULL) {
+		return mail_file_write(data, buf, len);
+	}
+	// si falla seguimos leyendo el cuerpo y al final contestamos 451
+	if (!data->plugin_failed && data->plugin->chunk(data->plugin_state, buf, len, plugin_emit, data) != 0) {
+		data->plugin_failed = true;
+	}
+	return len;
+}
+
+static void
+mail_file_printf(smtp_data* data, const char* fmt, ...)
+{
+	char line[512];
+	va_list ap;
+	va_start(ap, fmt);
+	const int n = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (n > 0) {
+		mail_file_write(data, line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1);
+	}
+}
+
+/**
+ * cierra el frame comprimido y agrega al nombre el sufijo ",S=<tamaño>" de
+ * maildir++ con el tamaño sin comprimir
+ * @returns 0 si el archivo quedó completo
+ */
+static int
+finish_compression(smtp_data* data)
+{
+	const unsigned long long raw = compressor_raw_size(data->compressor);
+	const int ret = compressor_finish(data->compressor);
+	data->compressor = NULL;
+	if (ret != 0) {
+		logf(LOG_ERROR, "Error writing compressed mail file %s: %s", data->temp_full_path, strerror(errno));
+		return -1;
+	}
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ",S=%llu", raw);
+	char path[sizeof(data->temp_full_path)];
+	const size_t name_len = strlen(data->filename_fd);
+	const int n = snprintf(path, sizeof(path), "%s%s", data->temp_full_path, suffix);
+	if (n < 0 || (size_t)n >= sizeof(path) || name_len + strlen(suffix) >= sizeof(data->filename_fd)) {
+		// sin sufijo igual se lee: lo que cuenta es el número mágico
+		return 0;
+	}
+	if (rename(data->temp_full_path, path) != 0) {
+		logf(LOG_ERROR, "Error renaming %s: %s", data->temp_full_path, strerror(errno));
+		return 0;
+	}
+	memcpy(data->temp_full_path, path, n + 1);
+	memcpy(data->filename_fd + name_len, suffix, strlen(suffix) + 1);
+	return 0;
+}
+
+/**
+ * arranca el programa de transformación con `file' como salida.
+ * @returns el extremo del pipe donde escribir el cuerpo, o -1 si no se pudo
+ */
+static int
+start_transform(smtp_data* data, int file)
+{
+	int pipe_fd[2];
+	// con O_CLOEXEC los hijos de otras sesiones no heredan este pipe y el
+	// programa ve EOF en cuanto lo cerramos
+	if (pipe2(pipe_fd, O_CLOEXEC) != 0) {
+		logf(LOG_ERROR, "Could not create the pipe to the transformation: %s", strerror(errno));
+		return -1;
+	}
+
+	const pid_t pid = fork();
+	if (pid < 0) {
+		logf(LOG_ERROR, "Could not start the transformation: %s", strerror(errno));
+		close(pipe_fd[0]);
+		close(pipe_fd[1]);
+		return -1;
+	}
+
+	if (pid == 0) {  // Child process
+		// dup2 no copia O_CLOEXEC: el resto se cierra en el exec. main cerró
+		// stdin, así que el archivo puede haber quedado en el 0
+		if (file == STDIN_FILENO && (file = dup(file)) < 0) {
+			_exit(EXIT_FAILURE);
+		}
+		if (dup2(pipe_fd[0], STDIN_FILENO) < 0 || dup2(file, STDOUT_FILENO) < 0) {
+			_exit(EXIT_FAILURE);
 		}
+		execlp(config.program, config.program, (char*)NULL);
+		// el padre lo ve en el estado de salida (transform_reap)
+		_exit(127);
+	}
+
+	// Parent process
+	close(pipe_fd[0]);  // Close read end, not used by parent
+	close(file);        // Close file, as it's now handled by child
+	data->transform_pid = pid;
+	// nos avisa en el selector cuando termina (ver transform_wait)
+	data->transform_pidfd = pidfd_open(pid, 0);
+	if (data->transform_pidfd < 0) {
+		logf(LOG_DEBUG, "pidfd_open: %s, waiting for transformation %d blocking", strerror(errno), pid);
+	}
+	return pipe_fd[1];
+}
 
-		// Escribir la información del remitente
-		dprintf(data->output_fd, "MAIL FROM: <%s>\r\n", data->mail_from);
+/**
+ * crea el archivo temporal del mail (o el pipe hacia la transformación) y
+ * escribe el sobre. Si no se puede, el cuerpo se lee igual y se descarta, y
+ * el cliente recibe un 451 al terminarlo (ver body_failed).
+ * @returns -1 si ni siquiera hay dónde descartarlo
+ */
+static int
+open_mail_file(struct selector_key* key)
+{
+	smtp_data* data = ATTACHMENT(key);
+	// un plugin escribe a través nuestro: sólo un programa externo se lleva el archivo
+	bool program = config.transform && !config.plugin;
+	const bool compress = should_compress(data);
+	// sin programa escribimos el archivo nosotros y podemos recortarlo al
+	// final, así que lo preasignamos con el tamaño declarado (SIZE)
+	const size_t size_hint = program || compress ? 0 : data->declared_size;
+	// el temporal va en el maildir del primer destinatario local; si todos son
+	// remotos, en el de postmaster
+	char* owner = "postmaster@" LOCAL_DOMAIN;
+	for (size_t i = 0; i < data->rcpt_qty; i++) {
+		if (is_local_rcpt((char*)data->rcpt_to[i])) {
+			owner = (char*)data->rcpt_to[i];
+			break;
+		}
+	}
+	data->body_failed = false;
+	int file = create_temp_mail_file(owner, data->filename_fd, data->temp_full_path, size_hint);
+	if (file < 0) {
+		logf(LOG_ERROR, "Could not create the temp file for %s, discarding the message", owner);
+		data->body_failed = true;
+		data->temp_full_path[0] = '\0';
+		program = false;
+		file = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		if (file < 0) {
+			logf(LOG_ERROR, "Could not open /dev/null: %s", strerror(errno));
+			return -1;
+		}
+	}
 
-		// Escribir la información de los destinatarios
-		for (size_t i = 0; i < data->rcpt_qty; i++) {
-			dprintf(data->output_fd, "RCPT TO: <%s>\r\n", data->rcpt_to[i]);
+	if (program) {
+		data->output_fd = start_transform(data, file);
+		if (data->output_fd < 0) {
+			// el cuerpo va al temporal, que después se borra
+			data->body_failed = true;
+			program = false;
+		}
+	}
+	if (!program) {
+		data->output_fd = file;
+		if (compress && !data->body_failed && (data->compressor = compressor_new(file)) == NULL) {
+			logf(LOG_ERROR, "Could not start compressing %s, storing it as is", data->temp_full_path);
 		}
-		dprintf(file, "DATA\r\n");
+	}
+
+	// lo que escribe el programa no pasa por acá: eso no se deduplica
+	data->content_hashed = !program;
+	data->content_hash = MAILDIR_HASH_INIT;
+	data->content_size = 0;
+
+	// Escribir la información del remitente
+	mail_file_printf(data, "MAIL FROM: <%s>\r\n", data->mail_from);
+
+	// Escribir la información de los destinatarios
+	for (size_t i = 0; i < data->rcpt_qty; i++) {
+		mail_file_printf(data, "RCPT TO: <%s>\r\n", data->rcpt_to[i]);
+	}
+	mail_file_printf(data, "DATA\r\n");
+	if (config.transform && config.plugin && !data->body_failed) {
+		plugin_start(data);
+	}
 
-		selector_register(key->s, data->output_fd, &file_handler, OP_NOOP, data);
+	data->is_body = true;
+	if (SELECTOR_SUCCESS != selector_register(key->s, data->output_fd, &file_handler, OP_NOOP, data)) {
+		logf(LOG_ERROR, "Could not register the mail file of fd %d", data->fd);
+		smtp_discard_body(key);
+		return -1;
+	}
+	return 0;
+}
 
-		data->is_body= true;
+void
+request_data_init(unsigned int state, struct selector_key* key)
+{
+	logf(LOG_DEBUG, "Request data initiated, currently in state: %d", state);
+	smtp_data* data = ATTACHMENT(key);
+	data->request_parser.request = &data->request;
+	data->request_parser.output_fd = &data->output_fd;
+
+	if (data->state == CHUNK) {
+		// el resto de un bloque de BDAT: handle_bdat ya preparó el parser
+		return;
+	}
+	if (data->is_body) {
+		// volvemos de escribir un bloque del cuerpo: el archivo ya existe y el
+		// parser tiene que seguir en el estado en que quedó (p.ej. después de un CRLF)
+		enum request_state st = data->request_parser.state;
+		request_parser_data_init(&data->request_parser);
+		data->request_parser.state = st;
+		return;
+	}
+	request_parser_data_init(&data->request_parser);
+	if (open_mail_file(key) != 0) {
+		// sin output_fd, request_actual_read termina la sesión con el primer bloque
+		data->output_fd = -1;
+	}
 }
 
 void
@@ -613,50 +1326,384 @@ request_data_close(unsigned int state, struct selector_key* key)
 	}
 }
 
-socket_state
-write_file_handler(struct selector_key* key)
+static socket_state enqueue_mail(struct selector_key* key, bool stored, const char* store_key);
+static socket_state enqueue_done(struct selector_key* key, bool queued);
+
+/**
+ * junta al programa de transformación si ya terminó (o lo espera, con
+ * `block'). @returns true si terminó bien
+ */
+static bool
+transform_reap(smtp_data* data, bool block)
+{
+	int status;
+	pid_t r;
+	while ((r = waitpid(data->transform_pid, &status, block ? 0 : WNOHANG)) < 0 && errno == EINTR) {
+	}
+	if (r == 0) {
+		return false;
+	}
+	if (r < 0) {
+		logf(LOG_ERROR, "waitpid %d: %s", data->transform_pid, strerror(errno));
+	} else if (WIFSIGNALED(status)) {
+		logf(LOG_ERROR, "Transformation %d killed by signal %d", data->transform_pid, WTERMSIG(status));
+	} else if (WEXITSTATUS(status) != 0) {
+		logf(LOG_ERROR, "Transformation %d exited with status %d", data->transform_pid, WEXITSTATUS(status));
+	}
+	data->transform_pid = 0;
+	return r > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void
+transform_close_pidfd(fd_selector s, smtp_data* data)
+{
+	if (data->transform_pidfd >= 0) {
+		// si todavía no lo registramos falla y no importa
+		selector_unregister_fd(s, data->transform_pidfd);
+		close(data->transform_pidfd);
+		data->transform_pidfd = -1;
+	}
+}
+
+/** la sesión se cierra o descarta el mensaje: el programa no termina de escribirlo */
+static void
+transform_abort(fd_selector s, smtp_data* data)
+{
+	if (data->transform_pid <= 0) {
+		return;
+	}
+	transform_close_pidfd(s, data);
+	kill(data->transform_pid, SIGKILL);
+	transform_reap(data, true);
+}
+
+/**
+ * ya le cerramos el pipe al programa: el mensaje se encola cuando termina de
+ * escribir el archivo, sin bloquear al selector mientras tanto
+ */
+static socket_state
+transform_wait(struct selector_key* key)
 {
-	socket_state ret = REQUEST_DATA_WRITE;
 	smtp_data* data = ATTACHMENT(key);
+	if (data->transform_pidfd >= 0 &&
+	    SELECTOR_SUCCESS == selector_register(key->s, data->transform_pidfd, &child_handler, OP_READ, data)) {
+		if (SELECTOR_SUCCESS != selector_set_interest(key->s, data->fd, OP_NOOP)) {
+			return REQUEST_ERROR;
+		}
+		return REQUEST_DATA_WRITE;
+	}
+	// sin pidfd: con el pipe cerrado no debería tardar
+	transform_close_pidfd(key->s, data);
+	return enqueue_mail(key, transform_reap(data, true), "");
+}
 
-	char* data_buffer = (char*)data->request.data;
-	size_t count = strlen(data_buffer);
-	ssize_t n = write(data->output_fd, data_buffer, count);
+unsigned
+transform_exit_handler(struct selector_key* key)
+{
+	smtp_data* data = ATTACHMENT(key);
+	if (data->transform_pid <= 0 || key->fd != data->transform_pidfd) {
+		return REQUEST_DATA_WRITE;
+	}
+	const bool ok = transform_reap(data, false);
+	if (data->transform_pid > 0) {
+		return REQUEST_DATA_WRITE;  // todavía no terminó
+	}
+	transform_close_pidfd(key->s, data);
+	// lo que escribe el programa no se deduplica: no hay clave del store
+	return enqueue_mail(key, ok, "");
+}
 
-	if (n < 0) {
-		return REQUEST_ERROR;
+/**
+ * el mail está completo en el archivo temporal: lo entregamos a cada
+ * destinatario y respondemos
+ */
+static socket_state
+deliver_mail(struct selector_key* key)
+{
+	smtp_data* data = ATTACHMENT(key);
+
+	// lo último que emita el plugin también entra en la clave
+	const bool transformed = plugin_finish(data, true) == 0;
+	// el mismo contenido comprimido y sin comprimir son archivos distintos
+	char store_key[MAILDIR_STORE_KEY_SIZE] = { 0 };
+	if (data->content_hashed) {
+		maildir_store_key(store_key, data->content_hash, data->content_size, data->compressor != NULL);
+	}
+	const bool stored = (data->compressor == NULL || finish_compression(data) == 0) && transformed && !data->body_failed;
+	// si lo preasignamos, descartamos lo que sobró (con un pipe no hace nada)
+	if (!data->body_failed) {
+		maildir_trim_temp_file(data->output_fd);
 	}
 
-	if (SELECTOR_SUCCESS != selector_set_interest_key(key, OP_NOOP)) {
+	if (SELECTOR_SUCCESS != selector_unregister_fd(key->s, data->output_fd))
 		return REQUEST_ERROR;
+
+	close(data->output_fd);
+	data->output_fd = -1;
+
+	// el programa sigue escribiendo el archivo después de que le cerramos el pipe
+	if (data->transform_pid > 0) {
+		return transform_wait(key);
 	}
+	return enqueue_mail(key, stored, store_key);
+}
 
-	if (data->request_parser.state == request_done) {
-		for (size_t i = 0; i < data->rcpt_qty; i++) {
-			copy_temp_to_new_single((char*)data->rcpt_to[i], data->filename_fd, data->temp_full_path);
-			time_t now = time(NULL);
+/** separa los destinatarios de la sesión en locales y remotos */
+static void
+split_rcpt(smtp_data* data, const char** local, size_t* local_qty, const char** remote, size_t* remote_qty)
+{
+	*local_qty = *remote_qty = 0;
+	const size_t rcpt_qty = data->rcpt_qty < N(data->rcpt_to) ? data->rcpt_qty : N(data->rcpt_to);
+	for (size_t i = 0; i < rcpt_qty; i++) {
+		const char* rcpt = (const char*)data->rcpt_to[i];
+		if (is_local_rcpt(rcpt)) {
+			local[(*local_qty)++] = rcpt;
+		} else {
+			remote[(*remote_qty)++] = rcpt;
+		}
+	}
+}
+
+static socket_state enqueue_local(struct selector_key* key, bool queued);
+
+/**
+ * saca de la sesión a los destinatarios locales en cuyo buzón no entran
+ * `size' bytes: una sola respuesta al cuerpo no puede rechazar a algunos, así
+ * que se descartan y queda en el log. Sin ninguno que lo acepte deja en
+ * `quota_refused' por qué, prefiriendo QUOTA_FULL (el remitente puede
+ * reintentar).
+ *
+ * @return los destinatarios que quedan
+ */
+static size_t
+drop_over_quota(smtp_data* data, uint64_t size)
+{
+	const size_t rcpt_qty = data->rcpt_qty < N(data->rcpt_to) ? data->rcpt_qty : N(data->rcpt_to);
+	quota_result refused = QUOTA_OK;
+	size_t kept = 0;
+	for (size_t i = 0; i < rcpt_qty; i++) {
+		const char* rcpt = (const char*)data->rcpt_to[i];
+		quota_result r = QUOTA_OK;
+		if (is_local_rcpt(rcpt)) {
+			const char* at = strchr(rcpt, '@');
+			r = quota_check(rcpt, at != NULL ? (size_t)(at - rcpt) : strlen(rcpt), size);
+		}
+		if (r != QUOTA_OK) {
+			logf(LOG_INFO, "Session %u: %s dropped, message of %llu bytes over quota", data->id, rcpt,
+			     (unsigned long long)size);
+			refused = refused == QUOTA_FULL ? QUOTA_FULL : r;
+		} else if (kept++ != i) {
+			memcpy(data->rcpt_to[kept - 1], data->rcpt_to[i], sizeof(data->rcpt_to[i]));
+		}
+	}
+	data->rcpt_qty = kept;
+	if (kept == 0) {
+		data->quota_refused = refused;
+	}
+	return kept;
+}
+
+/**
+ * encola el mensaje ya escrito en el temporal y contesta, o espera en
+ * REQUEST_DATA_WRITE a que el relay y el spool lo tengan en disco. `stored'
+ * es false si no se pudo escribir entero
+ */
+static socket_state
+enqueue_mail(struct selector_key* key, bool stored, const char* store_key)
+{
+	smtp_data* data = ATTACHMENT(key);
+	// lo que pasó el límite quedó truncado (ver mail_body_write)
+	stored = stored && !data->too_big;
+
+	// la entrega a los maildirs la hace el spool y la remota el relay: sólo
+	// esperamos a que los sobres estén en disco para contestar
+	const char* local[N(data->rcpt_to)];
+	const char* remote[N(data->rcpt_to)];
+	size_t local_qty, remote_qty;
+	split_rcpt(data, local, &local_qty, remote, &remote_qty);
+	// en RCPT sólo sabíamos el SIZE declarado: cada buzón local se vuelve a
+	// mirar con el tamaño real, y los que ya no tienen lugar salen del mensaje
+	data->quota_refused = QUOTA_OK;
+	if (stored && local_qty > 0) {
+		struct stat st;
+		const uint64_t size = stat(data->temp_full_path, &st) == 0 ? (uint64_t)st.st_size : 0;
+		if (drop_over_quota(data, size) == 0) {
+			stored = false;
+		}
+		split_rcpt(data, local, &local_qty, remote, &remote_qty);
+	}
+	snprintf(data->store_key, sizeof(data->store_key), "%s", store_key);
+	spool_new_id(data->queue_id);
+	bool queued = stored;
+	if (queued && remote_qty > 0) {
+		// lo que llegó por DATA quedó con los puntos duplicados; lo de BDAT, tal cual
+		const bool stuffed = data->state != CHUNK;
+		// los fsync los hace el hilo del relay; el spool va después, si no hay cómo cancelarlo
+		data->relay_commit = relay_submit(data->id, (const char*)data->mail_from, remote, remote_qty,
+		                                  data->temp_full_path, data->queue_id, stuffed, spool_committed, key->s,
+		                                  data->fd);
+		if (data->relay_commit == NULL) {
+			queued = false;
+		} else if (relay_commit_status_of(data->relay_commit) == SPOOL_COMMIT_PENDING) {
+			return selector_set_interest(key->s, data->fd, OP_NOOP) == SELECTOR_SUCCESS ? REQUEST_DATA_WRITE
+			                                                                           : REQUEST_ERROR;
+		}
+	}
+	return enqueue_local(key, queued);
+}
+
+/** los sobres remotos ya están en disco (o no había): sigue el del spool */
+static socket_state
+enqueue_local(struct selector_key* key, bool queued)
+{
+	smtp_data* data = ATTACHMENT(key);
+	if (data->relay_commit != NULL) {
+		queued = queued && relay_commit_status_of(data->relay_commit) == SPOOL_COMMIT_DONE;
+		// desde acá los mensajes están en la cola del relay, y se cancelan con relay_cancel
+		relay_commit_release(data->relay_commit);
+		data->relay_commit = NULL;
+	}
+	const char* local[N(data->rcpt_to)];
+	const char* remote[N(data->rcpt_to)];
+	size_t local_qty, remote_qty;
+	split_rcpt(data, local, &local_qty, remote, &remote_qty);
+	if (queued && local_qty > 0) {
+		// el fsync lo hace un hilo del spool, junto con los de otras sesiones
+		data->commit = spool_submit(data->id, (const char*)data->mail_from, local, local_qty, data->filename_fd,
+		                            data->temp_full_path, data->store_key[0] != '\0' ? data->store_key : NULL,
+		                            data->queue_id, spool_committed, key->s, data->fd);
+		if (data->commit == NULL) {
+			relay_cancel(data->queue_id);
+			queued = false;
+		} else if (spool_commit_status_of(data->commit) == SPOOL_COMMIT_PENDING) {
+			return selector_set_interest(key->s, data->fd, OP_NOOP) == SELECTOR_SUCCESS ? REQUEST_DATA_WRITE
+			                                                                           : REQUEST_ERROR;
+		}
+	} else if (queued) {
+		// el relay tiene su propio enlace al archivo
+		unlink(data->temp_full_path);
+	}
+	return enqueue_done(key, queued);
+}
+
+unsigned
+spool_commit_handler(struct selector_key* key)
+{
+	smtp_data* data = ATTACHMENT(key);
+	if (data->relay_commit != NULL) {
+		if (relay_commit_status_of(data->relay_commit) == SPOOL_COMMIT_PENDING) {
+			return REQUEST_DATA_WRITE;
+		}
+		return enqueue_local(key, true);
+	}
+	const spool_commit_status status = spool_commit_status_of(data->commit);
+	if (status == SPOOL_COMMIT_PENDING) {
+		return REQUEST_DATA_WRITE;
+	}
+	if (status == SPOOL_COMMIT_FAILED) {
+		relay_cancel(data->queue_id);
+	}
+	return enqueue_done(key, status == SPOOL_COMMIT_DONE);
+}
+
+/** el mensaje quedó encolado (o no, con `queued' en false): contestamos */
+static socket_state
+enqueue_done(struct selector_key* key, bool queued)
+{
+	smtp_data* data = ATTACHMENT(key);
+	if (SELECTOR_SUCCESS != selector_set_interest(key->s, data->fd, OP_WRITE)) {
+		return REQUEST_ERROR;
+	}
+	const size_t rcpt_qty = data->rcpt_qty < N(data->rcpt_to) ? data->rcpt_qty : N(data->rcpt_to);
+	if (queued) {
+		time_t now = time(NULL);
+		for (size_t i = 0; i < rcpt_qty; i++) {
 			register_mail((char*)data->mail_from, (char*)data->rcpt_to[i], data->filename_fd, now);
 		}
-		if (SELECTOR_SUCCESS != selector_set_interest(key->s, data->fd, OP_WRITE)) {
+		logger_event(LOG_EV_QUEUED, data->id, rcpt_qty, 0, 0);
+	} else {
+		// handle_body/handle_chunk contestan 451 y el mensaje se descarta
+		data->queue_id[0] = '\0';
+		if (data->commit == NULL) {
+			unlink(data->temp_full_path);
+		}
+	}
+	spool_commit_release(data->commit);
+	data->commit = NULL;
+
+	clean_request(key);
+	// Procesamiento
+	return request_process(key);
+}
+
+/**
+ * escribe el bloque de un BDAT directo desde el buffer de lectura, sin
+ * escanearlo ni copiarlo
+ */
+static socket_state
+write_chunk_handler(struct selector_key* key)
+{
+	smtp_data* data = ATTACHMENT(key);
+	struct request_parser* p = &data->request_parser;
+
+	size_t count;
+	uint8_t* ptr = buffer_read_ptr(&data->read_buffer, &count);
+	if (count > p->n - p->i) {
+		count = p->n - p->i;
+	}
+	if (count > 0) {
+		ssize_t n = mail_body_write(data, ptr, count);
+		if (n < 0) {
 			return REQUEST_ERROR;
 		}
+		buffer_read_adv(&data->read_buffer, n);
+		p->i += n;
+	}
+
+	if (SELECTOR_SUCCESS != selector_set_interest_key(key, OP_NOOP)) {
+		return REQUEST_ERROR;
+	}
 
-		if (SELECTOR_SUCCESS != selector_unregister_fd(key->s, data->output_fd))
+	if (p->i < p->n) {
+		if (SELECTOR_SUCCESS != selector_set_interest(key->s, data->fd, OP_READ))
 			return REQUEST_ERROR;
-		
-		
-		close(data->output_fd);
+		return REQUEST_DATA;
+	}
+
+	if (data->chunk_last || data->too_big) {
+		return deliver_mail(key);
+	}
+	// quedan más bloques: el archivo sigue abierto hasta el BDAT LAST
+	if (SELECTOR_SUCCESS != selector_set_interest(key->s, data->fd, OP_WRITE)) {
+		return REQUEST_ERROR;
+	}
+	return request_process(key);
+}
+
+socket_state
+write_file_handler(struct selector_key* key)
+{
+	socket_state ret = REQUEST_DATA_WRITE;
+	smtp_data* data = ATTACHMENT(key);
 
-		// rename  rcpt file
+	if (data->state == CHUNK) {
+		return write_chunk_handler(key);
+	}
 
+	char* data_buffer = (char*)data->request.data;
+	size_t count = strlen(data_buffer);
+	ssize_t n = mail_body_write(data, data_buffer, count);
 
-		data->output_fd = 0;
+	if (n < 0) {
+		return REQUEST_ERROR;
+	}
 
-		clean_request(key);
-		// Procesamiento
-		return request_process(key);
+	if (SELECTOR_SUCCESS != selector_set_interest_key(key, OP_NOOP)) {
+		return REQUEST_ERROR;
+	}
 
-		// escribo mi rta
+	if (data->request_parser.state == request_done) {
+		return deliver_mail(key);
 	} else {
 		if (SELECTOR_SUCCESS != selector_set_interest(key->s, data->fd, OP_READ))
 			return REQUEST_ERROR;
@@ -682,7 +1729,7 @@ strndup(const char* s, size_t n)
 void
 on_done_init(const unsigned state, struct selector_key* key)
 {
-	printf("on_done_init\n %d", state);
+	logf(LOG_DEBUG, "on_done_init %u", state);
 	smtp_data* data = ATTACHMENT(key);
 	free(data);
 	// anything else to free?
@@ -695,6 +1742,11 @@ clean_request(struct selector_key* key)
 	// close(data->output_fd);
 	//  free(data->request.data); // freeing the data buffer
 	memset(&data->is_body, 0, sizeof((data->is_body)));
+	memset(&data->binarymime, 0, sizeof((data->binarymime)));
+	memset(&data->declared_size, 0, sizeof((data->declared_size)));
+	// create_temp_mail_file sólo genera un nombre nuevo si éstos están vacíos
+	memset(&data->filename_fd, 0, sizeof((data->filename_fd)));
+	memset(&data->temp_full_path, 0, sizeof((data->temp_full_path)));
 	memset(&data->request, 0, sizeof((data->request)));
 	memset(&data->mail_from, 0, sizeof((data->mail_from)));
 	memset(&data->rcpt_to, 0, sizeof((data->rcpt_to)));
@@ -0,0 +1,981 @@
+/**
+ * spool.c - cola persistente de mensajes aceptados (ver spool.h)
+ */
+#include "spool.h"
+
+#include "logger.h"
+#include "maildir.h"
+#include "quota.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ENVELOPE_EXT ".env"
+#define TEMP_EXT     ".tmp"
+#define FAILED_EXT   ".failed"
+#define PATH_SIZE    (sizeof(SPOOL_DIR) + 1 + SPOOL_ID_SIZE + sizeof(FAILED_EXT))
+#define FIELD_SIZE   512
+#define MAX_WORKERS  16
+// un temporal de sobre más viejo que esto quedó de un proceso que murió escribiéndolo
+#define STALE_TEMP_S 60
+// tamaño inicial de la tabla de ids y del heap; crecen al doble
+#define JOBS_MIN 64
+
+/** un sobre en la cola; el contenido sólo está en disco */
+struct job
+{
+	char id[SPOOL_ID_SIZE];
+	unsigned attempts;
+	/** cuándo intentar la entrega, en ms de CLOCK_MONOTONIC */
+	uint64_t due_ms;
+	/** siguiente en el mismo bucket de la tabla de ids */
+	struct job* next;
+};
+
+/** un sobre leído de disco */
+struct envelope
+{
+	uint32_t session;
+	char name[FIELD_SIZE];
+	char data[FIELD_SIZE];
+	/** clave en el store de maildir.h; vacía si se entrega copiando */
+	char key[MAILDIR_STORE_KEY_SIZE];
+	char from[FIELD_SIZE];
+	char** rcpt;
+	size_t rcpt_qty;
+};
+
+/** ver spool_submit */
+struct spool_commit
+{
+	char id[SPOOL_ID_SIZE];
+	char data_path[FIELD_SIZE];
+	spool_commit_status status;
+	/** quien lo envió y el hilo de commits; se libera cuando lo sueltan los dos */
+	unsigned refs;
+	spool_notify_fn notify;
+	void* ctx;
+	int fd;
+	/** sólo los usa el hilo de commits mientras procesa la tanda */
+	bool synced;
+	bool renamed;
+	bool waiting;
+	struct spool_commit* next;
+};
+
+enum delivery
+{
+	DELIVERY_DONE,
+	/** algún destinatario falló */
+	DELIVERY_RETRY,
+	/** otro proceso lo está entregando */
+	DELIVERY_BUSY,
+	/** el sobre ya no existe: lo terminó otro proceso */
+	DELIVERY_GONE,
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup;
+// todos los sobres de la cola, por id; jobs_qty cuenta también los que se están entregando
+static struct job** buckets = NULL;
+static size_t buckets_qty = 0;
+static size_t jobs_qty = 0;
+// los que esperan turno, min-heap por due_ms; uno que se está entregando no está
+static struct job** heap = NULL;
+static size_t heap_qty = 0;
+static size_t heap_cap = 0;
+static bool stopping = false;
+static unsigned sequence = 0;
+static uint64_t last_scan_ms = 0;
+static uint64_t last_gc_ms = 0;
+
+static pthread_t workers[MAX_WORKERS];
+static unsigned workers_qty = 0;
+// commits esperando su tanda, en orden de llegada
+static struct spool_commit* commits = NULL;
+static struct spool_commit** commits_tail = &commits;
+static pthread_cond_t commit_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_t committer;
+static bool committer_started = false;
+static bool initialized = false;
+/** SPOOL_DIR abierto, para fsync de los renombres */
+static int dir_fd = -1;
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+spool_path(char* buf, const char* id, const char* ext)
+{
+	snprintf(buf, PATH_SIZE, "%s/%s%s", SPOOL_DIR, id, ext);
+}
+
+static size_t
+id_bucket(const char* id, size_t qty)
+{
+	return maildir_hash(MAILDIR_HASH_INIT, id, strlen(id)) & (qty - 1);
+}
+
+/** el sobre `id' si está en la cola. Con el mutex tomado */
+static struct job*
+find_job(const char* id)
+{
+	if (buckets_qty == 0) {
+		return NULL;
+	}
+	for (struct job* j = buckets[id_bucket(id, buckets_qty)]; j != NULL; j = j->next) {
+		if (strcmp(j->id, id) == 0) {
+			return j;
+		}
+	}
+	return NULL;
+}
+
+/** duplica la tabla de ids. Con el mutex tomado */
+static int
+grow_buckets(void)
+{
+	const size_t qty = buckets_qty == 0 ? JOBS_MIN : buckets_qty * 2;
+	struct job** b = calloc(qty, sizeof(*b));
+	if (b == NULL) {
+		return -1;
+	}
+	for (size_t i = 0; i < buckets_qty; i++) {
+		while (buckets[i] != NULL) {
+			struct job* j = buckets[i];
+			buckets[i] = j->next;
+			const size_t k = id_bucket(j->id, qty);
+			j->next = b[k];
+			b[k] = j;
+		}
+	}
+	free(buckets);
+	buckets = b;
+	buckets_qty = qty;
+	return 0;
+}
+
+/** pone un sobre en el heap según su due_ms. Con el mutex tomado */
+static int
+heap_push(struct job* job)
+{
+	if (heap_qty == heap_cap) {
+		const size_t cap = heap_cap == 0 ? JOBS_MIN : heap_cap * 2;
+		struct job** h = realloc(heap, cap * sizeof(*h));
+		if (h == NULL) {
+			return -1;
+		}
+		heap = h;
+		heap_cap = cap;
+	}
+	size_t i = heap_qty++;
+	while (i > 0 && heap[(i - 1) / 2]->due_ms > job->due_ms) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = job;
+	return 0;
+}
+
+/** saca el sobre de menor due_ms; el heap no puede estar vacío. Con el mutex tomado */
+static struct job*
+heap_pop(void)
+{
+	struct job* top = heap[0];
+	struct job* last = heap[--heap_qty];
+	size_t i = 0;
+	for (size_t c = 1; c < heap_qty; c = 2 * i + 1) {
+		if (c + 1 < heap_qty && heap[c + 1]->due_ms < heap[c]->due_ms) {
+			c++;
+		}
+		if (heap[c]->due_ms >= last->due_ms) {
+			break;
+		}
+		heap[i] = heap[c];
+		i = c;
+	}
+	if (heap_qty > 0) {
+		heap[i] = last;
+	}
+	return top;
+}
+
+/** agrega un sobre a la cola si no estaba. Con el mutex tomado */
+static void
+add_job(const char* id, uint64_t due_ms)
+{
+	if (find_job(id) != NULL) {
+		return;
+	}
+	if (jobs_qty >= buckets_qty && grow_buckets() != 0 && buckets_qty == 0) {
+		logf(LOG_ERROR, "Spool: no memory to queue %s", id);
+		return;
+	}
+	struct job* j = calloc(1, sizeof(*j));
+	if (j != NULL) {
+		snprintf(j->id, sizeof(j->id), "%s", id);
+		j->due_ms = due_ms;
+	}
+	if (j == NULL || heap_push(j) != 0) {
+		// sigue en disco: lo levanta el próximo escaneo
+		logf(LOG_ERROR, "Spool: no memory to queue %s", id);
+		free(j);
+		return;
+	}
+	const size_t k = id_bucket(id, buckets_qty);
+	j->next = buckets[k];
+	buckets[k] = j;
+	jobs_qty++;
+	pthread_cond_signal(&wakeup);
+}
+
+/** saca de la cola y libera un sobre que no está en el heap. Con el mutex tomado */
+static void
+remove_job(struct job* job)
+{
+	for (struct job** p = &buckets[id_bucket(job->id, buckets_qty)]; *p != NULL; p = &(*p)->next) {
+		if (*p == job) {
+			*p = job->next;
+			jobs_qty--;
+			free(job);
+			return;
+		}
+	}
+}
+
+/**
+ * el próximo sobre para entregar, que sale del heap hasta que se llame a
+ * `finish', o NULL si no hay ninguno vencido; en ese caso `wait_ms' queda en
+ * el vencimiento más cercano. Con el mutex tomado
+ */
+static struct job*
+next_due(uint64_t now, uint64_t* wait_ms)
+{
+	if (heap_qty == 0) {
+		return NULL;
+	}
+	if (heap[0]->due_ms <= now) {
+		return heap_pop();
+	}
+	if (heap[0]->due_ms < *wait_ms) {
+		*wait_ms = heap[0]->due_ms;
+	}
+	return NULL;
+}
+
+/** encola los sobres del directorio que no conocíamos */
+static void
+scan(bool remove_stale)
+{
+	DIR* dir = opendir(SPOOL_DIR);
+	if (dir == NULL) {
+		logf(LOG_ERROR, "Spool: opendir %s: %s", SPOOL_DIR, strerror(errno));
+		return;
+	}
+	const time_t now = time(NULL);
+	const uint64_t due = now_ms();
+	struct dirent* e;
+	while ((e = readdir(dir)) != NULL) {
+		const size_t len = strlen(e->d_name);
+		const size_t ext = strlen(ENVELOPE_EXT);
+		if (len > ext && len - ext < SPOOL_ID_SIZE && strcmp(e->d_name + len - ext, ENVELOPE_EXT) == 0) {
+			char id[SPOOL_ID_SIZE];
+			snprintf(id, sizeof(id), "%.*s", (int)(len - ext), e->d_name);
+			pthread_mutex_lock(&mutex);
+			add_job(id, due);
+			pthread_mutex_unlock(&mutex);
+		} else if (remove_stale && len > strlen(TEMP_EXT) &&
+		           strcmp(e->d_name + len - strlen(TEMP_EXT), TEMP_EXT) == 0) {
+			struct stat st;
+			if (fstatat(dir_fd, e->d_name, &st, 0) == 0 && now - st.st_mtime > STALE_TEMP_S) {
+				unlinkat(dir_fd, e->d_name, 0);
+			}
+		}
+	}
+	closedir(dir);
+}
+
+static bool
+has_newline(const char* s)
+{
+	return strchr(s, '\n') != NULL || strchr(s, '\r') != NULL;
+}
+
+/** escribe el sobre `id' en su temporal, con fsync si `sync' */
+static int
+write_temp_envelope(const char* id, uint32_t session, const char* from, const char* const* rcpt, size_t rcpt_qty,
+                    const char* name, const char* data_path, const char* key, bool sync)
+{
+	char tmp[PATH_SIZE];
+	spool_path(tmp, id, TEMP_EXT);
+
+	const int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		logf(LOG_ERROR, "Spool: creating %s: %s", tmp, strerror(errno));
+		return -1;
+	}
+	FILE* f = fdopen(fd, "w");
+	if (f == NULL) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	fprintf(f, "session %u\nname %s\ndata %s\nfrom %s\n", session, name, data_path, from);
+	if (key != NULL && key[0] != '\0') {
+		fprintf(f, "key %s\n", key);
+	}
+	for (size_t i = 0; i < rcpt_qty; i++) {
+		fprintf(f, "rcpt %s\n", rcpt[i]);
+	}
+	bool ok = fflush(f) == 0 && !ferror(f);
+	if (ok && sync) {
+		ok = fsync(fd) == 0;
+	}
+	ok = fclose(f) == 0 && ok;
+	if (!ok) {
+		logf(LOG_ERROR, "Spool: writing %s: %s", tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/** escribe el sobre `id' en un temporal y lo renombra, reemplazando al anterior */
+static int
+write_envelope(const char* id, uint32_t session, const char* from, const char* const* rcpt, size_t rcpt_qty,
+               const char* name, const char* data_path, const char* key)
+{
+	if (write_temp_envelope(id, session, from, rcpt, rcpt_qty, name, data_path, key, SPOOL_FSYNC) != 0) {
+		return -1;
+	}
+	char tmp[PATH_SIZE], env[PATH_SIZE];
+	spool_path(tmp, id, TEMP_EXT);
+	spool_path(env, id, ENVELOPE_EXT);
+	if (rename(tmp, env) != 0) {
+		logf(LOG_ERROR, "Spool: writing %s: %s", env, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	if (SPOOL_FSYNC && dir_fd >= 0) {
+		fsync(dir_fd);
+	}
+	return 0;
+}
+
+static void
+free_envelope(struct envelope* env)
+{
+	for (size_t i = 0; i < env->rcpt_qty; i++) {
+		free(env->rcpt[i]);
+	}
+	free(env->rcpt);
+	env->rcpt = NULL;
+	env->rcpt_qty = 0;
+}
+
+static int
+read_envelope(FILE* f, struct envelope* env)
+{
+	memset(env, 0, sizeof(*env));
+	char* line = NULL;
+	size_t cap = 0;
+	ssize_t n;
+	int ret = 0;
+	while (ret == 0 && (n = getline(&line, &cap, f)) > 0) {
+		if (line[n - 1] == '\n') {
+			line[--n] = '\0';
+		}
+		char* value = strchr(line, ' ');
+		if (value == NULL) {
+			continue;
+		}
+		*value++ = '\0';
+		if (strcmp(line, "session") == 0) {
+			env->session = strtoul(value, NULL, 10);
+		} else if (strcmp(line, "name") == 0) {
+			snprintf(env->name, sizeof(env->name), "%s", value);
+		} else if (strcmp(line, "data") == 0) {
+			snprintf(env->data, sizeof(env->data), "%s", value);
+		} else if (strcmp(line, "from") == 0) {
+			snprintf(env->from, sizeof(env->from), "%s", value);
+		} else if (strcmp(line, "key") == 0) {
+			snprintf(env->key, sizeof(env->key), "%s", value);
+		} else if (strcmp(line, "rcpt") == 0) {
+			char** rcpt = realloc(env->rcpt, (env->rcpt_qty + 1) * sizeof(*rcpt));
+			char* dup = strdup(value);
+			if (rcpt == NULL || dup == NULL) {
+				free(dup);
+				ret = -1;
+			}
+			if (rcpt != NULL) {
+				env->rcpt = rcpt;
+			}
+			if (ret == 0) {
+				env->rcpt[env->rcpt_qty++] = dup;
+			}
+		}
+	}
+	free(line);
+	if (ret == 0 && (env->name[0] == '\0' || env->data[0] == '\0')) {
+		ret = -1;
+	}
+	if (ret != 0) {
+		free_envelope(env);
+	}
+	return ret;
+}
+
+/** entrega el sobre `id' a los destinatarios que le quedan */
+static enum delivery
+deliver(const char* id)
+{
+	char path[PATH_SIZE];
+	spool_path(path, id, ENVELOPE_EXT);
+	const int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		return errno == ENOENT ? DELIVERY_GONE : DELIVERY_RETRY;
+	}
+	// mientras lo tengamos bloqueado ningún otro proceso lo entrega
+	struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	if (fcntl(fd, F_SETLK, &fl) != 0) {
+		close(fd);
+		return DELIVERY_BUSY;
+	}
+	// lo abrimos justo cuando otro proceso lo terminaba (borrado o reescrito)
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_nlink == 0) {
+		close(fd);
+		return DELIVERY_BUSY;
+	}
+
+	FILE* f = fdopen(fd, "r");
+	if (f == NULL) {
+		close(fd);
+		return DELIVERY_RETRY;
+	}
+	struct envelope env;
+	if (read_envelope(f, &env) != 0) {
+		logf(LOG_ERROR, "Spool: malformed envelope %s", path);
+		fclose(f);
+		return DELIVERY_RETRY;
+	}
+
+	// con el mensaje en el store cada destinatario es un enlace más; si no se
+	// puede (otro filesystem, colisión), una copia como antes
+	char store_path[FIELD_SIZE];
+	const bool stored = env.key[0] != '\0' && maildir_store_add(env.data, env.key, store_path, sizeof(store_path)) == 0;
+	struct stat data_st;
+	const uint64_t size = stat(env.data, &data_st) == 0 ? (uint64_t)data_st.st_size : 0;
+	size_t failed = 0;
+	for (size_t i = 0; i < env.rcpt_qty; i++) {
+		if ((stored && maildir_link_to_new(env.rcpt[i], env.name, store_path) == 0) ||
+		    copy_temp_to_new_single(env.rcpt[i], env.name, env.data) == 0) {
+			logger_event(LOG_EV_DELIVERED, env.session, i, env.rcpt_qty, 0);
+			const char* at = strchr(env.rcpt[i], '@');
+			quota_charge(env.rcpt[i], at != NULL ? (size_t)(at - env.rcpt[i]) : strlen(env.rcpt[i]), size);
+			free(env.rcpt[i]);
+		} else {
+			// los que fallaron quedan al principio para reescribir el sobre
+			env.rcpt[failed++] = env.rcpt[i];
+		}
+	}
+	const size_t total = env.rcpt_qty;
+	env.rcpt_qty = failed;
+
+	enum delivery ret = DELIVERY_DONE;
+	if (failed == 0) {
+		unlink(path);
+		if (unlink(env.data) != 0 && errno != ENOENT) {
+			logf(LOG_ERROR, "Spool: removing %s: %s", env.data, strerror(errno));
+		}
+	} else {
+		logf(LOG_INFO, "Spool: %s: %zu of %zu recipients deferred", id, failed, total);
+		if (failed < total) {
+			write_envelope(id, env.session, env.from, (const char* const*)env.rcpt, failed, env.name, env.data,
+			               env.key);
+		}
+		ret = DELIVERY_RETRY;
+	}
+	free_envelope(&env);
+	fclose(f);
+	return ret;
+}
+
+/** reprograma o descarta un sobre según cómo terminó la entrega. Con el mutex tomado */
+static void
+finish(struct job* job, enum delivery result)
+{
+	switch (result) {
+		case DELIVERY_DONE:
+		case DELIVERY_GONE:
+			remove_job(job);
+			return;
+		case DELIVERY_BUSY:
+			job->due_ms = now_ms() + SPOOL_RETRY_MS;
+			break;
+		case DELIVERY_RETRY:
+			if (++job->attempts >= SPOOL_MAX_ATTEMPTS) {
+				char from[PATH_SIZE], to[PATH_SIZE];
+				spool_path(from, job->id, ENVELOPE_EXT);
+				spool_path(to, job->id, FAILED_EXT);
+				logf(LOG_ERROR, "Spool: giving up on %s after %u attempts", job->id, job->attempts);
+				rename(from, to);
+				remove_job(job);
+				return;
+			} else {
+				uint64_t delay = (uint64_t)SPOOL_RETRY_MS << (job->attempts - 1);
+				job->due_ms = now_ms() + (delay < SPOOL_RETRY_MAX_MS ? delay : SPOOL_RETRY_MAX_MS);
+			}
+			break;
+	}
+	if (heap_push(job) != 0) {
+		// lo vuelve a encontrar el próximo escaneo
+		logf(LOG_ERROR, "Spool: no memory to reschedule %s", job->id);
+		remove_job(job);
+	}
+}
+
+static void*
+worker_main(void* arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&mutex);
+	while (!stopping) {
+		const uint64_t now = now_ms();
+		uint64_t wait_ms = last_scan_ms + SPOOL_SCAN_INTERVAL_MS;
+		struct job* job = next_due(now, &wait_ms);
+		if (job == NULL) {
+			if (now >= last_scan_ms + SPOOL_SCAN_INTERVAL_MS) {
+				// sin trabajo: buscamos sobres que haya dejado otro proceso
+				last_scan_ms = now;
+				const bool gc = now >= last_gc_ms + MAILDIR_STORE_GC_MS;
+				if (gc) {
+					last_gc_ms = now;
+				}
+				pthread_mutex_unlock(&mutex);
+				scan(false);
+				if (gc) {
+					maildir_store_gc();
+				}
+				pthread_mutex_lock(&mutex);
+				continue;
+			}
+			struct timespec ts = { .tv_sec = wait_ms / 1000, .tv_nsec = (wait_ms % 1000) * 1000000 };
+			pthread_cond_timedwait(&wakeup, &mutex, &ts);
+			continue;
+		}
+
+		char id[SPOOL_ID_SIZE];
+		memcpy(id, job->id, sizeof(id));
+		pthread_mutex_unlock(&mutex);
+		const enum delivery result = deliver(id);
+		pthread_mutex_lock(&mutex);
+		finish(job, result);
+	}
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+/** fsync de `path', sólo de los datos si `data_only' */
+static int
+sync_file(const char* path, bool data_only)
+{
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || (data_only ? fdatasync(fd) : fsync(fd)) != 0) {
+		logf(LOG_ERROR, "Spool: syncing %s: %s", path, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+/** suelta una referencia a un commit. Con el mutex tomado */
+static void
+commit_put(struct spool_commit* c)
+{
+	if (--c->refs > 0) {
+		return;
+	}
+	// nadie más va a mirar el resultado: el archivo no tiene otro dueño
+	if (c->status == SPOOL_COMMIT_FAILED) {
+		unlink(c->data_path);
+	}
+	free(c);
+}
+
+/** el directorio que contiene a `path', en `out' de FIELD_SIZE */
+static void
+parent_dir(const char* path, char* out)
+{
+	snprintf(out, FIELD_SIZE, "%s", path);
+	char* slash = strrchr(out, '/');
+	if (slash == NULL) {
+		strcpy(out, ".");
+	} else if (slash == out) {
+		slash[1] = '\0';
+	} else {
+		*slash = '\0';
+	}
+}
+
+/** el mensaje y el sobre temporal a disco */
+static bool
+commit_sync(struct spool_commit* c)
+{
+	char tmp[PATH_SIZE];
+	spool_path(tmp, c->id, TEMP_EXT);
+	if (sync_file(c->data_path, true) != 0 || sync_file(tmp, false) != 0) {
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * el nombre del mensaje está en un directorio de los maildirs: sin su fsync
+ * el sobre puede sobrevivir a un crash que se lleve el archivo. Uno por
+ * directorio distinto en la tanda
+ */
+static void
+commit_sync_dirs(struct spool_commit* batch)
+{
+	char dir[FIELD_SIZE], other[FIELD_SIZE];
+	for (struct spool_commit* c = batch; c != NULL; c = c->next) {
+		if (!c->synced) {
+			continue;
+		}
+		parent_dir(c->data_path, dir);
+		bool seen = false;
+		for (struct spool_commit* p = batch; p != c && !seen; p = p->next) {
+			parent_dir(p->data_path, other);
+			seen = p->synced && strcmp(dir, other) == 0;
+		}
+		if (seen || sync_file(dir, false) == 0) {
+			continue;
+		}
+		// todos los de ese directorio fallan
+		for (struct spool_commit* n = c; n != NULL; n = n->next) {
+			parent_dir(n->data_path, other);
+			if (n->synced && strcmp(dir, other) == 0) {
+				char tmp[PATH_SIZE];
+				spool_path(tmp, n->id, TEMP_EXT);
+				unlink(tmp);
+				n->synced = false;
+			}
+		}
+	}
+}
+
+static bool
+commit_rename(struct spool_commit* c)
+{
+	char tmp[PATH_SIZE], env[PATH_SIZE];
+	spool_path(tmp, c->id, TEMP_EXT);
+	spool_path(env, c->id, ENVELOPE_EXT);
+	if (rename(tmp, env) != 0) {
+		logf(LOG_ERROR, "Spool: writing %s: %s", env, strerror(errno));
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * hace los commits de a tandas: todos los que llegaron mientras se
+ * sincronizaba la anterior comparten el fsync del directorio
+ */
+static void*
+committer_main(void* arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&mutex);
+	for (;;) {
+		if (commits == NULL) {
+			if (stopping) {
+				break;
+			}
+			pthread_cond_wait(&commit_wakeup, &mutex);
+			continue;
+		}
+		struct spool_commit* batch = commits;
+		commits = NULL;
+		commits_tail = &commits;
+		pthread_mutex_unlock(&mutex);
+
+		// el mensaje y su directorio tienen que llegar a disco antes que el sobre que lo referencia
+		for (struct spool_commit* c = batch; c != NULL; c = c->next) {
+			c->synced = commit_sync(c);
+		}
+		commit_sync_dirs(batch);
+		size_t renamed = 0;
+		for (struct spool_commit* c = batch; c != NULL; c = c->next) {
+			c->renamed = c->synced && commit_rename(c);
+			renamed += c->renamed;
+		}
+		if (renamed > 0 && fsync(dir_fd) != 0) {
+			logf(LOG_ERROR, "Spool: syncing %s: %s", SPOOL_DIR, strerror(errno));
+			for (struct spool_commit* c = batch; c != NULL; c = c->next) {
+				if (c->renamed) {
+					char env[PATH_SIZE];
+					spool_path(env, c->id, ENVELOPE_EXT);
+					unlink(env);
+					c->renamed = false;
+				}
+			}
+		}
+
+		logf(LOG_DEBUG, "Spool: committed %zu envelopes in one batch", renamed);
+		const uint64_t now = now_ms();
+		pthread_mutex_lock(&mutex);
+		for (struct spool_commit* c = batch; c != NULL; c = c->next) {
+			c->status = c->renamed ? SPOOL_COMMIT_DONE : SPOOL_COMMIT_FAILED;
+			c->waiting = c->refs > 1;
+			if (c->renamed) {
+				add_job(c->id, now);
+			}
+		}
+		pthread_mutex_unlock(&mutex);
+		// sin el mutex: quien recibe el aviso consulta el estado
+		for (struct spool_commit* c = batch; c != NULL; c = c->next) {
+			if (c->waiting) {
+				c->notify(c->ctx, c->fd);
+			}
+		}
+		pthread_mutex_lock(&mutex);
+		while (batch != NULL) {
+			struct spool_commit* next = batch->next;
+			commit_put(batch);
+			batch = next;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+int
+spool_init(unsigned qty)
+{
+	if (mkdir(SPOOL_DIR, S_IRWXU) != 0 && errno != EEXIST) {
+		logf(LOG_ERROR, "Spool: mkdir %s: %s", SPOOL_DIR, strerror(errno));
+		return -1;
+	}
+	dir_fd = open(SPOOL_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) {
+		logf(LOG_ERROR, "Spool: open %s: %s", SPOOL_DIR, strerror(errno));
+		return -1;
+	}
+
+	// los vencimientos se miden con CLOCK_MONOTONIC: no les afecta un cambio de hora
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wakeup, &attr);
+	pthread_condattr_destroy(&attr);
+	initialized = true;
+
+	stopping = false;
+	scan(true);
+	last_scan_ms = now_ms();
+	if (jobs_qty > 0) {
+		logf(LOG_INFO, "Spool: %zu messages pending from a previous run", jobs_qty);
+	}
+
+	if (pthread_create(&committer, NULL, committer_main, NULL) != 0) {
+		logf(LOG_ERROR, "Spool: pthread_create: %s", strerror(errno));
+		return -1;
+	}
+	committer_started = true;
+
+	if (qty > MAX_WORKERS) {
+		qty = MAX_WORKERS;
+	}
+	for (workers_qty = 0; workers_qty < qty; workers_qty++) {
+		if (pthread_create(&workers[workers_qty], NULL, worker_main, NULL) != 0) {
+			logf(LOG_ERROR, "Spool: pthread_create: %s", strerror(errno));
+			break;
+		}
+	}
+	return workers_qty > 0 ? 0 : -1;
+}
+
+void
+spool_new_id(char* id)
+{
+	pthread_mutex_lock(&mutex);
+	const unsigned seq = ++sequence;
+	pthread_mutex_unlock(&mutex);
+	snprintf(id, SPOOL_ID_SIZE, "%lld.%ld.%u", (long long)time(NULL), (long)getpid(), seq);
+}
+
+/** un salto de línea en un campo agregaría líneas al sobre */
+static bool
+valid_envelope(uint32_t session, const char* from, const char* const* rcpt, size_t rcpt_qty, const char* name,
+               const char* data_path, const char* key)
+{
+	bool valid = rcpt_qty > 0 && !has_newline(from) && !has_newline(name) && !has_newline(data_path) &&
+	             strlen(data_path) < FIELD_SIZE && (key == NULL || !has_newline(key));
+	for (size_t i = 0; valid && i < rcpt_qty; i++) {
+		valid = !has_newline(rcpt[i]);
+	}
+	if (!valid) {
+		logf(LOG_ERROR, "Spool: refusing envelope of session %u", session);
+	}
+	return valid;
+}
+
+int
+spool_enqueue(uint32_t session, const char* from, const char* const* rcpt, size_t rcpt_qty, const char* name,
+              const char* data_path, const char* key, const char* id)
+{
+	if (!valid_envelope(session, from, rcpt, rcpt_qty, name, data_path, key)) {
+		return -1;
+	}
+	// el mensaje y su directorio tienen que llegar a disco antes que el sobre que lo referencia
+	char dir[FIELD_SIZE];
+	parent_dir(data_path, dir);
+	if (SPOOL_FSYNC && (sync_file(data_path, true) != 0 || sync_file(dir, false) != 0)) {
+		return -1;
+	}
+	if (write_envelope(id, session, from, rcpt, rcpt_qty, name, data_path, key) != 0) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&mutex);
+	add_job(id, now_ms());
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+struct spool_commit*
+spool_submit(uint32_t session, const char* from, const char* const* rcpt, size_t rcpt_qty, const char* name,
+             const char* data_path, const char* key, const char* id, spool_notify_fn notify, void* ctx, int fd)
+{
+	if (!valid_envelope(session, from, rcpt, rcpt_qty, name, data_path, key)) {
+		return NULL;
+	}
+	struct spool_commit* c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		logf(LOG_ERROR, "Spool: no memory to queue %s", id);
+		return NULL;
+	}
+	snprintf(c->id, sizeof(c->id), "%s", id);
+	snprintf(c->data_path, sizeof(c->data_path), "%s", data_path);
+	c->notify = notify;
+	c->ctx = ctx;
+	c->fd = fd;
+
+	if (!SPOOL_FSYNC) {
+		// no hay nada que esperar
+		if (write_envelope(id, session, from, rcpt, rcpt_qty, name, data_path, key) != 0) {
+			free(c);
+			return NULL;
+		}
+		c->status = SPOOL_COMMIT_DONE;
+		c->refs = 1;
+		pthread_mutex_lock(&mutex);
+		add_job(id, now_ms());
+		pthread_mutex_unlock(&mutex);
+		return c;
+	}
+	if (write_temp_envelope(id, session, from, rcpt, rcpt_qty, name, data_path, key, false) != 0) {
+		free(c);
+		return NULL;
+	}
+	c->status = SPOOL_COMMIT_PENDING;
+	c->refs = 2;
+	pthread_mutex_lock(&mutex);
+	*commits_tail = c;
+	commits_tail = &c->next;
+	pthread_cond_signal(&commit_wakeup);
+	pthread_mutex_unlock(&mutex);
+	return c;
+}
+
+spool_commit_status
+spool_commit_status_of(struct spool_commit* commit)
+{
+	pthread_mutex_lock(&mutex);
+	const spool_commit_status ret = commit->status;
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
+
+void
+spool_commit_release(struct spool_commit* commit)
+{
+	if (commit == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&mutex);
+	commit_put(commit);
+	pthread_mutex_unlock(&mutex);
+}
+
+size_t
+spool_pending(void)
+{
+	pthread_mutex_lock(&mutex);
+	const size_t ret = jobs_qty;
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
+
+void
+spool_finalize(void)
+{
+	if (!initialized) {
+		return;
+	}
+	pthread_mutex_lock(&mutex);
+	stopping = true;
+	pthread_cond_broadcast(&wakeup);
+	pthread_cond_broadcast(&commit_wakeup);
+	pthread_mutex_unlock(&mutex);
+	for (unsigned i = 0; i < workers_qty; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	workers_qty = 0;
+	// termina los commits que quedaban antes de salir
+	if (committer_started) {
+		pthread_join(committer, NULL);
+		committer_started = false;
+	}
+
+	for (size_t i = 0; i < buckets_qty; i++) {
+		while (buckets[i] != NULL) {
+			struct job* next = buckets[i]->next;
+			free(buckets[i]);
+			buckets[i] = next;
+		}
+	}
+	free(buckets);
+	buckets = NULL;
+	buckets_qty = 0;
+	jobs_qty = 0;
+	free(heap);
+	heap = NULL;
+	heap_qty = heap_cap = 0;
+	pthread_cond_destroy(&wakeup);
+	initialized = false;
+	if (dir_fd >= 0) {
+		close(dir_fd);
+		dir_fd = -1;
+	}
+}
@@ -0,0 +1,263 @@
+/**
+ * timer_wheel.c - rueda de timers jerárquica
+ */
+#include "timer_wheel.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SLOT_MASK    (TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(l) ((l) * TIMER_WHEEL_BITS)
+/** máximo delta representable, en ticks */
+#define MAX_DELTA    ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+struct timer_wheel
+{
+	unsigned tick_ms;
+	/** próximo tick a procesar. Todos los anteriores ya fueron procesados */
+	uint64_t now;
+	/** cantidad de timers armados */
+	unsigned count;
+
+	struct wheel_timer* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	/** bit i prendido si slots[level][i] no está vacío */
+	uint64_t occupied[TIMER_WHEEL_LEVELS];
+};
+
+uint64_t
+timer_wheel_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+timer_wheel
+timer_wheel_new(unsigned tick_ms, uint64_t now_ms)
+{
+	if (tick_ms == 0) {
+		return NULL;
+	}
+	timer_wheel w = calloc(1, sizeof(*w));
+	if (w != NULL) {
+		w->tick_ms = tick_ms;
+		w->now = now_ms / tick_ms;
+	}
+	return w;
+}
+
+void
+timer_wheel_destroy(timer_wheel w)
+{
+	if (w == NULL) {
+		return;
+	}
+	for (unsigned l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+		for (unsigned i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+			struct wheel_timer* t = w->slots[l][i];
+			while (t != NULL) {
+				struct wheel_timer* next = t->next;
+				t->next = NULL;
+				t->pprev = NULL;
+				t = next;
+			}
+		}
+	}
+	free(w);
+}
+
+void
+wheel_timer_init(struct wheel_timer* t, wheel_timer_callback on_expire, void* data)
+{
+	memset(t, 0, sizeof(*t));
+	t->on_expire = on_expire;
+	t->data = data;
+}
+
+bool
+wheel_timer_pending(const struct wheel_timer* t)
+{
+	return t->pprev != NULL;
+}
+
+/** engancha `t' en el casillero que le corresponde según su vencimiento */
+static void
+insert(timer_wheel w, struct wheel_timer* t)
+{
+	uint64_t expires = t->expires;
+	unsigned level = 0;
+	unsigned slot;
+
+	if (expires < w->now) {
+		// ya venció: que se procese en el próximo tick
+		slot = w->now & SLOT_MASK;
+	} else {
+		uint64_t delta = expires - w->now;
+		if (delta > MAX_DELTA) {
+			// demasiado lejos: lo estacionamos en el último nivel y se
+			// reubicará cada vez que se cascadee.
+			delta = MAX_DELTA;
+			expires = w->now + MAX_DELTA;
+		}
+		while (delta >= (1ULL << LEVEL_SHIFT(level + 1))) {
+			level++;
+		}
+		slot = (expires >> LEVEL_SHIFT(level)) & SLOT_MASK;
+	}
+
+	struct wheel_timer** head = &w->slots[level][slot];
+	t->level = level;
+	t->slot = slot;
+	t->next = *head;
+	if (t->next != NULL) {
+		t->next->pprev = &t->next;
+	}
+	t->pprev = head;
+	*head = t;
+	w->occupied[level] |= 1ULL << slot;
+}
+
+/** desengancha `t' de la lista en la que esté */
+static void
+unlink_timer(timer_wheel w, struct wheel_timer* t)
+{
+	*t->pprev = t->next;
+	if (t->next != NULL) {
+		t->next->pprev = t->pprev;
+	}
+	if (w->slots[t->level][t->slot] == NULL) {
+		w->occupied[t->level] &= ~(1ULL << t->slot);
+	}
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+void
+timer_wheel_schedule(timer_wheel w, struct wheel_timer* t, uint64_t now_ms, uint64_t ms)
+{
+	if (wheel_timer_pending(t)) {
+		unlink_timer(w, t);
+	} else {
+		w->count++;
+	}
+	// redondeamos para arriba: un timer nunca vence antes de tiempo
+	t->expires = (now_ms + ms + w->tick_ms - 1) / w->tick_ms;
+	insert(w, t);
+}
+
+void
+timer_wheel_cancel(timer_wheel w, struct wheel_timer* t)
+{
+	if (wheel_timer_pending(t)) {
+		unlink_timer(w, t);
+		w->count--;
+	}
+}
+
+/** reubica todos los timers de un casillero de nivel `level' > 0 */
+static unsigned
+cascade(timer_wheel w, unsigned level)
+{
+	const unsigned index = (w->now >> LEVEL_SHIFT(level)) & SLOT_MASK;
+	struct wheel_timer* t = w->slots[level][index];
+	w->slots[level][index] = NULL;
+	w->occupied[level] &= ~(1ULL << index);
+
+	while (t != NULL) {
+		struct wheel_timer* next = t->next;
+		insert(w, t);
+		t = next;
+	}
+	return index;
+}
+
+unsigned
+timer_wheel_advance(timer_wheel w, uint64_t now_ms)
+{
+	const uint64_t target = now_ms / w->tick_ms;
+	unsigned fired = 0;
+
+	while (w->now <= target) {
+		if (w->count == 0) {
+			w->now = target + 1;
+			break;
+		}
+		const unsigned index = w->now & SLOT_MASK;
+		if (w->occupied[0] == 0 && index != 0) {
+			// nada que vencer en este nivel hasta la próxima vuelta
+			uint64_t next_round = (w->now | SLOT_MASK) + 1;
+			w->now = next_round < target + 1 ? next_round : target + 1;
+			continue;
+		}
+		if (index == 0) {
+			for (unsigned l = 1; l < TIMER_WHEEL_LEVELS && cascade(w, l) == 0; l++) {
+				// los niveles superiores sólo se cascadean al completar vuelta
+			}
+		}
+
+		// movemos la lista a una cabeza local para que los callbacks puedan
+		// cancelar o rearmar cualquier timer, incluso los de esta misma lista.
+		struct wheel_timer* list = w->slots[0][index];
+		w->slots[0][index] = NULL;
+		w->occupied[0] &= ~(1ULL << index);
+		if (list != NULL) {
+			list->pprev = &list;
+		}
+		w->now++;
+
+		while (list != NULL) {
+			struct wheel_timer* t = list;
+			list = t->next;
+			if (list != NULL) {
+				list->pprev = &list;
+			}
+			t->next = NULL;
+			t->pprev = NULL;
+			w->count--;
+			fired++;
+			t->on_expire(t, t->data);
+		}
+	}
+	return fired;
+}
+
+int64_t
+timer_wheel_next_ms(timer_wheel w, uint64_t now_ms)
+{
+	if (w->count == 0) {
+		return -1;
+	}
+
+	uint64_t next = UINT64_MAX;
+	const unsigned index = w->now & SLOT_MASK;
+	if (w->occupied[0] != 0) {
+		// rotamos el bitmap para que el bit 0 sea el tick actual
+		uint64_t rot = w->occupied[0] >> index;
+		if (index != 0) {
+			rot |= w->occupied[0] << (TIMER_WHEEL_SLOTS - index);
+		}
+		next = w->now + (unsigned)__builtin_ctzll(rot);
+	}
+	for (unsigned l = 1; l < TIMER_WHEEL_LEVELS; l++) {
+		if (w->occupied[l] != 0) {
+			// hay que despertar, como muy tarde, en la próxima cascada
+			uint64_t boundary = (w->now | SLOT_MASK) + 1;
+			if (boundary < next) {
+				next = boundary;
+			}
+			break;
+		}
+	}
+	assert(next != UINT64_MAX);
+
+	const uint64_t next_ms = next * w->tick_ms;
+	return next_ms > now_ms ? (int64_t)(next_ms - now_ms) : 0;
+}
+
+unsigned
+timer_wheel_count(timer_wheel w)
+{
+	return w->count;
+}
@@ -0,0 +1,135 @@
+#include "transform.h"
+
+#include "logger.h"
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+static void* handles[TRANSFORM_MAX_PLUGINS];
+static const transform_plugin* plugins[TRANSFORM_MAX_PLUGINS];
+// nombre del archivo, sin el directorio ni el sufijo
+static char names[TRANSFORM_MAX_PLUGINS][NAME_MAX + 1];
+static size_t handles_qty = 0;
+static const transform_plugin* current = NULL;
+
+bool
+transform_is_plugin(const char* path)
+{
+	const size_t len = strlen(path), suffix = strlen(TRANSFORM_PLUGIN_SUFFIX);
+	return len > suffix && strcmp(path + len - suffix, TRANSFORM_PLUGIN_SUFFIX) == 0;
+}
+
+/** `name' sin el sufijo, si lo tiene */
+static size_t
+plugin_name_len(const char* name)
+{
+	return transform_is_plugin(name) ? strlen(name) - strlen(TRANSFORM_PLUGIN_SUFFIX) : strlen(name);
+}
+
+static int
+transform_load(const char* dir, const char* file)
+{
+	if (handles_qty == TRANSFORM_MAX_PLUGINS) {
+		logf(LOG_ERROR, "Transform: too many plugins, %s/%s not loaded", dir, file);
+		return -1;
+	}
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/%s", dir, file) >= (int)sizeof(path)) {
+		logf(LOG_ERROR, "Transform: path too long: %s/%s", dir, file);
+		return -1;
+	}
+	void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (handle == NULL) {
+		logf(LOG_ERROR, "Transform: %s", dlerror());
+		return -1;
+	}
+	const transform_plugin* plugin = dlsym(handle, TRANSFORM_PLUGIN_SYMBOL);
+	if (plugin == NULL || plugin->abi_version != TRANSFORM_ABI_VERSION || plugin->init == NULL ||
+	    plugin->chunk == NULL || plugin->finish == NULL) {
+		logf(LOG_ERROR, "Transform: %s does not export a version %d `%s'", path, TRANSFORM_ABI_VERSION,
+		     TRANSFORM_PLUGIN_SYMBOL);
+		dlclose(handle);
+		return -1;
+	}
+	const size_t len = plugin_name_len(file);
+	for (size_t i = 0; i < handles_qty; i++) {
+		// el primero gana: el plugin nombrado en la línea de comandos se carga antes
+		if (strlen(names[i]) == len && strncmp(names[i], file, len) == 0) {
+			logf(LOG_ERROR, "Transform: a plugin named %.*s is already loaded, %s skipped", (int)len, file, path);
+			dlclose(handle);
+			return -1;
+		}
+	}
+	memcpy(names[handles_qty], file, len);
+	names[handles_qty][len] = '\0';
+	plugins[handles_qty] = plugin;
+	handles[handles_qty++] = handle;
+	logf(LOG_INFO, "Transform: loaded plugin %s from %s", plugin->name != NULL ? plugin->name : "?", path);
+	return 0;
+}
+
+int
+transform_load_file(const char* path)
+{
+	const char* slash = strrchr(path, '/');
+	if (slash == NULL) {
+		return transform_load(".", path);
+	}
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+	return transform_load(dir, slash + 1);
+}
+
+int
+transform_load_dir(const char* dir)
+{
+	DIR* d = opendir(dir);
+	if (d == NULL) {
+		logf(LOG_ERROR, "Transform: cannot open plugin directory %s", dir);
+		return -1;
+	}
+	int loaded = 0;
+	struct dirent* de;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] != '.' && transform_is_plugin(de->d_name) && transform_load(dir, de->d_name) == 0) {
+			loaded++;
+		}
+	}
+	closedir(d);
+	return loaded;
+}
+
+int
+transform_select(const char* name)
+{
+	// sólo un nombre: nunca se abre nada fuera del directorio de plugins
+	if (strchr(name, '/') != NULL || strstr(name, "..") != NULL) {
+		return -1;
+	}
+	const size_t len = plugin_name_len(name);
+	for (size_t i = 0; i < handles_qty; i++) {
+		if (strlen(names[i]) == len && strncmp(names[i], name, len) == 0) {
+			current = plugins[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const transform_plugin*
+transform_current(void)
+{
+	return current;
+}
+
+void
+transform_finalize(void)
+{
+	current = NULL;
+	while (handles_qty > 0) {
+		dlclose(handles[--handles_qty]);
+	}
+}
@@ -0,0 +1,215 @@
+#include "upgrade.h"
+
+#include "logger.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define UPGRADE_READY 'R'
+
+/** channel to the process that started us, -1 if this is not an upgrade */
+static int parent_channel = -1;
+/** process started by upgrade_start */
+static pid_t child = -1;
+
+static void
+set_cloexec(const int fd)
+{
+	const int flags = fcntl(fd, F_GETFD);
+	if (flags != -1) {
+		fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+	}
+}
+
+int
+upgrade_inherit(int* fds, unsigned n)
+{
+	const char* env = getenv(UPGRADE_ENV);
+	if (env == NULL) {
+		return 0;
+	}
+	char* end = NULL;
+	const long channel = strtol(env, &end, 10);
+	unsetenv(UPGRADE_ENV);  // un upgrade posterior no debe heredarlo
+	if (end == env || *end != '\0' || channel < 0 || channel > INT32_MAX) {
+		logf(LOG_ERROR, "Invalid %s: %s", UPGRADE_ENV, env);
+		return -1;
+	}
+	parent_channel = channel;
+	set_cloexec(parent_channel);
+
+	if (n > UPGRADE_MAX_FDS) {
+		n = UPGRADE_MAX_FDS;
+	}
+	char byte;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	union
+	{
+		char buf[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	ssize_t r;
+	do {
+		r = recvmsg(parent_channel, &msg, 0);
+	} while (r < 0 && errno == EINTR);
+	if (r <= 0) {
+		logf(LOG_ERROR, "Receiving listening sockets: %s", r == 0 ? "channel closed" : strerror(errno));
+		return -1;
+	}
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		logf(LOG_ERROR, "Receiving listening sockets: %s", "no descriptors");
+		return -1;
+	}
+	const unsigned received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	const int* passed = (const int*)CMSG_DATA(cmsg);
+	for (unsigned i = 0; i < received; i++) {
+		if (i < n) {
+			memcpy(fds + i, passed + i, sizeof(int));
+			set_cloexec(fds[i]);
+		} else {
+			int extra;
+			memcpy(&extra, passed + i, sizeof(int));
+			close(extra);
+		}
+	}
+	if (msg.msg_flags & MSG_CTRUNC) {
+		logf(LOG_ERROR, "Receiving listening sockets: %s", "descriptors truncated");
+	}
+	return received < n ? received : n;
+}
+
+void
+upgrade_ready(void)
+{
+	if (parent_channel < 0) {
+		return;
+	}
+	const char byte = UPGRADE_READY;
+	ssize_t r;
+	do {
+		r = write(parent_channel, &byte, 1);
+	} while (r < 0 && errno == EINTR);
+	if (r != 1) {
+		logf(LOG_ERROR, "Notifying previous process: %s", strerror(errno));
+	}
+}
+
+int
+upgrade_previous(void)
+{
+	const int channel = parent_channel;
+	parent_channel = -1;
+	return channel;
+}
+
+int
+upgrade_start(char* const argv[], const int* fds, unsigned n)
+{
+	if (n == 0 || n > UPGRADE_MAX_FDS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// channel[0] queda en este proceso, channel[1] lo hereda el nuevo
+	int channel[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, channel) < 0) {
+		logf(LOG_ERROR, "socketpair: %s", strerror(errno));
+		return -1;
+	}
+	set_cloexec(channel[0]);
+
+	const pid_t pid = fork();
+	if (pid < 0) {
+		logf(LOG_ERROR, "fork: %s", strerror(errno));
+		close(channel[0]);
+		close(channel[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		char env[16];
+		snprintf(env, sizeof(env), "%d", channel[1]);
+		if (setenv(UPGRADE_ENV, env, 1) == 0) {
+			execv(argv[0], argv);
+		}
+		perror("upgrade: execv");
+		_exit(127);
+	}
+	close(channel[1]);
+	child = pid;
+
+	char byte = 0;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	union
+	{
+		char buf[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = CMSG_SPACE(n * sizeof(int)),
+	};
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+
+	ssize_t r;
+	do {
+		r = sendmsg(channel[0], &msg, MSG_NOSIGNAL);
+	} while (r < 0 && errno == EINTR);
+	if (r != 1) {
+		// el nuevo proceso no recibe nada y termina solo; upgrade_finish lo espera
+		logf(LOG_ERROR, "Sending listening sockets: %s", strerror(errno));
+	}
+
+	if (fcntl(channel[0], F_SETFL, fcntl(channel[0], F_GETFL) | O_NONBLOCK) < 0) {
+		logf(LOG_ERROR, "fcntl: %s", strerror(errno));
+	}
+	return channel[0];
+}
+
+int
+upgrade_finish(int channel)
+{
+	char byte;
+	ssize_t r;
+	do {
+		r = read(channel, &byte, 1);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return -1;
+	}
+	if (r == 1 && byte == UPGRADE_READY) {
+		return 1;
+	}
+
+	// el nuevo proceso no llegó a servir; si cerró el canal es porque terminó
+	if (r == 0 && child > 0) {
+		int status;
+		while (waitpid(child, &status, 0) < 0 && errno == EINTR) {
+		}
+		child = -1;
+	}
+	return 0;
+}
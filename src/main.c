@@ -11,9 +11,18 @@
  * el selector.
  */
 #include "lib/headers/access_registry.h"
+#include "lib/headers/conn_table.h"
+#include "lib/headers/maildir.h"
+#include "lib/headers/mailindex.h"
 #include "lib/headers/monitor.h"
+#include "lib/headers/quota.h"
+#include "lib/headers/recipients.h"
+#include "lib/headers/relay.h"
 #include "lib/headers/selector.h"
 #include "lib/headers/smtp.h"
+#include "lib/headers/spool.h"
+#include "lib/headers/transform.h"
+#include "lib/headers/upgrade.h"
 #include "logger.h"
 
 #include <errno.h>
@@ -29,6 +38,11 @@
 #include <unistd.h>
 #
 static bool done = false;
+static bool upgrade_requested = false;
+// respuesta del proceso nuevo durante un upgrade: -1 pendiente, 0 falló, 1 sirviendo
+static int upgrade_result = -1;
+// el proceso que nos lanzó con un upgrade todavía está drenando sus sesiones
+static bool previous_running = false;
 
 static void
 sigterm_handler(const int signal)
@@ -37,15 +51,55 @@ sigterm_handler(const int signal)
 	done = true;
 }
 
+static void
+sigusr2_handler(const int signal)
+{
+	(void)signal;
+	upgrade_requested = true;
+}
+
+static void
+upgrade_read(struct selector_key* key)
+{
+	upgrade_result = upgrade_finish(key->fd);
+	if (upgrade_result == 1) {
+		// queda abierto hasta que salimos: el proceso nuevo espera eso para tomar quota.db
+		selector_set_interest_key(key, OP_NOOP);
+	} else if (upgrade_result == 0) {
+		selector_unregister_fd(key->s, key->fd);
+	}
+}
+
+/** el proceso que nos lanzó terminó: ya guardó sus cuotas y las nuestras pueden arrancar */
+static void
+previous_read(struct selector_key* key)
+{
+	char byte;
+	if (read(key->fd, &byte, 1) > 0) {
+		return;
+	}
+	logf(LOG_INFO, "Previous process exited, rebuilding quotas");
+	previous_running = false;
+	quota_start();
+	selector_unregister_fd(key->s, key->fd);
+}
+
+static void
+upgrade_close(struct selector_key* key)
+{
+	close(key->fd);
+}
+
 int
 main(const int argc, const char** argv)
 {
 	char command[256];
 	unsigned port = 2525;
 	unsigned monitor_port = 2526;
+	int backlog = SMTP_DEFAULT_BACKLOG;
 
-	if (argc != 3) {
-		fprintf(stderr, "Usage: %s <port> <command>\n", argv[0]);
+	if (argc != 3 && argc != 4) {
+		fprintf(stderr, "Usage: %s <port> <command> [backlog]\n", argv[0]);
 		return 1;
 	}
 
@@ -70,34 +124,58 @@ main(const int argc, const char** argv)
 	}
 	port = sl;
 
-	// Validate command
-	int c = 0;
+	// Validate backlog
+	if (argc == 4) {
+		end = 0;
+		errno = 0;
+		sl = strtol(argv[3], &end, 10);
+		if (end == argv[3] || '\0' != *end || ERANGE == errno || sl <= 0 || sl > INT_MAX) {
+			fprintf(stderr, "backlog should be a positive integer: %s\n", argv[3]);
+			return 1;
+		}
+		backlog = sl;
+	}
+
+	// no tenemos nada que leer de stdin. Antes del logger: un proceso lanzado
+	// por un upgrade arranca sin fd 0 y el archivo del log puede quedar ahí
+	close(0);
+
+	// logger: antes de cargar los plugins y de heredar los sockets, que
+	// también pueden fallar y tienen que quedar en el log
+	logger_init("", NULL);
+	logger_set_level(LOG_DEBUG);
+	logger_events_init("");
+
+	// Validate command: un programa o un plugin (ver transform.h)
+	const bool c = strcmp(argv[2], "-") != 0;
 	printf("Command argument received: %s\n", argv[2]);
-	if (strcmp(argv[2], "-") != 0 && (c = access(argv[2], X_OK) != 0)) {
+	if (c && access(argv[2], transform_is_plugin(argv[2]) ? R_OK : X_OK) != 0) {
 		fprintf(stderr, "Command not executable or not found: %s\n", argv[2]);
+		logger_finalize();
 		return 1;
 	}
 	if (c) {
 		int n = sizeof(command);
-		if (strlen(argv[2]) > (size_t)n) {
+		if (strlen(argv[2]) >= (size_t)n) {
 		    fprintf(stderr, "Command too long: %s\n", argv[2]);
+		    logger_finalize();
 		    return 1;
 		}
 		strncpy(command, argv[2], n);
-		init_status(command);
+		if (init_status(command) != 0) {
+			fprintf(stderr, "Could not load transformation plugin: %s\n", argv[2]);
+			logger_finalize();
+			return 1;
+		}
 
 	} else {
 		init_status(NULL);
 	}
 
-	// no tenemos nada que leer de stdin
-
-
-	close(0);
-
 	const char* err_msg = NULL;
 	selector_status ss = SELECTOR_SUCCESS;
 	fd_selector selector = NULL;
+	int server6 = -1, server4 = -1, monitor_server6 = -1, monitor_server4 = -1;
 
 	struct sockaddr_in6 addr6;
 	struct sockaddr_in addr4;
@@ -109,6 +187,26 @@ main(const int argc, const char** argv)
 	memset(&monitor_addr6, 0, sizeof(monitor_addr6));
 	memset(&monitor_addr4, 0, sizeof(monitor_addr4));
 
+	// si nos lanzó un upgrade (SIGUSR2) heredamos los sockets pasivos ya
+	// escuchando en vez de crearlos: la cola de accept nunca se cierra
+	int inherited[4];
+	const int inherited_qty = upgrade_inherit(inherited, N(inherited));
+	if (inherited_qty < 0) {
+		err_msg = "receiving listening sockets";
+		goto finally;
+	}
+	if (inherited_qty == (int)N(inherited)) {
+		server6 = inherited[0];
+		server4 = inherited[1];
+		monitor_server6 = inherited[2];
+		monitor_server4 = inherited[3];
+		fprintf(stdout, "Inherited listening sockets from the previous process\n");
+		goto listening;
+	} else if (inherited_qty > 0) {
+		err_msg = "receiving listening sockets";
+		goto finally;
+	}
+
 	addr6.sin6_family = AF_INET6;   // IPv6
 	addr6.sin6_addr = in6addr_any;  // any local address, filter
 	addr6.sin6_port = htons(port);  // set port
@@ -127,13 +225,13 @@ main(const int argc, const char** argv)
 	monitor_addr4.sin_port = htons(monitor_port);       // set port
 
 	// create sockets
-	const int server6 = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+	server6 = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
 	if (server6 < 0) {
 		err_msg = "unable to create IPv6 socket";
 		goto finally;
 	}
 
-	const int server4 = socket(AF_INET, SOCK_STREAM, 0);
+	server4 = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (server4 < 0) {
 		err_msg = "unable to create IPv4 socket";
 		goto finally;
@@ -141,13 +239,13 @@ main(const int argc, const char** argv)
 
 	// for monitoring
 
-	const int monitor_server6 = socket(AF_INET6, SOCK_DGRAM, 0);
+	monitor_server6 = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
 	if (monitor_server6 < 0) {
 		err_msg = "unable to create IPv6 socket";
 		goto finally;
 	}
 
-	const int monitor_server4 = socket(AF_INET, SOCK_DGRAM, 0);
+	monitor_server4 = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
 	if (monitor_server4 < 0) {
 		err_msg = "unable to create IPv4 socket";
 		goto finally;
@@ -228,20 +326,26 @@ main(const int argc, const char** argv)
 	}
 
 	// listen for incoming connections
-	if (listen(server6, 20) < 0) {
+	if (listen(server6, backlog) < 0) {
 		err_msg = "unable to listen on IPv6 socket";
 		goto finally;
 	}
 
-	if (listen(server4, 20) < 0) {
+	if (listen(server4, backlog) < 0) {
 		err_msg = "unable to listen on IPv4 socket";
 		goto finally;
 	}
 
+listening:
 	// registrar sigterm es útil para terminar el programa normalmente.
 	// esto ayuda mucho en herramientas como valgrind.
 	signal(SIGTERM, sigterm_handler);
 	signal(SIGINT, sigterm_handler);
+	// SIGUSR2: reemplazar el binario sin cortar el servicio. Con sigaction
+	// porque signal() restablece el handler tras la primera entrega.
+	struct sigaction upgrade_action = { .sa_handler = sigusr2_handler };
+	sigemptyset(&upgrade_action.sa_mask);
+	sigaction(SIGUSR2, &upgrade_action, NULL);
 
 	// set socket to Non blocking [SETTING SERVER SOCKET FLAGS]
 	if (selector_fd_set_nio(server6) == -1) {
@@ -262,10 +366,6 @@ main(const int argc, const char** argv)
 		goto finally;
 	}
 
-	// logger
-	logger_init(selector, "", NULL);
-	logger_set_level(LOG_DEBUG);
-
 	// TODO: check if we need timeout
 	const struct selector_init conf = {
         .signal = SIGALRM,
@@ -323,12 +423,69 @@ main(const int argc, const char** argv)
 		err_msg = "registering IPv4 monitoring fd";
 		goto finally;
 	}
-	// logger
-	logger_init(selector, "", NULL);
-	logger_set_level(LOG_DEBUG);
-
 	init_access_registry();
 
+	if (conn_table_init(selector, NULL) != 0) {
+		err_msg = "initializing connection table";
+		goto finally;
+	}
+
+	if (recipients_init(selector, RECIPIENTS_FILE) != 0) {
+		err_msg = "loading recipient directory";
+		goto finally;
+	}
+
+	if (maildir_init(MAILDIR_SHARDS_FILE, MAILDIR_COMPRESS_FILE) != 0) {
+		err_msg = "loading maildir settings";
+		goto finally;
+	}
+	// en un upgrade el proceso anterior sigue entregando: ver previous_read
+	if (quota_init(selector, QUOTA_FILE, QUOTA_USAGE_FILE, inherited_qty > 0) != 0) {
+		err_msg = "loading quotas";
+		goto finally;
+	}
+
+	// antes de aceptar: los mensajes que dejó otro proceso se siguen entregando
+	if (spool_init(SPOOL_WORKERS) != 0) {
+		err_msg = "initializing spool";
+		goto finally;
+	}
+	if (mailindex_init(MAILINDEX_WORKERS) != 0) {
+		err_msg = "initializing mailbox index";
+		goto finally;
+	}
+	if (relay_init(selector, RELAY_ROUTES_FILE, RELAY_CLIENTS_FILE) != 0) {
+		err_msg = "initializing relay";
+		goto finally;
+	}
+
+	// ya atendemos: el proceso anterior puede dejar de aceptar
+	upgrade_ready();
+
+	const struct fd_handler upgrade = {
+		.handle_read = upgrade_read,
+		.handle_write = NULL,
+		.handle_close = upgrade_close,
+	};
+	const struct fd_handler previous_handler = {
+		.handle_read = previous_read,
+		.handle_write = NULL,
+		.handle_close = upgrade_close,
+	};
+	const int previous = upgrade_previous();
+	if (previous >= 0) {
+		previous_running = true;
+		if (selector_register(selector, previous, &previous_handler, OP_READ, NULL) != SELECTOR_SUCCESS) {
+			logf(LOG_ERROR, "Unable to register channel %d to the previous process", previous);
+			close(previous);
+			previous_running = false;
+		}
+	}
+	if (!previous_running) {
+		quota_start();
+	}
+	bool upgrading = false, draining = false;
+
 	// main loop to serve clients
 	while (!done) {
 		err_msg = NULL;
@@ -337,6 +494,55 @@ main(const int argc, const char** argv)
 			err_msg = "serving";
 			goto finally;
 		}
+
+		if (upgrade_requested) {
+			upgrade_requested = false;
+			if (upgrading || draining) {
+				logf(LOG_INFO, "Upgrade already in progress, ignoring SIGUSR2");
+				continue;
+			}
+			if (previous_running) {
+				// el que venga después no sabría cuándo termina ese proceso
+				logf(LOG_INFO, "Previous process still draining, ignoring SIGUSR2");
+				continue;
+			}
+			const int listeners[] = { server6, server4, monitor_server6, monitor_server4 };
+			const int channel = upgrade_start((char* const*)argv, listeners, N(listeners));
+			if (channel < 0) {
+				continue;
+			}
+			if (selector_register(selector, channel, &upgrade, OP_READ, NULL) != SELECTOR_SUCCESS) {
+				logf(LOG_ERROR, "Unable to register upgrade channel %d", channel);
+				close(channel);
+				continue;
+			}
+			logf(LOG_INFO, "Upgrade started, waiting for the new process");
+			upgrading = true;
+			upgrade_result = -1;
+		}
+
+		if (upgrading && upgrade_result == 0) {
+			logf(LOG_ERROR, "New process failed to start, still serving");
+			upgrading = false;
+		} else if (upgrading && upgrade_result == 1) {
+			// el proceso nuevo ya acepta en los mismos sockets: dejamos de
+			// aceptar y terminamos cuando se cierre la última sesión
+			int* listeners[] = { &server6, &server4, &monitor_server6, &monitor_server4 };
+			for (unsigned i = 0; i < N(listeners); i++) {
+				selector_unregister_fd(selector, *listeners[i]);
+				close(*listeners[i]);
+				*listeners[i] = -1;
+			}
+			smtp_drain(selector);
+			logf(LOG_INFO, "Handed over listening sockets, draining %u sessions", smtp_active_sessions());
+			upgrading = false;
+			draining = true;
+		}
+
+		if (draining && smtp_active_sessions() == 0) {
+			logf(LOG_INFO, "All sessions drained, exiting");
+			break;
+		}
 	}
 
 	if (err_msg == NULL) {
@@ -355,10 +561,20 @@ finally:
 		perror(err_msg);
 		ret = 1;
 	}
+	conn_table_destroy();
+	recipients_destroy();
+	mailindex_finalize();
+	spool_finalize();
+	relay_finalize();
+	quota_finalize();
+	maildir_finalize();
 	if (selector != NULL) {
 		selector_destroy(selector);
 	}
 	selector_close();
+	// después de cerrar las sesiones, que pueden tener un mensaje en el plugin
+	transform_finalize();
+	buffer_pool_destroy();
 
 	free_access_registry();
 
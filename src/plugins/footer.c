@@ -0,0 +1,91 @@
+/**
+ * footer.c - transformation plugin that appends a footer to every message.
+ *
+ *     ./smtpd.elf 2525 build/footer.so
+ *
+ * The footer is taken from SMTPD_FOOTER when the message starts, or
+ * FOOTER_DEFAULT if it is not set. It is a sample of the plugin API (see
+ * transform.h): the body goes through untouched and the footer is emitted
+ * in finish, dot-stuffed like the body when it came by DATA.
+ */
+#include "transform.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define FOOTER_DEFAULT "-- \r\nDelivered by smtpd"
+
+struct footer
+{
+	bool stuffed;
+	bool line_start;  // el último byte del cuerpo fue un '\n'
+	const char* text;
+};
+
+static void*
+footer_init(const char* from, const char* const* rcpt, size_t rcpt_qty, bool stuffed)
+{
+	(void)from;
+	(void)rcpt;
+	(void)rcpt_qty;
+	struct footer* f = malloc(sizeof(*f));
+	if (f == NULL) {
+		return NULL;
+	}
+	const char* text = getenv("SMTPD_FOOTER");
+	f->stuffed = stuffed;
+	f->line_start = true;
+	f->text = text != NULL ? text : FOOTER_DEFAULT;
+	return f;
+}
+
+static int
+footer_chunk(void* state, const void* buf, size_t len, transform_emit_fn emit, void* sink)
+{
+	struct footer* f = state;
+	if (len == 0) {
+		return 0;
+	}
+	f->line_start = ((const char*)buf)[len - 1] == '\n';
+	return emit(sink, buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+static int
+footer_finish(void* state, transform_emit_fn emit, void* sink)
+{
+	struct footer* f = state;
+	int ret = 0;
+	// lo que llegó por DATA se guarda sin el CRLF final, y el relay lo agrega
+	if (f->stuffed || !f->line_start) {
+		ret = emit(sink, "\r\n", 2) == 2 ? 0 : -1;
+	}
+	for (const char* line = f->text; ret == 0 && *line != '\0';) {
+		size_t len = strcspn(line, "\n");
+		const char* next = line[len] == '\n' ? line + len + 1 : line + len;
+		if (len > 0 && line[len - 1] == '\r') {
+			len--;
+		}
+		if (f->stuffed && line[0] == '.' && emit(sink, ".", 1) != 1) {
+			ret = -1;
+		}
+		if (ret == 0 && emit(sink, line, len) != (ssize_t)len) {
+			ret = -1;
+		}
+		// la última línea de un cuerpo de DATA también queda sin CRLF
+		const bool last = *next == '\0';
+		if (ret == 0 && (!last || !f->stuffed) && emit(sink, "\r\n", 2) != 2) {
+			ret = -1;
+		}
+		line = next;
+	}
+	free(f);
+	return ret;
+}
+
+const transform_plugin smtpd_transform_plugin = {
+	.abi_version = TRANSFORM_ABI_VERSION,
+	.name = "footer",
+	.init = footer_init,
+	.chunk = footer_chunk,
+	.finish = footer_finish,
+};
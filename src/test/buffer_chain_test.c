@@ -0,0 +1,113 @@
+#include "buffer_chain.h"
+#include "tests.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static void
+fill(uint8_t* p, size_t n, unsigned seed)
+{
+	for (size_t i = 0; i < n; i++) {
+		p[i] = (uint8_t)(i * 31 + seed);
+	}
+}
+
+void
+test_write_read_across_segments()
+{
+	static uint8_t in[3 * BUFFER_CHAIN_SEGMENT_SIZE + 100], out[sizeof(in)];
+	fill(in, sizeof(in), 7);
+
+	buffer_chain c;
+	buffer_chain_init(&c, 0);
+	assert_true(!buffer_chain_can_read(&c), "starts empty");
+	assert_true(buffer_chain_write(&c, in, 10) == 10, "small write");
+	assert_true(buffer_chain_write(&c, in + 10, sizeof(in) - 10) == sizeof(in) - 10, "large write");
+	assert_true(buffer_chain_len(&c) == sizeof(in), "length");
+
+	struct iovec iov[BUFFER_CHAIN_IOV_MAX];
+	assert_true(buffer_chain_read_iov(&c, iov, BUFFER_CHAIN_IOV_MAX) == 4, "one iovec per segment");
+
+	assert_true(buffer_chain_read(&c, out, 5) == 5, "partial read");
+	assert_true(buffer_chain_read(&c, out + 5, sizeof(out)) == sizeof(out) - 5, "read the rest");
+	assert_true(memcmp(in, out, sizeof(in)) == 0, "bytes preserved in order");
+	assert_true(!buffer_chain_can_read(&c) && c.head == NULL, "segments released when empty");
+}
+
+void
+test_limit()
+{
+	uint8_t in[100] = { 0 };
+	buffer_chain c;
+	buffer_chain_init(&c, 64);
+	assert_true(buffer_chain_write(&c, in, sizeof(in)) == 64, "write capped at limit");
+	assert_true(buffer_chain_write(&c, in, 1) == 0, "full");
+	buffer_chain_read_adv(&c, 10);
+	assert_true(buffer_chain_write(&c, in, sizeof(in)) == 10, "room after reading");
+	buffer_chain_reset(&c);
+}
+
+void
+test_pool_reuse()
+{
+	buffer_pool_destroy();
+	buffer_chain c;
+	buffer_chain_init(&c, 0);
+	uint8_t b = 1;
+	buffer_chain_write(&c, &b, 1);
+	assert_true(buffer_pool_free_qty() == 0, "segment taken from the pool");
+	buffer_chain_read_adv(&c, 1);
+	assert_true(buffer_pool_free_qty() == 1, "segment back in the pool");
+	buffer_chain_write(&c, &b, 1);
+	assert_true(buffer_pool_free_qty() == 0, "segment reused");
+	buffer_chain_reset(&c);
+	buffer_pool_destroy();
+}
+
+void
+test_readv_writev()
+{
+	int sv[2];
+	assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair");
+
+	static uint8_t in[2 * BUFFER_CHAIN_SEGMENT_SIZE + 17], out[sizeof(in)];
+	fill(in, sizeof(in), 3);
+
+	buffer_chain w, r;
+	buffer_chain_init(&w, 0);
+	buffer_chain_init(&r, 0);
+	buffer_chain_write(&w, in, sizeof(in));
+	assert_true(buffer_chain_send(&w, sv[0], MSG_NOSIGNAL) == (ssize_t)sizeof(in), "single sendmsg");
+	assert_true(!buffer_chain_can_read(&w), "sent bytes consumed");
+
+	size_t got = 0;
+	while (got < sizeof(in)) {
+		ssize_t n = buffer_chain_readv(&r, sv[1], sizeof(in) - got);
+		assert_true(n > 0, "readv");
+		got += n;
+	}
+	assert_true(buffer_chain_len(&r) == sizeof(in), "received length");
+	buffer_chain_read(&r, out, sizeof(out));
+	assert_true(memcmp(in, out, sizeof(in)) == 0, "round trip");
+
+	// una reserva sin datos no retiene memoria
+	close(sv[0]);
+	assert_true(buffer_chain_readv(&r, sv[1], 100) == 0, "EOF");
+	assert_true(r.head == NULL, "unused reservation released");
+	close(sv[1]);
+	buffer_pool_destroy();
+}
+
+int
+main(void)
+{
+	test_write_read_across_segments();
+	test_limit();
+	test_pool_reuse();
+	test_readv_writev();
+	printf("All tests passed.\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,172 @@
+#include "compress.h"
+#include "tests.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** comprime `len' bytes en `path' escribiéndolos en pedazos de `piece' */
+static void
+compress_to(const char* path, const uint8_t* buf, size_t len, size_t piece)
+{
+	const int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	assert_true(fd >= 0, path);
+	compressor* c = compressor_new(fd);
+	assert_true(c != NULL, "compressor");
+	for (size_t off = 0; off < len; off += piece) {
+		const size_t n = len - off < piece ? len - off : piece;
+		assert_true(compressor_write(c, buf + off, n) == (ssize_t)n, "write");
+	}
+	assert_true(compressor_raw_size(c) == len, "raw size");
+	assert_true(compressor_finish(c) == 0, "finish");
+	close(fd);
+}
+
+static uint8_t*
+decompress_from(const char* path, size_t* len)
+{
+	const int in = open(path, O_RDONLY);
+	assert_true(in >= 0, path);
+	assert_true(compress_is_compressed(in), "magic");
+	FILE* out = tmpfile();
+	const ssize_t n = compress_decompress(in, fileno(out));
+	close(in);
+	assert_true(n >= 0, "decompress");
+	uint8_t* buf = malloc(n + 1);
+	rewind(out);
+	assert_true(fread(buf, 1, n, out) == (size_t)n, "read back");
+	fclose(out);
+	*len = n;
+	return buf;
+}
+
+static long
+file_size(const char* path)
+{
+	FILE* f = fopen(path, "r");
+	fseek(f, 0, SEEK_END);
+	const long size = ftell(f);
+	fclose(f);
+	return size;
+}
+
+static size_t
+make_mail(uint8_t* buf, size_t size)
+{
+	static const char* const lines[] = {
+		"Received: from mx.example.org (mx.example.org [192.0.2.1]) by local\r\n",
+		"Subject: nightly report for the archive mailbox\r\n",
+		"The job finished without errors. 1234 records were processed.\r\n",
+		"--boundary\r\nContent-Type: text/plain; charset=utf-8\r\n\r\n",
+		"\r\n",
+	};
+	size_t len = 0;
+	unsigned i = 0;
+	while (len < size) {
+		const char* l = lines[(i * 7 + i / 3) % 5];
+		size_t n = strlen(l);
+		if (n > size - len) {
+			n = size - len;
+		}
+		memcpy(buf + len, l, n);
+		len += n;
+		i++;
+	}
+	return len;
+}
+
+void
+test_round_trip()
+{
+	const size_t sizes[] = { 0, 1, 12, 13, 100, 65536, 65537, 300000 };
+	static uint8_t mail[300000];
+	make_mail(mail, sizeof(mail));
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		compress_to("./m.lz4", mail, sizes[i], 1000);
+		size_t len;
+		uint8_t* back = decompress_from("./m.lz4", &len);
+		assert_true(len == sizes[i] && memcmp(back, mail, len) == 0, "same bytes");
+		free(back);
+	}
+	const long compressed = file_size("./m.lz4");
+	printf("mail text: %zu -> %ld bytes (%.1fx)\n", sizeof(mail), compressed, (double)sizeof(mail) / compressed);
+	assert_true(compressed * 3 < (long)sizeof(mail), "at least 3x on mail text");
+}
+
+void
+test_incompressible_blocks_stored()
+{
+	static uint8_t noise[200000];
+	srand(1);
+	for (size_t i = 0; i < sizeof(noise); i++) {
+		noise[i] = rand();
+	}
+	compress_to("./n.lz4", noise, sizeof(noise), sizeof(noise));
+	assert_true(file_size("./n.lz4") < (long)sizeof(noise) + 64, "bounded overhead");
+	size_t len;
+	uint8_t* back = decompress_from("./n.lz4", &len);
+	assert_true(len == sizeof(noise) && memcmp(back, noise, len) == 0, "same bytes");
+	free(back);
+}
+
+void
+test_lz4_tool_compatibility()
+{
+	if (system("command -v lz4 > /dev/null") != 0) {
+		printf("lz4 not installed, skipping compatibility check\n");
+		return;
+	}
+	static uint8_t mail[150000];
+	make_mail(mail, sizeof(mail));
+	compress_to("./c.lz4", mail, sizeof(mail), 4096);
+	assert_true(system("lz4 -d -q -f c.lz4 c.out && lz4 -q -f -c c.out > d.lz4") == 0, "lz4 tool");
+	FILE* f = fopen("./c.out", "r");
+	static uint8_t back[sizeof(mail)];
+	assert_true(fread(back, 1, sizeof(back), f) == sizeof(back) && memcmp(back, mail, sizeof(mail)) == 0,
+	            "lz4 reads our frames");
+	fclose(f);
+	size_t len;
+	uint8_t* ours = decompress_from("./d.lz4", &len);
+	assert_true(len == sizeof(mail) && memcmp(ours, mail, len) == 0, "we read lz4's frames");
+	free(ours);
+}
+
+void
+test_rejects_garbage()
+{
+	const int fd = open("./g", O_CREAT | O_TRUNC | O_RDWR, 0644);
+	assert_true(write(fd, "MAIL FROM: <a@local>\r\n", 22) == 22, "write");
+	assert_true(!compress_is_compressed(fd), "plain file");
+	lseek(fd, 0, SEEK_SET);
+	assert_true(compress_decompress(fd, fd) == -1, "not a frame");
+	close(fd);
+}
+
+void
+bench_throughput()
+{
+	static uint8_t mail[4 << 20];
+	make_mail(mail, sizeof(mail));
+	const clock_t start = clock();
+	compress_to("./b.lz4", mail, sizeof(mail), 16384);
+	const double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+	printf("%.0f MB/s compressing\n", sizeof(mail) / secs / 1e6);
+}
+
+int
+main(void)
+{
+	char dir[] = "/tmp/compress_test.XXXXXX";
+	assert_true(mkdtemp(dir) != NULL && chdir(dir) == 0, "temp dir");
+
+	test_round_trip();
+	test_incompressible_blocks_stored();
+	test_lz4_tool_compatibility();
+	test_rejects_garbage();
+	bench_throughput();
+	printf("All tests passed.\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,103 @@
+#include "conn_table.h"
+#include "tests.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct sockaddr_storage
+v4(const char* ip)
+{
+	struct sockaddr_storage ss;
+	memset(&ss, 0, sizeof(ss));
+	struct sockaddr_in* in = (struct sockaddr_in*)&ss;
+	in->sin_family = AF_INET;
+	inet_pton(AF_INET, ip, &in->sin_addr);
+	return ss;
+}
+
+static struct sockaddr_storage
+v6(const char* ip)
+{
+	struct sockaddr_storage ss;
+	memset(&ss, 0, sizeof(ss));
+	struct sockaddr_in6* in6 = (struct sockaddr_in6*)&ss;
+	in6->sin6_family = AF_INET6;
+	inet_pton(AF_INET6, ip, &in6->sin6_addr);
+	return ss;
+}
+
+void
+test_concurrency_limit()
+{
+	const struct conn_limits limits = {
+		.max_per_host = 2, .max_rate = 100, .rate_window_s = 60, .v4_prefix = 32, .v6_prefix = 64
+	};
+	conn_table_init(NULL, &limits);
+	struct sockaddr_storage a = v4("10.0.0.1");
+	struct sockaddr_storage b = v4("10.0.0.2");
+
+	assert_true(conn_table_acquire(&a, 1000) == CONN_ADMIT, "first admitted");
+	assert_true(conn_table_acquire(&a, 1000) == CONN_ADMIT, "second admitted");
+	assert_true(conn_table_acquire(&a, 1000) == CONN_TOO_MANY, "third refused");
+	assert_true(conn_table_acquire(&b, 1000) == CONN_ADMIT, "other host admitted");
+	conn_table_release(&a);
+	assert_true(conn_table_active(&a) == 1, "release decrements");
+	assert_true(conn_table_acquire(&a, 1000) == CONN_ADMIT, "admitted after release");
+
+	conn_table_destroy();
+}
+
+void
+test_rate_limit()
+{
+	const struct conn_limits limits = {
+		.max_per_host = 100, .max_rate = 5, .rate_window_s = 10, .v4_prefix = 32, .v6_prefix = 64
+	};
+	conn_table_init(NULL, &limits);
+	struct sockaddr_storage a = v4("192.168.1.1");
+
+	for (int i = 0; i < 5; i++) {
+		assert_true(conn_table_acquire(&a, 100) == CONN_ADMIT, "under the rate");
+		conn_table_release(&a);
+	}
+	assert_true(conn_table_acquire(&a, 100) == CONN_TOO_FAST, "over the rate");
+	// two windows later the history no longer counts
+	assert_true(conn_table_acquire(&a, 125) == CONN_ADMIT, "rate window slid");
+
+	conn_table_destroy();
+}
+
+void
+test_v6_prefix_and_sweep()
+{
+	const struct conn_limits limits = {
+		.max_per_host = 1, .max_rate = 100, .rate_window_s = 10, .v4_prefix = 32, .v6_prefix = 64
+	};
+	conn_table_init(NULL, &limits);
+	struct sockaddr_storage a = v6("2001:db8::1");
+	struct sockaddr_storage b = v6("2001:db8::ffff:2");
+	struct sockaddr_storage c = v6("2001:db8:0:1::1");
+
+	assert_true(conn_table_acquire(&a, 0) == CONN_ADMIT, "first v6 admitted");
+	assert_true(conn_table_acquire(&b, 0) == CONN_TOO_MANY, "same /64 shares the limit");
+	assert_true(conn_table_acquire(&c, 0) == CONN_ADMIT, "other /64 admitted");
+
+	conn_table_release(&c);
+	conn_table_sweep(100);
+	assert_true(conn_table_active(&a) == 1, "sweep keeps entries with open sessions");
+	assert_true(conn_table_acquire(&c, 100) == CONN_ADMIT, "swept prefix starts over");
+
+	conn_table_destroy();
+}
+
+int
+main(void)
+{
+	test_concurrency_limit();
+	test_rate_limit();
+	test_v6_prefix_and_sweep();
+	printf("All tests passed.\n");
+	return EXIT_SUCCESS;
+}
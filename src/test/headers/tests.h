@@ -1,6 +1,19 @@
 #ifndef TEST_H_8VyRIy8mLICCGx62mh19ScMWpkI
 #define TEST_H_8VyRIy8mLICCGx62mh19ScMWpkI
 
+#include <stdio.h>
+#include <stdlib.h>
+
 #define N(x) (sizeof(x) / sizeof(x[0]))
 
+/** termina el test con `msg' si `cond' es falso */
+static inline void
+assert_true(int cond, const char* msg)
+{
+	if (!cond) {
+		fprintf(stderr, "Assertion failed: %s\n", msg);
+		exit(EXIT_FAILURE);
+	}
+}
+
 #endif
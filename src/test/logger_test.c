@@ -0,0 +1,126 @@
+#include "logger.h"
+#include "tests.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char output[8192];
+
+static void
+read_back(FILE* stream)
+{
+	fflush(stream);
+	rewind(stream);
+	size_t n = fread(output, 1, sizeof(output) - 1, stream);
+	output[n] = '\0';
+}
+
+void
+test_deferred_formatting()
+{
+	FILE* stream = tmpfile();
+	logger_init(NULL, stream);
+
+	char buf[32];
+	strcpy(buf, "volatile");
+	logf(LOG_INFO, "int=%d neg=%i uint=%u hex=%#x", 42, -7, 3000000000u, 255u);
+	logf(LOG_INFO, "long=%ld size=%zu short=%hd char=%c", -1234567890123L, (size_t)99, (short)-3, 'Z');
+	logf(LOG_INFO, "str=[%-10s] pad=[%5.2s] dbl=%.3f pct=%%", buf, "abcdef", 3.14159);
+	logf(LOG_INFO, "star=[%*d] left=[%*d] prec=[%.*s] neg=[%.*s]", 5, 42, -4, 7, 3, "abcdef", -1, "all");
+	// the string is copied at the call site, so overwriting it afterwards must not show
+	strcpy(buf, "changed");
+	logf(LOG_OUTPUT, "no args");
+	log(LOG_WARNING, "via log");
+
+	logger_finalize();
+	read_back(stream);
+	fclose(stream);
+
+	assert_true(strstr(output, "[INFO]\tint=42 neg=-7 uint=3000000000 hex=0xff\n") != NULL, "integers");
+	assert_true(strstr(output, "long=-1234567890123 size=99 short=-3 char=Z\n") != NULL, "length modifiers");
+	assert_true(strstr(output, "str=[volatile  ] pad=[   ab] dbl=3.142 pct=%\n") != NULL, "strings and doubles");
+	assert_true(strstr(output, "star=[   42] left=[7   ] prec=[abc] neg=[all]\n") != NULL, "star width and precision");
+	assert_true(strstr(output, "\tno args\n") != NULL, "output level has no tag");
+	assert_true(strstr(output, "[WARNING]\tvia log\n") != NULL, "log macro");
+}
+
+void
+test_level_filter()
+{
+	FILE* stream = tmpfile();
+	logger_init(NULL, stream);
+	logger_set_level(LOG_WARNING);
+
+	logf(LOG_DEBUG, "hidden %d", 1);
+	logf(LOG_ERROR, "shown %d", 2);
+
+	logger_finalize();
+	read_back(stream);
+	fclose(stream);
+
+	assert_true(strstr(output, "hidden") == NULL, "debug filtered out");
+	assert_true(strstr(output, "shown 2") != NULL, "error kept");
+}
+
+void
+test_many_records()
+{
+	FILE* stream = tmpfile();
+	logger_init(NULL, stream);
+
+	for (int i = 0; i < 100; i++) {
+		logf(LOG_DEBUG, "record %d", i);
+	}
+
+	logger_finalize();
+	read_back(stream);
+	fclose(stream);
+
+	assert_true(strstr(output, "record 0\n") != NULL, "first record written");
+	assert_true(strstr(output, "record 99\n") != NULL, "records drained on finalize");
+}
+
+void
+test_event_log()
+{
+	char path[] = "/tmp/logger_test_XXXXXX";
+	int fd = mkstemp(path);
+	close(fd);
+	unlink(path);
+
+	logger_init(NULL, NULL);
+	assert_true(logger_events_init(path) == 0, "event log opened");
+	logger_event(LOG_EV_SESSION_OPEN, 7, 5, 2, 0);
+	logger_event(LOG_EV_DELIVERED, 7, 0, 1, 0);
+	logger_finalize();
+
+	FILE* f = fopen(path, "rb");
+	struct logger_event_header header;
+	struct logger_event events[3];
+	assert_true(fread(&header, sizeof(header), 1, f) == 1, "header present");
+	assert_true(memcmp(header.magic, LOGGER_EVENT_MAGIC, sizeof(header.magic)) == 0, "magic");
+	assert_true(header.record_size == sizeof(struct logger_event), "record size");
+	assert_true(fread(events, sizeof(*events), 3, f) == 2, "two events");
+	fclose(f);
+	unlink(path);
+
+	assert_true(events[0].event == LOG_EV_SESSION_OPEN && events[0].session == 7, "first event");
+	assert_true(events[0].fields[0] == 5 && events[0].fields[1] == 2, "first event fields");
+	assert_true(events[1].event == LOG_EV_DELIVERED && events[1].fields[1] == 1, "second event");
+	assert_true(events[0].timestamp_ns != 0 && events[1].timestamp_ns >= events[0].timestamp_ns, "timestamps");
+	assert_true(strcmp(logger_get_event_string(LOG_EV_DELIVERED), "DELIVERED") == 0, "event names");
+}
+
+int
+main(void)
+{
+	test_deferred_formatting();
+	test_level_filter();
+	test_many_records();
+	test_event_log();
+	printf("All tests passed.\n");
+	return EXIT_SUCCESS;
+}
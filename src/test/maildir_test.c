@@ -0,0 +1,181 @@
+#include "maildir.h"
+#include "tests.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void
+write_file(const char* path, const char* content)
+{
+	FILE* f = fopen(path, "w");
+	assert_true(f != NULL, path);
+	fputs(content, f);
+	fclose(f);
+}
+
+static void
+count_visit(const char* path, const char* name, void* arg)
+{
+	(void)name;
+	assert_true(access(path, R_OK) == 0, "visited path exists");
+	(*(unsigned*)arg)++;
+}
+
+void
+test_flat_layout()
+{
+	assert_true(maildir_init("./maildir_shards", "./maildir_compress") == 0, "init without file");
+	assert_true(!maildir_is_sharded("alice"), "flat by default");
+	write_file("./msg", "hello");
+	assert_true(copy_temp_to_new_single("alice@local", "1_flat", "./msg") == 0, "deliver");
+	assert_true(access("./Maildir/alice/new/1_flat", R_OK) == 0, "flat path");
+
+	char path[MAILDIR_PATH_SIZE];
+	assert_true(maildir_message_path("alice", "1_flat", path, sizeof(path)) == 0, "found");
+	assert_true(strcmp(path, "./Maildir/alice/new/1_flat") == 0, "flat path returned");
+	assert_true(maildir_message_path("alice", "missing", path, sizeof(path)) == -1, "missing");
+	maildir_finalize();
+}
+
+void
+test_sharded_layout()
+{
+	write_file("./maildir_shards", "# buzones con mucho tráfico\nsystem\n\nalerts  # otro\n");
+	assert_true(maildir_init("./maildir_shards", "./maildir_compress") == 0, "init");
+	assert_true(maildir_is_sharded("system") && maildir_is_sharded("alerts"), "listed");
+	assert_true(!maildir_is_sharded("alice") && !maildir_is_sharded("sys"), "not listed");
+
+	// un mensaje anterior al cambio de layout queda en new/ y se sigue encontrando
+	assert_true(copy_temp_to_new_single("alice@local", "0_old", "./msg") == 0, "create maildir");
+	assert_true(system("mkdir -p Maildir/system/new && cp msg Maildir/system/new/0_old") == 0, "legacy message");
+
+	char name[32];
+	for (int i = 0; i < 1000; i++) {
+		snprintf(name, sizeof(name), "%d_sharded", i);
+		assert_true(copy_temp_to_new_single("system@local", name, "./msg") == 0, "deliver");
+	}
+	char path[MAILDIR_PATH_SIZE];
+	assert_true(access("./Maildir/system/new/1_sharded", F_OK) != 0, "not at the top level");
+	assert_true(maildir_message_path("system", "1_sharded", path, sizeof(path)) == 0, "found in its shard");
+	assert_true(strlen(path) == strlen("./Maildir/system/new/") + MAILDIR_SHARD_DIGITS + 1 + strlen("1_sharded"),
+	            "shard path");
+	assert_true(maildir_message_path("system", "0_old", path, sizeof(path)) == 0, "legacy message found");
+	assert_true(strcmp(path, "./Maildir/system/new/0_old") == 0, "legacy path");
+
+	unsigned seen = 0;
+	assert_true(maildir_foreach("system", "new", count_visit, &seen) == 1001 && seen == 1001, "all messages listed");
+
+	// leído por un cliente: pasa a cur/ con flags, en el mismo shard o plano
+	char cur[MAILDIR_PATH_SIZE + 8];
+	assert_true(maildir_message_path("system", "7_sharded", path, sizeof(path)) == 0, "found");
+	snprintf(cur, sizeof(cur), "%s", path);
+	memcpy(strstr(cur, "/new/"), "/cur/", 5);
+	*strrchr(cur, '/') = '\0';
+	assert_true(mkdir(cur, 0777) == 0, "cur shard");
+	strcat(cur, "/7_sharded:2,S");
+	assert_true(rename(path, cur) == 0, "move to cur");
+	assert_true(maildir_message_path("system", "7_sharded", path, sizeof(path)) == 0, "found in cur");
+	assert_true(strcmp(path, cur) == 0, "cur path with flags");
+	assert_true(rename("./Maildir/system/new/0_old", "./Maildir/system/cur/0_old:2,RS") == 0, "legacy to cur");
+	assert_true(maildir_message_path("system", "0_old", path, sizeof(path)) == 0, "legacy found in cur");
+	assert_true(strcmp(path, "./Maildir/system/cur/0_old:2,RS") == 0, "legacy cur path");
+	maildir_finalize();
+}
+
+enum { NAME_THREADS = 4, NAMES_PER_THREAD = 20000 };
+static char names[NAME_THREADS * NAMES_PER_THREAD][MAIL_FILE_NAME_LENGTH];
+
+static void*
+generate_names(void* arg)
+{
+	char(*out)[MAIL_FILE_NAME_LENGTH] = arg;
+	for (int i = 0; i < NAMES_PER_THREAD; i++) {
+		assert_true(maildir_unique_name(out[i], MAIL_FILE_NAME_LENGTH) == 0, "name fits");
+	}
+	return NULL;
+}
+
+static int
+compare_names(const void* a, const void* b)
+{
+	return strcmp(a, b);
+}
+
+void
+test_unique_names()
+{
+	pthread_t threads[NAME_THREADS];
+	for (int i = 0; i < NAME_THREADS; i++) {
+		assert_true(pthread_create(&threads[i], NULL, generate_names, names[i * NAMES_PER_THREAD]) == 0, "thread");
+	}
+	for (int i = 0; i < NAME_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	const size_t qty = sizeof(names) / sizeof(names[0]);
+	qsort(names, qty, sizeof(names[0]), compare_names);
+	for (size_t i = 1; i < qty; i++) {
+		assert_true(strcmp(names[i - 1], names[i]) != 0, "no duplicates across threads");
+	}
+
+	long long sec;
+	long usec, pid;
+	unsigned q;
+	int used = 0;
+	assert_true(sscanf(names[0], "%lld.M%6ldP%ldQ%u.%n", &sec, &usec, &pid, &q, &used) == 4, "maildir format");
+	assert_true(pid == (long)getpid() && names[0][used] != '\0', "pid and host");
+	assert_true(strchr(names[0], '/') == NULL && strchr(names[0], ':') == NULL, "no separators");
+
+	char small[8];
+	assert_true(maildir_unique_name(small, sizeof(small)) == -1, "too small");
+}
+
+void
+test_temp_file_never_overwritten()
+{
+	char name[MAIL_FILE_NAME_LENGTH] = { 0 };
+	char path[MAILDIR_PATH_SIZE] = { 0 };
+	const int fd = create_temp_mail_file("alice@local", name, path, 0);
+	assert_true(fd >= 0 && name[0] != '\0', "created with a new name");
+	assert_true(write(fd, "x", 1) == 1, "write");
+	close(fd);
+
+	// con el nombre ya asignado se reabre el mismo archivo
+	const int again = create_temp_mail_file("alice@local", name, path, 0);
+	assert_true(again >= 0, "reopened");
+	close(again);
+
+	char other[MAIL_FILE_NAME_LENGTH] = { 0 };
+	char other_path[MAILDIR_PATH_SIZE] = { 0 };
+	const int fd2 = create_temp_mail_file("alice@local", other, other_path, 0);
+	assert_true(fd2 >= 0 && strcmp(other, name) != 0 && strcmp(other_path, path) != 0, "second message");
+	close(fd2);
+}
+
+void
+test_shard_everything()
+{
+	write_file("./maildir_shards", "*\n");
+	assert_true(maildir_init("./maildir_shards", "./maildir_compress") == 0, "init");
+	assert_true(maildir_is_sharded("anyone"), "every mailbox");
+	maildir_finalize();
+	assert_true(!maildir_is_sharded("anyone"), "finalized");
+}
+
+int
+main(void)
+{
+	char dir[] = "/tmp/maildir_test.XXXXXX";
+	assert_true(mkdtemp(dir) != NULL && chdir(dir) == 0, "temp dir");
+
+	test_flat_layout();
+	test_sharded_layout();
+	test_shard_everything();
+	test_unique_names();
+	test_temp_file_never_overwritten();
+	printf("All tests passed.\n");
+	return EXIT_SUCCESS;
+}
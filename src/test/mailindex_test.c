@@ -0,0 +1,207 @@
+#include "compress.h"
+#include "mailindex.h"
+#include "tests.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static void
+write_file(const char* path, const char* content)
+{
+	FILE* f = fopen(path, "w");
+	assert_true(f != NULL, path);
+	fputs(content, f);
+	fclose(f);
+}
+
+/** las fechas de los directorios tienen la resolución del reloj del kernel */
+static void
+next_tick(void)
+{
+	const struct timespec t = { 0, 20 * 1000 * 1000 };
+	nanosleep(&t, NULL);
+}
+
+#define MAX_SEEN 8
+
+struct seen
+{
+	size_t qty;
+	mailindex_entry entries[MAX_SEEN];
+};
+
+static void
+collect(const mailindex_entry* e, void* arg)
+{
+	struct seen* s = arg;
+	assert_true(s->qty < MAX_SEEN, "not too many entries");
+	s->entries[s->qty++] = *e;
+}
+
+static const char* const mail = "MAIL FROM: <alice@example.org>\r\n"
+                                "RCPT TO: <bob@local>\r\n"
+                                "DATA\r\n"
+                                "From: Alice <alice@example.org>\r\n"
+                                "subject:   Weekly Report \r\n"
+                                "\r\n"
+                                "Subject: not a header\r\n";
+
+void
+test_subject_hash()
+{
+	const uint64_t h = mailindex_subject_hash("Weekly Report", 13);
+	assert_true(mailindex_subject_hash("  weekly report\r\n", 17) == h, "case and blanks ignored");
+	assert_true(mailindex_subject_hash("Weekly Reports", 14) != h, "different subject");
+}
+
+void
+test_append_and_list()
+{
+	write_file("./m1", mail);
+	write_file("./m2", "MAIL FROM: <>\r\nRCPT TO: <bob@local>\r\nDATA\r\nTo: bob\r\n\r\nno subject\r\n");
+	// sin índice la entrega no lo arma: queda desactualizado hasta un rebuild,
+	// y desde ahí cada entrega agrega una línea
+	assert_true(copy_temp_to_new_single("bob@local", "1.M1P1Q1.host", "./m1") == 0, "deliver 1");
+	assert_true(access("./Maildir/bob/" MAILINDEX_FILE, F_OK) != 0, "no index on delivery");
+	assert_true(mailindex_check("bob") == 1, "missing index is stale");
+	assert_true(mailindex_rebuild("bob") == 1, "rebuilt");
+	assert_true(copy_temp_to_new_single("bob@local", "1.M2P1Q2.host", "./m2") == 0, "deliver 2");
+	assert_true(mailindex_check("bob") == 0, "append keeps it fresh");
+
+	struct seen s = { 0 };
+	assert_true(mailindex_foreach("bob", collect, &s) == 2 && s.qty == 2, "two entries");
+	assert_true(strcmp(s.entries[0].name, "1.M1P1Q1.host") == 0, "delivery order");
+	assert_true(strcmp(s.entries[0].from, "alice@example.org") == 0, "sender");
+	assert_true(s.entries[0].size == strlen(mail), "size");
+	assert_true(s.entries[0].subject_hash == mailindex_subject_hash("weekly report", 13), "subject");
+	assert_true(s.entries[0].received > 0, "received");
+	assert_true(strcmp(s.entries[1].from, "-") == 0, "empty sender");
+	assert_true(s.entries[1].subject_hash == mailindex_subject_hash("", 0), "no subject");
+
+	// una línea a medio escribir no se lista
+	FILE* f = fopen("./Maildir/bob/" MAILINDEX_FILE, "a");
+	fputs("1700000000 12 00", f);
+	fclose(f);
+	s.qty = 0;
+	assert_true(mailindex_foreach("bob", collect, &s) == 2, "partial line skipped");
+
+	assert_true(mailindex_foreach("nobody", collect, &s) == -1, "no mailbox");
+	assert_true(mailindex_foreach("../bob", collect, &s) == -1, "not a local part");
+}
+
+void
+test_rebuild()
+{
+	// un buzón sin índice: las entregas no lo arman, y listarlo tampoco
+	write_file("./m3", mail);
+	assert_true(copy_temp_to_new_single("carol@local", "2.M1P1Q1.host", "./m3") == 0, "deliver");
+	assert_true(copy_temp_to_new_single("carol@local", "2.M2P1Q2.host", "./m3") == 0, "deliver");
+	assert_true(rename("./Maildir/carol/new/2.M2P1Q2.host", "./Maildir/carol/cur/2.M2P1Q2.host:2,S") == 0, "read");
+
+	struct seen s = { 0 };
+	assert_true(access("./Maildir/carol/" MAILINDEX_FILE, F_OK) != 0, "no index");
+	assert_true(mailindex_check("carol") == 1, "missing index");
+	assert_true(mailindex_foreach("carol", collect, &s) == 0, "not rebuilt by a listing");
+	assert_true(mailindex_rebuild("carol") == 2, "rebuilt");
+	assert_true(mailindex_check("carol") == 0, "current");
+	assert_true(mailindex_foreach("carol", collect, &s) == 2, "listed");
+	const bool cur_first = strcmp(s.entries[0].name, "2.M2P1Q2.host:2,S") == 0;
+	assert_true(strcmp(s.entries[cur_first ? 0 : 1].name, "2.M2P1Q2.host:2,S") == 0, "name in cur");
+	assert_true(strcmp(s.entries[1].from, "alice@example.org") == 0, "sender parsed");
+	assert_true(mailindex_rebuild("carol") == 2, "explicit rebuild");
+}
+
+void
+test_stale_index()
+{
+	write_file("./m5", mail);
+	assert_true(copy_temp_to_new_single("erin@local", "4.M1P1Q1.host", "./m5") == 0, "deliver");
+	assert_true(mailindex_rebuild("erin") == 1, "first index");
+	assert_true(copy_temp_to_new_single("erin@local", "4.M2P1Q2.host", "./m5") == 0, "deliver");
+	assert_true(mailindex_check("erin") == 0, "deliveries keep it current");
+	assert_true(mailindex_check("nobody") == -1, "no mailbox");
+
+	// un cliente lo lee y después borra el otro: la línea sobra hasta el rebuild
+	next_tick();
+	assert_true(rename("./Maildir/erin/new/4.M1P1Q1.host", "./Maildir/erin/cur/4.M1P1Q1.host:2,S") == 0, "read");
+	assert_true(mailindex_check("erin") == 1, "moved message");
+	assert_true(mailindex_rebuild("erin") == 2, "rebuilt");
+	next_tick();
+	assert_true(unlink("./Maildir/erin/new/4.M2P1Q2.host") == 0, "delete");
+	assert_true(mailindex_check("erin") == 1, "deleted message");
+	assert_true(mailindex_rebuild("erin") == 1, "compacted");
+
+	struct seen s = { 0 };
+	assert_true(mailindex_foreach("erin", collect, &s) == 1, "one entry left");
+	assert_true(strcmp(s.entries[0].name, "4.M1P1Q1.host:2,S") == 0, "the one in cur");
+}
+
+static int notified_fd = -1;
+static pthread_mutex_t notified_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notified_cond = PTHREAD_COND_INITIALIZER;
+
+static void
+notify(void* ctx, int fd)
+{
+	assert_true(ctx == &notified_fd, "context");
+	pthread_mutex_lock(&notified_mutex);
+	notified_fd = fd;
+	pthread_cond_signal(&notified_cond);
+	pthread_mutex_unlock(&notified_mutex);
+}
+
+void
+test_rebuild_async()
+{
+	assert_true(mailindex_rebuild_async("erin", notify, &notified_fd, 7) == -1, "no workers yet");
+	assert_true(mailindex_init(1) == 0, "init");
+	assert_true(unlink("./Maildir/erin/" MAILINDEX_FILE) == 0, "drop index");
+	assert_true(mailindex_rebuild_async("erin", notify, &notified_fd, 7) == 0, "queued");
+	pthread_mutex_lock(&notified_mutex);
+	while (notified_fd == -1) {
+		pthread_cond_wait(&notified_cond, &notified_mutex);
+	}
+	pthread_mutex_unlock(&notified_mutex);
+	assert_true(notified_fd == 7, "notified with the fd");
+	assert_true(mailindex_check("erin") == 0, "rebuilt by the worker");
+	mailindex_finalize();
+}
+
+void
+test_compressed_message()
+{
+	const int fd = open("./m4.lz4", O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	compressor* c = compressor_new(fd);
+	assert_true(c != NULL && compressor_write(c, mail, strlen(mail)) == (ssize_t)strlen(mail), "compress");
+	assert_true(compressor_finish(c) == 0, "finish");
+	close(fd);
+	assert_true(copy_temp_to_new_single("dave@local", "3.M1P1Q1.host,S=10", "./m4.lz4") == 0, "deliver");
+	assert_true(mailindex_rebuild("dave") == 1, "indexed");
+
+	struct seen s = { 0 };
+	assert_true(mailindex_foreach("dave", collect, &s) == 1, "one entry");
+	assert_true(strcmp(s.entries[0].from, "alice@example.org") == 0, "sender from the LZ4 frame");
+	assert_true(s.entries[0].subject_hash == mailindex_subject_hash("Weekly Report", 13), "subject too");
+}
+
+int
+main(void)
+{
+	char dir[] = "/tmp/mailindex_test.XXXXXX";
+	assert_true(mkdtemp(dir) != NULL && chdir(dir) == 0, "temp dir");
+	assert_true(maildir_init("./maildir_shards", "./maildir_compress") == 0, "maildir init");
+
+	test_subject_hash();
+	test_append_and_list();
+	test_rebuild();
+	test_stale_index();
+	test_rebuild_async();
+	test_compressed_message();
+	maildir_finalize();
+	printf("All tests passed.\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,145 @@
+#include "maildir.h"
+#include "quota.h"
+#include "tests.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static void
+write_file(const char* path, const char* content)
+{
+	FILE* f = fopen(path, "w");
+	assert_true(f != NULL, path);
+	fputs(content, f);
+	fclose(f);
+}
+
+static void
+wait_rebuilt(void)
+{
+	const struct timespec pause = { 0, 1000000 };
+	for (int i = 0; i < 5000 && !quota_rebuilt(); i++) {
+		nanosleep(&pause, NULL);
+	}
+	assert_true(quota_rebuilt(), "rebuild finished");
+}
+
+void
+test_limits()
+{
+	write_file("./quotas", "# límites\n*  10K\nbob 100 2\ncarol 1M  # grande\nbad\n");
+	assert_true(quota_init(NULL, "./quotas", "./quota.db", false) == 0, "init");
+	wait_rebuilt();
+
+	assert_true(quota_check("alice", 5, 0) == QUOTA_OK, "default, empty");
+	assert_true(quota_check("alice", 5, 10 * 1024 + 1) == QUOTA_TOO_BIG, "larger than the default");
+	assert_true(quota_check("bob@local", 3, 60) == QUOTA_OK, "fits");
+	assert_true(quota_check("bob", 3, 101) == QUOTA_TOO_BIG, "larger than the quota");
+	assert_true(quota_check("carol", 5, 512 * 1024) == QUOTA_OK, "suffix");
+
+	quota_charge("bob@local", 3, 60);
+	assert_true(quota_check("bob", 3, 41) == QUOTA_FULL, "no room left");
+	assert_true(quota_check("bob", 3, 40) == QUOTA_OK, "exactly fits");
+	quota_charge("bob", 3, 10);
+	assert_true(quota_check("bob", 3, 1) == QUOTA_FULL, "message limit");
+
+	uint64_t bytes, messages;
+	assert_true(quota_usage("bob", &bytes, &messages) == 0 && bytes == 70 && messages == 2, "usage");
+	assert_true(quota_usage("dave", &bytes, &messages) == -1, "unknown");
+	quota_finalize();
+	assert_true(quota_check("bob", 3, 1000) == QUOTA_OK, "nothing enforced after finalize");
+}
+
+void
+test_save_and_load()
+{
+	unlink("./quotas");
+	unlink("./quota.db");
+	assert_true(quota_init(NULL, "./quotas", "./quota.db", false) == 0, "init");
+	wait_rebuilt();
+	quota_charge("erin", 4, 300);
+	quota_charge("erin", 4, 200);
+	assert_true(quota_check("erin", 4, 1 << 30) == QUOTA_OK, "no limits file: nothing refused");
+	assert_true(quota_save() == 0, "save");
+	quota_finalize();
+
+	// sin maildirs el rebuild no tiene nada que recorrer y queda lo guardado
+	assert_true(quota_init(NULL, "./quotas", "./quota.db", false) == 0, "reload");
+	uint64_t bytes, messages;
+	assert_true(quota_usage("erin", &bytes, &messages) == 0 && bytes == 500 && messages == 2, "loaded");
+	quota_finalize();
+}
+
+void
+test_deferred()
+{
+	// como el proceso nuevo de un upgrade: el archivo es del anterior hasta que termina
+	write_file("./quota.db", "frank 100 1\n");
+	assert_true(quota_init(NULL, "./quotas", "./quota.db", true) == 0, "init");
+	uint64_t bytes, messages;
+	assert_true(quota_usage("frank", &bytes, &messages) == 0 && bytes == 100, "loaded");
+	quota_charge("frank", 5, 50);
+	assert_true(!quota_rebuilt(), "no rebuild yet");
+	quota_finalize();
+	assert_true(quota_init(NULL, "./quotas", "./quota.db", true) == 0, "reload");
+	assert_true(quota_usage("frank", &bytes, &messages) == 0 && bytes == 100, "not saved before quota_start");
+
+	quota_start();
+	wait_rebuilt();
+	quota_charge("frank", 5, 50);
+	quota_finalize();
+	assert_true(quota_init(NULL, "./quotas", "./quota.db", true) == 0, "reload");
+	assert_true(quota_usage("frank", &bytes, &messages) == 0 && bytes == 150, "saved after quota_start");
+	quota_finalize();
+}
+
+void
+test_rebuild_from_maildirs()
+{
+	assert_true(maildir_init("./maildir_shards", "./maildir_compress") == 0, "maildir init");
+	char user[16], name[16];
+	for (int u = 0; u < 20; u++) {
+		snprintf(user, sizeof(user), "user%d@local", u);
+		for (int m = 0; m <= u; m++) {
+			snprintf(name, sizeof(name), "msg%d", m);
+			assert_true(copy_temp_to_new_single(user, name, "./body") == 0, "deliver");
+		}
+	}
+	// algo movido a cur/ por un cliente también cuenta
+	assert_true(rename("./Maildir/user3/new/msg0", "./Maildir/user3/cur/msg0:2,S") == 0, "move to cur");
+	// y lo que el archivo guardado dice de más se corrige
+	write_file("./quota.db", "user1 999999 99\ngone 5 1\n");
+
+	assert_true(quota_init(NULL, "./quotas", "./quota.db", false) == 0, "init");
+	wait_rebuilt();
+	struct stat st;
+	assert_true(stat("./body", &st) == 0, "body");
+	uint64_t bytes, messages;
+	for (int u = 0; u < 20; u++) {
+		snprintf(user, sizeof(user), "user%d", u);
+		assert_true(quota_usage(user, &bytes, &messages) == 0, "rebuilt");
+		assert_true(messages == (uint64_t)u + 1 && bytes == messages * st.st_size, "counted");
+	}
+	assert_true(quota_usage("gone", &bytes, &messages) == 0 && bytes == 0 && messages == 0, "no maildir");
+	quota_finalize();
+	maildir_finalize();
+}
+
+int
+main(void)
+{
+	char dir[] = "/tmp/quota_test.XXXXXX";
+	assert_true(mkdtemp(dir) != NULL && chdir(dir) == 0, "temp dir");
+	write_file("./body", "MAIL FROM: <a@local>\r\nDATA\r\nhola\r\n");
+
+	test_limits();
+	test_save_and_load();
+	test_deferred();
+	test_rebuild_from_maildirs();
+	printf("All tests passed.\n");
+	return EXIT_SUCCESS;
+}
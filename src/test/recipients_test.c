@@ -0,0 +1,115 @@
+#include "recipients.h"
+#include "tests.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static void
+write_file(const char* path, const char* content)
+{
+	FILE* f = fopen(path, "w");
+	assert_true(f != NULL, path);
+	fputs(content, f);
+	fclose(f);
+}
+
+static bool
+exists(const char* name)
+{
+	return recipients_exists(name, strlen(name));
+}
+
+void
+test_missing_file_accepts_everyone()
+{
+	assert_true(recipients_init(NULL, "./recipients") == 0, "init without file");
+	assert_true(recipients_count() == 0, "no directory");
+	assert_true(exists("anyone"), "everyone accepted");
+	recipients_destroy();
+}
+
+void
+test_lookup()
+{
+	write_file("./recipients", "# mailboxes\nalice\n  bob\t# the admin\r\ncarol\n\nalice\ndave");
+	assert_true(recipients_init(NULL, "./recipients") == 0, "init");
+	assert_true(recipients_count() == 4, "duplicates and comments skipped");
+	assert_true(exists("alice") && exists("bob") && exists("carol") && exists("dave"), "listed");
+	assert_true(!exists("mallory") && !exists("ali") && !exists("alicex") && !exists(""), "not listed");
+	assert_true(!exists("Alice"), "case sensitive, like the maildir names");
+	assert_true(exists("postmaster") && exists("PostMaster"), "postmaster always exists");
+	// sólo se miran `len' bytes, como cuando se pasa la parte local de una dirección
+	assert_true(recipients_exists("bob@local", 3), "local part");
+	recipients_destroy();
+}
+
+void
+test_many_names()
+{
+	FILE* f = fopen("./recipients", "w");
+	assert_true(f != NULL, "open");
+	for (int i = 0; i < 10000; i++) {
+		fprintf(f, "user%d\n", i);
+	}
+	fclose(f);
+	assert_true(recipients_init(NULL, "./recipients") == 0, "init");
+	assert_true(recipients_count() == 10000, "count");
+
+	char name[32];
+	for (int i = 0; i < 10000; i++) {
+		snprintf(name, sizeof(name), "user%d", i);
+		assert_true(exists(name), "present");
+	}
+	enum { MISSES = 1000 };
+	static char absent[MISSES][32];
+	for (int i = 0; i < MISSES; i++) {
+		snprintf(absent[i], sizeof(absent[i]), "user%d", 10000 + i);
+	}
+	const clock_t start = clock();
+	unsigned hits = 0;
+	for (int round = 0; round < 1000; round++) {
+		for (int i = 0; i < MISSES; i++) {
+			hits += exists(absent[i]);
+		}
+	}
+	assert_true(hits == 0, "absent");
+	printf("%.1f ns per rejected lookup\n", (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / (1000 * MISSES));
+	recipients_destroy();
+}
+
+void
+test_reload_on_change()
+{
+	write_file("./recipients", "alice\n");
+	assert_true(recipients_init(NULL, "./recipients") == 0, "init");
+	assert_true(recipients_reload() == 0, "unchanged");
+	assert_true(!exists("bob"), "not yet");
+
+	// otro tamaño, así el cambio se nota aunque el mtime no avance
+	write_file("./recipients.new", "alice\nbob\n");
+	assert_true(rename("./recipients.new", "./recipients") == 0, "replace");
+	assert_true(recipients_reload() == 1, "reloaded");
+	assert_true(exists("bob") && recipients_count() == 2, "new name");
+
+	unlink("./recipients");
+	assert_true(recipients_reload() == 1, "removed");
+	assert_true(exists("mallory"), "no directory accepts everyone");
+	recipients_destroy();
+}
+
+int
+main(void)
+{
+	char dir[] = "/tmp/recipients_test.XXXXXX";
+	assert_true(mkdtemp(dir) != NULL && chdir(dir) == 0, "temp dir");
+
+	test_missing_file_accepts_everyone();
+	test_lookup();
+	test_many_names();
+	test_reload_on_change();
+	printf("All tests passed.\n");
+	return EXIT_SUCCESS;
+}
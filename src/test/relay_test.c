@@ -0,0 +1,290 @@
+#include "relay.h"
+
+#include "buffer_chain.h"
+#include "tests.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static bool
+exists(const char* path)
+{
+	struct stat st;
+	return stat(path, &st) == 0;
+}
+
+static void
+write_file(const char* path, const char* content)
+{
+	FILE* f = fopen(path, "w");
+	assert_true(f != NULL, path);
+	fputs(content, f);
+	fclose(f);
+}
+
+/* un servidor SMTP mínimo: anuncia PIPELINING, contesta 450 a los
+ * destinatarios que contienen "temp" y cuenta conexiones y mensajes */
+static pthread_mutex_t sink_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int sink_fd;
+static unsigned sink_connections = 0;
+static unsigned sink_messages = 0;
+static char sink_last_body[1024];
+
+static void
+sink_session(int fd)
+{
+	FILE* f = fdopen(fd, "r+");
+	setvbuf(f, NULL, _IONBF, 0);
+	char* line = NULL;
+	size_t cap = 0;
+	dprintf(fd, "220 sink\r\n");
+	while (getline(&line, &cap, f) > 0) {
+		if (strncmp(line, "EHLO", 4) == 0) {
+			dprintf(fd, "250-sink\r\n250 PIPELINING\r\n");
+		} else if (strncmp(line, "RCPT", 4) == 0) {
+			dprintf(fd, strstr(line, "temp") != NULL ? "450 try later\r\n" : "250 ok\r\n");
+		} else if (strncmp(line, "DATA", 4) == 0) {
+			dprintf(fd, "354 go\r\n");
+			char body[sizeof(sink_last_body)] = { 0 };
+			while (getline(&line, &cap, f) > 0 && strcmp(line, ".\r\n") != 0) {
+				strncat(body, line, sizeof(body) - strlen(body) - 1);
+			}
+			pthread_mutex_lock(&sink_mutex);
+			sink_messages++;
+			memcpy(sink_last_body, body, sizeof(body));
+			pthread_mutex_unlock(&sink_mutex);
+			dprintf(fd, "250 queued\r\n");
+		} else if (strncmp(line, "QUIT", 4) == 0) {
+			dprintf(fd, "221 bye\r\n");
+			break;
+		} else {
+			dprintf(fd, "250 ok\r\n");
+		}
+	}
+	free(line);
+	fclose(f);
+}
+
+static void*
+sink_main(void* arg)
+{
+	(void)arg;
+	int fd;
+	while ((fd = accept(sink_fd, NULL, NULL)) >= 0) {
+		pthread_mutex_lock(&sink_mutex);
+		sink_connections++;
+		pthread_mutex_unlock(&sink_mutex);
+		sink_session(fd);
+	}
+	return NULL;
+}
+
+/** arranca el servidor en un puerto efímero y retorna el puerto */
+static unsigned
+sink_start(void)
+{
+	sink_fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t len = sizeof(addr);
+	assert_true(bind(sink_fd, (struct sockaddr*)&addr, len) == 0 && listen(sink_fd, 8) == 0, "sink listen");
+	assert_true(getsockname(sink_fd, (struct sockaddr*)&addr, &len) == 0, "sink port");
+	pthread_t thread;
+	assert_true(pthread_create(&thread, NULL, sink_main, NULL) == 0, "sink thread");
+	pthread_detach(thread);
+	return ntohs(addr.sin_port);
+}
+
+static unsigned
+sink_count(unsigned* counter)
+{
+	pthread_mutex_lock(&sink_mutex);
+	unsigned n = *counter;
+	pthread_mutex_unlock(&sink_mutex);
+	return n;
+}
+
+/** corre el selector hasta que `done' se cumpla o pasen unos segundos */
+static void
+serve_until(fd_selector s, bool (*done)(void))
+{
+	const time_t deadline = time(NULL) + 5;
+	while (!done() && time(NULL) < deadline) {
+		assert_true(selector_select(s) == SELECTOR_SUCCESS, "select");
+	}
+}
+
+static bool
+both_delivered(void)
+{
+	return relay_pending() == 0 && sink_count(&sink_messages) == 2;
+}
+
+static bool
+attempted_once(void)
+{
+	return sink_count(&sink_messages) == 3 && relay_pending() == 1 && exists(RELAY_DIR "/3.1.1.0.env");
+}
+
+static bool
+allowed(const char* text)
+{
+	struct sockaddr_storage a = { 0 };
+	if (strchr(text, ':') != NULL) {
+		struct sockaddr_in6* in6 = (struct sockaddr_in6*)&a;
+		in6->sin6_family = AF_INET6;
+		inet_pton(AF_INET6, text, &in6->sin6_addr);
+	} else {
+		struct sockaddr_in* in = (struct sockaddr_in*)&a;
+		in->sin_family = AF_INET;
+		inet_pton(AF_INET, text, &in->sin_addr);
+	}
+	return relay_allowed(&a);
+}
+
+void
+test_client_networks(void)
+{
+	assert_true(allowed("10.1.2.3") && allowed("10.255.0.1"), "in 10.0.0.0/8");
+	assert_true(allowed("192.168.7.9") && !allowed("192.168.6.9"), "in 192.168.7.0/25");
+	assert_true(!allowed("192.168.7.200"), "outside the /25");
+	assert_true(allowed("::ffff:10.0.0.1"), "IPv4 mapped");
+	assert_true(allowed("2001:db8::1") && !allowed("2001:db9::1"), "IPv6 prefix");
+	assert_true(!allowed("127.0.0.1"), "unlisted loopback rejected");
+}
+
+void
+test_messages_share_one_connection(fd_selector s)
+{
+	write_file("./m1", "MAIL FROM: <a@local>\r\nRCPT TO: <x@remote.test>\r\nDATA\r\nSubject: hi\r\n\r\n..dot");
+	const char* rcpt[] = { "x@remote.test", "y@other.test" };
+	assert_true(relay_has_route("remote.test") && relay_has_route("other.test"), "routes");
+	assert_true(!relay_has_route("nowhere.test"), "no default route");
+
+	assert_true(relay_enqueue(1, "a@local", rcpt, 1, "./m1", "1.1.1", true) == 0, "enqueue 1");
+	assert_true(relay_enqueue(2, "a@local", rcpt, 2, "./m1", "2.1.1", true) == 0, "enqueue 2");
+	// se puede borrar en cuanto se encola: el relay tiene su propio enlace
+	unlink("./m1");
+	serve_until(s, both_delivered);
+
+	// dos dominios con el mismo host comparten el salto: una transacción para
+	// el segundo mensaje y una sola conexión para los dos
+	assert_true(both_delivered(), "delivered");
+	assert_true(sink_count(&sink_connections) == 1, "one connection");
+	assert_true(strcmp(sink_last_body, "Subject: hi\r\n\r\n..dot\r\n") == 0, "body sent stuffed, header skipped");
+	assert_true(!exists(RELAY_DIR "/1.1.1.0.env") && !exists(RELAY_DIR "/1.1.1.0.msg"), "files removed");
+
+	const char* bad[] = { "x@nowhere.test" };
+	write_file("./m2", "body");
+	assert_true(relay_enqueue(3, "a@local", bad, 1, "./m2", "9.1.1", true) == -1, "no route refused");
+}
+
+void
+test_temporary_failure_keeps_the_recipient(fd_selector s)
+{
+	const char* rcpt[] = { "x@remote.test", "temp@remote.test" };
+	assert_true(relay_enqueue(3, "a@local", rcpt, 2, "./m2", "3.1.1", false) == 0, "enqueue");
+	serve_until(s, attempted_once);
+	assert_true(attempted_once(), "attempted");
+	assert_true(strcmp(sink_last_body, "body\r\n") == 0, "raw body terminated");
+
+	FILE* f = fopen(RELAY_DIR "/3.1.1.0.env", "r");
+	char env[256] = { 0 };
+	assert_true(f != NULL && fread(env, 1, sizeof(env) - 1, f) > 0, "envelope kept");
+	fclose(f);
+	assert_true(strstr(env, "rcpt temp@remote.test\n") != NULL, "deferred recipient kept");
+	assert_true(strstr(env, "rcpt x@remote.test\n") == NULL, "delivered recipient removed");
+}
+
+void
+test_cancel_removes_files(fd_selector s)
+{
+	(void)s;
+	const char* rcpt[] = { "z@remote.test" };
+	assert_true(relay_enqueue(4, "a@local", rcpt, 1, "./m2", "4.1.1", true) == 0, "enqueue");
+	assert_true(exists(RELAY_DIR "/4.1.1.0.env"), "envelope written");
+	relay_cancel("4.1.1");
+	assert_true(!exists(RELAY_DIR "/4.1.1.0.env") && !exists(RELAY_DIR "/4.1.1.0.msg"), "cancelled");
+}
+
+static pthread_mutex_t notify_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned notified = 0;
+
+static void
+count_notify(void* ctx, int fd)
+{
+	(void)ctx;
+	(void)fd;
+	pthread_mutex_lock(&notify_mutex);
+	notified++;
+	pthread_mutex_unlock(&notify_mutex);
+}
+
+void
+test_submit_commits_in_the_background(fd_selector s)
+{
+	(void)s;
+	const char* rcpt[] = { "w@remote.test" };
+	write_file("./m3", "body");
+	const size_t pending = relay_pending();
+	struct relay_commit* c = relay_submit(5, "a@local", rcpt, 1, "./m3", "5.1.1", true, count_notify, NULL, -1);
+	assert_true(c != NULL, "submit");
+	const struct timespec tick = { .tv_sec = 0, .tv_nsec = 10000000 };
+	for (int i = 0; i < 500 && relay_commit_status_of(c) == SPOOL_COMMIT_PENDING; i++) {
+		nanosleep(&tick, NULL);
+	}
+	assert_true(relay_commit_status_of(c) == SPOOL_COMMIT_DONE, "committed");
+	pthread_mutex_lock(&notify_mutex);
+	assert_true(notified == 1, "notified once");
+	pthread_mutex_unlock(&notify_mutex);
+	assert_true(exists(RELAY_DIR "/5.1.1.0.env") && !exists(RELAY_DIR "/5.1.1.0.tmp"), "envelope published");
+	// hasta que se suelta, quien lo envió puede descartarlo sin que empiece a enviarse
+	assert_true(relay_pending() == pending, "not queued before release");
+	relay_commit_release(c);
+	assert_true(relay_pending() == pending + 1, "queued on release");
+	relay_cancel("5.1.1");
+	assert_true(!exists(RELAY_DIR "/5.1.1.0.env") && !exists(RELAY_DIR "/5.1.1.0.msg"), "cancelled");
+}
+
+int
+main(void)
+{
+	char dir[] = "/tmp/relay_test.XXXXXX";
+	assert_true(mkdtemp(dir) != NULL && chdir(dir) == 0, "temp dir");
+	signal(SIGPIPE, SIG_IGN);
+
+	// los dos dominios van al mismo salto
+	const unsigned port = sink_start();
+	char routes[128];
+	snprintf(routes, sizeof(routes), "remote.test 127.0.0.1 %u\n# comment\nother.test 127.0.0.1 %u\n", port, port);
+	write_file("./relay_routes", routes);
+	write_file("./relay_clients", "10.0.0.0/8\n192.168.7.0/25  # oficina\n2001:db8::/32\n");
+
+	const struct selector_init conf = { .signal = SIGALRM, .select_timeout = { .tv_sec = 0, .tv_nsec = 50000000 } };
+	assert_true(selector_init(&conf) == 0, "selector init");
+	fd_selector s = selector_new(64);
+	assert_true(s != NULL, "selector");
+	assert_true(relay_init(s, "./relay_routes", "./relay_clients") == 0, "relay init");
+
+	test_client_networks();
+	test_messages_share_one_connection(s);
+	test_temporary_failure_keeps_the_recipient(s);
+	test_cancel_removes_files(s);
+	test_submit_commits_in_the_background(s);
+
+	relay_finalize();
+	selector_destroy(s);
+	selector_close();
+	buffer_pool_destroy();
+	printf("All tests passed.\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,159 @@
+#include "request.h"
+#include "tests.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct result
+{
+	enum request_state state;
+	size_t consumed;
+	struct request request;
+};
+
+typedef enum request_state (*feed_fn)(struct request_parser* p, const uint8_t c);
+typedef enum request_state (*consume_fn)(buffer* b, struct request_parser* p, bool* errored);
+
+/** referencia: la línea byte a byte por la máquina de estados */
+static void
+parse_bytes(const char* line, feed_fn feed, struct result* out)
+{
+	struct request_parser p = { .request = &out->request };
+	request_parser_init(&p);
+	const size_t n = strlen(line);
+	size_t i = 0;
+	enum request_state st = p.state;
+	while (i < n && !request_is_done(st, NULL)) {
+		st = feed(&p, (uint8_t)line[i++]);
+	}
+	out->state = st;
+	out->consumed = i;
+}
+
+/** la línea entregada en dos lecturas, cortada en `split' */
+static void
+parse_consume(const char* line, size_t split, consume_fn consume, struct result* out)
+{
+	uint8_t raw[512];
+	buffer b;
+	buffer_init(&b, sizeof(raw), raw);
+	struct request_parser p = { .request = &out->request };
+	request_parser_init(&p);
+
+	const size_t n = strlen(line);
+	enum request_state st = p.state;
+	size_t consumed = 0;
+	const size_t parts[] = { split, n - split };
+	size_t off = 0;
+	for (int k = 0; k < 2 && !request_is_done(st, NULL); k++) {
+		memcpy(buffer_write_ptr(&b, &(size_t){ 0 }), line + off, parts[k]);
+		buffer_write_adv(&b, parts[k]);
+		off += parts[k];
+		size_t before, after;
+		buffer_read_ptr(&b, &before);
+		st = consume(&b, &p, NULL);
+		buffer_read_ptr(&b, &after);
+		consumed += before - after;
+	}
+	out->state = st;
+	out->consumed = consumed;
+}
+
+static void
+check(const char* line, feed_fn feed, consume_fn consume)
+{
+	struct result expected, got;
+	parse_bytes(line, feed, &expected);
+	for (size_t split = 0; split <= strlen(line); split++) {
+		parse_consume(line, split, consume, &got);
+		assert_true(got.state == expected.state, line);
+		if (expected.state == request_done) {
+			assert_true(got.consumed == expected.consumed, "consumed up to CRLF");
+			assert_true(strcmp(got.request.verb, expected.request.verb) == 0, "verb");
+			assert_true(strcmp(got.request.arg, expected.request.arg) == 0, "arg");
+		}
+	}
+}
+
+static void
+check_line(const char* line)
+{
+	check(line, request_parser_feed, request_consume);
+}
+
+void
+test_same_as_byte_parser()
+{
+	static const char* const lines[] = {
+		"EHLO example.org\r\n",
+		"MAIL FROM:<a@b.c> SIZE=100\r\n",
+		"RCPT TO:<x@y>\r\n",
+		"DATA\r\n",
+		"data\r\n",
+		"RSET\r\nNOOP\r\n",
+		"QUIT\r\n",
+		"NOOPS\r\n",
+		"HELO\r\n",
+		"HELO x\rz\n",
+		"HELO x\r",
+		"\r\n",
+		" \r\n",
+		"VERYLONGVERBNAME x\r\n",
+		"VERYLONGVERBNA x\r\n",
+		"X a\nb\r\n",
+	};
+	for (size_t i = 0; i < sizeof(lines) / sizeof(*lines); i++) {
+		check_line(lines[i]);
+	}
+
+	// argumento en el límite del campo
+	char line[300] = "RCPT ";
+	memset(line + 5, 'a', 255);
+	strcpy(line + 260, "\r\n");
+	check_line(line);
+	line[260] = 'a';
+	strcpy(line + 261, "\r\n");
+	check_line(line);
+}
+
+void
+test_admin_same_as_byte_parser()
+{
+	static const char* const lines[] = {
+		"XAUTH password\r\n", "XFROM a@b\r\n", "XGET ALL\r\n", "XQUIT\r\n", "xquit\r\n",
+		"XGET\r\n",           "XAUTH\rx\n",    "\r\n",         " x\r\n",
+	};
+	for (size_t i = 0; i < sizeof(lines) / sizeof(*lines); i++) {
+		check(lines[i], request_parser_admin_feed, request_consume_admin);
+	}
+}
+
+void
+test_pipelined_lines()
+{
+	uint8_t raw[] = "MAIL FROM:<a@b>\r\nRCPT TO:<c@d>\r\nDATA\r\n";
+	buffer b;
+	buffer_init(&b, sizeof(raw) - 1, raw);
+	buffer_write_adv(&b, sizeof(raw) - 1);
+	struct request request;
+	struct request_parser p = { .request = &request };
+
+	static const char* const verbs[] = { "MAIL", "RCPT", "DATA" };
+	for (int i = 0; i < 3; i++) {
+		request_parser_init(&p);
+		assert_true(request_consume(&b, &p, NULL) == request_done, "line done");
+		assert_true(strcmp(request.verb, verbs[i]) == 0, "pipelined verb");
+	}
+	assert_true(!buffer_can_read(&b), "all consumed");
+}
+
+int
+main(void)
+{
+	test_same_as_byte_parser();
+	test_admin_same_as_byte_parser();
+	test_pipelined_lines();
+	printf("All tests passed.\n");
+	return EXIT_SUCCESS;
+}
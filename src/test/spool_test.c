@@ -0,0 +1,209 @@
+#include "spool.h"
+
+#include "maildir.h"
+#include "tests.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static bool
+exists(const char* path)
+{
+	struct stat st;
+	return stat(path, &st) == 0;
+}
+
+static void
+write_file(const char* path, const char* content)
+{
+	FILE* f = fopen(path, "w");
+	assert_true(f != NULL, path);
+	fputs(content, f);
+	fclose(f);
+}
+
+/** espera a que los hilos vacíen la cola */
+static void
+wait_empty(void)
+{
+	const struct timespec ms = { .tv_sec = 0, .tv_nsec = 1000000 };
+	for (int i = 0; i < 5000 && spool_pending() > 0; i++) {
+		nanosleep(&ms, NULL);
+	}
+	assert_true(spool_pending() == 0, "queue drained");
+}
+
+void
+test_enqueue_delivers_to_every_recipient()
+{
+	mkdir("./Maildir", 0777);
+	mkdir("./Maildir/a", 0777);
+	mkdir("./Maildir/a/tmp", 0777);
+	write_file("./Maildir/a/tmp/m1", "hello\r\n");
+
+	assert_true(spool_init(2) == 0, "init");
+	const char* rcpt[] = { "a@local", "b@local" };
+	char id[SPOOL_ID_SIZE];
+	spool_new_id(id);
+	assert_true(spool_enqueue(1, "x@local", rcpt, 2, "m1", "./Maildir/a/tmp/m1", NULL, id) == 0, "enqueue");
+	wait_empty();
+
+	assert_true(exists("./Maildir/a/new/m1") && exists("./Maildir/b/new/m1"), "delivered to both");
+	assert_true(!exists("./Maildir/a/tmp/m1"), "message file removed");
+	char env[128];
+	snprintf(env, sizeof(env), "%s/%s.env", SPOOL_DIR, id);
+	assert_true(!exists(env), "envelope removed");
+
+	const char* bad[] = { "a@local\nrcpt evil@local" };
+	assert_true(spool_enqueue(1, "x@local", bad, 1, "m1", "./Maildir/a/tmp/m1", NULL, id) == -1, "newline refused");
+	spool_finalize();
+}
+
+void
+test_recovers_envelopes_left_on_disk()
+{
+	write_file("./Maildir/a/tmp/m2", "again\r\n");
+	write_file(SPOOL_DIR "/1.1.1.env", "session 2\nname m2\ndata ./Maildir/a/tmp/m2\nfrom x@local\nrcpt c@local\n");
+
+	assert_true(spool_init(1) == 0, "init");
+	wait_empty();
+	assert_true(exists("./Maildir/c/new/m2"), "delivered after restart");
+	assert_true(!exists(SPOOL_DIR "/1.1.1.env"), "envelope removed");
+	spool_finalize();
+}
+
+static volatile int notified_fd = -1;
+
+static void
+notify(void* ctx, int fd)
+{
+	(void)ctx;
+	notified_fd = fd;
+}
+
+void
+test_submit_notifies_when_committed()
+{
+	write_file("./Maildir/a/tmp/m6", "async\r\n");
+	write_file("./Maildir/a/tmp/m7", "dropped\r\n");
+
+	assert_true(spool_init(1) == 0, "init");
+	const char* rcpt[] = { "e@local" };
+	char id[SPOOL_ID_SIZE];
+	spool_new_id(id);
+	struct spool_commit* c = spool_submit(4, "x@local", rcpt, 1, "m6", "./Maildir/a/tmp/m6", NULL, id, notify, NULL, 42);
+	assert_true(c != NULL, "submit");
+	const struct timespec ms = { .tv_sec = 0, .tv_nsec = 1000000 };
+	for (int i = 0; i < 5000 && spool_commit_status_of(c) == SPOOL_COMMIT_PENDING; i++) {
+		nanosleep(&ms, NULL);
+	}
+	assert_true(spool_commit_status_of(c) == SPOOL_COMMIT_DONE, "committed");
+	assert_true(!SPOOL_FSYNC || notified_fd == 42, "notified with the fd");
+	spool_commit_release(c);
+
+	// quien lo envió se fue antes de que terminara: se entrega igual
+	spool_new_id(id);
+	spool_commit_release(spool_submit(5, "x@local", rcpt, 1, "m7", "./Maildir/a/tmp/m7", NULL, id, notify, NULL, 43));
+	spool_finalize();
+	assert_true(spool_init(1) == 0, "init again");
+	wait_empty();
+	assert_true(exists("./Maildir/e/new/m6") && exists("./Maildir/e/new/m7"), "both delivered");
+	spool_finalize();
+}
+
+void
+test_many_envelopes()
+{
+	// más que el tamaño inicial de la tabla y del heap: tienen que crecer
+	enum { qty = 200 };
+	for (int i = 0; i < qty; i++) {
+		char data[64], env[128], content[256];
+		snprintf(data, sizeof(data), "./Maildir/a/tmp/many%d", i);
+		write_file(data, "bulk\r\n");
+		snprintf(env, sizeof(env), "%s/2.2.%d.env", SPOOL_DIR, i);
+		snprintf(content, sizeof(content), "session 3\nname many%d\ndata %s\nfrom x@local\nrcpt d@local\n", i, data);
+		write_file(env, content);
+	}
+
+	assert_true(spool_init(2) == 0, "init");
+	wait_empty();
+	for (int i = 0; i < qty; i++) {
+		char path[64];
+		snprintf(path, sizeof(path), "./Maildir/d/new/many%d", i);
+		assert_true(exists(path), "every envelope delivered");
+	}
+	spool_finalize();
+}
+
+static struct stat
+stat_of(const char* path)
+{
+	struct stat st;
+	assert_true(stat(path, &st) == 0, path);
+	return st;
+}
+
+void
+test_store_links_every_recipient()
+{
+	const char* body = "MAIL FROM: <x@local>\r\nDATA\r\nnewsletter\r\n";
+	char key[MAILDIR_STORE_KEY_SIZE];
+	maildir_store_key(key, maildir_hash(MAILDIR_HASH_INIT, body, strlen(body)), strlen(body), false);
+	write_file("./Maildir/a/tmp/m3", body);
+
+	assert_true(spool_init(2) == 0, "init");
+	const char* rcpt[] = { "d@local", "e@local", "f@local" };
+	char id[SPOOL_ID_SIZE];
+	spool_new_id(id);
+	assert_true(spool_enqueue(1, "x@local", rcpt, 3, "m3", "./Maildir/a/tmp/m3", key, id) == 0, "enqueue");
+	wait_empty();
+
+	char stored[256];
+	snprintf(stored, sizeof(stored), "%s/%.2s/%s", MAILDIR_STORE_DIR, key, key);
+	const struct stat st = stat_of(stored);
+	assert_true(st.st_nlink == 4, "one stored file, three links");
+	assert_true(stat_of("./Maildir/d/new/m3").st_ino == st.st_ino && stat_of("./Maildir/f/new/m3").st_ino == st.st_ino,
+	            "recipients share the stored file");
+
+	// mismo contenido en otro mensaje: se reutiliza
+	write_file("./Maildir/a/tmp/m4", body);
+	spool_new_id(id);
+	assert_true(spool_enqueue(2, "x@local", rcpt, 1, "m4", "./Maildir/a/tmp/m4", key, id) == 0, "enqueue again");
+	wait_empty();
+	assert_true(stat_of("./Maildir/d/new/m4").st_ino == st.st_ino, "identical message reused");
+
+	// misma clave, otro contenido: no se confía en el hash
+	write_file("./Maildir/a/tmp/m5", "MAIL FROM: <x@local>\r\nDATA\r\nnewsletteR\r\n");
+	spool_new_id(id);
+	assert_true(spool_enqueue(3, "x@local", rcpt, 1, "m5", "./Maildir/a/tmp/m5", key, id) == 0, "enqueue collision");
+	wait_empty();
+	assert_true(stat_of("./Maildir/d/new/m5").st_ino != st.st_ino, "collision delivered by copy");
+	spool_finalize();
+
+	assert_true(maildir_store_gc() == 0, "still referenced");
+	unlink("./Maildir/d/new/m3");
+	unlink("./Maildir/e/new/m3");
+	unlink("./Maildir/f/new/m3");
+	unlink("./Maildir/d/new/m4");
+	assert_true(maildir_store_gc() == 1 && !exists(stored), "unreferenced message collected");
+}
+
+int
+main(void)
+{
+	char dir[] = "/tmp/spool_test.XXXXXX";
+	assert_true(mkdtemp(dir) != NULL && chdir(dir) == 0, "temp dir");
+
+	test_enqueue_delivers_to_every_recipient();
+	test_recovers_envelopes_left_on_disk();
+	test_submit_notifies_when_committed();
+	test_many_envelopes();
+	test_store_links_every_recipient();
+	printf("All tests passed.\n");
+	return EXIT_SUCCESS;
+}
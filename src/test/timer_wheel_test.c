@@ -0,0 +1,131 @@
+#include "timer_wheel.h"
+#include "tests.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TICK_MS 10
+
+static unsigned fired_count;
+static uint64_t fired_at[16];
+
+static void
+on_expire(struct wheel_timer* t, void* data)
+{
+	(void)t;
+	uint64_t* now = data;
+	fired_at[fired_count++ % 16] = *now;
+}
+
+/** avanza de a un tick, como lo haría el selector */
+static void
+run_until(timer_wheel w, uint64_t* now, uint64_t until)
+{
+	while (*now < until) {
+		*now += TICK_MS;
+		timer_wheel_advance(w, *now);
+	}
+}
+
+void
+test_never_early()
+{
+	uint64_t now = 1000;
+	timer_wheel w = timer_wheel_new(TICK_MS, now);
+	struct wheel_timer t;
+	wheel_timer_init(&t, on_expire, &now);
+
+	fired_count = 0;
+	timer_wheel_schedule(w, &t, now, 25);
+	run_until(w, &now, 1020);
+	assert_true(fired_count == 0, "fired before 25ms");
+	run_until(w, &now, 1030);
+	assert_true(fired_count == 1, "fired once at 30ms");
+	assert_true(!wheel_timer_pending(&t), "timer disarmed after firing");
+	assert_true(timer_wheel_count(w) == 0, "wheel is empty");
+
+	timer_wheel_destroy(w);
+}
+
+void
+test_cascade()
+{
+	uint64_t now = 0;
+	timer_wheel w = timer_wheel_new(TICK_MS, now);
+	struct wheel_timer t[3];
+	const uint64_t after[3] = { 5 * 60 * 1000, 3 * 60 * 1000, 700 };
+
+	fired_count = 0;
+	for (int i = 0; i < 3; i++) {
+		wheel_timer_init(&t[i], on_expire, &now);
+		timer_wheel_schedule(w, &t[i], now, after[i]);
+	}
+	run_until(w, &now, 6 * 60 * 1000);
+	assert_true(fired_count == 3, "all timers fired");
+	assert_true(fired_at[0] == 700, "700ms timer fired on time");
+	assert_true(fired_at[1] == 3 * 60 * 1000, "3 minute timer fired on time");
+	assert_true(fired_at[2] == 5 * 60 * 1000, "5 minute timer fired on time");
+
+	timer_wheel_destroy(w);
+}
+
+void
+test_cancel_and_reschedule()
+{
+	uint64_t now = 0;
+	timer_wheel w = timer_wheel_new(TICK_MS, now);
+	struct wheel_timer t;
+	wheel_timer_init(&t, on_expire, &now);
+
+	fired_count = 0;
+	timer_wheel_schedule(w, &t, now, 100);
+	timer_wheel_cancel(w, &t);
+	timer_wheel_cancel(w, &t);
+	run_until(w, &now, 200);
+	assert_true(fired_count == 0, "cancelled timer did not fire");
+
+	timer_wheel_schedule(w, &t, now, 1000);
+	run_until(w, &now, 900);
+	timer_wheel_schedule(w, &t, now, 1000);
+	run_until(w, &now, 1800);
+	assert_true(fired_count == 0, "rescheduled timer did not fire early");
+	run_until(w, &now, 1900);
+	assert_true(fired_count == 1, "rescheduled timer fired");
+
+	timer_wheel_destroy(w);
+}
+
+void
+test_next_ms()
+{
+	uint64_t now = 0;
+	timer_wheel w = timer_wheel_new(TICK_MS, now);
+	struct wheel_timer t;
+	wheel_timer_init(&t, on_expire, &now);
+
+	assert_true(timer_wheel_next_ms(w, now) == -1, "empty wheel has no expiry");
+	timer_wheel_schedule(w, &t, now, 200);
+	assert_true(timer_wheel_next_ms(w, now) == 200, "next expiry in level 0");
+	timer_wheel_schedule(w, &t, now, 60000);
+	int64_t next = timer_wheel_next_ms(w, now);
+	assert_true(next > 0 && next <= 60000, "next expiry never later than the timer");
+
+	// un salto grande (ej. select bloqueado) dispara todo lo vencido
+	fired_count = 0;
+	now = 120000;
+	timer_wheel_advance(w, now);
+	assert_true(fired_count == 1, "overdue timer fired after a long jump");
+
+	timer_wheel_destroy(w);
+}
+
+int
+main(void)
+{
+	test_never_early();
+	test_cascade();
+	test_cancel_and_reschedule();
+	test_next_ms();
+	printf("All tests passed.\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,99 @@
+#include "transform.h"
+#include "tests.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// se compila con `make', y el test corre desde src/
+#define PLUGIN_DIR "build"
+
+struct sink
+{
+	char buf[1024];
+	size_t len;
+};
+
+static ssize_t
+to_memory(void* arg, const void* buf, size_t len)
+{
+	struct sink* s = arg;
+	if (s->len + len > sizeof(s->buf) - 1) {
+		return -1;
+	}
+	memcpy(s->buf + s->len, buf, len);
+	s->len += len;
+	s->buf[s->len] = '\0';
+	return len;
+}
+
+/** pasa `body' por el plugin en pedazos de `piece' bytes */
+static void
+run(const transform_plugin* p, const char* body, size_t piece, bool stuffed, struct sink* out)
+{
+	const char* rcpt[] = { "bob@local" };
+	out->len = 0;
+	out->buf[0] = '\0';
+	void* state = p->init("alice@local", rcpt, 1, stuffed);
+	assert_true(state != NULL, "init");
+	for (size_t off = 0; off < strlen(body); off += piece) {
+		const size_t n = strlen(body) - off < piece ? strlen(body) - off : piece;
+		assert_true(p->chunk(state, body + off, n, to_memory, out) == 0, "chunk");
+	}
+	assert_true(p->finish(state, to_memory, out) == 0, "finish");
+}
+
+void
+test_load()
+{
+	assert_true(transform_is_plugin("./x.so") && !transform_is_plugin("./filter") && !transform_is_plugin(".so"),
+	            "plugin paths");
+	assert_true(transform_current() == NULL, "nothing loaded");
+	assert_true(transform_load_dir("./missing") == -1, "missing");
+	assert_true(transform_load_file(PLUGIN_DIR "/missing.so") == -1, "missing file");
+	assert_true(transform_load_file(PLUGIN_DIR "/footer.so") == 0, "load file");
+	// ya hay uno con ese nombre: no se carga dos veces
+	assert_true(transform_load_dir(PLUGIN_DIR) == 0, "same name skipped");
+	assert_true(transform_current() == NULL, "loading does not select");
+	assert_true(transform_select("nope") == -1, "unknown name");
+	// sólo nombres: una ruta no se abre aunque exista
+	assert_true(transform_select(PLUGIN_DIR "/footer.so") == -1 && transform_select("../footer") == -1, "paths");
+	assert_true(transform_current() == NULL, "still nothing");
+	assert_true(transform_select("footer.so") == 0, "select with suffix");
+	const transform_plugin* p = transform_current();
+	assert_true(p != NULL && strcmp(p->name, "footer") == 0, "current");
+	assert_true(transform_select("footer") == 0 && transform_current() == p, "select by name");
+}
+
+void
+test_footer()
+{
+	setenv("SMTPD_FOOTER", "-- \n.sig", 1);
+	const transform_plugin* p = transform_current();
+	struct sink out;
+
+	// por DATA: con los puntos duplicados y sin el CRLF final
+	run(p, "Subject: x\r\n\r\n..dot\r\nbody", 3, true, &out);
+	assert_true(strcmp(out.buf, "Subject: x\r\n\r\n..dot\r\nbody\r\n-- \r\n..sig") == 0, "stuffed footer");
+
+	// por BDAT: tal cual, con CRLF final
+	run(p, "Subject: x\r\n\r\n.dot\r\nbody\r\n", 5, false, &out);
+	assert_true(strcmp(out.buf, "Subject: x\r\n\r\n.dot\r\nbody\r\n-- \r\n.sig\r\n") == 0, "raw footer");
+	run(p, "no newline", 100, false, &out);
+	assert_true(strcmp(out.buf, "no newline\r\n-- \r\n.sig\r\n") == 0, "line ended first");
+
+	unsetenv("SMTPD_FOOTER");
+	run(p, "", 1, false, &out);
+	assert_true(strstr(out.buf, "Delivered by smtpd") != NULL, "default footer");
+}
+
+int
+main(void)
+{
+	test_load();
+	test_footer();
+	transform_finalize();
+	assert_true(transform_current() == NULL, "unloaded");
+	printf("All tests passed.\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,105 @@
+/**
+ * eventlog_decode.c - renders a binary event log (see logger_events_init) as text or CSV.
+ *
+ * Usage: eventlog_decode.elf [-c] <file.events>
+ *   -c  print CSV (timestamp_ns,session,event,f0,f1,f2,f3) instead of text
+ */
+#include "logger.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void
+print_text(const struct logger_event* e)
+{
+	time_t secs = (time_t)(e->timestamp_ns / 1000000000ULL);
+	struct tm tm;
+	localtime_r(&secs, &tm);
+	printf("%04d-%02d-%02dT%02d:%02d:%02d.%09llu session=%u %s",
+	       tm.tm_year + 1900,
+	       tm.tm_mon + 1,
+	       tm.tm_mday,
+	       tm.tm_hour,
+	       tm.tm_min,
+	       tm.tm_sec,
+	       (unsigned long long)(e->timestamp_ns % 1000000000ULL),
+	       e->session,
+	       logger_get_event_string(e->event));
+	for (unsigned i = 0; i < LOGGER_EVENT_FIELDS; i++) {
+		const char* field = logger_get_event_field(e->event, i);
+		if (field != NULL) {
+			printf(" %s=%u", field, e->fields[i]);
+		}
+	}
+	putchar('\n');
+}
+
+static void
+print_csv(const struct logger_event* e)
+{
+	printf("%llu,%u,%s", (unsigned long long)e->timestamp_ns, e->session, logger_get_event_string(e->event));
+	for (unsigned i = 0; i < LOGGER_EVENT_FIELDS; i++) {
+		printf(",%u", e->fields[i]);
+	}
+	putchar('\n');
+}
+
+int
+main(int argc, char* argv[])
+{
+	bool csv = argc == 3 && strcmp(argv[1], "-c") == 0;
+	if (argc != 2 && !csv) {
+		fprintf(stderr, "Usage: %s [-c] <file.events>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const char* path = argv[argc - 1];
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	struct logger_event_header header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, LOGGER_EVENT_MAGIC, sizeof(header.magic)) != 0) {
+		fprintf(stderr, "%s: not an event log\n", path);
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+	if (header.byte_order_mark != LOGGER_EVENT_BOM) {
+		fprintf(stderr, "%s: written by a host of different byte order\n", path);
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+	if (header.version != LOGGER_EVENT_VERSION || header.record_size != sizeof(struct logger_event)) {
+		fprintf(stderr,
+		        "%s: unsupported version %u (record size %u)\n",
+		        path,
+		        (unsigned)header.version,
+		        (unsigned)header.record_size);
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+
+	if (csv) {
+		printf("timestamp_ns,session,event,f0,f1,f2,f3\n");
+	}
+
+	struct logger_event events[256];
+	size_t n;
+	while ((n = fread(events, sizeof(*events), sizeof(events) / sizeof(*events), f)) > 0) {
+		for (size_t i = 0; i < n; i++) {
+			if (csv) {
+				print_csv(events + i);
+			} else {
+				print_text(events + i);
+			}
+		}
+	}
+
+	fclose(f);
+	return EXIT_SUCCESS;
+}